@@ -19,7 +19,9 @@ limitations under the License.
 using namespace std;
 
 bool*       KAnalysis::bKIonsManager;
+ThreadCancel* KAnalysis::cancel;
 KDatabase*  KAnalysis::db;
+KFragIndex* KAnalysis::fragIndex;
 double      KAnalysis::highLinkMass;
 KIons*      KAnalysis::ions;
 double      KAnalysis::lowLinkMass;
@@ -27,8 +29,9 @@ double      KAnalysis::maxMass;
 double      KAnalysis::minMass;
 Mutex       KAnalysis::mutexKIonsManager;
 Mutex*      KAnalysis::mutexSpecScore;
-Mutex**     KAnalysis::mutexSingletScore;
+Mutex*      KAnalysis::mutexSingletScore;
 kParams     KAnalysis::params;
+KScheduler* KAnalysis::scheduler;
 KData*      KAnalysis::spec;
 char**      KAnalysis::xlTable;
 bool**      KAnalysis::scanBuffer;
@@ -42,11 +45,14 @@ int*        KAnalysis::pepBinSize;
 
 bool*       KAnalysis::soloLoop;
 bool        KAnalysis::firstPass;
+size_t      KAnalysis::soloStart;
+size_t      KAnalysis::soloStop;
 
 int KAnalysis::skipCount;
 int KAnalysis::nonSkipCount;
 
 KDecoys KAnalysis::decoys;
+KDecoyTable KAnalysis::decoyTable;
 KLog*   KAnalysis::klog;
 
 /*============================
@@ -54,7 +60,7 @@ KLog*   KAnalysis::klog;
 ============================*/
 KAnalysis::KAnalysis(kParams& p, KDatabase* d, KData* dat){
   unsigned int i;
-  int j,k;
+  int j;
   
   //Assign pointers and structures
   params=p;
@@ -63,9 +69,13 @@ KAnalysis::KAnalysis(kParams& p, KDatabase* d, KData* dat){
   xlTable = spec->getXLTable();
 
   //Do memory allocations and initialization
+  KScoreKernel::init();
   bKIonsManager=NULL;
+  cancel=NULL;
+  fragIndex=NULL;
   ions=NULL;
   allocateMemory(params.threads);
+  scheduler = new KScheduler(params.threads);
   for(j=0;j<params.threads;j++){
     for(i=0;i<params.fMods->size();i++) ions[j].addFixedMod((char)params.fMods->at(i).index,params.fMods->at(i).mass);
     for(i=0;i<params.mods->size();i++) ions[j].addMod((char)params.mods->at(i).index,params.mods->at(i).xl,params.mods->at(i).mass);
@@ -91,15 +101,13 @@ KAnalysis::KAnalysis(kParams& p, KDatabase* d, KData* dat){
   }
 
   //Create mutexes
+  //Spectra and their precursors share a fixed table of striped locks rather than owning one each
   Threading::CreateMutex(&mutexKIonsManager);
-  mutexSingletScore = new Mutex*[spec->size()];
-  mutexSpecScore = new Mutex[spec->size()];
-  for(j=0;j<spec->size();j++){
+  mutexSingletScore = new Mutex[SCORELOCKS];
+  mutexSpecScore = new Mutex[SCORELOCKS];
+  for(j=0;j<SCORELOCKS;j++){
     Threading::CreateMutex(&mutexSpecScore[j]);
-    mutexSingletScore[j] = new Mutex[spec->at(j).sizePrecursor()];
-    for(k=0;k<spec->at(j).sizePrecursor();k++){
-      Threading::CreateMutex(&mutexSingletScore[j][k]);
-    }
+    Threading::CreateMutex(&mutexSingletScore[j]);
   }
 
   decoys.decoySize=params.decoySize;
@@ -111,34 +119,34 @@ KAnalysis::KAnalysis(kParams& p, KDatabase* d, KData* dat){
 }
 
 KAnalysis::~KAnalysis(){
-  int i,j;
+  int i;
 
   //Destroy mutexes
   Threading::DestroyMutex(mutexKIonsManager);
-  for(i=0;i<spec->size();i++){
+  for(i=0;i<SCORELOCKS;i++){
     Threading::DestroyMutex(mutexSpecScore[i]);
-    for(j=0;j<spec->at(i).sizePrecursor();j++){
-      Threading::DestroyMutex(mutexSingletScore[i][j]);
-    }
-    delete [] mutexSingletScore[i];
+    Threading::DestroyMutex(mutexSingletScore[i]);
   }
   delete [] mutexSingletScore;
   delete [] mutexSpecScore;
   
 
-  if (params.turbo){
-    for (i = 0; i < spec->getMotifCount(); i++){
-      delete[] pepMass[i];
-      delete[] pepBin[i];
-    }
-    delete[] pepMass;
-    delete[] pepMassSize;
-    delete[] pepBin;
-    delete[] pepBinSize;
+  //makePepLists() always allocates these, and a search may construct one KAnalysis per shard
+  for (i = 0; i < spec->getMotifCount(); i++){
+    delete[] pepMass[i];
+    delete[] pepBin[i];
   }
+  delete[] pepMass;
+  delete[] pepMassSize;
+  delete[] pepBin;
+  delete[] pepBinSize;
 
   //Deallocate memory and release pointers
+  if(fragIndex!=NULL) delete fragIndex;
+  fragIndex=NULL;
   deallocateMemory(params.threads);
+  delete scheduler;
+  scheduler=NULL;
   db=NULL;
   spec=NULL;
   xlTable=NULL;
@@ -151,16 +159,26 @@ KAnalysis::~KAnalysis(){
 bool KAnalysis::doPeptideAnalysis(){
   size_t i;
   int iPercent;
-  int iTmp;
-  vector<kPeptide>* p;
-  vector<int> index;
-  vector<kPepMod> mods;
-
-  kScoreCard sc;
+  size_t pepCount;
+  vector<size_t> items;
+  vector<double> cost;
+
+  if(klog!=NULL) klog->addMessage(string("Scoring kernel: ")+KScoreKernel::getName(),true);
+  if(params.singletIndex>0) buildFragIndex();
+  if(params.singlePass && (params.specCentric || fragIndex!=NULL)){
+    if(klog!=NULL) klog->addParameterWarning("single_pass is ignored in spectrum_centric and singlet_index searches.");
+    params.singlePass=false;
+  }
+  if(params.specCentric) return doSpectrumAnalysis();
 
   firstPass=true;
 
-  ThreadPool<kAnalysisStruct*>* threadPool = new ThreadPool<kAnalysisStruct*>(analyzePeptideProc,params.threads,params.threads,1);
+  //Only a single pass keeps the lighter halves of cross-links for pairing
+  if(params.singlePass){
+    for(i=0;i<(size_t)spec->size();i++){
+      if(spec->inShard((int)i)) spec->at((int)i).resetLightPeps(params.topCount);
+    }
+  }
 
   //Set progress meter
   iPercent=0;
@@ -168,29 +186,186 @@ bool KAnalysis::doPeptideAnalysis(){
   fflush(stdout);
 
   //Set which list of peptides to search (with and without internal lysine)
-  p=db->getPeptideList();
+  pepCount=(size_t)db->getPeptideListSize();
 
   //track non-links and loops
-  soloLoop = new bool[p->size()];
-  for(i=0;i<p->size();i++) soloLoop[i]=false;
+  soloLoop = new bool[pepCount];
+  for(i=0;i<pepCount;i++) soloLoop[i]=false;
 
   //get boundaries for first pass
   double lowerBound=(spec->getMinMass()-lowLinkMass)/2-0.25;
   double upperBound=spec->getMaxMass()-highLinkMass-params.minPepMass+0.25;
 
-  //Iterate the peptide for the first pass
-  for(i=0;i<p->size();i++){
+  //Collect the peptides for the first pass. A single pass also collects the lighter halves of
+  //cross-links, so it runs down to the lightest peptide.
+  for(i=0;i<pepCount;i++){
+    if(db->getPeptideMass((int)i)>upperBound) continue;
+    if(!params.singlePass && db->getPeptideMass((int)i)<lowerBound) break;
+    items.push_back(i);
+    cost.push_back(peptideCost((int)i));
+  }
+  if(!scheduler->run(analyzePeptideJob,&iPercent,items,&cost,progressProc)){
+    cout << endl;
+    delete [] soloLoop;
+    return false;
+  }
+
+  //Finalize progress meter
+  if(iPercent<100) printf("\b\b\b100%%");
+  cout << endl;
 
-    if(p->at(i).mass>upperBound) continue;
-    if(p->at(i).mass<lowerBound) break;
+  if(fragIndex!=NULL && !doSingletIndexAnalysis()){
+    delete [] soloLoop;
+    return false;
+  }
 
-    threadPool->WaitForQueuedParams();
+  //A single pass only has to pair the singlets it collected
+  if(params.singlePass){
+    firstPass=false;
+    delete [] soloLoop;
+    return doPairingAnalysis();
+  }
+
+  //Perform the second pass
+  firstPass=false;
+  if(klog!=NULL) klog->addMessage("Scoring peptides (second pass).",true);
+  cout << "  Second pass ... ";
+
+  //get boundary for second pass
+  upperBound = (spec->getMaxMass() - lowLinkMass)/2;
+
+  //Set progress meter
+  iPercent = 0;
+  printf("%2d%%", iPercent);
+  fflush(stdout);
+
+  //Collect the peptides for the second pass, lightest first
+  items.clear();
+  cost.clear();
+  i=pepCount;
+  while(i>0){
+    i--;
+    if(db->getPeptideMass((int)i)>upperBound) break;
+    items.push_back(i);
+    cost.push_back(peptideCost((int)i));
+  }
+  if(!scheduler->run(analyzePeptideJob,&iPercent,items,&cost,progressProc)){
+    cout << endl;
+    delete [] soloLoop;
+    return false;
+  }
+
+  //Finalize progress meter
+  if(iPercent<100) printf("\b\b\b100%%");
+  cout << endl;
+
+  //clean up memory & release pointers
+  delete [] soloLoop;
+  return true;
+}
+
+//Spectrum-centric alternative to the peptide sweep. Spectra are ordered by precursor mass and cut
+//into blocks; each block is searched by a single thread against only the peptides whose masses can
+//reach its precursors. No two threads share a spectrum, so scores are recorded without locking.
+bool KAnalysis::doSpectrumAnalysis(){
+  size_t i,j;
+  int k;
+  int iPercent;
+  int iTmp;
+  int blockCount;
+  int blockSize;
+  double d;
+  double blockLowMass;
+  double blockHighMass;
+  double lowerBound;
+  double upperBound;
+  double slack;
+  vector<kMass> v;
+  vector<kSpecBlock*> blocks;
+  kSpecBlock* b;
+  kMass m;
+
+  ThreadPool<kAnalysisBlockStruct*>* threadPool = new ThreadPool<kAnalysisBlockStruct*>(analyzeBlockProc,params.threads,params.threads,1);
+
+  //Modifications move peptides away from their unmodified mass, so widen every block's peptide
+  //window by the largest possible gain or loss. Being generous here only costs a few empty lookups.
+  blockLowMass=0;
+  blockHighMass=0;
+  for(i=0;i<params.mods->size();i++){
+    d=params.mods->at(i).mass*(params.maxMods+2);
+    if(d<blockLowMass) blockLowMass=d;
+    if(d>blockHighMass) blockHighMass=d;
+  }
+
+  //Order spectra by their lightest precursor, then cut them into equally sized blocks
+  m.xl=false;
+  for(k=0;k<spec->size();k++){
+    if(spec->at(k).sizePrecursor()==0) continue;
+    if(!spec->inShard(k)) continue;
+    m.index=k;
+    m.mass=spec->at(k).getPrecursor(0).monoMass;
+    for(j=1;j<(size_t)spec->at(k).sizePrecursor();j++){
+      if(spec->at(k).getPrecursor((int)j).monoMass<m.mass) m.mass=spec->at(k).getPrecursor((int)j).monoMass;
+    }
+    v.push_back(m);
+  }
+  if(v.size()>0){
+    qsort(&v[0],v.size(),sizeof(kMass),compareMassList);
+    blockCount=params.threads*SPECBLOCKS;
+    if(blockCount>(int)v.size()) blockCount=(int)v.size();
+    blockSize=((int)v.size()+blockCount-1)/blockCount;
+    for(i=0;i<v.size();i+=blockSize){
+      b=new kSpecBlock();
+      for(j=i;j<i+blockSize && j<v.size();j++){
+        m.index=v[j].index;
+        for(k=0;k<spec->at(m.index).sizePrecursor();k++){
+          m.mass=spec->at(m.index).getPrecursor(k).monoMass;
+          b->massList.push_back(m);
+        }
+      }
+      qsort(&b->massList[0],b->massList.size(),sizeof(kMass),compareMassList);
+      b->minMass=b->massList[0].mass;
+      b->maxMass=b->massList[b->massList.size()-1].mass;
+      blocks.push_back(b);
+    }
+  }
+
+  //Set progress meter
+  iPercent=0;
+  printf("%2d%%",iPercent);
+  fflush(stdout);
 
-    kAnalysisStruct* a = new kAnalysisStruct(&mutexKIonsManager,&p->at(i),(int)i);
+  //get boundaries for first pass; peptides are sorted from heaviest to lightest
+  lowerBound=(spec->getMinMass()-lowLinkMass)/2-0.25;
+  upperBound=spec->getMaxMass()-highLinkMass-params.minPepMass+0.25;
+  soloStart=findPeptide(upperBound);
+  soloStop=findPeptide(lowerBound);
+
+  //Each block only needs peptides that can reach its precursors as linear peptides, loop-links,
+  //or the heavier half of a cross-link.
+  firstPass=true;
+  for(i=0;i<blocks.size();i++){
+    b=blocks[i];
+    slack=b->maxMass/1000000*params.ppmPrecursor+0.5;
+    d=b->minMass-highLinkMass-blockHighMass; //lightest loop-link
+    if(d>0) d/=2;                            //lightest heavier half of a cross-link
+    b->pepStart=findPeptide(b->maxMass-blockLowMass+slack);
+    b->pepStop=findPeptide(d-slack);
+    if(b->pepStart<soloStart) b->pepStart=soloStart;
+    if(b->pepStop>soloStop) b->pepStop=soloStop;
+    if(b->pepStop<b->pepStart) b->pepStop=b->pepStart;
+    b->soloStart=b->pepStart;
+    b->soloSize=b->pepStop-b->pepStart;
+    b->soloLoop=new bool[b->soloSize+1];
+    for(j=0;j<=b->soloSize;j++) b->soloLoop[j]=false;
+
+    if(isCancelled()) break;
+    threadPool->WaitForQueuedParams();
+    kAnalysisBlockStruct* a = new kAnalysisBlockStruct(&mutexKIonsManager,b);
     threadPool->Launch(a);
 
     //Update progress meter
-    iTmp=(int)((double)i/p->size()*100);
+    iTmp=(int)((double)i/blocks.size()*100);
     if(iTmp>iPercent){
       iPercent=iTmp;
       printf("\b\b\b%2d%%",iPercent);
@@ -201,84 +376,219 @@ bool KAnalysis::doPeptideAnalysis(){
   threadPool->WaitForQueuedParams();
   threadPool->WaitForThreads();
 
+  if(isCancelled()){
+    cout << endl;
+    for(i=0;i<blocks.size();i++) delete blocks[i];
+    delete threadPool;
+    return false;
+  }
+
   //Finalize progress meter
   printf("\b\b\b100%%");
   cout << endl;
 
+  if(fragIndex!=NULL && !doSingletIndexAnalysis()){
+    for(i=0;i<blocks.size();i++) delete blocks[i];
+    delete threadPool;
+    return false;
+  }
 
   //Perform the second pass
   firstPass=false;
   if(klog!=NULL) klog->addMessage("Scoring peptides (second pass).",true);
   cout << "  Second pass ... ";
 
-  //get boundary for second pass
-  upperBound = (spec->getMaxMass() - lowLinkMass)/2;
-
   //Set progress meter
   iPercent = 0;
   printf("%2d%%", iPercent);
   fflush(stdout);
 
-  i=p->size() - 1;
-  while(true){
-    if (p->at(i).mass>upperBound) break;
-
+  //get boundary for second pass, then limit each block to the linear peptides, loop-links,
+  //and lighter halves of cross-links that can reach its precursors
+  upperBound = (spec->getMaxMass() - lowLinkMass)/2;
+  for(i=0;i<blocks.size();i++){
+    b=blocks[i];
+    slack=b->maxMass/1000000*params.ppmPrecursor+0.5;
+    b->pepStart=findPeptide(b->maxMass-blockLowMass+slack);
+    j=findPeptide(upperBound);
+    if(b->pepStart<j) b->pepStart=j;
+    b->pepStop=findPeptide(b->minMass-highLinkMass-params.maxPepMass-blockHighMass-slack);
+    if(b->pepStop<b->pepStart) b->pepStop=b->pepStart;
+
+    if(isCancelled()) break;
     threadPool->WaitForQueuedParams();
-
-    kAnalysisStruct* a = new kAnalysisStruct(&mutexKIonsManager, &p->at(i), (int)i);
+    kAnalysisBlockStruct* a = new kAnalysisBlockStruct(&mutexKIonsManager,b);
     threadPool->Launch(a);
 
     //Update progress meter
-    iTmp = (int)((1.0-(double)i / p->size()) * 100);
+    iTmp = (int)((double)i/blocks.size()*100);
     if (iTmp>iPercent){
       iPercent = iTmp;
       printf("\b\b\b%2d%%", iPercent);
       fflush(stdout);
     }
-   
-    if(i==0) break;
-    i--;
   }
   threadPool->WaitForQueuedParams();
   threadPool->WaitForThreads();
 
   //Finalize progress meter
-  if(iPercent<100) printf("\b\b\b100%%");
+  if(iPercent<100 && !isCancelled()) printf("\b\b\b100%%");
   cout << endl;
 
   //clean up memory & release pointers
-  delete [] soloLoop;
+  for(i=0;i<blocks.size();i++) delete blocks[i];
   delete threadPool;
   threadPool=NULL;
-  p=NULL;
+  return !isCancelled();
+}
+
+//Pairs the singlets collected by a single pass. Each spectrum is paired by one worker, so the
+//pairing takes no locks.
+bool KAnalysis::doPairingAnalysis(){
+  int i,j;
+  int iPercent;
+  vector<size_t> items;
+  vector<double> cost;
+
+  if(klog!=NULL) klog->addMessage("Pairing cross-linked peptides.",true);
+  cout << "  Pairing ... ";
+
+  //Set progress meter
+  iPercent=0;
+  printf("%2d%%",iPercent);
+  fflush(stdout);
+
+  //Spectra with more lighter singlets take longer to pair
+  for(i=0;i<spec->size();i++){
+    if(!spec->inShard(i)) continue;
+    if(spec->at(i).sizePrecursor()==0) continue;
+    items.push_back((size_t)i);
+    cost.push_back(0);
+    for(j=0;j<spec->at(i).sizePrecursor();j++) cost.back()+=spec->at(i).getLightPeps(j)->singletCount;
+  }
+  if(!scheduler->run(analyzePairJob,&iPercent,items,&cost,progressProc)){
+    cout << endl;
+    return false;
+  }
+
+  //Finalize progress meter
+  if(iPercent<100) printf("\b\b\b100%%");
+  cout << endl;
   return true;
 }
 
-bool KAnalysis::doEValueAnalysis(){
+//Indexes every singlet that can be searched in the first pass (each link site and ion set of the
+//linkable peptides) by its charge 1 fragments that do not carry the partner peptide.
+bool KAnalysis::buildFragIndex(){
+  size_t i;
+  int j,k,n,x;
+  int len;
+  int m;
+  char mot[10];
+  char site[10];
+  char str[256];
+  double lowerBound;
+  double upperBound;
+  double minMass;
+  double maxMass;
+  string pepSeq;
+  kPeptide pep;
+  kFragCandidate c;
+  KIonSet* iset;
+
+  fragIndex = new KFragIndex();
+  fragIndex->setBinWidth(params.binSize);
+
+  //same peptide range as the first pass
+  lowerBound=(spec->getMinMass()-lowLinkMass)/2-0.25;
+  upperBound=spec->getMaxMass()-highLinkMass-params.minPepMass+0.25;
+
+  for(i=findPeptide(upperBound);i<(size_t)db->getPeptideListSize();i++){
+    pep=db->getPeptide((int)i);
+    if(pep.mass<lowerBound) break;
+    if(pep.xlSites==0) continue;
+
+    db->getPeptideSeq(pep,pepSeq);
+    minMass = pep.mass + lowLinkMass + params.minPepMass;
+    maxMass = pep.mass*2 + highLinkMass;
+    minMass-=(minMass/1000000*params.ppmPrecursor);
+    maxMass+=(maxMass/1000000*params.ppmPrecursor);
+
+    len=(pep.map[0].stop-pep.map[0].start)+1;
+    ions[0].setPeptide(true, &db->at(pep.map[0].index).sequence[pep.map[0].start], len, pep.mass, pep.nTerm, pep.cTerm, pep.n15);
+
+    for(k=0;k<len;k++){
+      m=getSingletMotifs(pep,pepSeq,k,len,mot,site);
+      for(n=0;n<m;n++){
+        if(spec->getCounterMotif(mot[n],0)>-1) break;
+      }
+      if(n==m) continue; //no motif at this site has a counterpart, so it is never scored
+
+      ions[0].reset();
+      ions[0].buildSingletIons(k);
+      ions[0].modIonsRec2(0,k,0,0,true);
+
+      for(j=0;j<ions[0].size();j++){
+        iset=ions[0].at(j);
+        iset->makeIndex(params.binSize, params.binOffset, params.ionSeries[0], params.ionSeries[1], params.ionSeries[2], params.ionSeries[3], params.ionSeries[4], params.ionSeries[5]);
+        c.pep=(int)i;
+        c.set=j;
+        c.k=(char)k;
+        c.lowMass=minMass+iset->difMass;
+        c.highMass=maxMass+iset->difMass;
+        fragIndex->addCandidate(c);
+        for(x=0;x<ions[0].getIonCount();x++){
+          if(params.ionSeries[0] && iset->aIons[1][x].mz>0) fragIndex->addFragment(iset->aIons[1][x].key,iset->aIons[1][x].pos);
+          if(params.ionSeries[1] && iset->bIons[1][x].mz>0) fragIndex->addFragment(iset->bIons[1][x].key,iset->bIons[1][x].pos);
+          if(params.ionSeries[2] && iset->cIons[1][x].mz>0) fragIndex->addFragment(iset->cIons[1][x].key,iset->cIons[1][x].pos);
+          if(params.ionSeries[3] && iset->xIons[1][x].mz>0) fragIndex->addFragment(iset->xIons[1][x].key,iset->xIons[1][x].pos);
+          if(params.ionSeries[4] && iset->yIons[1][x].mz>0) fragIndex->addFragment(iset->yIons[1][x].key,iset->yIons[1][x].pos);
+          if(params.ionSeries[5] && iset->zIons[1][x].mz>0) fragIndex->addFragment(iset->zIons[1][x].key,iset->zIons[1][x].pos);
+        }
+      }
+    }
+  }
+  ions[0].reset();
+
+  fragIndex->finalize();
+  fragIndex->allocate(params.threads);
+
+  sprintf(str,"Fragment index: %d singlets, %d fragments.",(int)fragIndex->size(),(int)fragIndex->sizePostings());
+  if(klog!=NULL) klog->addMessage(str,true);
+  return true;
+}
+
+//Searches the first pass singlets from the fragment index. Each spectrum only scores the singlets
+//that share enough fragments with it, rather than every singlet with a precursor in range.
+bool KAnalysis::doSingletIndexAnalysis(){
   int i;
   int iPercent;
   int iTmp;
 
-  ThreadPool<KSpectrum*>* threadPool = new ThreadPool<KSpectrum*>(analyzeEValueProc, params.threads, params.threads, 1);
+  ThreadPool<kAnalysisSpecStruct*>* threadPool = new ThreadPool<kAnalysisSpecStruct*>(analyzeSingletIndexProc,params.threads,params.threads,1);
+
+  if(klog!=NULL) klog->addMessage("Scoring singlets (fragment index).",true);
+  cout << "  Singlet pass ... ";
 
   //Set progress meter
-  iPercent = 0;
-  printf("%2d%%", iPercent);
+  iPercent=0;
+  printf("%2d%%",iPercent);
   fflush(stdout);
 
-  //Iterate the peptide for the first pass
-  for (i = 0; i<spec->size(); i++){
+  for(i=0;i<spec->size();i++){
+    if(!spec->inShard(i)) continue;
+    if(isCancelled()) break;
 
     threadPool->WaitForQueuedParams();
 
-    KSpectrum* a = &spec->at(i);
+    kAnalysisSpecStruct* a = new kAnalysisSpecStruct(&mutexKIonsManager,i);
     threadPool->Launch(a);
 
     //Update progress meter
-    iTmp = (int)((double)i / spec->size() * 100);
-    if (iTmp>iPercent){
-      iPercent = iTmp;
-      printf("\b\b\b%2d%%", iPercent);
+    iTmp=(int)((double)i/spec->size()*100);
+    if(iTmp>iPercent){
+      iPercent=iTmp;
+      printf("\b\b\b%2d%%",iPercent);
       fflush(stdout);
     }
   }
@@ -287,12 +597,46 @@ bool KAnalysis::doEValueAnalysis(){
   threadPool->WaitForThreads();
 
   //Finalize progress meter
-  printf("\b\b\b100%%");
+  if(!isCancelled()) printf("\b\b\b100%%");
   cout << endl;
 
-  //clean up memory & release pointers
+  //the index is only used in the first pass
+  delete fragIndex;
+  fragIndex=NULL;
   delete threadPool;
-  threadPool = NULL;
+  threadPool=NULL;
+  return !isCancelled();
+}
+
+bool KAnalysis::doEValueAnalysis(){
+  int i;
+  int iPercent;
+  vector<size_t> items;
+  vector<double> cost;
+
+  //Set progress meter
+  iPercent = 0;
+  printf("%2d%%", iPercent);
+  fflush(stdout);
+
+  decoyTable.build(params,decoys);
+
+  //Spectra with more precursors have more decoys to score
+  for (i = 0; i<spec->size(); i++){
+    if(!spec->inShard(i)) continue;
+    items.push_back((size_t)i);
+    cost.push_back((double)spec->at(i).sizePrecursor());
+  }
+  if(!scheduler->run(analyzeEValueJob,&iPercent,items,&cost,progressProc)){
+    decoyTable.clear();
+    cout << endl;
+    return false;
+  }
+  decoyTable.clear();
+
+  //Finalize progress meter
+  if(iPercent<100) printf("\b\b\b100%%");
+  cout << endl;
 
   return true;
 }
@@ -307,7 +651,27 @@ bool KAnalysis::doEValueAnalysis(){
 
 //These functions fire off when a thread starts. They pass the variables to for
 //each thread-specific analysis to the appropriate function.
-void KAnalysis::analyzePeptideProc(kAnalysisStruct* s){
+void KAnalysis::analyzeBlockProc(kAnalysisBlockStruct* s){
+  int i;
+  Threading::LockMutex(mutexKIonsManager);
+  for(i=0;i<params.threads;i++){
+    if(!bKIonsManager[i]){
+      bKIonsManager[i]=true;
+      break;
+    }
+  }
+  Threading::UnlockMutex(mutexKIonsManager);
+  if(i==params.threads){
+    cout << "Error in KAnalysis::analyzeBlockProc" << endl;
+    exit(-1);
+  }
+  s->bKIonsMem = &bKIonsManager[i];
+  analyzeBlock(s->block,i);
+  delete s;
+  s=NULL;
+}
+
+void KAnalysis::analyzeSingletIndexProc(kAnalysisSpecStruct* s){
   int i;
   Threading::LockMutex(mutexKIonsManager);
   for(i=0;i<params.threads;i++){
@@ -318,45 +682,91 @@ void KAnalysis::analyzePeptideProc(kAnalysisStruct* s){
   }
   Threading::UnlockMutex(mutexKIonsManager);
   if(i==params.threads){
-    cout << "Error in KAnalysis::analyzePeptidesProc" << endl;
+    cout << "Error in KAnalysis::analyzeSingletIndexProc" << endl;
     exit(-1);
   }
   s->bKIonsMem = &bKIonsManager[i];
-  analyzePeptide(s->pep,s->pepIndex,i);
+  analyzeSingletIndex(s->specIndex,i);
   delete s;
   s=NULL;
 }
 
-void KAnalysis::analyzeEValueProc(KSpectrum* s){
-  s->calcEValue(&params, decoys);
-  s = NULL;
+//Scheduler jobs. The worker index is fixed for the life of the thread, so it addresses that
+//thread's KIons and scan buffer directly.
+void KAnalysis::analyzeEValueJob(void* data, size_t item, int thread){
+  spec->at((int)item).calcEValue(&params, decoys, decoyTable);
+}
+
+void KAnalysis::analyzePairJob(void* data, size_t item, int thread){
+  pairSinglets((int)item);
+}
+
+void KAnalysis::analyzePeptideJob(void* data, size_t item, int thread){
+  kPeptide p=db->getPeptide((int)item);
+  analyzePeptide(&p,(int)item,thread);
+}
+
+void KAnalysis::progressProc(void* data, size_t done, size_t total){
+  int* iPercent=(int*)data;
+  int iTmp=(int)((double)done/total*100);
+  if(iTmp>*iPercent){
+    *iPercent=iTmp;
+    printf("\b\b\b%2d%%",*iPercent);
+    fflush(stdout);
+  }
 }
 
 //============================
 //  Analysis Functions
 //============================
 
+//Searches every peptide in the block's range for the current pass. The first pass runs from heavy
+//to light peptides and the second pass from light to heavy, mirroring doPeptideAnalysis.
+bool KAnalysis::analyzeBlock(kSpecBlock* b, int iIndex){
+  size_t i;
+  kPeptide p;
+
+  if(firstPass){
+    for(i=b->pepStart;i<b->pepStop;i++) {
+      if(isCancelled()) return false;
+      p=db->getPeptide((int)i);
+      analyzePeptide(&p,(int)i,iIndex,b);
+    }
+  } else {
+    i=b->pepStop;
+    while(i>b->pepStart){
+      if(isCancelled()) return false;
+      i--;
+      p=db->getPeptide((int)i);
+      analyzePeptide(&p,(int)i,iIndex,b);
+    }
+  }
+
+  return true;
+}
+
 //Analyzes all single peptides. Also analyzes cross-linked peptides when in full search mode, 
-//or stage 1 of relaxed mode analysis
-bool KAnalysis::analyzePeptide(kPeptide* p, int pepIndex, int iIndex){
+//or stage 1 of relaxed mode analysis. When a spectrum block is given, only its spectra are searched.
+bool KAnalysis::analyzePeptide(kPeptide* p, int pepIndex, int iIndex, kSpecBlock* b){
   int j;
   size_t k,k2,k3;
   bool bt;
   vector<int> index;
   vector<kPepMod> mods;
+  vector<kMass>* ml = (b==NULL) ? NULL : &b->massList;
 
   //char str[256];
-  //db->getPeptideSeq(p->map->at(0).index,p->map->at(0).start,p->map->at(0).stop,str);
+  //db->getPeptideSeq(p->map[0].index,p->map[0].start,p->map[0].stop,str);
   //if(strcmp(str,"VPSKK")==0) cout << str << "\t" << p->mass << endl;
   //Set the peptide, calc the ions, and score it against the spectra
-  ions[iIndex].setPeptide(true,&db->at(p->map->at(0).index).sequence[p->map->at(0).start],p->map->at(0).stop-p->map->at(0).start+1,p->mass,p->nTerm,p->cTerm,p->n15);
+  ions[iIndex].setPeptide(true,&db->at(p->map[0].index).sequence[p->map[0].start],p->map[0].stop-p->map[0].start+1,p->mass,p->nTerm,p->cTerm,p->n15);
   
-  if(!soloLoop[pepIndex]){ //if we've searched this peptide as solo in the first pass, skip doing so again
+  if(!isSoloLoop(pepIndex,b)){ //if we've searched this peptide as solo in the first pass, skip doing so again
     ions[iIndex].buildIons();
     ions[iIndex].modIonsRec2(0,-1,0,0,false);
 
     for(j=0;j<ions[iIndex].size();j++){
-      bt=spec->getBoundaries2(ions[iIndex][j].mass,params.ppmPrecursor,index,scanBuffer[iIndex]);
+      bt=spec->getBoundaries2(ions[iIndex][j].mass,params.ppmPrecursor,index,scanBuffer[iIndex],ml);
       if(bt) scoreSpectra(index,j,ions[iIndex][j].difMass,pepIndex,-1,-1,-1,-1,iIndex,-1,-1);
     }
 
@@ -368,7 +778,7 @@ bool KAnalysis::analyzePeptide(kPeptide* p, int pepIndex, int iIndex){
     */
 
     if(p->xlSites==0) {
-      soloLoop[pepIndex]=true;
+      setSoloLoop(pepIndex,b);
       return true;
     }
   } else {
@@ -376,10 +786,11 @@ bool KAnalysis::analyzePeptide(kPeptide* p, int pepIndex, int iIndex){
   }
 
   //Crosslinked peptides must also search singlets with reciprocol mass on each lysine
-  analyzeSinglets(*p,pepIndex,lowLinkMass,highLinkMass,iIndex);
+  //When the fragment index is used, first pass singlets are searched from it afterwards.
+  if(!firstPass || fragIndex==NULL) analyzeSinglets(*p,pepIndex,lowLinkMass,highLinkMass,iIndex,b);
 
   if(p->xlSites==1) {
-    soloLoop[pepIndex] = true;
+    setSoloLoop(pepIndex,b);
     return true;
   }
 
@@ -387,7 +798,7 @@ bool KAnalysis::analyzePeptide(kPeptide* p, int pepIndex, int iIndex){
   //check loop-links by iterating through each cross-linker mass
 
   //if we've already searched the loop link, exit now
-  if(soloLoop[pepIndex]) return true;
+  if(isSoloLoop(pepIndex,b)) return true;
 
   string pepSeq;
   vector<int> xlIndex;
@@ -428,7 +839,7 @@ bool KAnalysis::analyzePeptide(kPeptide* p, int pepIndex, int iIndex){
               ions[iIndex].buildLoopIons(spec->getLink(xlIndex[k3]).mass, (int)k, (int)k2);
               ions[iIndex].modLoopIonsRec2(0, (int)k, (int)k2, 0, 0, true);
               for (j = 0; j<ions[iIndex].size(); j++){
-                bt = spec->getBoundaries2(ions[iIndex][j].mass, params.ppmPrecursor, index, scanBuffer[iIndex]);
+                bt = spec->getBoundaries2(ions[iIndex][j].mass, params.ppmPrecursor, index, scanBuffer[iIndex], ml);
                 if (bt) scoreSpectra(index, j, 0, pepIndex, -1, (int)k, (int)k2, xlIndex[k3], iIndex,site1,site2);
               }
             } //k3
@@ -468,7 +879,7 @@ bool KAnalysis::analyzePeptide(kPeptide* p, int pepIndex, int iIndex){
               ions[iIndex].buildLoopIons(spec->getLink(xlIndex[k3]).mass, (int)k, (int)k2);
               ions[iIndex].modLoopIonsRec2(0, (int)k, (int)k2, 0, 0, true);
               for (j = 0; j<ions[iIndex].size(); j++){
-                bt = spec->getBoundaries2(ions[iIndex][j].mass, params.ppmPrecursor, index, scanBuffer[iIndex]);
+                bt = spec->getBoundaries2(ions[iIndex][j].mass, params.ppmPrecursor, index, scanBuffer[iIndex], ml);
                 if (bt) scoreSpectra(index, j, 0, pepIndex, -1, (int)k, (int)k2, xlIndex[k3], iIndex,site1,site2);
               }
             } //k3
@@ -480,11 +891,11 @@ bool KAnalysis::analyzePeptide(kPeptide* p, int pepIndex, int iIndex){
 
   }//k
 
-  soloLoop[pepIndex] = true;
+  setSoloLoop(pepIndex,b);
   return true;
 }
 
-bool KAnalysis::analyzeSinglets(kPeptide& pep, int index, double lowLinkMass, double highLinkMass, int iIndex){
+bool KAnalysis::analyzeSinglets(kPeptide& pep, int index, double lowLinkMass, double highLinkMass, int iIndex, kSpecBlock* b){
   int i;
   size_t j;
   int k;
@@ -497,10 +908,11 @@ bool KAnalysis::analyzeSinglets(kPeptide& pep, int index, double lowLinkMass, do
   vector<int> scanIndex;
   string pepSeq;
   bool bSearch;
+  kScoreCache cache;
 
-  int counterMotif;
-  int xlIndex;
-  double xlMass;
+  int counterMotif[10];
+  int xlIndex[10];
+  double xlMass[10];
 
   //get the peptide sequence
   db->getPeptideSeq(pep,pepSeq);
@@ -509,6 +921,7 @@ bool KAnalysis::analyzeSinglets(kPeptide& pep, int index, double lowLinkMass, do
   if(firstPass){
     minMass = pep.mass + lowLinkMass + params.minPepMass;
     maxMass = pep.mass*2 + highLinkMass; //any higher, and this would be the smaller peptide of the cross-link
+    if(params.singlePass && pep.mass + highLinkMass + params.maxPepMass > maxMass) maxMass = pep.mass + highLinkMass + params.maxPepMass; //smaller peptides are kept too
   } else {
     minMass = pep.mass*2 + lowLinkMass; //any lower, and this would be the larger peptide of the cross-link
     maxMass = pep.mass + highLinkMass + params.maxPepMass;
@@ -518,52 +931,12 @@ bool KAnalysis::analyzeSinglets(kPeptide& pep, int index, double lowLinkMass, do
 
   //Find mod mass as difference between precursor and peptide
   
-  len=(pep.map->at(0).stop-pep.map->at(0).start)+1;
-  ions[iIndex].setPeptide(true, &db->at(pep.map->at(0).index).sequence[pep.map->at(0).start], len, pep.mass, pep.nTerm, pep.cTerm, pep.n15);
+  len=(pep.map[0].stop-pep.map[0].start)+1;
+  ions[iIndex].setPeptide(true, &db->at(pep.map[0].index).sequence[pep.map[0].start], len, pep.mass, pep.nTerm, pep.cTerm, pep.n15);
   
   //Iterate every link site
   for(k=0;k<len;k++){
-    m=0; //number of motifs (linker-to-site combinations) found in the peptide
-    if (k == len - 1 && pep.cTerm){ //check if we are at the c-terminus on a c-terminal peptide
-      i=0;
-      while (xlTable['c'][i]>-1){ //check if c-terminus can be linked
-        for (n=0;n<m;n++){ //if we've seen motif(s) already, check if we are seeing them again
-          if (xlTable['c'][i]==mot[n]) break;
-        }
-        if (n==m) { //we have a new motif
-          site[m]='c'; //mark it as c-terminal
-          mot[m++] = xlTable['c'][i]; //mark the corresponding site
-        }
-        i++;
-      }
-    } else if (k == len - 1) { //if we are at the c-term of any other peptide, stop the analysis because it cannot be linked.
-      continue;
-    } else {
-      i=0;
-      while (xlTable[pepSeq[k]][i]>-1){ //check if amino acid can be linked
-        for (n = 0; n<m; n++){
-          if (xlTable[pepSeq[k]][i] == mot[n]) break;
-        }
-        if (n == m) {
-          site[m]=pepSeq[k];
-          mot[m++] = xlTable[pepSeq[k]][i];
-        }
-        i++;
-      }
-      if (/*m==0 &&*/ k == 0 && pep.nTerm){ // /*if it cannot be linked,*/ but is the n-terminus of a protein, check for a linker
-        i = 0;
-        while (xlTable['n'][i]>-1){
-          for (n = 0; n<m; n++){
-            if (xlTable['n'][i] == mot[n]) break;
-          }
-          if (n == m) {
-            site[m] = 'n';
-            mot[m++] = xlTable['n'][i];
-          }
-          i++;
-        }
-      }
-    }
+    m=getSingletMotifs(pep,pepSeq,k,len,mot,site);
     if (m==0) continue; //no matching motifs, so check next site on peptide
   
     //build fragment ions and score against all potential spectra
@@ -579,17 +952,22 @@ bool KAnalysis::analyzeSinglets(kPeptide& pep, int index, double lowLinkMass, do
       }
 
       //Iterate all spectra from (peptide mass + low linker + minimum mass) to (peptide mass + high linker + maximum mass)
-      if (!spec->getBoundaries(minMass + ions[iIndex][i].difMass, maxMass + ions[iIndex][i].difMass, scanIndex, scanBuffer[iIndex])) continue;
-
-      //This set of iterations is slow because of the amount of iterating.
-      for (n = 0; n < m; n++){ //iterate over sites
-        counterMotif = spec->getCounterMotif(mot[n], 0);
-        if (counterMotif>-1){ //only check peptide if it has a counterpart at this link site.
-          xlIndex = spec->getXLIndex((int)mot[n], 0);
-          xlMass = spec->getLink(xlIndex).mass;
-          for (j = 0; j<scanIndex.size(); j++){ //iterate over all potential spectra
-            bSearch = scoreSingletSpectra2(scanIndex[j], i, ions[iIndex][i].mass, xlMass, counterMotif, len, index, (char)k, minMass, iIndex, site[n], xlIndex);
-          }
+      if (!spec->getBoundaries(minMass + ions[iIndex][i].difMass, maxMass + ions[iIndex][i].difMass, scanIndex, scanBuffer[iIndex], (b==NULL) ? NULL : &b->massList)) continue;
+
+      //Spectra are visited in the outer loop so that each one scores this ion set once for all of
+      //its link sites. Every spectrum still sees its sites in the same order.
+      for (n = 0; n < m; n++){
+        counterMotif[n] = spec->getCounterMotif(mot[n], 0);
+        if (counterMotif[n]>-1){
+          xlIndex[n] = spec->getXLIndex((int)mot[n], 0);
+          xlMass[n] = spec->getLink(xlIndex[n]).mass;
+        }
+      }
+      for (j = 0; j<scanIndex.size(); j++){ //iterate over all potential spectra
+        cache.reset(spec->getSpectrum(scanIndex[j])->sizePrecursor());
+        for (n = 0; n < m; n++){ //iterate over sites
+          if (counterMotif[n]<0) continue; //only check peptide if it has a counterpart at this link site.
+          bSearch = scoreSingletSpectra2(scanIndex[j], i, ions[iIndex][i].mass, xlMass[n], counterMotif[n], len, index, (char)k, minMass, iIndex, site[n], xlIndex[n], cache);
         }
       }
     }
@@ -597,6 +975,72 @@ bool KAnalysis::analyzeSinglets(kPeptide& pep, int index, double lowLinkMass, do
   return true;
 }
 
+//First pass singlet search of a single spectrum using the fragment index. Candidates arrive grouped
+//by peptide and link site, so ions are only rebuilt when either changes.
+bool KAnalysis::analyzeSingletIndex(int specIndex, int iIndex){
+  size_t i;
+  int j,n;
+  int m=0;
+  int len=0;
+  int lastPep=-1;
+  int lastK=-1;
+  int counterMotif;
+  int xlIndex;
+  double xlMass;
+  double minMass=0;
+  double mass;
+  char mot[10];
+  char site[10];
+  string pepSeq;
+  vector<int> cand;
+  kScoreCache cache;
+
+  KSpectrum* s=spec->getSpectrum(specIndex);
+  if(s->sizePrecursor()==0) return true;
+
+  fragIndex->getCandidates(s,iIndex,params.singletIndex,cand);
+
+  for(i=0;i<cand.size();i++){
+    kFragCandidate& c=(*fragIndex)[cand[i]];
+
+    //the spectrum needs a precursor this singlet can explain
+    for(j=0;j<s->sizePrecursor();j++){
+      mass=s->getPrecursor(j).monoMass;
+      if(mass>=c.lowMass && mass<=c.highMass) break;
+    }
+    if(j==s->sizePrecursor()) continue;
+
+    kPeptide pep=db->getPeptide(c.pep);
+    if(c.pep!=lastPep){
+      db->getPeptideSeq(pep,pepSeq);
+      len=(pep.map[0].stop-pep.map[0].start)+1;
+      ions[iIndex].setPeptide(true, &db->at(pep.map[0].index).sequence[pep.map[0].start], len, pep.mass, pep.nTerm, pep.cTerm, pep.n15);
+      minMass = pep.mass + lowLinkMass + params.minPepMass;
+      minMass-=(minMass/1000000*params.ppmPrecursor);
+      lastK=-1;
+    }
+    if(c.pep!=lastPep || c.k!=lastK){
+      m=getSingletMotifs(pep,pepSeq,c.k,len,mot,site);
+      ions[iIndex].reset();
+      ions[iIndex].buildSingletIons(c.k);
+      ions[iIndex].modIonsRec2(0,c.k,0,0,true);
+      lastPep=c.pep;
+      lastK=c.k;
+    }
+    cache.reset(s->sizePrecursor());
+
+    for (n = 0; n < m; n++){ //iterate over sites
+      counterMotif = spec->getCounterMotif(mot[n], 0);
+      if (counterMotif>-1){ //only check peptide if it has a counterpart at this link site.
+        xlIndex = spec->getXLIndex((int)mot[n], 0);
+        xlMass = spec->getLink(xlIndex).mass;
+        scoreSingletSpectra2(specIndex, c.set, ions[iIndex][c.set].mass, xlMass, counterMotif, len, c.pep, c.k, minMass, iIndex, site[n], xlIndex, cache);
+      }
+    }
+  }
+  return true;
+}
+
 /* Deprecating
 bool KAnalysis::analyzeSingletsNC(kPeptide& pep, int index, int iIndex){
   int len;
@@ -613,8 +1057,8 @@ bool KAnalysis::analyzeSingletsNC(kPeptide& pep, int index, int iIndex){
   maxMass += (maxMass / 1000000 * params.ppmPrecursor);
 
   //Find mod mass as difference between precursor and peptide
-  len = (pep.map->at(0).stop - pep.map->at(0).start) + 1;
-  ions[iIndex].setPeptide(true, &db->at(pep.map->at(0).index).sequence[pep.map->at(0).start], len, pep.mass, pep.nTerm, pep.cTerm, pep.n15);
+  len = (pep.map[0].stop - pep.map[0].start) + 1;
+  ions[iIndex].setPeptide(true, &db->at(pep.map[0].index).sequence[pep.map[0].start], len, pep.mass, pep.nTerm, pep.cTerm, pep.n15);
 
   //build fragment ions and score against all potential spectra
   ions[iIndex].reset();
@@ -649,6 +1093,7 @@ bool KAnalysis::allocateMemory(int threads){
     ions[i].setModFlags(params.monoLinksOnXL,params.diffModsOnXL);
     ions[i].setSeries(params.ionSeries[0],params.ionSeries[1],params.ionSeries[2],params.ionSeries[3],params.ionSeries[4], params.ionSeries[5]);
     scanBuffer[i] = new bool[spec->size()];
+    memset(scanBuffer[i],false,spec->size()); //must start clear; getBoundaries resets only what it flags
     for(j=0;j<params.xLink->size();j++){
       for(k=0;k<params.xLink->at(j).motifA.size();k++){
         ions[i].site[params.xLink->at(j).motifA[k]]=true;
@@ -710,6 +1155,122 @@ int KAnalysis::findMass(kSingletScoreCardPlus* s, int sz, double mass){
   return mid;
 }
 
+//Returns the index of the first peptide at or below the given mass. The peptide list is sorted
+//from heaviest to lightest.
+size_t KAnalysis::findPeptide(double mass){
+  size_t lower=0;
+  size_t upper=(size_t)db->getPeptideListSize();
+  size_t mid;
+
+  while(lower<upper){
+    mid=(lower+upper)/2;
+    if(db->getPeptideMass((int)mid)>mass) lower=mid+1;
+    else upper=mid;
+  }
+  return lower;
+}
+
+//Fills mot and site with the unique linker motifs available at position k of the peptide and returns
+//how many were found.
+int KAnalysis::getSingletMotifs(kPeptide& pep, string& pepSeq, int k, int len, char* mot, char* site){
+  int i,n;
+  int m=0; //number of motifs (linker-to-site combinations) found in the peptide
+
+  if (k == len - 1 && pep.cTerm){ //check if we are at the c-terminus on a c-terminal peptide
+    i=0;
+    while (xlTable['c'][i]>-1){ //check if c-terminus can be linked
+      for (n=0;n<m;n++){ //if we've seen motif(s) already, check if we are seeing them again
+        if (xlTable['c'][i]==mot[n]) break;
+      }
+      if (n==m) { //we have a new motif
+        site[m]='c'; //mark it as c-terminal
+        mot[m++] = xlTable['c'][i]; //mark the corresponding site
+      }
+      i++;
+    }
+  } else if (k == len - 1) { //if we are at the c-term of any other peptide, it cannot be linked.
+    return 0;
+  } else {
+    i=0;
+    while (xlTable[pepSeq[k]][i]>-1){ //check if amino acid can be linked
+      for (n = 0; n<m; n++){
+        if (xlTable[pepSeq[k]][i] == mot[n]) break;
+      }
+      if (n == m) {
+        site[m]=pepSeq[k];
+        mot[m++] = xlTable[pepSeq[k]][i];
+      }
+      i++;
+    }
+    if (/*m==0 &&*/ k == 0 && pep.nTerm){ // /*if it cannot be linked,*/ but is the n-terminus of a protein, check for a linker
+      i = 0;
+      while (xlTable['n'][i]>-1){
+        for (n = 0; n<m; n++){
+          if (xlTable['n'][i] == mot[n]) break;
+        }
+        if (n == m) {
+          site[m] = 'n';
+          mot[m++] = xlTable['n'][i];
+        }
+        i++;
+      }
+    }
+  }
+  return m;
+}
+
+bool KAnalysis::isCancelled(){
+  return cancel!=NULL && cancel->IsCancelled();
+}
+
+//Spectrum-centric blocks only track peptides in their own first pass range. Anything else in the
+//global first pass range was searched there too; it just cannot reach this block's spectra.
+bool KAnalysis::isSoloLoop(int pepIndex, kSpecBlock* b){
+  if(b==NULL) return soloLoop[pepIndex];
+  if((size_t)pepIndex>=b->soloStart && (size_t)pepIndex<b->soloStart+b->soloSize) return b->soloLoop[pepIndex-b->soloStart];
+  return ((size_t)pepIndex>=soloStart && (size_t)pepIndex<soloStop);
+}
+
+//Spectrum-centric searches own their spectra outright, so the score mutexes are skipped. Otherwise
+//the lists share SCORELOCKS striped mutexes; neighboring spectra and the precursors of one spectrum
+//fall on different stripes.
+void KAnalysis::lockSinglet(int index, int pre){
+  if(!params.specCentric) Threading::LockMutex(mutexSingletScore[(index*8+pre)&(SCORELOCKS-1)]);
+}
+
+void KAnalysis::lockSpectrum(int index){
+  if(!params.specCentric) Threading::LockMutex(mutexSpecScore[index&(SCORELOCKS-1)]);
+}
+
+//Rough cost of searching a peptide in the current pass: its residues (a proxy for ion sets) times
+//the precursors its singlets can reach, scaled by the link sites that add singlet and loop searches.
+double KAnalysis::peptideCost(int pepIndex){
+  kPeptide p=db->getPeptide(pepIndex);
+  double len=p.map[0].stop-p.map[0].start+1;
+  size_t n;
+  if(p.xlSites==0) n=0;
+  else if(firstPass && params.singlePass) n=spec->countPrecursors(p.mass+lowLinkMass+params.minPepMass,p.mass+highLinkMass+params.maxPepMass);
+  else if(firstPass) n=spec->countPrecursors(p.mass+lowLinkMass+params.minPepMass,p.mass*2+highLinkMass);
+  else n=spec->countPrecursors(p.mass*2+lowLinkMass,p.mass+highLinkMass+params.maxPepMass);
+  return len*(n+1)*(p.xlSites+1);
+}
+
+void KAnalysis::setSoloLoop(int pepIndex, kSpecBlock* b){
+  if(b==NULL) {
+    soloLoop[pepIndex]=true;
+    return;
+  }
+  if((size_t)pepIndex>=b->soloStart && (size_t)pepIndex<b->soloStart+b->soloSize) b->soloLoop[pepIndex-b->soloStart]=true;
+}
+
+void KAnalysis::unlockSinglet(int index, int pre){
+  if(!params.specCentric) Threading::UnlockMutex(mutexSingletScore[(index*8+pre)&(SCORELOCKS-1)]);
+}
+
+void KAnalysis::unlockSpectrum(int index){
+  if(!params.specCentric) Threading::UnlockMutex(mutexSpecScore[index&(SCORELOCKS-1)]);
+}
+
 //Breakdown of the many parameters:
 // index   = spectrum index in data spectra object
 // sIndex  = ion set index
@@ -723,176 +1284,93 @@ int KAnalysis::findMass(kSingletScoreCardPlus* s, int sz, double mass){
 // iIndex  = thread index
 // linkSite  = amino acid being linked (or 'n' or 'c')
 // linkIndex = motif index of linked amino acid or terminus
-bool KAnalysis::scoreSingletSpectra2(int index, int sIndex, double mass, double xlMass, int counterMotif, int len, int pep, char k, double minMass, int iIndex, char linkSite, int linkIndex){ 
+// cache     = scores of this ion set against this spectrum from earlier link sites; see kScoreCache
+bool KAnalysis::scoreSingletSpectra2(int index, int sIndex, double mass, double xlMass, int counterMotif, int len, int pep, char k, double minMass, int iIndex, char linkSite, int linkIndex, kScoreCache& cache){ 
   kSingletScoreCard sc;
   kSingletScoreCard* tsc;
-  KIonSet* iset;
-  kPepMod mod;
   float score = 0;
-  int matches;
-  int conFrag;
-  int i,j,y;
+  int i,y;
+  int first,last;
   vector<kPepMod> v;
 
   double low,high,m;
   int lowI,highI;
   bool bScored=false;
-  bool ret;
+  bool bMods=false;
   int max = (int)((params.maxPepMass + 1000) / 0.015);
-  int alpha;
 
   KSpectrum* s = spec->getSpectrum(index);
   kPrecursor* p;
   KTopPeps* tp;
   kScoreCard protSC;
-  size_t x;
   int sz = s->sizePrecursor();
+  char lastSite;
+  bool bLink;
+  bool bSite;
 
-  string seq1,seq2;
+  string seq;
+
+  sc.len = len;
+  sc.k1 = k;
+  sc.linkable = false;
+  sc.pep1 = pep;
+  sc.mass = mass;
+  sc.site = linkSite;
+  sc.link = linkIndex;
 
   for (i = 0; i<sz; i++){
     p = s->getPrecursor2(i);
+    sc.pre = i;
 
     if(!firstPass && (p->monoMass-spec->getLink(linkIndex).mass+0.2)/2>mass){
 
-      //Threading::LockMutex(mutexSingletScore[index][i]);
+      //Find the partners within the precursor tolerance. The window is padded slightly; the exact
+      //ppm test below decides.
       tp = s->getTopPeps(i);
-      int ind=(int)((p->monoMass-xlMass-mass)/10);
-      if(tp->singletList[ind]==NULL) {
-        //Threading::UnlockMutex(mutexSingletScore[index][i]);
-        continue;
-      }
-
-      //TODO: this could be made faster by checking the peptide only once for every partner of the same mass!!!
-      list<kSingletScoreCard*>::iterator it = tp->singletList[ind]->begin();
-      while(it!=tp->singletList[ind]->end()){
-        tsc=*it;
-        if(fabs((p->monoMass-tsc->mass-spec->getLink(linkIndex).mass-mass)/p->monoMass*1e6)>params.ppmPrecursor){
-          it++;
-          continue;
-        }
-        if(!spec->checkLink(linkSite,tsc->site,linkIndex)){
-          it++;
-          continue;
-        }
-        score = kojakScoring(index, p->monoMass - mass, sIndex, iIndex, matches, conFrag, p->charge);
-        protSC.simpleScore = tsc->simpleScore + score;
-        y = (int)(protSC.simpleScore * 10.0 + 0.5);
-        if (y >= HISTOSZ) y = HISTOSZ - 1;
-        Threading::LockMutex(mutexSpecScore[index]);  //no matter how low the score, put this test in our histogram.
-        s->histogram[y]++;
-        s->histogramCount++;
-        if (score<params.minPepScore || protSC.simpleScore <= s->lowScore) { //peptide needs a minimum score, and combined score should exceed bottom of best hits
-          Threading::UnlockMutex(mutexSpecScore[index]);
-          it++;
-          continue;
-        }
-        Threading::UnlockMutex(mutexSpecScore[index]);
-       
-
-        protSC.mods1->clear();
-        protSC.mods2->clear();
-
-        //alphabetize cross-linked peptides before storing them; this prevents confusion with duplications downstream
-        //instead of alphabetical, order them by mass (larger first), this has implications with downstream scoring...
-        //resort to alphabetical in case of equal mass
-        bool bSecond=false;
-        if(mass==tsc->mass){
-          if(seq2.size()==0) ret=db->getPeptideSeq(pep,seq2);
-          ret=db->getPeptideSeq(tsc->pep1, seq1);
-          alpha=seq1.compare(seq2);
-          if (alpha>0 || (alpha == 0 && k<tsc->k1)) bSecond=true;
+      m = p->monoMass - spec->getLink(linkIndex).mass - mass;
+      low = p->monoMass / 1000000 * params.ppmPrecursor * 1.0001;
+      tp->findSingletMass(m-low,m+low,first,last);
+      if(first==last) continue;
+
+      //Partners of equal mass are adjacent and usually share a link site, so the link check is
+      //repeated only when the site changes. The peptide is scored once, on the first partner that fits.
+      bSite=false;
+      lastSite=0;
+      bLink=false;
+      for(;first<last;first++){
+        tsc=&tp->getSingletByMass(first);
+        if(fabs((p->monoMass-tsc->mass-spec->getLink(linkIndex).mass-mass)/p->monoMass*1e6)>params.ppmPrecursor) continue;
+        if(!bSite || tsc->site!=lastSite){
+          bSite=true;
+          lastSite=tsc->site;
+          bLink=spec->checkLink(linkSite,tsc->site,linkIndex);
         }
-        if (mass>tsc->mass || bSecond){ //pep2 listed first
-          protSC.k1 = k;
-          protSC.k2 = tsc->k1;
-          protSC.site1 = linkSite;
-          protSC.site2 = tsc->site;
-          protSC.pep1 = pep;
-          protSC.pep2 = tsc->pep1;
-          protSC.score1 = score;
-          protSC.score2 = tsc->simpleScore;
-          protSC.mass1 = mass;
-          protSC.mass2 = tsc->mass;
-          protSC.matches1 = matches;
-          protSC.matches2 = tsc->matches;
-          protSC.conFrag1 = conFrag;
-          protSC.conFrag2 = tsc->conFrag;
-          for (x = 0; x<tsc->modLen; x++) protSC.mods2->push_back(tsc->mods[x]);
-          ret=true; //indicates where to put mods to pep2
-        } else { //pep1 listed first
-          protSC.k1 = tsc->k1;
-          protSC.k2 = k;
-          protSC.site1 = tsc->site;
-          protSC.site2 = linkSite;
-          protSC.pep1 = tsc->pep1;
-          protSC.pep2 = pep;
-          protSC.score1 = tsc->simpleScore;
-          protSC.score2 = score;
-          protSC.mass1 = tsc->mass;
-          protSC.mass2 = mass;
-          protSC.matches1 = tsc->matches;
-          protSC.matches2 = matches;
-          protSC.conFrag1 = tsc->conFrag;
-          protSC.conFrag2 = conFrag;
-          for (x = 0; x<tsc->modLen; x++) protSC.mods1->push_back(tsc->mods[x]);
-          ret=false; //indicates where to put mods to pep2
+        if(!bLink) continue;
+        scoreSinglet(index, i, sIndex, iIndex, cache, sc);
+        if(!bMods){
+          indexSingletMods(iIndex,sIndex,v);
+          bMods=true;
         }
-        
-        protSC.mass = tsc->mass + spec->getLink(linkIndex).mass + mass;
-        protSC.linkable1 = tsc->linkable;
-        protSC.linkable2 = false;
-        protSC.link = linkIndex;
-        protSC.precursor = (char)i;
-
-        //special case for identical peptides
-        //if(protSC.pep2==protSC.pep1 && protSC.k1==protSC.k2){ 
-        //  protSC.score1/=2;
-        //  protSC.score2/=2;
-        //  protSC.simpleScore/=2;
-        //  it++;
-        //  continue; //WARNING...JUST SKIPPING THESE...
-        //}
-
-        //index the mods for pep2
-        iset = ions[iIndex].at(sIndex);
-        if (iset->difMass != 0){
-          for (j = 0; j<ions[iIndex].getIonCount(); j++) {
-            if (iset->mods[j] != 0){
-              if(j==0){
-                if(iset->nTermMass!=0){
-                  mod.pos=-1;
-                  mod.mass=iset->nTermMass;
-                  if (ret) protSC.mods1->push_back(mod);
-                  else protSC.mods2->push_back(mod);
-                }
-                if(fabs(iset->mods[j]-iset->nTermMass)<0.0001) continue;
-              }
-              if (j == ions[iIndex].getIonCount() - 1){
-                if (iset->cTermMass != 0){
-                  mod.pos = -2;
-                  mod.mass = iset->cTermMass;
-                  if (ret) protSC.mods1->push_back(mod);
-                  else protSC.mods2->push_back(mod);
-                }
-                if (fabs(iset->mods[j] - iset->cTermMass)<0.0001) continue;
-              }
-              //if (j == 0 && iset->modNTerm) mod.term = true;
-              //else if (j == ions[iIndex].getIonCount() - 1 && iset->modCTerm) mod.term = true;
-              //else mod.term = false;
-              mod.pos = (char)j;
-              mod.mass = iset->mods[j];
-              if(ret) protSC.mods1->push_back(mod);
-              else protSC.mods2->push_back(mod);
-            }
+        scoreCrossLink(index, i, sc, (v.size()>0) ? &v[0] : NULL, *tsc, tp->getSingletMods(*tsc), linkIndex, seq, protSC, true);
+      }
+    }
+
+    //In a single pass search, keep the lighter half of a cross-link for pairing after the sweep
+    if (firstPass && params.singlePass && (p->monoMass-spec->getLink(linkIndex).mass+0.2)/2>mass){
+      scoreSinglet(index, i, sIndex, iIndex, cache, sc);
+      bScored = true;
+      if(sc.simpleScore>=params.minPepScore && sc.simpleScore>0){
+        tp = s->getLightPeps(i);
+        if(sc.simpleScore>=tp->singletFloor.load(memory_order_relaxed)){
+          if(!bMods){
+            indexSingletMods(iIndex,sIndex,v);
+            bMods=true;
           }
+          lockSinglet(index,i);
+          tp->checkSingletScore(sc,v);
+          unlockSinglet(index,i);
         }
-        Threading::LockMutex(mutexSpecScore[index]);
-        s->checkScore(protSC);
-        Threading::UnlockMutex(mutexSpecScore[index]);
-        it++;
       }
-    //Threading::UnlockMutex(mutexSingletScore[index][i]);
     }
 
     if (firstPass && mass>(p->monoMass - spec->getLink(linkIndex).mass) / 2-0.2){
@@ -916,14 +1394,13 @@ bool KAnalysis::scoreSingletSpectra2(int index, int sIndex, double mass, double
       }
       if (lowI >= highI) continue;
       
-      score = kojakScoring(index, p->monoMass - mass, sIndex, iIndex, matches, conFrag, p->charge);
+      scoreSinglet(index, i, sIndex, iIndex, cache, sc);
+      score = sc.simpleScore;
       bScored = true;
       y = (int)(score * 10.0 + 0.5);
       if (y >= HISTOSZ) y = HISTOSZ - 1;
-      Threading::LockMutex(mutexSpecScore[index]);
-      s->histogramSinglet[y]++;
-      s->histogramSingletCount++;
-      Threading::UnlockMutex(mutexSpecScore[index]);
+      Threading::AtomicIncrement(s->histogramSinglet[y]);
+      Threading::AtomicIncrement(s->histogramSingletCount);
       if(score<params.minPepScore || score<=0) continue;
       //if(conFrag<2) continue; //FOR TESTING ONLY
 
@@ -932,67 +1409,17 @@ bool KAnalysis::scoreSingletSpectra2(int index, int sIndex, double mass, double
       //  score*=(1.0+(double)conFrag/10);
       //}
 
-      Threading::LockMutex(mutexSingletScore[index][i]);
       tp = s->getTopPeps(i);
-      if(tp->singletCount>=tp->singletMax && score<tp->singletLast->simpleScore) {
-        Threading::UnlockMutex(mutexSingletScore[index][i]);
-        continue; //don't bother with the singlet overhead if it won't make the list
-      }
-      Threading::UnlockMutex(mutexSingletScore[index][i]);
-
-      sc.len = len;
-      sc.simpleScore = score;
-      sc.k1 = k;
-      sc.linkable = false;
-      sc.pep1 = pep;
-      sc.pre = i;
-      sc.mass = mass;
-      sc.site = linkSite;
-      sc.matches=matches;
-      sc.conFrag=conFrag;
-      v.clear();
-      if (sc.mods != NULL) {
-        sc.modLen = 0;
-        delete[] sc.mods;
-        sc.mods = NULL;
-      }
-      iset = ions[iIndex].at(sIndex);
-      if (iset->difMass != 0){
-        for (j = 0; j<ions[iIndex].getIonCount(); j++) {
-          if (iset->mods[j] != 0){
-            if (j == 0){
-              if (iset->nTermMass != 0){
-                mod.pos = -1;
-                mod.mass = iset->nTermMass;
-                v.push_back(mod);
-              }
-              if (fabs(iset->mods[j] - iset->nTermMass)<0.0001) continue;
-            }
-            if (j == ions[iIndex].getIonCount() - 1){
-              if (iset->cTermMass != 0){
-                mod.pos = -2;
-                mod.mass = iset->cTermMass;
-                v.push_back(mod);
-              }
-              if (fabs(iset->mods[j] - iset->cTermMass)<0.0001) continue;
-            }
-            //if (j == 0 && iset->modNTerm) mod.term = true;
-            //else if (j == ions[iIndex].getIonCount() - 1 && iset->modCTerm) mod.term = true;
-            //else mod.term = false;
-            mod.pos = (char)j;
-            mod.mass = iset->mods[j];
-            v.push_back(mod);
-          }
-        }
-        sc.modLen = (char)v.size();
-        sc.mods = new kPepMod[sc.modLen];
-        for (j = 0; j<(int)sc.modLen; j++) sc.mods[j] = v[j];
+      if(score<tp->singletFloor.load(memory_order_relaxed)) continue; //don't bother with the singlet overhead if it won't make the list
+
+      if(!bMods){
+        indexSingletMods(iIndex,sIndex,v);
+        bMods=true;
       }
 
-      Threading::LockMutex(mutexSingletScore[index][i]);
-      tp = s->getTopPeps(i);
-      tp->checkSingletScore(sc);
-      Threading::UnlockMutex(mutexSingletScore[index][i]);
+      lockSinglet(index,i);
+      tp->checkSingletScore(sc,v);
+      unlockSinglet(index,i);
 
       //bScored=true;
     }
@@ -1001,6 +1428,165 @@ bool KAnalysis::scoreSingletSpectra2(int index, int sIndex, double mass, double
   return bScored;
 }
 
+//Combines a singlet (sc, the lighter half) with a partner from the precursor's list of heavier halves
+//and keeps the cross-link if it makes the spectrum's top hits. seq caches sc's sequence between calls.
+//bLock is false when only the calling thread can touch the spectrum.
+void KAnalysis::scoreCrossLink(int index, int pre, kSingletScoreCard& sc, kPepMod* mods, kSingletScoreCard& tsc, kPepMod* tmods, int linkIndex, string& seq, kScoreCard& protSC, bool bLock){
+  KSpectrum* s = spec->getSpectrum(index);
+  string seq1;
+  int alpha;
+  int x;
+  int y;
+  bool bSecond;
+
+  protSC.simpleScore = tsc.simpleScore + sc.simpleScore;
+  y = (int)(protSC.simpleScore * 10.0 + 0.5);
+  if (y >= HISTOSZ) y = HISTOSZ - 1;
+  Threading::AtomicIncrement(s->histogram[y]);  //no matter how low the score, put this test in our histogram.
+  Threading::AtomicIncrement(s->histogramCount);
+  if (sc.simpleScore<params.minPepScore || protSC.simpleScore <= s->lowScore.load(memory_order_relaxed)) return; //peptide needs a minimum score, and combined score should exceed bottom of best hits
+
+  protSC.mods1->clear();
+  protSC.mods2->clear();
+
+  //alphabetize cross-linked peptides before storing them; this prevents confusion with duplications downstream
+  //instead of alphabetical, order them by mass (larger first), this has implications with downstream scoring...
+  //resort to alphabetical in case of equal mass
+  bSecond=false;
+  if(sc.mass==tsc.mass){
+    if(seq.size()==0) db->getPeptideSeq(sc.pep1,seq);
+    db->getPeptideSeq(tsc.pep1, seq1);
+    alpha=seq1.compare(seq);
+    if (alpha>0 || (alpha == 0 && sc.k1<tsc.k1)) bSecond=true;
+  }
+  if (sc.mass>tsc.mass || bSecond){ //pep2 listed first
+    protSC.k1 = sc.k1;
+    protSC.k2 = tsc.k1;
+    protSC.site1 = sc.site;
+    protSC.site2 = tsc.site;
+    protSC.pep1 = sc.pep1;
+    protSC.pep2 = tsc.pep1;
+    protSC.score1 = sc.simpleScore;
+    protSC.score2 = tsc.simpleScore;
+    protSC.mass1 = sc.mass;
+    protSC.mass2 = tsc.mass;
+    protSC.matches1 = sc.matches;
+    protSC.matches2 = tsc.matches;
+    protSC.conFrag1 = sc.conFrag;
+    protSC.conFrag2 = tsc.conFrag;
+    for (x = 0; x<sc.modLen; x++) protSC.mods1->push_back(mods[x]);
+    for (x = 0; x<tsc.modLen; x++) protSC.mods2->push_back(tmods[x]);
+  } else { //pep1 listed first
+    protSC.k1 = tsc.k1;
+    protSC.k2 = sc.k1;
+    protSC.site1 = tsc.site;
+    protSC.site2 = sc.site;
+    protSC.pep1 = tsc.pep1;
+    protSC.pep2 = sc.pep1;
+    protSC.score1 = tsc.simpleScore;
+    protSC.score2 = sc.simpleScore;
+    protSC.mass1 = tsc.mass;
+    protSC.mass2 = sc.mass;
+    protSC.matches1 = tsc.matches;
+    protSC.matches2 = sc.matches;
+    protSC.conFrag1 = tsc.conFrag;
+    protSC.conFrag2 = sc.conFrag;
+    for (x = 0; x<tsc.modLen; x++) protSC.mods1->push_back(tmods[x]);
+    for (x = 0; x<sc.modLen; x++) protSC.mods2->push_back(mods[x]);
+  }
+
+  protSC.mass = tsc.mass + spec->getLink(linkIndex).mass + sc.mass;
+  protSC.linkable1 = tsc.linkable;
+  protSC.linkable2 = false;
+  protSC.link = linkIndex;
+  protSC.precursor = (char)pre;
+
+  //special case for identical peptides
+  //if(protSC.pep2==protSC.pep1 && protSC.k1==protSC.k2){ 
+  //  protSC.score1/=2;
+  //  protSC.score2/=2;
+  //  protSC.simpleScore/=2;
+  //  continue; //WARNING...JUST SKIPPING THESE...
+  //}
+
+  if(bLock) lockSpectrum(index);
+  s->checkScore(protSC);
+  if(bLock) unlockSpectrum(index);
+}
+
+//Pairs the lighter singlets collected by a single pass sweep with the heavier singlets of the same
+//precursor. Only the calling thread works on the spectrum, so nothing is locked.
+void KAnalysis::pairSinglets(int index){
+  int i,r;
+  int first,last;
+  double m,tol;
+  string seq;
+  kScoreCard protSC;
+  kPrecursor* p;
+  KTopPeps* tp;
+  KTopPeps* lp;
+  kSingletScoreCard* sc;
+  kSingletScoreCard* tsc;
+
+  KSpectrum* s = spec->getSpectrum(index);
+  for(i=0;i<s->sizePrecursor();i++){
+    p = s->getPrecursor2(i);
+    tp = s->getTopPeps(i);
+    lp = s->getLightPeps(i);
+    tol = p->monoMass / 1000000 * params.ppmPrecursor * 1.0001;
+    for(r=0;r<lp->singletCount;r++){
+      if(isCancelled()) return;
+      sc = &lp->getSingletScoreCard(r);
+      seq.clear();
+      m = p->monoMass - spec->getLink(sc->link).mass - sc->mass;
+      tp->findSingletMass(m-tol,m+tol,first,last);
+      for(;first<last;first++){
+        tsc=&tp->getSingletByMass(first);
+        if(fabs((p->monoMass-tsc->mass-spec->getLink(sc->link).mass-sc->mass)/p->monoMass*1e6)>params.ppmPrecursor) continue;
+        if(!spec->checkLink(sc->site,tsc->site,sc->link)) continue;
+        scoreCrossLink(index, i, *sc, lp->getSingletMods(*sc), *tsc, tp->getSingletMods(*tsc), sc->link, seq, protSC, false);
+      }
+    }
+    lp->resetSingletList();
+  }
+}
+
+//The mods of ion set sIndex, as stored with singlets and PSMs
+void KAnalysis::indexSingletMods(int iIndex, int sIndex, vector<kPepMod>& v){
+  int j;
+  kPepMod mod;
+  KIonSet* iset = ions[iIndex].at(sIndex);
+
+  v.clear();
+  if (iset->difMass == 0) return;
+  for (j = 0; j<ions[iIndex].getIonCount(); j++) {
+    if (iset->mods[j] != 0){
+      if (j == 0){
+        if (iset->nTermMass != 0){
+          mod.pos = -1;
+          mod.mass = iset->nTermMass;
+          v.push_back(mod);
+        }
+        if (fabs(iset->mods[j] - iset->nTermMass)<0.0001) continue;
+      }
+      if (j == ions[iIndex].getIonCount() - 1){
+        if (iset->cTermMass != 0){
+          mod.pos = -2;
+          mod.mass = iset->cTermMass;
+          v.push_back(mod);
+        }
+        if (fabs(iset->mods[j] - iset->cTermMass)<0.0001) continue;
+      }
+      //if (j == 0 && iset->modNTerm) mod.term = true;
+      //else if (j == ions[iIndex].getIonCount() - 1 && iset->modCTerm) mod.term = true;
+      //else mod.term = false;
+      mod.pos = (char)j;
+      mod.mass = iset->mods[j];
+      v.push_back(mod);
+    }
+  }
+}
+
 void KAnalysis::scoreSpectra(vector<int>& index, int sIndex, double modMass, int pep1, int pep2, int k1, int k2, int link, int iIndex, char linkSite1, char linkSite2){
   unsigned int a;
   int i,z,ps,y;
@@ -1026,11 +1612,11 @@ void KAnalysis::scoreSpectra(vector<int>& index, int sIndex, double modMass, int
     
     sc.simpleScore=kojakScoring(index[a],modMass,sIndex,iIndex, matches, conFrag, z);
     y = (int)(sc.simpleScore * 10.0 + 0.5);
-    Threading::LockMutex(mutexSpecScore[index[a]]);
-    spec->at(index[a]).histogram[y]++;
-    spec->at(index[a]).histogramCount++;
-    Threading::UnlockMutex(mutexSpecScore[index[a]]);
+    if (y >= HISTOSZ) y = HISTOSZ - 1;
+    Threading::AtomicIncrement(spec->at(index[a]).histogram[y]);
+    Threading::AtomicIncrement(spec->at(index[a]).histogramCount);
     if(sc.simpleScore<0.1)  continue;
+    if(sc.simpleScore<=spec->at(index[a]).lowScore.load(memory_order_relaxed)) continue; //checkScore would not keep it
 
     //maybe do all this only if the score is going to make the list? see singlets above
     sc.mods1->clear();
@@ -1076,15 +1662,30 @@ void KAnalysis::scoreSpectra(vector<int>& index, int sIndex, double modMass, int
         }
       }
     }
-    Threading::LockMutex(mutexSpecScore[index[a]]);
+    lockSpectrum(index[a]);
     spec->at(index[a]).checkScore(sc);
-    Threading::UnlockMutex(mutexSpecScore[index[a]]);
+    unlockSpectrum(index[a]);
+  }
+}
+
+//Scores ion set sIndex against precursor pre of spectrum index, filling sc's score, matches, and
+//conFrag. The peptide's score depends only on the precursor, so it is computed once per cache.
+void KAnalysis::scoreSinglet(int index, int pre, int sIndex, int iIndex, kScoreCache& cache, kSingletScoreCard& sc){
+  kPrecursor* p;
+  if(cache.score[pre]<0){
+    p=spec->getSpectrum(index)->getPrecursor2(pre);
+    cache.score[pre]=kojakScoring(index, p->monoMass-sc.mass, sIndex, iIndex, cache.matches[pre], cache.conFrag[pre], p->charge, cache.prefix);
   }
+  sc.simpleScore=cache.score[pre];
+  sc.matches=cache.matches[pre];
+  sc.conFrag=cache.conFrag[pre];
 }
 
 //An alternative score uses the XCorr metric from the Comet algorithm
 //This version allows for fast scoring when the cross-linked mass is added.
-float KAnalysis::kojakScoring(int specIndex, double modMass, int sIndex, int iIndex, int& match, int& conFrag, int z) { 
+//prefix, if given, holds 24 kScorePrefix (series*4+charge) for this spectrum and ion set. They are
+//filled on first use and spare later calls from rescoring the ions that are not shifted.
+float KAnalysis::kojakScoring(int specIndex, double modMass, int sIndex, int iIndex, int& match, int& conFrag, int z, kScorePrefix* prefix) { 
 
   KSpectrum* s=spec->getSpectrum(specIndex);
   KIonSet* ki=ions[iIndex].at(sIndex);
@@ -1094,32 +1695,19 @@ float KAnalysis::kojakScoring(int specIndex, double modMass, int sIndex, int iIn
 
   double dXcorr=0.0;
   double invBinSize=s->getInvBinSize();
-  double binOffset=params.binOffset;
   double dif;
-  double mz;
 
   int ionCount=ions[iIndex].getIonCount();
   int maxCharge=z;
   if(maxCharge<1) maxCharge=s->getCharge();  
 
-  int i,j,k;
-  int key;
-  int pos;
-  int con;
+  int j,k;
+  int off;
+  int sum=0;
+  kScorePrefix* pc;
   match=0;
   conFrag=0;
 
-  //Assign ion series
-  kISValue***  ionSeries;
-  ionSeries=new kISValue**[numIonSeries];
-  k=0;
-  if(params.ionSeries[0]) ionSeries[k++]=ki->aIons;
-  if(params.ionSeries[1]) ionSeries[k++]=ki->bIons;
-  if(params.ionSeries[2]) ionSeries[k++]=ki->cIons;
-  if(params.ionSeries[3]) ionSeries[k++]=ki->xIons;
-  if(params.ionSeries[4]) ionSeries[k++]=ki->yIons;
-  if(params.ionSeries[5]) ionSeries[k++]=ki->zIons;
-
   //The number of fragment ion series to analyze is PrecursorCharge-1
   //However, don't analyze past the 3+ series
   if(maxCharge>4) maxCharge=4;
@@ -1129,76 +1717,35 @@ float KAnalysis::kojakScoring(int specIndex, double modMass, int sIndex, int iIn
 
     dif=modMass/k;
 
-    //Iterate through pfFastXcorrData
-    for(j=0;j<numIonSeries;j++){
-      con=0;
-
-      for(i=0;i<ionCount;i++){
-
-        //get key -- see if this can be precomputed for the half that doesn't contain the linked peptide
-        if(ionSeries[j][k][i].mz<0) {
-          mz = params.binSize * (int)((dif-ionSeries[j][k][i].mz)*invBinSize+binOffset);
-          key = (int)mz;
-          if(key>=s->kojakBins) {
-            if (con>conFrag) conFrag = con;
-            con = 0;
-            break;
-          }
-          if(s->kojakSparseArray[key]==NULL) {
-            if (con>conFrag) conFrag = con;
-            con = 0;
-            continue;
-          }
-          pos = (int)((mz-key)*invBinSize);
-          dXcorr += s->kojakSparseArray[key][pos];
-          if (s->kojakSparseArray[key][pos]>5) {
-            match++;
-            con++;
-          } else {
-            if(con>conFrag) conFrag=con;
-            con=0;
-          }
-        } else {
-          key=ionSeries[j][k][i].key;
-          if (key >= s->kojakBins) {
-            if (con>conFrag) conFrag = con;
-            con = 0;
-            break;
-          }
-          if (s->kojakSparseArray[key] == NULL) {
-            if (con>conFrag) conFrag = con;
-            con = 0;
-            continue;
-          }
-          pos = ionSeries[j][k][i].pos;
-          dXcorr += s->kojakSparseArray[key][pos];
-          if (s->kojakSparseArray[key][pos]>5) {
-            match++;
-            con++;
-          } else {
-            if (con>conFrag) conFrag = con;
-            con = 0;
-          }
+    //Ions that contain the linked peptide are shifted by dif; the kernel bins them and sums the
+    //spectrum's values at every ion.
+    for(j=0;j<6;j++){
+      if(!params.ionSeries[j]) continue;
+      off=(j*4+k)*ki->len;
+      if(prefix!=NULL){
+        pc=&prefix[j*4+k];
+        if(!pc->done) KScoreKernel::scorePrefix(&ki->soaMz[off],&ki->soaKey[off],&ki->soaPos[off],ionCount,s->kojakArray,*pc);
+        if(pc->valid){
+          sum+=pc->sum;
+          match+=pc->match;
+          if(pc->conFrag>conFrag) conFrag=pc->conFrag;
+          if(pc->ended || pc->start==ionCount) continue;
+          off+=pc->start;
+          KScoreKernel::score(&ki->soaMz[off],&ki->soaKey[off],&ki->soaPos[off],ionCount-pc->start,dif,params.binSize,invBinSize,params.binOffset,s->kojakArray,sum,match,conFrag,pc->con);
+          continue;
         }
       }
+      KScoreKernel::score(&ki->soaMz[off],&ki->soaKey[off],&ki->soaPos[off],ionCount,dif,params.binSize,invBinSize,params.binOffset,s->kojakArray,sum,match,conFrag);
     }
 
   }
 
-  //Scale score appropriately
+  //Scale score appropriately; the sum of integer bin values is exact, so converting it here
+  //gives the same score as accumulating in double precision.
+  dXcorr=sum;
   if(dXcorr <= 0.0) dXcorr=0.0;
   else dXcorr *= 0.005;
 
-  //Clean up memory
-  k = 0;
-  if (params.ionSeries[0]) ionSeries[k++] = NULL;
-  if (params.ionSeries[1]) ionSeries[k++] = NULL;
-  if (params.ionSeries[2]) ionSeries[k++] = NULL;
-  if (params.ionSeries[3]) ionSeries[k++] = NULL;
-  if (params.ionSeries[4]) ionSeries[k++] = NULL;
-  if (params.ionSeries[5]) ionSeries[k++] = NULL;
-
-  delete[] ionSeries;
   return float(dXcorr);
 }
 
@@ -1320,6 +1867,13 @@ void KAnalysis::setBinList(kMatchSet* m, int iIndex, int charge, double preMass,
 }
 */
 
+//Stops the search early once c is raised. The running pass returns false after the work in
+//flight has finished; scores already recorded are kept.
+void KAnalysis::setCancel(ThreadCancel* c){
+  cancel=c;
+  scheduler->setCancel(c);
+}
+
 void KAnalysis::setLog(KLog* c){
   klog=c;
 }
@@ -1332,7 +1886,7 @@ void KAnalysis::makePepLists(){
   bool bMatch;
   size_t i,k;
   vector<double> v;
-  vector<kPeptide>* p=db->getPeptideList();
+  kPeptide p;
   string pep;
   
   pepMass = new double*[spec->getMotifCount()];
@@ -1345,15 +1899,16 @@ void KAnalysis::makePepLists(){
     v.clear();
 
     //iterate through peptide list
-    for (i = 0; i < p->size(); i++){
+    for (i = 0; i < (size_t)db->getPeptideListSize(); i++){
+      p=db->getPeptide((int)i);
 
       //skip peptides that cannot be linked
-      if (p->at(i).xlSites==0) continue;
+      if (p.xlSites==0) continue;
 
       //determine which motifs are allowed for this peptide
       //check termini first
       bMatch=false;
-      if(p->at(i).nTerm){
+      if(p.nTerm){
         for (m = 0; m < 20; m++){
           if (xlTable['n'][m] == -1) break;
           if (xlTable['n'][m] == (char)j) {
@@ -1362,7 +1917,7 @@ void KAnalysis::makePepLists(){
           }
         }
       }
-      if(!bMatch && p->at(i).cTerm){
+      if(!bMatch && p.cTerm){
         for (m = 0; m < 20; m++){
           if (xlTable['c'][m] == -1) break;
           if (xlTable['c'][m] == (char)j) {
@@ -1372,7 +1927,7 @@ void KAnalysis::makePepLists(){
         }
       }
       if(!bMatch){
-        db->getPeptideSeq(p->at(i),pep);
+        db->getPeptideSeq(p,pep);
         for (k = 0; k < pep.size(); k++){
           if (xlTable[pep[k]][0]>-1) {
             for (m = 0; m < 20; m++){
@@ -1391,13 +1946,13 @@ void KAnalysis::makePepLists(){
       if (!bMatch) continue;
 
       //add peptide mass to our list
-      v.push_back(p->at(i).mass);
+      v.push_back(p.mass);
 
       //add all possible modification masses too
       if (!params.diffModsOnXL && !params.monoLinksOnXL) continue;
 
       //These should be modified for quick mass calculations without ion series expansion
-      ions[0].setPeptide(true, &db->at(p->at(i).map->at(0).index).sequence[p->at(i).map->at(0).start], p->at(i).map->at(0).stop - p->at(i).map->at(0).start + 1, p->at(i).mass, p->at(i).nTerm, p->at(i).cTerm,p->at(i).n15);
+      ions[0].setPeptide(true, &db->at(p.map[0].index).sequence[p.map[0].start], p.map[0].stop - p.map[0].start + 1, p.mass, p.nTerm, p.cTerm,p.n15);
       ions[0].buildIons();
       ions[0].modIonsRec(0, -1, 0, 0, false); //does this need to be modIonsRec2???
       for (m = 1; m<ions[0].size(); m++) v.push_back(ions[0][m].mass);
@@ -1418,8 +1973,6 @@ void KAnalysis::makePepLists(){
 
   }
 
-  p = NULL;
-
 }
 
 bool KAnalysis::findCompMass(int motif, double low, double high){
@@ -1457,6 +2010,14 @@ int KAnalysis::compareD(const void *p1, const void *p2){
   else return 0;
 }
 
+int KAnalysis::compareMassList(const void *p1, const void *p2){
+  const kMass d1 = *(kMass *)p1;
+  const kMass d2 = *(kMass *)p2;
+  if(d1.mass<d2.mass) return -1;
+  else if(d1.mass>d2.mass) return 1;
+  else return 0;
+}
+
 int KAnalysis::comparePeptideBMass(const void *p1, const void *p2){
   const kPeptideB d1 = *(kPeptideB *)p1;
   const kPeptideB d2 = *(kPeptideB *)p2;
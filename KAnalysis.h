@@ -19,35 +19,20 @@ limitations under the License.
 
 #include "KDB.h"
 #include "KData.h"
+#include "KFragIndex.h"
 #include "KLog.h"
 #include "KIons.h"
+#include "KScoreKernel.h"
+#include "KScheduler.h"
 #include "Threading.h"
 #include "ThreadPool.h"
 
+#define SPECBLOCKS 4  //spectrum blocks per thread in spectrum-centric searches
+#define SCORELOCKS 1024 //striped locks for the top hit and singlet lists; must be a power of 2
+
 //=============================
 // Structures for threading
 //=============================
-struct kAnalysisStruct {
-  bool*       bKIonsMem;    //Pointer to the memory manager array to mark memory is in use
-  Mutex*      mutex;        //Pointer to a mutex for protecting memory
-  kPeptide*   pep;
-  int         pepIndex;
-  kAnalysisStruct(Mutex* m, kPeptide* p, int i){
-    mutex=m;
-    pep=p;
-    pepIndex=i;
-  }
-  ~kAnalysisStruct(){
-    //Mark that memory is not being used, but do not delete it here.
-    Threading::LockMutex(*mutex);
-    if(bKIonsMem!=NULL) *bKIonsMem=false;
-    bKIonsMem=NULL;
-    Threading::UnlockMutex(*mutex);
-    mutex=NULL;   //release mutex
-    pep=NULL;
-  }
-};
-
 struct kAnalysisNCStruct {
   bool*               bKIonsMem;    //Pointer to the memory manager array to mark memory is in use
   Mutex*              mutex;        //Pointer to a mutex for protecting memory
@@ -88,6 +73,85 @@ struct kAnalysisRelStruct {
   }
 };
 
+struct kAnalysisSpecStruct {
+  bool*       bKIonsMem;    //Pointer to the memory manager array to mark memory is in use
+  Mutex*      mutex;        //Pointer to a mutex for protecting memory
+  int         specIndex;
+  kAnalysisSpecStruct(Mutex* m, int i){
+    mutex=m;
+    specIndex=i;
+  }
+  ~kAnalysisSpecStruct(){
+    //Mark that memory is not being used, but do not delete it here.
+    Threading::LockMutex(*mutex);
+    if(bKIonsMem!=NULL) *bKIonsMem=false;
+    bKIonsMem=NULL;
+    Threading::UnlockMutex(*mutex);
+    mutex=NULL;   //release mutex
+  }
+};
+
+//Scores of one ion set against one spectrum, kept while every link site and precursor is tried.
+//Whole scores are kept per precursor, and the unshifted ions of each series and charge are scored
+//once for all of the precursors. Call reset() before moving to another spectrum or ion set.
+struct kScoreCache {
+  kScorePrefix        prefix[24]; //indexed as the KIonSet ion arrays: series*4+charge
+  std::vector<float>  score;      //per precursor; negative until scored
+  std::vector<int>    matches;
+  std::vector<int>    conFrag;
+  void reset(int precursors){
+    int i;
+    for(i=0;i<24;i++) prefix[i].done=false;
+    score.assign(precursors,-1);
+    matches.assign(precursors,0);
+    conFrag.assign(precursors,0);
+  }
+};
+
+//Spectrum-centric searches split the spectra into blocks of neighboring precursor mass. A block is
+//only ever searched by one thread at a time, so its spectra can be scored without locking.
+struct kSpecBlock {
+  std::vector<kMass> massList;  //sorted precursor masses of the spectra in this block
+  double  minMass;              //lowest precursor mass in the block
+  double  maxMass;              //highest precursor mass in the block
+  bool*   soloLoop;             //first pass non-link and loop tracking, offset by soloStart
+  size_t  soloStart;
+  size_t  soloSize;
+  size_t  pepStart;             //peptide index range to search in the current pass
+  size_t  pepStop;
+  kSpecBlock(){
+    minMass=0;
+    maxMass=0;
+    pepStart=0;
+    pepStop=0;
+    soloLoop=NULL;
+    soloStart=0;
+    soloSize=0;
+  }
+  ~kSpecBlock(){
+    if(soloLoop!=NULL) delete [] soloLoop;
+  }
+};
+
+struct kAnalysisBlockStruct {
+  bool*       bKIonsMem;    //Pointer to the memory manager array to mark memory is in use
+  Mutex*      mutex;        //Pointer to a mutex for protecting memory
+  kSpecBlock* block;
+  kAnalysisBlockStruct(Mutex* m, kSpecBlock* b){
+    mutex=m;
+    block=b;
+  }
+  ~kAnalysisBlockStruct(){
+    //Mark that memory is not being used, but do not delete it here.
+    Threading::LockMutex(*mutex);
+    if(bKIonsMem!=NULL) *bKIonsMem=false;
+    bKIonsMem=NULL;
+    Threading::UnlockMutex(*mutex);
+    mutex=NULL;   //release mutex
+    block=NULL;
+  }
+};
+
 class KAnalysis{
 public:
 
@@ -99,6 +163,7 @@ public:
   bool doPeptideAnalysis ();
   bool doEValueAnalysis  ();
 
+  void setCancel(ThreadCancel* c);
   void setLog(KLog* c);
   //bool doPeptideAnalysisNC ();
   //__int64 xCorrCount;
@@ -106,32 +171,61 @@ public:
 private:
 
   //Thread-start functions
-  static void analyzePeptideProc (kAnalysisStruct* s); 
-  static void analyzeEValueProc  (KSpectrum* s);
+  static void analyzeBlockProc   (kAnalysisBlockStruct* s);
+  static void analyzeSingletIndexProc (kAnalysisSpecStruct* s);
+
+  //Scheduler jobs
+  static void analyzeEValueJob   (void* data, size_t item, int thread);
+  static void analyzePairJob     (void* data, size_t item, int thread);
+  static void analyzePeptideJob  (void* data, size_t item, int thread);
+  static void progressProc       (void* data, size_t done, size_t total);
 
   //Analysis functions
-  static bool analyzePeptide(kPeptide* p, int pepIndex, int iIndex);
+  static bool analyzeBlock  (kSpecBlock* b, int iIndex);
+  static bool analyzePeptide(kPeptide* p, int pepIndex, int iIndex, kSpecBlock* b=NULL);
+  static bool analyzeSingletIndex(int specIndex, int iIndex);
+  bool        doPairingAnalysis();
+  bool        doSingletIndexAnalysis();
+  bool        doSpectrumAnalysis();
 
   //Private Functions
   bool         allocateMemory          (int threads);
-  static bool  analyzeSinglets         (kPeptide& pep, int index, double lowLinkMass, double highLinkMass, int iIndex);
+  static bool  analyzeSinglets         (kPeptide& pep, int index, double lowLinkMass, double highLinkMass, int iIndex, kSpecBlock* b=NULL);
   static bool  analyzeSingletsNC       (kPeptide& pep, int index, int iIndex);
+  bool         buildFragIndex          ();
   static void  checkXLMotif            (int motifA, char* motifB, std::vector<int>& v);
   void         deallocateMemory        (int threads);
   static int   findMass                (kSingletScoreCardPlus* s, int sz, double mass);
+  static size_t findPeptide            (double mass);
+  static int   getSingletMotifs        (kPeptide& pep, std::string& pepSeq, int k, int len, char* mot, char* site);
+  static void  indexSingletMods        (int iIndex, int sIndex, std::vector<kPepMod>& v);
+  static bool  isCancelled             ();
+  static bool  isSoloLoop              (int pepIndex, kSpecBlock* b);
+  static void  lockSinglet             (int index, int pre);
+  static void  lockSpectrum            (int index);
+  static void  pairSinglets            (int index);
+  static double peptideCost            (int pepIndex);
+  static void  setSoloLoop             (int pepIndex, kSpecBlock* b);
+  static void  unlockSinglet           (int index, int pre);
+  static void  unlockSpectrum          (int index);
+  static void  scoreCrossLink          (int index, int pre, kSingletScoreCard& sc, kPepMod* mods, kSingletScoreCard& tsc, kPepMod* tmods, int linkIndex, std::string& seq, kScoreCard& protSC, bool bLock);
   static void  scoreSpectra            (std::vector<int>& index, int sIndex, double modMass, int pep1, int pep2, int k1, int k2, int link, int iIndex, char linkSite1, char linkSite2);
-  static float kojakScoring            (int specIndex, double modMass, int sIndex, int iIndex, int& match, int& conFrag, int z = 0);
+  static float kojakScoring            (int specIndex, double modMass, int sIndex, int iIndex, int& match, int& conFrag, int z = 0, kScorePrefix* prefix = NULL);
+  static void  scoreSinglet            (int index, int pre, int sIndex, int iIndex, kScoreCache& cache, kSingletScoreCard& sc);
   static void  setBinList              (kMatchSet* m, int iIndex, int charge, double preMass, kPepMod* mods, char modLen);
 
   //Data Members
   static bool*      bKIonsManager;
+  static ThreadCancel* cancel;  //raised to stop the search early; may be NULL
   static KDatabase* db;
+  static KFragIndex* fragIndex; //first pass singlet index, NULL unless singlet_index is set
   static double     highLinkMass;
   static KIons*     ions;
   static double     lowLinkMass;
   static double     maxMass;
   static double     minMass;
   static kParams    params;
+  static KScheduler* scheduler; //persistent workers for the peptide and e-value passes
   static KData*     spec;
   static char**     xlTable;
   static bool**     scanBuffer;
@@ -149,18 +243,22 @@ private:
 
   static bool* soloLoop;
   static bool firstPass;
+  static size_t soloStart;   //first pass peptide range, used by spectrum-centric blocks
+  static size_t soloStop;
 
   static KDecoys decoys;
+  static KDecoyTable decoyTable; //binned decoy fragments, built for the e-value pass
   static KLog* klog;
 
-  static bool scoreSingletSpectra2(int index, int sIndex, double mass, double xlMass, int counterMotif, int len, int pep, char k, double minMass, int iIndex, char linkSite, int linkIndex);
+  static bool scoreSingletSpectra2(int index, int sIndex, double mass, double xlMass, int counterMotif, int len, int pep, char k, double minMass, int iIndex, char linkSite, int linkIndex, kScoreCache& cache);
 
   static Mutex  mutexKIonsManager; 
   static Mutex* mutexSpecScore; //these signal PSM list reads/additions/deleteions
-  static Mutex** mutexSingletScore; //these signal singlet list reads/additions/deletions
+  static Mutex* mutexSingletScore; //these signal singlet list reads/additions/deletions
 
   //Utilities
   static int compareD           (const void *p1,const void *p2);
+  static int compareMassList    (const void *p1,const void *p2);
   static int comparePeptideBMass(const void *p1,const void *p2);
   static int compareSSCPlus     (const void *p1,const void *p2);
   
@@ -16,6 +16,13 @@ limitations under the License.
 
 #include "KDB.h"
 
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
 //==============================
@@ -86,6 +93,8 @@ KDatabase::KDatabase(){
   n15Label="NON15LABEL";
   klog=NULL;
   linkablePepCount=0;
+  threads=1;
+  clearPeptides();
 }
 
 KDatabase::~KDatabase(){
@@ -103,331 +112,193 @@ kDB& KDatabase::operator[ ](const int& i){
 //  User Functions
 //==============================
 
-//buildDB reads in a FASTA file and stores it in memory.
+//buildDB reads in a FASTA file and stores it in memory. The file is mapped and scanned a line at
+//a time. Each protein is gathered in one reused buffer, then copied into vDB at its final size.
 bool  KDatabase::buildDB(const char* fname, string decoyStr) {
-  char    str[10240];
-  char*   tok;
-  FILE*   f;
-  kDB    d;
-  char   c;
-
-  d.name="NIL";
+  const char* buf;
+  const char* p;
+  const char* end;
+  const char* eol;
+  const char* line;
+  char        aaTable[256];
+  char        c;
+  size_t      i;
+  size_t      len;
+  size_t      sz;
+  bool        bHeader=false;
+
+  kDB d;
 
   vDB.clear();
-  f=fopen(fname,"rt");
-  if(f==NULL) return false;
-  while(!feof(f)){
-    if(fgets(str,10240,f)==NULL) continue;
-    if(strlen(str)>0){
-      tok=strtok(str,"\r\n");
-      if(tok==NULL) continue;
-      strcpy(str,tok);
-    }
-    if(str[0]=='>') {
-      if(d.name.compare("NIL")!=0) {
-        if(d.sequence.length()>65000){
-          if (klog != NULL) klog->addDBWarning(d.name + " has a sequence that is too long. It will be skipped.");
-          else cout << "  WARNING: " << &d.name[0] << " has a sequence that is too long. It will be skipped." << endl;
-        } else {
-          if(d.name.find(decoyStr)!=string::npos) d.decoy=true;
-          else d.decoy=false;
-          vDB.push_back(d);
-        }
-      }
-      d.name=&str[1];
-      d.sequence="";
+  buf=mapFile(fname,sz);
+  if(buf==NULL) return false;
+
+  //residues with a mass map to their upper case letter, everything else to 0
+  for(i=0;i<256;i++){
+    c=(char)toupper((int)i);
+    if(i<128 && c>=0 && AA[c]!=0) aaTable[i]=c;
+    else aaTable[i]=0;
+  }
+
+  d.name="NIL";
+  p=buf;
+  end=buf+sz;
+  while(p<end){
+    eol=(const char*)memchr(p,'\n',end-p);
+    if(eol==NULL) eol=end;
+    line=p;
+    len=eol-p;
+    p=eol+1;
+    eol=(const char*)memchr(line,'\r',len);
+    if(eol!=NULL) len=eol-line;
+    if(len==0) continue;
+
+    if(line[0]=='>') {
+      if(bHeader) addProtein(d,decoyStr);
+      bHeader=true;
+      d.name.assign(line+1,len-1);
+      d.sequence.clear();
     } else {
-      for(unsigned int i=0;i<strlen(str);i++){
-        c=toupper(str[i]);
-        if(AA[c]==0) {
-          if (klog != NULL) klog->addDBWarning(d.name+" has an unexpected amino acid character or errant white space: '" + c + "'");
-          else cout << "  WARNING: " << &d.name[0] << " has an unexpected amino acid character or errant white space: '" << c << "'" << endl;
-        }
-        if(c==' ' || c=='\t') continue;
-        if (AA[c] == 0) {
-          if (klog != NULL) {
-            string tmpStr="Mass of '";
-            klog->addDBWarning(tmpStr + c + "' is currently set to 0. Consider revising with the aa_mass parameter.");
-          } else cout << "  WARNING: Mass of '" << c << "' is currently set to 0. Consider revising with the aa_mass parameter." << endl;
+      for(i=0;i<len;i++){
+        c=aaTable[(unsigned char)line[i]];
+        if(c==0) {
+          c=(char)toupper(line[i]);
+          if(!addResidueWarning(d.name,c)) continue;
         }
         d.sequence+=c;
       }
     }
   }
-  fclose(f);
-  if(d.sequence.length()>65000){
-    if (klog != NULL) klog->addDBWarning(d.name + " has a sequence that is too long. It will be skipped.");
-    else cout << "  WARNING: " << &d.name[0] << " has a sequence that is too long. It will be skipped." << endl;
-   } else {
-    if (d.name.find(decoyStr) != string::npos) d.decoy = true;
-    else d.decoy = false;
-    vDB.push_back(d);
-  }
+  addProtein(d,decoyStr);
+  unmapFile(buf,sz);
 
   cout << "  Total Proteins: " << vDB.size() << endl;
 
   return true;
 }
 
+//Decoys are made on multiple threads, each filling its own range of the new protein entries.
 void KDatabase::buildDecoy(string decoy_label) {
-
-  typedef struct clips {
-    int start;
-    int stop;
-  } clips;
-
-  size_t i, j,sz;
-  vector<clips> cut;
-  clips c;
+  size_t sz;
+  kDBThreadStruct job;
 
   sz = vDB.size();
-  for (i = 0; i < sz; i++) {
-
-    cut.clear();
-    c.start = -1;
-    //if (vDB[i].sequence[0] == 'M')j = 1; //leave leading methionines in place
-    //else j = 0;
-    for (j = 1; j < vDB[i].sequence.size(); j++) {
-      if (enzyme.cutN[vDB[i].sequence[j]] || enzyme.cutC[vDB[i].sequence[j]]) {
-        if (c.start > -1) { //mark the space in between
-          c.stop = (int)j - 1;
-          cut.push_back(c);
-          c.start = -1; //reset
-        }
-      } else {
-        if (c.start < 0) c.start = (int)j;
-      }
-    }
-    if (!enzyme.cutN[vDB[i].sequence[j - 1]] && !enzyme.cutC[vDB[i].sequence[j - 1]]) { //check last amino acid
-      c.stop = (int)j - 1;
-      cut.push_back(c);
-    }
-
-    //reverse the sequences
-    string rev;
-    kDB decoy = vDB[i];
-    decoy.name = decoy_label + "_" + decoy.name;
-    for (j = 0; j < cut.size(); j++) {
-      rev.clear();
-
-      //adjust ends for restrictive sites
-      while (enzyme.exceptN[decoy.sequence[cut[j].start]] || enzyme.exceptC[decoy.sequence[cut[j].start]]) {
-        cut[j].start++;
-        if (cut[j].start == decoy.sequence.size()) break;
-      }
-      while (enzyme.exceptN[decoy.sequence[cut[j].stop]] || enzyme.exceptC[decoy.sequence[cut[j].stop]]) {
-        cut[j].stop--;
-        if (cut[j].stop == -1) break;
-      }
-      if (cut[j].start == decoy.sequence.size()) continue; //skip when out of bounds
-      if (cut[j].stop == -1) continue; //skip when out of bounds
-      if (cut[j].stop <= cut[j].start) continue; //skip if nothing will happen
-
-
-      for (size_t k = cut[j].stop; k >= cut[j].start; k--) {
-        rev += decoy.sequence[k];
-        if (k == 0) break;
-      }
-      decoy.sequence.replace(cut[j].start, (size_t)cut[j].stop - (size_t)cut[j].start + 1, rev);
-    }
-
-    vDB.push_back(decoy);
-  }
+  vDB.resize(sz*2);
+  job.db = this;
+  job.str = decoy_label;
+  runJobs(job, decoyProc, sz, threads*4);
 
   cout << "  Adding Kojak-generated decoys. New Total Proteins: " << vDB.size() << endl;
 }
 
-//buildPeptides creates lists of peptides to search based on the user-defined enzyme rules
+//buildPeptides creates lists of peptides to search based on the user-defined enzyme rules.
+//Proteins are digested on multiple threads in chunks that are joined in protein order.
 bool KDatabase::buildPeptides(double min, double max, int mis){
 
-  double mass;
-  bool bCutMarked;
-  bool bNTerm;
-  bool bCTerm;
-  bool bN15;
-
-  int mc;
-  int next;
-
-  char xlSites;
-
-  kPepMap  pm;
-  kPeptide p;
-  
-  size_t DBSize=vDB.size();
   size_t i;
-  size_t k;
   size_t n;
-  size_t seqSize;
-  size_t start;
-
-  vPep.clear();
-
-  for(i=0;i<DBSize;i++){
-    if (vDB[i].name.find(n15Label) == string::npos) bN15=false;
-    else bN15=true;
-    seqSize=vDB[i].sequence.size();
-    start=0;
-    n=0;
-    k=0;
-    mc=0;
-    mass=18.0105633+fixMassPepN+fixMassProtN;
-    if(vDB[i].sequence[0]=='M') next=0; //allow for next start site to be amino acid after initial M.
-    else next = -1;
-
-    pm.index=(int)i;
-    bNTerm=false;
-    bCTerm=false;
-    xlSites=0;
-
-    while(true){
-
-      bCutMarked=false;
-
-      //Check if we cut n-terminal to this AA
-      if(n>0 && enzyme.cutN[vDB[i].sequence[start+n]] && !enzyme.exceptC[vDB[i].sequence[start+n-1]]){
-        if(next==-1) next=(int)start+(int)n-1;
-        if(!bCutMarked) mc++;
-        bCutMarked=true;
-
-        //Add the peptide now (if enough mass)
-        if ((mass+fixMassPepC)>min) addPeptide((int)i, (int)start, (int)n - 1, mass+fixMassPepC, p, vPep, bNTerm, bCTerm, bN15, xlSites);
-
-      }
-
-      //Add the peptide mass
-      if (bN15) mass += AAn15[vDB[i].sequence[start + n]];
-      else mass+=AA[vDB[i].sequence[start+n]];
-
-      //Check if we cut c-terminal to this AA
-      if((start+n+1)<seqSize && enzyme.cutC[vDB[i].sequence[start+n]] && !enzyme.exceptN[vDB[i].sequence[start+n+1]]){
-        if(next==-1) next=(int)(start+n);
-        if(!bCutMarked) mc++;
-        bCutMarked=true;
-
-        //Add the peptide now (if enough mass)
-        if((mass+fixMassPepC)>min && (mass+fixMassPepC)<max) addPeptide((int)i,(int)start,(int)n,mass+fixMassPepC,p,vPep,bNTerm,bCTerm, bN15, xlSites);
-
-      }
-
-      //Mark sites of cross-linker attachment (if searching for cross-links)
-      if(checkAA(p,i,start,n,seqSize,bNTerm,bCTerm)) xlSites++;
-
-      //Check if we are at the end of the sequence
-      if((start+n+1)==seqSize) {
-
-        //Add the peptide now (if enough mass)
-        if ((mass+fixMassPepC+fixMassProtC)>min && (mass+fixMassPepC+fixMassProtC)<max) addPeptide((int)i, (int)start, (int)n, mass+fixMassPepC+fixMassProtC, p, vPep, bNTerm, bCTerm, bN15, xlSites);
-        if(next>-1) {
-          start=next+1;
-          n=0;
-          mc=0;
-          mass=18.0105633+fixMassPepN;
-          bNTerm = false;
-          bCTerm = false;
-          xlSites=0;
-          next=-1;
-          continue;
-        } else {
-          break;
-        }
-
-      }
-
-      //Check if we exceeded peptide mass
-      //Check if we exceeded the number of missed cleavages
-      if((mass+fixMassPepC)>max || mc>mis ) {
-
-        //if we know next cut site
-        if(next>-1) {
-          start=next+1;
-          n=0;
-          mc=0;
-          mass=18.0105633+fixMassPepN;
-          bNTerm = false;
-          bCTerm = false;
-          xlSites = 0;
-          next=-1;
-
-        //Otherwise, continue scanning until it is found
-        } else {
-          while((start+n)<seqSize-1){
-            n++;
-            if(n>0 && enzyme.cutN[vDB[i].sequence[start+n]] && !enzyme.exceptC[vDB[i].sequence[start+n-1]]){
-              next=(int)(start+n);
-              break;
-            } else if((start+n+1)<seqSize && enzyme.cutC[vDB[i].sequence[start+n]] && !enzyme.exceptN[vDB[i].sequence[start+n+1]]){
-              next=(int)(start+n);
-              break;
-            } 
-          }
-          if(next<0) break;
-
-          start=next+1;
-          n=0;
-          mc=0;
-          mass=18.0105633+fixMassPepN;
-          bNTerm = false;
-          bCTerm = false;
-          xlSites = 0;
-          next=-1;
-        }  
-      } else {
-        n++;
-        continue;
-      }
-
-    }
-
+  size_t chunkCount;
+  size_t chunkSize;
+
+  kDBThreadStruct         job;
+  vector<kDigestPeptide>* vChunk;
+  vector<kDigestPeptide>  vDigest;
+  vector<uint64_t>        vHash;
+  vector<int>             vOwner;
+  vector<size_t>          vNext;
+  vector<kPeptideB>       vOrder;
+  kPeptideB               pb;
+
+  clearPeptides();
+
+  job.db=this;
+  job.min=min;
+  job.max=max;
+  job.mis=mis;
+
+  chunkCount=(size_t)threads*8;
+  if(chunkCount>vDB.size()) chunkCount=vDB.size();
+  if(chunkCount<1) chunkCount=1;
+  chunkSize=(vDB.size()+chunkCount-1)/chunkCount;
+  vChunk = new vector<kDigestPeptide>[chunkCount];
+  ThreadPool<kDBThreadStruct*>* threadPool = new ThreadPool<kDBThreadStruct*>(digestProc,threads,threads,1);
+  for(i=0;i<chunkCount;i++){
+    threadPool->WaitForQueuedParams();
+    kDBThreadStruct* a = new kDBThreadStruct(job);
+    a->start=i*chunkSize;
+    a->stop=a->start+chunkSize;
+    if(a->stop>vDB.size()) a->stop=vDB.size();
+    if(a->start>a->stop) a->start=a->stop;
+    a->vP=&vChunk[i];
+    threadPool->Launch(a);
   }
+  threadPool->WaitForQueuedParams();
+  threadPool->WaitForThreads();
+  delete threadPool;
+
+  n=0;
+  for(i=0;i<chunkCount;i++) n+=vChunk[i].size();
+  vDigest.reserve(n);
+  for(i=0;i<chunkCount;i++) vDigest.insert(vDigest.end(),vChunk[i].begin(),vChunk[i].end());
+  delete [] vChunk;
 
   /* Diagnostic block - probably safe to give the boot
   cout << vPep.size() << endl;
   kPepSort ps2;
   for (i = 0; i < vPep.size(); i++) {
-    getPeptideSeq(vPep[i].map->at(0).index, vPep[i].map->at(0).start, vPep[i].map->at(0).stop, ps2.sequence);
-    cout << ps2.sequence << "\t" << vPep[i].map->at(0).start << endl;
+    getPeptideSeq(vPep[i].map[0].index, vPep[i].map[0].start, vPep[i].map[0].stop, ps2.sequence);
+    cout << ps2.sequence << "\t" << vPep[i].map[0].start << endl;
   }
   */
 
-  //merge duplicates
-  kPepSort ps;
-  ps.index=0;
-  ps.sequence.clear();
-  vector<kPepSort> vPS;
-  for(i=0;i<vPep.size();i++){
-    ps.index=(int)i;
-    ps.n15=vPep[i].n15;
-    getPeptideSeq(vPep[i].map->at(0).index,vPep[i].map->at(0).start,vPep[i].map->at(0).stop,ps.sequence);
-    vPS.push_back(ps);
-  }
-  //qsort(&vPS[0],vPS.size(),sizeof(kPepSort),compareSequence);
-  sort(vPS.begin(),vPS.end(),compareSequenceB);
-
-  vector<kPeptide> vtp;
-  for(i=vPS.size()-1;i>0;i--){
-    if(vPS[i].sequence.compare(vPS[i-1].sequence)==0 && vPS[i].n15==vPS[i-1].n15){
-      for(k=0;k<vPep[vPS[i].index].map->size();k++){
-        vPep[vPS[i-1].index].map->push_back(vPep[vPS[i].index].map->at(k));
-        if (vPep[vPS[i].index].cTerm) vPep[vPS[i - 1].index].cTerm = vPep[vPS[i].index].cTerm;
-        if (vPep[vPS[i].index].nTerm) vPep[vPS[i - 1].index].nTerm = vPep[vPS[i].index].nTerm;
-        if (vPep[vPS[i].index].xlSites>vPep[vPS[i - 1].index].xlSites) vPep[vPS[i - 1].index].xlSites = vPep[vPS[i].index].xlSites;
-      }
-      vPep[vPS[i].index].mass=-1;
-    }
+  //merge duplicates: peptides are hashed by sequence, then each thread merges one partition of the
+  //hashes. The first occurrence of a sequence becomes the owner of the others.
+  vHash.resize(vDigest.size());
+  vOwner.resize(vDigest.size());
+  if(vDigest.size()>0){
+    job.vP=&vDigest;
+    job.hash=&vHash[0];
+    job.owner=&vOwner[0];
+    runJobs(job, hashProc, vDigest.size(), threads*4);
+    runJobs(job, mergeProc, threads, threads);
   }
-  for(i=0;i<vPep.size();i++){
-    if(vPep[i].mass>0) vtp.push_back(vPep[i]);
+  vector<uint64_t>().swap(vHash);
+
+  //sort peptides by mass (high to low), ties by list order, using a permutation of the indexes
+  for(i=0;i<vDigest.size();i++){
+    if(vOwner[i]!=(int)i) continue;
+    pb.mass=vDigest[i].mass;
+    pb.index=(int)i;
+    vOrder.push_back(pb);
   }
-  vPep.clear();
+  if(vOrder.size()>1) qsort(&vOrder[0],vOrder.size(),sizeof(kPeptideB),compareMassIndex);
+
+  //fill the peptide table; each owner's rank in the sorted list is kept in vNext until the
+  //mappings are placed
+  pepMass.resize(vOrder.size());
+  pepFlags.resize(vOrder.size());
+  pepXLSites.resize(vOrder.size());
+  pepMapStart.assign(vOrder.size()+1,0);
+  vNext.resize(vDigest.size());
   n=0;
-  for(i=0;i<vtp.size();i++) {
-    if (vtp[i].xlSites>0)n++;
-    vPep.push_back(vtp[i]);
+  for(i=0;i<vOrder.size();i++){
+    kDigestPeptide& d=vDigest[vOrder[i].index];
+    pepMass[i]=d.mass;
+    pepFlags[i]=d.flags;
+    pepXLSites[i]=d.xlSites;
+    if(d.xlSites>0) n++;
+    vNext[vOrder[i].index]=i;
   }
+  for(i=0;i<vDigest.size();i++) pepMapStart[vNext[vOwner[i]]+1]++;
+  for(i=0;i<vOrder.size();i++) pepMapStart[i+1]+=pepMapStart[i];
+  vector<kPeptideB>().swap(vOrder);
+  for(i=0;i<vDigest.size();i++){
+    if(vOwner[i]==(int)i) vNext[i]=pepMapStart[vNext[i]];
+  }
+  pepMap.resize(vDigest.size());
+  for(i=0;i<vDigest.size();i++) pepMap[vNext[vOwner[i]]++]=vDigest[i].map;
 
-  cout << "  " << vPep.size() << " peptides to search (" << n << " linkable)." << endl;
-  qsort(&vPep[0],vPep.size(),sizeof(kPeptide),compareMass);
+  cout << "  " << pepMass.size() << " peptides to search (" << n << " linkable)." << endl;
   linkablePepCount=(int)n;
 
   //Diagnostics for David
@@ -454,36 +325,36 @@ bool KDatabase::buildPeptides(double min, double max, int mis){
     bDec0=false;
     bDec1=false;
     bRev=false;
-    for(size_t j=0;j<vPep[i].map->size();j++){
+    for(size_t j=0;j<vPep[i].mapSize;j++){
 
-      //if(vDB[vPep[i].map->at(j).index].name.find("DEBRUIJN0")!=string::npos) bDec0=true;
-      //else if (vDB[vPep[i].map->at(j).index].name.find("DEBRUIJN1") != string::npos) bDec1=true;
+      //if(vDB[vPep[i].map[j].index].name.find("DEBRUIJN0")!=string::npos) bDec0=true;
+      //else if (vDB[vPep[i].map[j].index].name.find("DEBRUIJN1") != string::npos) bDec1=true;
       //else bTarg = true;
 
-      if (vDB[vPep[i].map->at(j).index].name.find("REV") != string::npos) bRev = true;
+      if (vDB[vPep[i].map[j].index].name.find("REV") != string::npos) bRev = true;
       else bTarg = true;
 
     }
 
     if(bTarg && !bDec0 && !bDec1) {
       targ++;
-      lenT[(vPep[i].map->at(0).stop - vPep[i].map->at(0).start+1)]++;
+      lenT[(vPep[i].map[0].stop - vPep[i].map[0].start+1)]++;
     } else if(!bTarg && bDec0 && !bDec1){
       dec0++;
-      lenD0[(vPep[i].map->at(0).stop - vPep[i].map->at(0).start + 1)]++;
+      lenD0[(vPep[i].map[0].stop - vPep[i].map[0].start + 1)]++;
     } else if(!bTarg && !bDec0 && bDec1){
       dec1++;
-      lenD1[(vPep[i].map->at(0).stop - vPep[i].map->at(0).start + 1)]++;
+      lenD1[(vPep[i].map[0].stop - vPep[i].map[0].start + 1)]++;
     } else {
       multi++;
     }
 
     if (bTarg && !bRev) {
       targ++;
-      lenT[(vPep[i].map->at(0).stop - vPep[i].map->at(0).start + 1)]++;
+      lenT[(vPep[i].map[0].stop - vPep[i].map[0].start + 1)]++;
     } else if (!bTarg && bRev){
       rev++;
-      lenR[(vPep[i].map->at(0).stop - vPep[i].map->at(0).start + 1)]++;
+      lenR[(vPep[i].map[0].stop - vPep[i].map[0].start + 1)]++;
     } else {
       multi++;
     }
@@ -505,14 +376,14 @@ bool KDatabase::buildPeptides(double min, double max, int mis){
   /*
   char str[256];
   for(i=0;i<vPep.size();i++){
-    getPeptideSeq(vPep[i].map->at(0).index,vPep[i].map->at(0).start,vPep[i].map->at(0).stop,str);
+    getPeptideSeq(vPep[i].map[0].index,vPep[i].map[0].start,vPep[i].map[0].stop,str);
     cout << i << ", " << vPep[i].mass << "\t" << str;
     for(k=0;k<vPep[i].vA->size();k++) cout << "\t" << vPep[i].vA->at(k);
     cout << endl;
     //if(i==10) break;
   }
   for(i=0;i<vPepK.size();i++){
-    getPeptideSeq(vPepK[i].map->at(0).index,vPepK[i].map->at(0).start,vPepK[i].map->at(0).stop,str);
+    getPeptideSeq(vPepK[i].map[0].index,vPepK[i].map[0].start,vPepK[i].map[0].stop,str);
     cout << i << ", " << vPepK[i].mass << "\t" << str;
     for(k=0;k<vPepK[i].vA->size();k++) cout << "\t" << vPepK[i].vA->at(k);
     cout << endl;
@@ -535,6 +406,184 @@ void KDatabase::exportDB(string fName) {
   fclose(f);
 }
 
+//The cache key covers the FASTA contents and everything that changes the proteins or peptides
+//built from them: decoys, enzyme, amino acid and fixed modification masses, 15N label, peptide
+//mass bounds, miscleavages, and the cross-link sites. Returns 0 if the FASTA cannot be read.
+uint64_t KDatabase::getCacheKey(const char* fname, string decoyStr, bool decoy, double min, double max, int mis){
+  char*     buf;
+  size_t    sz;
+  uint64_t  h=14695981039346656037ULL;
+  int       ver=KDBCACHEVERSION;
+  FILE*     f;
+
+  f=fopen(fname,"rb");
+  if(f==NULL) return 0;
+  buf=new char[1048576];
+  while((sz=fread(buf,1,1048576,f))>0) h=hashBytes(h,buf,sz);
+  fclose(f);
+  delete [] buf;
+
+  h=hashBytes(h,&ver,sizeof(int));
+  h=hashBytes(h,decoyStr.c_str(),decoyStr.size()+1);
+  h=hashBytes(h,&decoy,sizeof(bool));
+  h=hashBytes(h,&min,sizeof(double));
+  h=hashBytes(h,&max,sizeof(double));
+  h=hashBytes(h,&mis,sizeof(int));
+  h=hashBytes(h,AA,sizeof(AA));
+  h=hashBytes(h,AAn15,sizeof(AAn15));
+  h=hashBytes(h,&fixMassPepC,sizeof(double));
+  h=hashBytes(h,&fixMassPepN,sizeof(double));
+  h=hashBytes(h,&fixMassProtC,sizeof(double));
+  h=hashBytes(h,&fixMassProtN,sizeof(double));
+  h=hashBytes(h,xlTable,sizeof(xlTable));
+  h=hashBytes(h,&enzyme,sizeof(kEnzymeRules));
+  h=hashBytes(h,n15Label.c_str(),n15Label.size()+1);
+  if(h==0) h=1;
+  return h;
+}
+
+//Replaces buildDB, buildDecoy, and buildPeptides with the contents of a cache file. Returns false,
+//leaving the database empty, if the file is missing, incomplete, or was made with a different key.
+bool KDatabase::loadCache(string fName, uint64_t key){
+  FILE*           f;
+  kDBCacheHeader  h;
+  uint64_t        end=0;
+  size_t          i;
+  bool            bOK=true;
+  kDB             d;
+
+  vector<kDBCacheProtein> vP;
+  vector<kDBCachePeptide> vC;
+  vector<kPepMap>         vM;
+  vector<char>            text;
+
+  f=fopen(fName.c_str(),"rb");
+  if(f==NULL) return false;
+  if(fread(&h,sizeof(kDBCacheHeader),1,f)!=1 || strncmp(h.magic,"KOJAKDB",8)!=0 || h.version!=KDBCACHEVERSION || h.key!=key){
+    fclose(f);
+    return false;
+  }
+
+  vP.resize((size_t)h.proteinCount);
+  vC.resize((size_t)h.peptideCount);
+  vM.resize((size_t)h.mapCount);
+  text.resize((size_t)h.textSize);
+  if(vP.size()>0 && fread(&vP[0],sizeof(kDBCacheProtein),vP.size(),f)!=vP.size()) bOK=false;
+  if(bOK && vC.size()>0 && fread(&vC[0],sizeof(kDBCachePeptide),vC.size(),f)!=vC.size()) bOK=false;
+  if(bOK && vM.size()>0 && fread(&vM[0],sizeof(kPepMap),vM.size(),f)!=vM.size()) bOK=false;
+  if(bOK && text.size()>0 && fread(&text[0],1,text.size(),f)!=text.size()) bOK=false;
+  if(bOK && (fread(&end,sizeof(uint64_t),1,f)!=1 || end!=key)) bOK=false;
+  fclose(f);
+  if(!bOK) return false;
+
+  for(i=0;i<vP.size();i++){
+    if(vP[i].name+vP[i].nameLen>h.textSize || vP[i].sequence+vP[i].sequenceLen>h.textSize) return false;
+  }
+  for(i=0;i<vC.size();i++){
+    if(vC[i].mapCount==0 || vC[i].map+vC[i].mapCount>h.mapCount) return false;
+  }
+
+  vDB.clear();
+  vDB.reserve(vP.size());
+  for(i=0;i<vP.size();i++){
+    d.name.assign(&text[0]+vP[i].name,vP[i].nameLen);
+    d.sequence.assign(&text[0]+vP[i].sequence,vP[i].sequenceLen);
+    d.decoy=(vP[i].decoy!=0);
+    vDB.push_back(d);
+  }
+
+  clearPeptides();
+  pepMass.resize(vC.size());
+  pepFlags.resize(vC.size());
+  pepXLSites.resize(vC.size());
+  pepMapStart.resize(vC.size()+1);
+  pepMap.reserve(vM.size());
+  for(i=0;i<vC.size();i++){
+    pepMass[i]=vC[i].mass;
+    pepFlags[i]=0;
+    if(vC[i].cTerm) pepFlags[i]|=KDBCTERM;
+    if(vC[i].nTerm) pepFlags[i]|=KDBNTERM;
+    if(vC[i].n15) pepFlags[i]|=KDBN15;
+    pepXLSites[i]=vC[i].xlSites;
+    pepMapStart[i]=pepMap.size();
+    pepMap.insert(pepMap.end(),vM.begin()+(size_t)vC[i].map,vM.begin()+(size_t)(vC[i].map+vC[i].mapCount));
+  }
+  pepMapStart[vC.size()]=pepMap.size();
+  linkablePepCount=(int)h.linkablePepCount;
+
+  cout << "  Total Proteins: " << vDB.size() << endl;
+  cout << "  " << pepMass.size() << " peptides to search (" << linkablePepCount << " linkable)." << endl;
+  return true;
+}
+
+//Writes the proteins and digested peptides for reuse by loadCache. The file is written under a
+//temporary name and then renamed, so concurrent searches never read a partial cache.
+bool KDatabase::saveCache(string fName, uint64_t key){
+  FILE*           f;
+  kDBCacheHeader  h;
+  kDBCacheProtein cp;
+  kDBCachePeptide pc;
+  size_t          i;
+  bool            bOK=true;
+  string          tmpName;
+  char            str[32];
+
+  vector<kDBCacheProtein> vP;
+  vector<kDBCachePeptide> vC;
+  string                  text;
+
+  cp.pad=0;
+  for(i=0;i<vDB.size();i++){
+    cp.name=text.size();
+    cp.nameLen=(uint32_t)vDB[i].name.size();
+    text+=vDB[i].name;
+    cp.sequence=text.size();
+    cp.sequenceLen=(uint32_t)vDB[i].sequence.size();
+    text+=vDB[i].sequence;
+    cp.decoy=vDB[i].decoy;
+    vP.push_back(cp);
+  }
+  for(i=0;i<pepMass.size();i++){
+    pc.mass=pepMass[i];
+    pc.map=pepMapStart[i];
+    pc.mapCount=(uint32_t)(pepMapStart[i+1]-pepMapStart[i]);
+    pc.cTerm=((pepFlags[i]&KDBCTERM)!=0);
+    pc.nTerm=((pepFlags[i]&KDBNTERM)!=0);
+    pc.n15=((pepFlags[i]&KDBN15)!=0);
+    pc.xlSites=pepXLSites[i];
+    vC.push_back(pc);
+  }
+
+  memset(&h,0,sizeof(kDBCacheHeader));
+  strcpy(h.magic,"KOJAKDB");
+  h.version=KDBCACHEVERSION;
+  h.linkablePepCount=(uint32_t)linkablePepCount;
+  h.key=key;
+  h.proteinCount=vP.size();
+  h.peptideCount=vC.size();
+  h.mapCount=pepMap.size();
+  h.textSize=text.size();
+
+  sprintf(str,".%d.tmp",(int)time(NULL));
+  tmpName=fName+str;
+  f=fopen(tmpName.c_str(),"wb");
+  if(f==NULL) return false;
+  if(fwrite(&h,sizeof(kDBCacheHeader),1,f)!=1) bOK=false;
+  if(bOK && vP.size()>0 && fwrite(&vP[0],sizeof(kDBCacheProtein),vP.size(),f)!=vP.size()) bOK=false;
+  if(bOK && vC.size()>0 && fwrite(&vC[0],sizeof(kDBCachePeptide),vC.size(),f)!=vC.size()) bOK=false;
+  if(bOK && pepMap.size()>0 && fwrite(&pepMap[0],sizeof(kPepMap),pepMap.size(),f)!=pepMap.size()) bOK=false;
+  if(bOK && text.size()>0 && fwrite(&text[0],1,text.size(),f)!=text.size()) bOK=false;
+  if(bOK && fwrite(&key,sizeof(uint64_t),1,f)!=1) bOK=false;
+  if(fclose(f)!=0) bOK=false;
+
+  if(bOK && rename(tmpName.c_str(),fName.c_str())!=0){
+    remove(fName.c_str()); //rename does not replace existing files on all platforms
+    if(rename(tmpName.c_str(),fName.c_str())!=0) bOK=false;
+  }
+  if(!bOK) remove(tmpName.c_str());
+  return bOK;
+}
+
 //==============================
 //  Accessors & Modifiers
 //==============================
@@ -562,16 +611,24 @@ kEnzymeRules& KDatabase::getEnzymeRules(){
   return enzyme;
 }
 
-kPeptide& KDatabase::getPeptide(int index){
-  return vPep[index];
+kPeptide KDatabase::getPeptide(int index){
+  kPeptide p;
+  p.cTerm=((pepFlags[index]&KDBCTERM)!=0);
+  p.nTerm=((pepFlags[index]&KDBNTERM)!=0);
+  p.n15=((pepFlags[index]&KDBN15)!=0);
+  p.xlSites=pepXLSites[index];
+  p.mass=pepMass[index];
+  p.map=&pepMap[pepMapStart[index]];
+  p.mapSize=pepMapStart[index+1]-pepMapStart[index];
+  return p;
 }
 
-vector<kPeptide>* KDatabase::getPeptideList(){
-  return &vPep;
+int KDatabase::getPeptideListSize(){
+  return (int)pepMass.size();
 }
 
-int KDatabase::getPeptideListSize(){
-  return (int)vPep.size();
+double KDatabase::getPeptideMass(int index){
+  return pepMass[index];
 }
 
 bool KDatabase::getPeptideSeq(int index, int start, int stop, char* str){
@@ -588,14 +645,14 @@ bool KDatabase::getPeptideSeq(int index, int start, int stop, string& str){
 }
 
 bool KDatabase::getPeptideSeq(kPeptide& p, string& str){
-  str=vDB[p.map->at(0).index].sequence.substr(p.map->at(0).start,p.map->at(0).stop-p.map->at(0).start+1);
+  str=vDB[p.map[0].index].sequence.substr(p.map[0].start,p.map[0].stop-p.map[0].start+1);
   return true;
 }
 
 bool KDatabase::getPeptideSeq(int pepIndex, string& str){
-  if((size_t)pepIndex>vPep.size()) return false;
-  kPeptide p = vPep[(size_t)pepIndex];
-  str = vDB[p.map->at(0).index].sequence.substr(p.map->at(0).start, p.map->at(0).stop - p.map->at(0).start + 1);
+  if((size_t)pepIndex>pepMass.size()) return false;
+  kPepMap& m = pepMap[pepMapStart[(size_t)pepIndex]];
+  str = vDB[m.index].sequence.substr(m.start, m.stop - m.start + 1);
   return true;
 }
 
@@ -686,6 +743,11 @@ void KDatabase::setN15Label(char* str){
   n15Label=str;
 }
 
+void KDatabase::setThreads(int i){
+  if(i<1) i=1;
+  threads=i;
+}
+
 void KDatabase::setXLTable(char** arr, int szA, int szB){
   for (int i = 0; i < szA; i++){
     for (int j = 0; j < szB; j++){
@@ -697,29 +759,272 @@ void KDatabase::setXLTable(char** arr, int szA, int szB){
 //==============================
 //  Private Functions
 //==============================
-void KDatabase::addPeptide(int index, int start, int len, double mass, kPeptide& p, vector<kPeptide>& vP, bool bN, bool bC, bool bN15, char xlSites){
-  kPepMap  pm;
-                           
-  pm.index=index;
-  pm.start=start;
-  pm.stop=start+len;
-  
-  p.nTerm=bN;
-  p.cTerm=bC;
+//Reverses the sequence between enzyme cut sites of a target protein
+void KDatabase::makeDecoy(kDB& target, kDB& decoy, string& decoy_label) {
+
+  typedef struct clips {
+    int start;
+    int stop;
+  } clips;
+
+  size_t j;
+  vector<clips> cut;
+  clips c;
+
+  cut.clear();
+  c.start = -1;
+  //if (target.sequence[0] == 'M')j = 1; //leave leading methionines in place
+  //else j = 0;
+  for (j = 1; j < target.sequence.size(); j++) {
+    if (enzyme.cutN[target.sequence[j]] || enzyme.cutC[target.sequence[j]]) {
+      if (c.start > -1) { //mark the space in between
+        c.stop = (int)j - 1;
+        cut.push_back(c);
+        c.start = -1; //reset
+      }
+    } else {
+      if (c.start < 0) c.start = (int)j;
+    }
+  }
+  if (!enzyme.cutN[target.sequence[j - 1]] && !enzyme.cutC[target.sequence[j - 1]]) { //check last amino acid
+    c.stop = (int)j - 1;
+    cut.push_back(c);
+  }
+
+  //reverse the sequences
+  string rev;
+  decoy = target;
+  decoy.name = decoy_label + "_" + decoy.name;
+  for (j = 0; j < cut.size(); j++) {
+    rev.clear();
+
+    //adjust ends for restrictive sites
+    while (enzyme.exceptN[decoy.sequence[cut[j].start]] || enzyme.exceptC[decoy.sequence[cut[j].start]]) {
+      cut[j].start++;
+      if (cut[j].start == decoy.sequence.size()) break;
+    }
+    while (enzyme.exceptN[decoy.sequence[cut[j].stop]] || enzyme.exceptC[decoy.sequence[cut[j].stop]]) {
+      cut[j].stop--;
+      if (cut[j].stop == -1) break;
+    }
+    if (cut[j].start == decoy.sequence.size()) continue; //skip when out of bounds
+    if (cut[j].stop == -1) continue; //skip when out of bounds
+    if (cut[j].stop <= cut[j].start) continue; //skip if nothing will happen
+
+
+    for (size_t k = cut[j].stop; k >= cut[j].start; k--) {
+      rev += decoy.sequence[k];
+      if (k == 0) break;
+    }
+    decoy.sequence.replace(cut[j].start, (size_t)cut[j].stop - (size_t)cut[j].start + 1, rev);
+  }
+
+}
+
+void KDatabase::addPeptide(int index, int start, int len, double mass, vector<kDigestPeptide>& vP, bool bN, bool bC, bool bN15, char xlSites){
+  kDigestPeptide p;
+
+  p.map.index=index;
+  p.map.start=start;
+  p.map.stop=start+len;
+  p.flags=0;
+  if(bC) p.flags|=KDBCTERM;
+  if(bN) p.flags|=KDBNTERM;
+  if(bN15) p.flags|=KDBN15;
   p.xlSites=xlSites;
   p.mass=mass;
-  p.n15=bN15;
-  p.map->clear();
-  p.map->push_back(pm);
   vP.push_back(p);
 
   //char str[256];
-  //getPeptideSeq(p.map->at(0).index,p.map->at(0).start,p.map->at(0).stop,str);
-  //cout << "Adding: " << str << "\t" << p.vA->size()+p.vB->size() << endl;
+  //getPeptideSeq(p.map.index,p.map.start,p.map.stop,str);
+  //cout << "Adding: " << str << endl;
+
+}
+
+//Digests proteins start to stop-1, adding the peptides to vP in protein order
+void KDatabase::digestProteins(size_t start, size_t stop, double min, double max, int mis, vector<kDigestPeptide>& vP){
+
+  double mass;
+  bool bCutMarked;
+  bool bNTerm;
+  bool bCTerm;
+  bool bN15;
+
+  int mc;
+  int next;
+
+  char xlSites;
+
+  size_t i;
+  size_t n;
+  size_t seqSize;
+  size_t startAA;
+
+  for(i=start;i<stop;i++){
+    if (vDB[i].name.find(n15Label) == string::npos) bN15=false;
+    else bN15=true;
+    seqSize=vDB[i].sequence.size();
+    startAA=0;
+    n=0;
+    mc=0;
+    mass=18.0105633+fixMassPepN+fixMassProtN;
+    if(vDB[i].sequence[0]=='M') next=0; //allow for next start site to be amino acid after initial M.
+    else next = -1;
+
+    bNTerm=false;
+    bCTerm=false;
+    xlSites=0;
+
+    while(true){
+
+      bCutMarked=false;
+
+      //Check if we cut n-terminal to this AA
+      if(n>0 && enzyme.cutN[vDB[i].sequence[startAA+n]] && !enzyme.exceptC[vDB[i].sequence[startAA+n-1]]){
+        if(next==-1) next=(int)startAA+(int)n-1;
+        if(!bCutMarked) mc++;
+        bCutMarked=true;
+
+        //Add the peptide now (if enough mass)
+        if ((mass+fixMassPepC)>min) addPeptide((int)i, (int)startAA, (int)n - 1, mass+fixMassPepC, vP, bNTerm, bCTerm, bN15, xlSites);
+
+      }
+
+      //Add the peptide mass
+      if (bN15) mass += AAn15[vDB[i].sequence[startAA + n]];
+      else mass+=AA[vDB[i].sequence[startAA+n]];
+
+      //Check if we cut c-terminal to this AA
+      if((startAA+n+1)<seqSize && enzyme.cutC[vDB[i].sequence[startAA+n]] && !enzyme.exceptN[vDB[i].sequence[startAA+n+1]]){
+        if(next==-1) next=(int)(startAA+n);
+        if(!bCutMarked) mc++;
+        bCutMarked=true;
+
+        //Add the peptide now (if enough mass)
+        if((mass+fixMassPepC)>min && (mass+fixMassPepC)<max) addPeptide((int)i,(int)startAA,(int)n,mass+fixMassPepC,vP,bNTerm,bCTerm, bN15, xlSites);
+
+      }
+
+      //Mark sites of cross-linker attachment (if searching for cross-links)
+      if(checkAA(i,startAA,n,seqSize,bNTerm,bCTerm)) xlSites++;
+
+      //Check if we are at the end of the sequence
+      if((startAA+n+1)==seqSize) {
+
+        //Add the peptide now (if enough mass)
+        if ((mass+fixMassPepC+fixMassProtC)>min && (mass+fixMassPepC+fixMassProtC)<max) addPeptide((int)i, (int)startAA, (int)n, mass+fixMassPepC+fixMassProtC, vP, bNTerm, bCTerm, bN15, xlSites);
+        if(next>-1) {
+          startAA=next+1;
+          n=0;
+          mc=0;
+          mass=18.0105633+fixMassPepN;
+          bNTerm = false;
+          bCTerm = false;
+          xlSites=0;
+          next=-1;
+          continue;
+        } else {
+          break;
+        }
+
+      }
+
+      //Check if we exceeded peptide mass
+      //Check if we exceeded the number of missed cleavages
+      if((mass+fixMassPepC)>max || mc>mis ) {
+
+        //if we know next cut site
+        if(next>-1) {
+          startAA=next+1;
+          n=0;
+          mc=0;
+          mass=18.0105633+fixMassPepN;
+          bNTerm = false;
+          bCTerm = false;
+          xlSites = 0;
+          next=-1;
+
+        //Otherwise, continue scanning until it is found
+        } else {
+          while((startAA+n)<seqSize-1){
+            n++;
+            if(n>0 && enzyme.cutN[vDB[i].sequence[startAA+n]] && !enzyme.exceptC[vDB[i].sequence[startAA+n-1]]){
+              next=(int)(startAA+n);
+              break;
+            } else if((startAA+n+1)<seqSize && enzyme.cutC[vDB[i].sequence[startAA+n]] && !enzyme.exceptN[vDB[i].sequence[startAA+n+1]]){
+              next=(int)(startAA+n);
+              break;
+            } 
+          }
+          if(next<0) break;
 
+          startAA=next+1;
+          n=0;
+          mc=0;
+          mass=18.0105633+fixMassPepN;
+          bNTerm = false;
+          bCTerm = false;
+          xlSites = 0;
+          next=-1;
+        }  
+      } else {
+        n++;
+        continue;
+      }
+
+    }
+
+  }
+}
+
+void KDatabase::hashPeptides(size_t start, size_t stop, vector<kDigestPeptide>& vP, uint64_t* hash){
+  size_t i;
+  uint64_t h;
+  bool bN15;
+  for(i=start;i<stop;i++){
+    kPepMap& m=vP[i].map;
+    bN15=((vP[i].flags&KDBN15)!=0);
+    h=hashBytes(14695981039346656037ULL,&vDB[m.index].sequence[m.start],(size_t)(m.stop-m.start+1));
+    hash[i]=hashBytes(h,&bN15,sizeof(bool));
+  }
 }
 
-bool KDatabase::checkAA(kPeptide& p, size_t i, size_t start, size_t n, size_t seqSize, bool& bN, bool& bC){
+//Keeps a protein read by buildDB, unless its sequence is too long. Only the copy in vDB is sized
+//to fit; d is reused for the next protein.
+void KDatabase::addProtein(kDB& d, string& decoyStr){
+  if(d.sequence.size()>65000){
+    if (klog != NULL) klog->addDBWarning(d.name + " has a sequence that is too long. It will be skipped.");
+    else cout << "  WARNING: " << d.name << " has a sequence that is too long. It will be skipped." << endl;
+    return;
+  }
+  if(d.name.find(decoyStr)!=string::npos) d.decoy=true;
+  else d.decoy=false;
+  vDB.push_back(d);
+}
+
+//Reports a character without an amino acid mass. Returns false if the character is white space
+//and should be left out of the sequence.
+bool KDatabase::addResidueWarning(string name, char c){
+  if (klog != NULL) klog->addDBWarning(name+" has an unexpected amino acid character or errant white space: '" + c + "'");
+  else cout << "  WARNING: " << name << " has an unexpected amino acid character or errant white space: '" << c << "'" << endl;
+  if(c==' ' || c=='\t') return false;
+  if (klog != NULL) {
+    string tmpStr="Mass of '";
+    klog->addDBWarning(tmpStr + c + "' is currently set to 0. Consider revising with the aa_mass parameter.");
+  } else cout << "  WARNING: Mass of '" << c << "' is currently set to 0. Consider revising with the aa_mass parameter." << endl;
+  return true;
+}
+
+void KDatabase::clearPeptides(){
+  vector<double>().swap(pepMass);
+  vector<char>().swap(pepFlags);
+  vector<char>().swap(pepXLSites);
+  vector<size_t>().swap(pepMapStart);
+  vector<kPepMap>().swap(pepMap);
+  pepMapStart.push_back(0);
+}
+
+bool KDatabase::checkAA(size_t i, size_t start, size_t n, size_t seqSize, bool& bN, bool& bC){
   if (start + n == 0){
     bN=true;
     if (xlTable['n'][0]>-1) return true;
@@ -736,31 +1041,160 @@ bool KDatabase::checkAA(kPeptide& p, size_t i, size_t start, size_t n, size_t se
   return false;
 }
 
+//Merges duplicate peptides whose hash falls in this partition. Peptides are visited in list order,
+//so results do not depend on the number of threads.
+void KDatabase::mergeDuplicates(int part, int parts, vector<kDigestPeptide>& vP, uint64_t* hash, int* owner){
+  size_t i;
+  bool bMatch;
+  unordered_multimap<uint64_t,int> first;
+  pair<unordered_multimap<uint64_t,int>::iterator,unordered_multimap<uint64_t,int>::iterator> r;
+  unordered_multimap<uint64_t,int>::iterator it;
+
+  for(i=0;i<vP.size();i++){
+    if(hash[i]%parts!=(uint64_t)part) continue;
+    owner[i]=(int)i;
+    bMatch=false;
+    r=first.equal_range(hash[i]);
+    for(it=r.first;it!=r.second;it++){
+      kDigestPeptide& p=vP[it->second];
+      kDigestPeptide& d=vP[i];
+      if(!samePeptide(p,d)) continue;
+      p.flags|=d.flags;
+      if(d.xlSites>p.xlSites) p.xlSites=d.xlSites;
+      owner[i]=it->second;
+      bMatch=true;
+      break;
+    }
+    if(!bMatch) first.insert(pair<uint64_t,int>(hash[i],(int)i));
+  }
+}
+
+bool KDatabase::samePeptide(kDigestPeptide& a, kDigestPeptide& b){
+  size_t len=(size_t)(a.map.stop-a.map.start+1);
+  if((a.flags&KDBN15)!=(b.flags&KDBN15)) return false;
+  if(len!=(size_t)(b.map.stop-b.map.start+1)) return false;
+  return vDB[a.map.index].sequence.compare(a.map.start,len,vDB[b.map.index].sequence,b.map.start,len)==0;
+}
+
+//Splits count items into ranges for the given number of jobs and waits for them to finish
+void KDatabase::runJobs(kDBThreadStruct& job, void (*proc)(kDBThreadStruct*), size_t count, int jobs){
+  size_t i;
+  size_t sz;
+  if(jobs<1) jobs=1;
+  if((size_t)jobs>count) jobs=(int)count;
+  if(jobs<1) return;
+  sz=(count+jobs-1)/jobs;
+  ThreadPool<kDBThreadStruct*>* threadPool = new ThreadPool<kDBThreadStruct*>(proc,threads,threads,1);
+  for(i=0;i<(size_t)jobs;i++){
+    threadPool->WaitForQueuedParams();
+    kDBThreadStruct* a = new kDBThreadStruct(job);
+    a->part=(int)i;
+    a->parts=jobs;
+    a->start=i*sz;
+    a->stop=a->start+sz;
+    if(a->stop>count) a->stop=count;
+    if(a->start>a->stop) a->start=a->stop;
+    threadPool->Launch(a);
+  }
+  threadPool->WaitForQueuedParams();
+  threadPool->WaitForThreads();
+  delete threadPool;
+}
+
+//==============================
+//  Thread-start functions
+//==============================
+void KDatabase::decoyProc(kDBThreadStruct* s){
+  size_t sz=s->db->vDB.size()/2;
+  for(size_t i=s->start;i<s->stop;i++) s->db->makeDecoy(s->db->vDB[i],s->db->vDB[sz+i],s->str);
+  delete s;
+}
+
+void KDatabase::digestProc(kDBThreadStruct* s){
+  s->db->digestProteins(s->start,s->stop,s->min,s->max,s->mis,*s->vP);
+  delete s;
+}
+
+void KDatabase::hashProc(kDBThreadStruct* s){
+  s->db->hashPeptides(s->start,s->stop,*s->vP,s->hash);
+  delete s;
+}
+
+void KDatabase::mergeProc(kDBThreadStruct* s){
+  s->db->mergeDuplicates(s->part,s->parts,*s->vP,s->hash,s->owner);
+  delete s;
+}
+
 //==============================
 //  Utility Functions
 //==============================
-int KDatabase::compareMass(const void *p1, const void *p2){ //sort high to low
-  const kPeptide d1 = *(kPeptide *)p1;
-  const kPeptide d2 = *(kPeptide *)p2;
-  if(d1.mass<d2.mass) {
-		return 1;
-	} else if(d1.mass>d2.mass) {
-  	return -1;
-  } else {
-	  return 0;
+//Returns the contents of a file, or NULL if it cannot be read. Release with unmapFile().
+const char* KDatabase::mapFile(const char* fname, size_t& sz){
+#ifdef _MSC_VER
+  FILE* f;
+  char* buf;
+  f=fopen(fname,"rb");
+  if(f==NULL) return NULL;
+  _fseeki64(f,0,SEEK_END);
+  sz=(size_t)_ftelli64(f);
+  _fseeki64(f,0,SEEK_SET);
+  buf=new char[sz+1];
+  if(fread(buf,1,sz,f)!=sz){
+    delete [] buf;
+    fclose(f);
+    return NULL;
   }
+  fclose(f);
+  return buf;
+#else
+  int fd;
+  struct stat st;
+  void* buf;
+  fd=open(fname,O_RDONLY);
+  if(fd<0) return NULL;
+  if(fstat(fd,&st)!=0){
+    close(fd);
+    return NULL;
+  }
+  sz=(size_t)st.st_size;
+  if(sz==0){
+    close(fd);
+    return "";
+  }
+  buf=mmap(NULL,sz,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if(buf==MAP_FAILED) return NULL;
+  madvise(buf,sz,MADV_SEQUENTIAL);
+  return (const char*)buf;
+#endif
 }
 
-int KDatabase::compareSequence(const void *p1, const void *p2){
-  const kPepSort d1 = *(kPepSort *)p1;
-  const kPepSort d2 = *(kPepSort *)p2;
-  return d1.sequence.compare(d2.sequence);
+void KDatabase::unmapFile(const char* buf, size_t sz){
+#ifdef _MSC_VER
+  delete [] buf;
+#else
+  if(sz>0) munmap((void*)buf,sz);
+#endif
+}
+
+//64-bit FNV-1a
+uint64_t KDatabase::hashBytes(uint64_t h, const void* p, size_t sz){
+  const unsigned char* c=(const unsigned char*)p;
+  for(size_t i=0;i<sz;i++){
+    h^=c[i];
+    h*=1099511628211ULL;
+  }
+  return h;
 }
 
-bool KDatabase::compareSequenceB(const kPepSort& p1, const kPepSort& p2){
-  int i=p1.sequence.compare(p2.sequence);
-  if(i==0) return p1.n15<p2.n15;
-  else return i<0;
+int KDatabase::compareMassIndex(const void *p1, const void *p2){ //sort high to low, then by index
+  const kPeptideB* d1 = (kPeptideB *)p1;
+  const kPeptideB* d2 = (kPeptideB *)p2;
+  if(d1->mass<d2->mass) return 1;
+  else if(d1->mass>d2->mass) return -1;
+  else if(d1->index<d2->index) return -1;
+  else if(d1->index>d2->index) return 1;
+  return 0;
 }
 
 
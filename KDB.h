@@ -18,12 +18,83 @@ limitations under the License.
 #define _KDB_H
 
 #include <algorithm>
+#include <ctime>
 #include <iostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "KLog.h"
+#include "ThreadPool.h"
 #include "KStructs.h"
+#include <stdint.h>
+
+#define KDBCACHEVERSION 1
+
+//Bits of the peptide table flags
+#define KDBCTERM  0x01
+#define KDBNTERM  0x02
+#define KDBN15    0x04
+
+//A peptide as it is cut from a protein, before duplicate sequences are merged
+typedef struct kDigestPeptide{
+  double  mass;
+  kPepMap map;
+  char    flags;
+  char    xlSites;
+} kDigestPeptide;
+
+//Records of the binary peptide database cache. The file is laid out as the header, then the
+//protein, peptide, and map records, then all protein names and sequences as one block of text,
+//and finally the key again to mark a complete file. Offsets count records (or bytes of text)
+//from the start of their section, so the file can also be memory-mapped as is.
+typedef struct kDBCacheHeader{
+  char      magic[8];   //"KOJAKDB"
+  uint32_t  version;
+  uint32_t  linkablePepCount;
+  uint64_t  key;        //hash of the FASTA file and the settings used to digest it
+  uint64_t  proteinCount;
+  uint64_t  peptideCount;
+  uint64_t  mapCount;
+  uint64_t  textSize;
+} kDBCacheHeader;
+
+typedef struct kDBCacheProtein{
+  uint64_t  name;
+  uint64_t  sequence;
+  uint32_t  nameLen;
+  uint32_t  sequenceLen;
+  uint32_t  decoy;
+  uint32_t  pad;
+} kDBCacheProtein;
+
+typedef struct kDBCachePeptide{
+  double    mass;
+  uint64_t  map;        //first kPepMap record of this peptide
+  uint32_t  mapCount;
+  char      cTerm;
+  char      nTerm;
+  char      n15;
+  char      xlSites;
+} kDBCachePeptide;
+
+class KDatabase;
+
+//A range of proteins or peptides handed to a worker thread while building the database
+typedef struct kDBThreadStruct{
+  KDatabase* db;
+  size_t start;
+  size_t stop;
+  int part;     //partition (and count) for merging duplicate peptides
+  int parts;
+  int mis;
+  double min;
+  double max;
+  std::string str;
+  std::vector<kDigestPeptide>* vP;
+  uint64_t* hash;
+  int* owner;   //index of the first peptide with the same sequence
+} kDBThreadStruct;
 
 class KDatabase{
 public:
@@ -41,14 +112,19 @@ public:
   bool  buildPeptides (double min, double max, int mis); //Make peptide list within mass boundaries and miscleavages.
   void  exportDB      (std::string fName);
 
+  //Peptide database cache
+  uint64_t  getCacheKey (const char* fname, std::string decoyStr, bool decoy, double min, double max, int mis);
+  bool      loadCache   (std::string fName, uint64_t key);
+  bool      saveCache   (std::string fName, uint64_t key);
+
   //Accessors & Modifiers
   void                addFixedMod         (char mod, double mass);
   kDB&                at                  (const int& i);
   double              getAAMass           (char aa, bool n15=false);
   kEnzymeRules&       getEnzymeRules      ();
-  kPeptide&           getPeptide          (int index);
-  std::vector<kPeptide>*   getPeptideList();
+  kPeptide            getPeptide          (int index);
   int                 getPeptideListSize  ();
+  double              getPeptideMass      (int index);
   bool                getPeptideSeq       (int index, int start, int stop, char* str);
   bool                getPeptideSeq       (int index, int start, int stop, std::string& str);
   bool                getPeptideSeq       (kPeptide& p, std::string& str);
@@ -59,6 +135,7 @@ public:
   bool                setEnzyme           (char* str);
   void                setLog              (KLog* c);
   void                setN15Label         (char* str);
+  void                setThreads          (int i);
   void                setXLTable          (char** arr, int szA, int szB);
 
   int linkablePepCount;
@@ -77,17 +154,43 @@ private:
   std::string   n15Label;
 
   std::vector<kDB>      vDB;    //Entire FASTA database stored in memory
-  std::vector<kPeptide> vPep;   //List of all peptides
+
+  //List of all peptides, sorted by mass from high to low, as one array per field. The mappings
+  //of peptide i are pepMap[pepMapStart[i]] up to pepMap[pepMapStart[i+1]].
+  std::vector<double>   pepMass;
+  std::vector<char>     pepFlags;
+  std::vector<char>     pepXLSites;
+  std::vector<size_t>   pepMapStart;
+  std::vector<kPepMap>  pepMap;
+
+  int           threads;
 
   KLog* klog;
 
-  void addPeptide(int index, int start, int len, double mass, kPeptide& p, std::vector<kPeptide>& vP, bool bN, bool bC, bool bN15, char xlSites);
-  bool checkAA(kPeptide& p, size_t i, size_t start, size_t n, size_t seqSize, bool& bN, bool& bC);
+  void addProtein(kDB& d, std::string& decoyStr);
+  bool addResidueWarning(std::string name, char c);
+  void addPeptide(int index, int start, int len, double mass, std::vector<kDigestPeptide>& vP, bool bN, bool bC, bool bN15, char xlSites);
+  bool checkAA(size_t i, size_t start, size_t n, size_t seqSize, bool& bN, bool& bC);
+  void clearPeptides();
+  void digestProteins(size_t start, size_t stop, double min, double max, int mis, std::vector<kDigestPeptide>& vP);
+  void hashPeptides(size_t start, size_t stop, std::vector<kDigestPeptide>& vP, uint64_t* hash);
+  void makeDecoy(kDB& target, kDB& decoy, std::string& decoy_label);
+  void mergeDuplicates(int part, int parts, std::vector<kDigestPeptide>& vP, uint64_t* hash, int* owner);
+  void runJobs(kDBThreadStruct& job, void (*proc)(kDBThreadStruct*), size_t count, int jobs);
+  bool samePeptide(kDigestPeptide& a, kDigestPeptide& b);
+
+  //Thread-start functions
+  static void decoyProc (kDBThreadStruct* s);
+  static void digestProc(kDBThreadStruct* s);
+  static void hashProc  (kDBThreadStruct* s);
+  static void mergeProc (kDBThreadStruct* s);
+
+  static uint64_t     hashBytes (uint64_t h, const void* p, size_t sz);
+  static const char*  mapFile   (const char* fname, size_t& sz);
+  static void         unmapFile (const char* buf, size_t sz);
 
   //Utility functions (for sorting)
-  static int compareMass      (const void *p1, const void *p2);
-  static int compareSequence  (const void *p1, const void *p2);
-  static bool compareSequenceB(const kPepSort& p1, const kPepSort& p2);
+  static int compareMassIndex (const void *p1, const void *p2);
 
 };
 
@@ -15,6 +15,7 @@ limitations under the License.
 */
 
 #include "KData.h"
+#include <cstdarg>
 
 using namespace std;
 using namespace MSToolkit;
@@ -25,8 +26,14 @@ using namespace MSToolkit;
 KData::KData(){
   int i,j,k;
   bScans=NULL;
+  bPrecursorMem=NULL;
+  precursors=NULL;
+  bShardPeaks=false;
+  activeShard=-1;
+  shardCount=1;
   params=NULL;
   klog=NULL;
+  cancel=NULL;
   xlTable = new char*[128];
   for (i = 0; i<128; i++) xlTable[i] = new char[20];
   for(i=0;i<128;i++){
@@ -40,7 +47,13 @@ KData::KData(){
 
 KData::KData(kParams* p){
   bScans=NULL;
+  bPrecursorMem=NULL;
+  precursors=NULL;
+  bShardPeaks=false;
+  activeShard=-1;
+  shardCount=1;
   klog=NULL;
+  cancel=NULL;
   params=p;
   size_t i;
   int j,k;
@@ -193,6 +206,40 @@ void KData::buildXLTable(){
   
 }
 
+//Splits the spectra into n shards of similar size by their lightest precursor mass, so that each
+//shard needs only a narrow band of the peptide list. Spectra without precursors go in the first
+//shard. Returns the number of shards actually made.
+int KData::buildShards(int n){
+  size_t i;
+  int j;
+  int sz;
+  kMass m;
+  vector<kMass> v;
+
+  activeShard=-1;
+  shardCount=1;
+  specShard.assign(spec.size(),0);
+
+  m.xl=false;
+  for(i=0;i<spec.size();i++){
+    if(spec[i].sizePrecursor()==0) continue;
+    m.index=(int)i;
+    m.mass=spec[i].getPrecursor(0).monoMass;
+    for(j=1;j<spec[i].sizePrecursor();j++){
+      if(spec[i].getPrecursor(j).monoMass<m.mass) m.mass=spec[i].getPrecursor(j).monoMass;
+    }
+    v.push_back(m);
+  }
+  if(n>(int)v.size()) n=(int)v.size();
+  if(n<2) return shardCount;
+
+  qsort(&v[0],v.size(),sizeof(kMass),compareMassList);
+  sz=((int)v.size()+n-1)/n;
+  for(i=0;i<v.size();i++) specShard[v[i].index]=(int)i/sz;
+  shardCount=((int)v.size()+sz-1)/sz;
+  return shardCount;
+}
+
 bool KData::checkLink(char p1Site, char p2Site, int linkIndex){
   return xlTargets[p1Site][linkIndex].target[p2Site];
 }
@@ -223,10 +270,11 @@ void KData::diagSinglet(){
     unknownMass = 0;
     for (int q = 0; q<spec[b].sizePrecursor(); q++){
       if (spec[b].getTopPeps(q)->singletCount == 0) continue;
-      if (spec[b].getTopPeps(q)->singletFirst->simpleScore>spec[b].getScoreCard(0).simpleScore){
-        if (spec[b].getTopPeps(q)->singletFirst->simpleScore>maxScore) {
-          maxScore = spec[b].getTopPeps(q)->singletFirst->simpleScore;
-          unknownMass = spec[b].getPrecursor(q).monoMass - spec[b].getTopPeps(q)->singletFirst->mass;
+      kSingletScoreCard& sc = spec[b].getTopPeps(q)->getSingletScoreCard(0);
+      if (sc.simpleScore>spec[b].getScoreCard(0).simpleScore){
+        if (sc.simpleScore>maxScore) {
+          maxScore = sc.simpleScore;
+          unknownMass = spec[b].getPrecursor(q).monoMass - sc.mass;
         }
       }
     }
@@ -246,7 +294,17 @@ void KData::diagSinglet(){
   cout << endl;
 }
 
-bool KData::getBoundaries(double mass1, double mass2, vector<int>& index, bool* buffer){
+//Releases the search data of every spectrum in the active shard. Their results remain for export.
+void KData::freeShard(){
+  for(size_t i=0;i<spec.size();i++){
+    if(inShard((int)i)) spec[i].freeSearchData();
+  }
+}
+
+//Precursor lookups search the full massList unless ml points to a subset of it (such as the
+//precursors belonging to a block of spectra in a spectrum-centric search).
+bool KData::getBoundaries(double mass1, double mass2, vector<int>& index, bool* buffer, vector<kMass>* ml){
+  vector<kMass>& massList = (ml==NULL) ? this->massList : *ml;
   int sz=(int)massList.size();
 
   if(mass1>massList[sz-1].mass) return false;
@@ -258,8 +316,6 @@ bool KData::getBoundaries(double mass1, double mass2, vector<int>& index, bool*
   int low;
   int high;
 
-  vector<int> v;
-
   //binary search to closest mass
   while(massList[mid].mass!=mass1){
 		if(lower>=upper) break;
@@ -308,42 +364,53 @@ bool KData::getBoundaries(double mass1, double mass2, vector<int>& index, bool*
   if(mid<0) return false;
   high=mid;
 
-  sz=(int)spec.size();
-  memset(buffer,false,sz);
-  for (i = low; i <= high; i++) buffer[massList[i].index]=true;
   index.clear();
-  for (i = 0; i < sz; i++) {
-    if(buffer[i]) index.push_back(i);
+  for (i = low; i <= high; i++) {
+    if(buffer[massList[i].index]) continue;
+    buffer[massList[i].index]=true;
+    index.push_back(massList[i].index);
   }
+  finalizeBoundaries(index,buffer);
   return true;
 
-  /* old method
-  for(i=low;i<=high;i++) v.push_back(massList[i].index);
+}
 
-  //Sort indexes and copy to final array, removing duplicates.
-  //This may be a potentially slow step and should be profiled
-  qsort(&v[0],v.size(),sizeof(int),compareInt);
-  index.clear();
-  index.push_back(v[0]);
-  mid=(int)v.size();
-  for(i=1;i<mid;i++){
-    if(v[i]!=v[i-1]) index.push_back(v[i]);
+//Counts the precursors from mass1 to mass2 without visiting them; used to estimate search cost.
+size_t KData::countPrecursors(double mass1, double mass2){
+  size_t lower=0;
+  size_t upper=massList.size();
+  size_t mid;
+  size_t first;
+
+  if(mass2<mass1) return 0;
+
+  //first precursor at or above mass1
+  while(lower<upper){
+    mid=(lower+upper)/2;
+    if(massList[mid].mass<mass1) lower=mid+1;
+    else upper=mid;
   }
-	return true;
-  */
+  first=lower;
 
+  //first precursor above mass2
+  upper=massList.size();
+  while(lower<upper){
+    mid=(lower+upper)/2;
+    if(massList[mid].mass<=mass2) lower=mid+1;
+    else upper=mid;
+  }
+  return lower-first;
 }
 
 //Get the list of spectrum array indexes to search based on desired mass
-bool KData::getBoundaries2(double mass, double prec, vector<int>& index, bool* buffer){
+bool KData::getBoundaries2(double mass, double prec, vector<int>& index, bool* buffer, vector<kMass>* ml){
+  vector<kMass>& massList = (ml==NULL) ? this->massList : *ml;
   int sz=(int)massList.size();
   int lower=0;
   int mid=sz/2;
   int upper=sz;
 	int i;
 
-  vector<int> v;
-
   double minMass = mass - (mass/1000000*prec);
   double maxMass = mass + (mass/1000000*prec);
 
@@ -366,14 +433,18 @@ bool KData::getBoundaries2(double mass, double prec, vector<int>& index, bool* b
 	//Check that mass is correct
 	if(massList[mid].mass<minMass || massList[mid].mass>maxMass) return false;
 
-  v.push_back(massList[mid].index);
+  index.clear();
+  index.push_back(massList[mid].index);
+  buffer[massList[mid].index]=true;
 
 	//check left 
   i=mid;
 	while(i>0){
 		i--;
     if(massList[i].mass<minMass) break;
-    v.push_back(massList[i].index);
+    if(buffer[massList[i].index]) continue;
+    buffer[massList[i].index]=true;
+    index.push_back(massList[i].index);
 	}
 
 	//check right
@@ -381,28 +452,12 @@ bool KData::getBoundaries2(double mass, double prec, vector<int>& index, bool* b
 	while(i<(sz-1)){
 		i++;
     if(massList[i].mass>maxMass) break;
-    v.push_back(massList[i].index);
+    if(buffer[massList[i].index]) continue;
+    buffer[massList[i].index]=true;
+    index.push_back(massList[i].index);
 	}
 
-  sz = (int)spec.size();
-  memset(buffer, false, sz);
-  for (i = 0; i < (int)v.size(); i++) buffer[v[i]] = true;
-  index.clear();
-  for (i = 0; i < sz; i++) {
-    if (buffer[i]) index.push_back(i);
-  }
-  return true;
-
-  //Sort indexes and copy to final array, removing duplicates.
-  //This may be a potentially slow step and should be profiled
-  qsort(&v[0],v.size(),sizeof(int),compareInt);
-  index.clear();
-  index.push_back(v[0]);
-  mid=(int)v.size();
-  for(i=1;i<mid;i++){
-    if(v[i]!=v[i-1]) index.push_back(v[i]);
-  }
-
+  finalizeBoundaries(index,buffer);
 	return true;
 
 }
@@ -435,37 +490,63 @@ int KData::getXLIndex(int motifIndex, int xlIndex){
   return motifs[motifIndex].xlIndex[xlIndex];
 }
 
+bool KData::inShard(int i){
+  if(activeShard<0) return true;
+  return specShard[i]==activeShard;
+}
+
 //This function tries to assign best possible 18O2 and 18O4 precursor ion mass values
-//for all MS2 spectra
+//for all MS2 spectra. Spectra are split into windows of consecutive scans (i.e. retention time
+//windows) that are mapped on separate threads. Each thread has its own KPrecursor, so every
+//window fills its own buffer of MS1 scans, overlapping those of its neighbors.
 bool KData::mapPrecursors(){
   
   int iPercent=0;
   int iTmp;
   
   size_t i;
-  int j,k,n;
-
-  KPrecursor pre(params);
-  kMass      m;
+  int windowCount;
+  int windowSize;
 
   int peakCounts=0;
   int specCounts=0;
-  int ret;
 
-  int prePre=0;
   int foundPre=0;
-  int noPre=0;
-
-  //Open the data file in the precursor mapping object
-  //if(!pre.setFile(&p)) return false;
 
   //Print progress
   if(klog!=NULL) klog->addMessage("Mapping precursors to MS/MS spectra",true);
   printf("  Mapping precursors ... %2d%%",iPercent);
   fflush(stdout);
 
-  //Iterate all MS/MS spectra
-  for(i=0;i<spec.size();i++){
+  //Hardklor and its model library are only needed for precursor refinement
+  Threading::CreateMutex(&mutexPrecursor);
+  bPrecursorMem = new bool[params->threads];
+  precursors = new KPrecursor*[params->threads];
+  for(iTmp=0;iTmp<params->threads;iTmp++){
+    bPrecursorMem[iTmp]=false;
+    if(params->precursorRefinement) precursors[iTmp] = new KPrecursor(params);
+    else precursors[iTmp] = NULL;
+  }
+
+  ThreadPool<kPrecursorWindow*>* threadPool = new ThreadPool<kPrecursorWindow*>(mapPrecursorsProc,params->threads,params->threads,1);
+
+  windowCount=params->threads*4;
+  if(windowCount>(int)spec.size()) windowCount=(int)spec.size();
+  if(windowCount<1) windowCount=1;
+  windowSize=((int)spec.size()+windowCount-1)/windowCount;
+
+  //Windows are queued in retention time order, so each KPrecursor only ever moves forward in the file
+  for(i=0;i<spec.size();i+=windowSize){
+    if(isCancelled()) break;
+
+    threadPool->WaitForQueuedParams();
+
+    kPrecursorWindow* a = new kPrecursorWindow();
+    a->data=this;
+    a->start=(int)i;
+    a->stop=(int)i+windowSize;
+    if(a->stop>(int)spec.size()) a->stop=(int)spec.size();
+    threadPool->Launch(a);
 
     //Update progress
     iTmp=(int)(i*100.0/spec.size());
@@ -474,6 +555,62 @@ bool KData::mapPrecursors(){
       printf("\b\b\b%2d%%",iPercent);
       fflush(stdout);
     }
+  }
+
+  threadPool->WaitForQueuedParams();
+  threadPool->WaitForThreads();
+  delete threadPool;
+
+  for(iTmp=0;iTmp<params->threads;iTmp++){
+    if(precursors[iTmp]!=NULL) delete precursors[iTmp];
+  }
+  delete [] precursors;
+  delete [] bPrecursorMem;
+  precursors=NULL;
+  bPrecursorMem=NULL;
+  Threading::DestroyMutex(mutexPrecursor);
+
+  if(isCancelled()){
+    cout << endl;
+    return false;
+  }
+
+  for(i=0;i<spec.size();i++){
+    if(spec[i].sizePrecursor()>0){
+      foundPre++;
+      specCounts++;
+      peakCounts+=spec[i].size();
+    }
+  }
+ 
+
+  //Finalize the progress
+  printf("\b\b\b100%%");
+  cout << endl;
+
+  //peak lists are not held yet when they are read per shard, so they cannot be counted here
+  char tempStr[256];
+  if(bShardPeaks) sprintf(tempStr,"%d spectra will be analyzed.",specCounts);
+  else sprintf(tempStr,"%d spectra with %d peaks will be analyzed.",specCounts,peakCounts);
+  cout << "  " << tempStr << endl;
+  if (klog != NULL) klog->addMessage(string(tempStr),true);
+
+  activeShard=-1;
+  buildMassList();
+
+  if(bScans!=NULL) delete[] bScans;
+  bScans = new bool[spec.size()];
+
+  return true;
+}
+
+//Maps precursors for spectra start to stop-1, in order. kp is NULL without precursor refinement.
+void KData::mapPrecursorWindow(int start, int stop, KPrecursor* kp){
+  int i;
+  int k,n;
+
+  for(i=start;i<stop;i++){
+    if(isCancelled()) return;
 
     bool bAddHardklor=false;
     bool bAddEstimate=false;
@@ -494,7 +631,7 @@ bool KData::mapPrecursors(){
 
     if(bAddHardklor){
       //only do Hardklor analysis if data contain precursor scans
-      if (params->precursorRefinement) ret = pre.getSpecRange(spec[i]);
+      if (kp!=NULL) kp->getSpecRange(spec[i]);
     }
 
     if(bAddEstimate){
@@ -525,49 +662,7 @@ bool KData::mapPrecursors(){
       }
     }
 
-    if(spec[i].sizePrecursor()>0){
-      foundPre++;
-      specCounts++;
-      peakCounts+=spec[i].size();
-
-      //build singletList
-      spec[i].resetSingletList();
-
-    }
-
-  }
- 
-
-  //Finalize the progress
-  printf("\b\b\b100%%");
-  cout << endl;
-
-  cout << "  " << specCounts << " spectra with " << peakCounts << " peaks will be analyzed." << endl;
-  if (klog != NULL) {
-    char tempStr[256];
-    sprintf(tempStr,"%d spectra with %d peaks will be analyzed.",specCounts,peakCounts);
-    klog->addMessage(string(tempStr),true);
   }
-
-  //Build mass list - this orders all precursor masses, with an index pointing to the actual
-  //array position for the spectrum. This is because all spectra will have more than 1
-  //precursor mass
-  massList.clear();
-  for(i=0;i<spec.size();i++){
-    m.index=(int)i;
-    for(j=0;j<spec[i].sizePrecursor();j++){
-      m.mass=spec[i].getPrecursor(j).monoMass;
-      massList.push_back(m);
-    }
-  }
-
-  //sort mass list from low to high
-  qsort(&massList[0],massList.size(),sizeof(kMass),compareMassList);
-
-  if(bScans!=NULL) delete[] bScans;
-  bScans = new bool[spec.size()];
-
-  return true;
 }
 
 void KData::outputDiagnostics(FILE* f, KSpectrum& s, KDatabase& db){
@@ -581,6 +676,7 @@ void KData::outputDiagnostics(FILE* f, KSpectrum& s, KDatabase& db){
   kPrecursor* p;
   KTopPeps* tp;
   kSingletScoreCard* sc;
+  kPepMod* mods;
   kScoreCard psm;
   
   fprintf(f, " <scan id=\"%d\">\n", s.getScanNumber());
@@ -595,20 +691,19 @@ void KData::outputDiagnostics(FILE* f, KSpectrum& s, KDatabase& db){
     fprintf(f, "   <precursor mass=\"%.4lf\" charge=\"%d\" type=\"%d\" hk_corr=\"%.4lf\">\n", p->monoMass, p->charge, code, p->corr);
 
     tp = s.getTopPeps(j);
-    sc = tp->singletFirst;
-    k=1;
-    while (sc != NULL){
-      fprintf(f,"    <peptide rank=\"%d\" sequence=\"",k++);
-      db.getPeptideSeq(db.getPeptideList()->at(sc->pep1).map->at(0).index, db.getPeptideList()->at(sc->pep1).map->at(0).start, db.getPeptideList()->at(sc->pep1).map->at(0).stop, strs);
+    for (k = 0; k<tp->singletCount; k++){
+      sc = &tp->getSingletScoreCard(k);
+      mods = tp->getSingletMods(*sc);
+      fprintf(f,"    <peptide rank=\"%d\" sequence=\"",k+1);
+      db.getPeptideSeq(db.getPeptide(sc->pep1).map[0].index, db.getPeptide(sc->pep1).map[0].start, db.getPeptide(sc->pep1).map[0].stop, strs);
       for (i = 0; i<strlen(strs); i++){
         fprintf(f, "%c", strs[i]);
         for (x = 0; x<sc->modLen; x++){
-          if (sc->mods[x].pos == char(i)) fprintf(f, "[%.2lf]", sc->mods[x].mass);
+          if (mods[x].pos == char(i)) fprintf(f, "[%.2lf]", mods[x].mass);
         }
         if (char(i) == sc->k1) fprintf(f, "[x]");
       }
       fprintf(f, "\" link_site=\"%d\" score=\"%.4lf\" matches=\"%d\" longest_run=\"%d\" mass=\"%.4lf\"/>\n", (int)sc->k1+1, sc->simpleScore, sc->matches, sc->conFrag, sc->mass);
-      sc = sc->next;
     }
     fprintf(f,"   </precursor>\n");
   }
@@ -624,7 +719,7 @@ void KData::outputDiagnostics(FILE* f, KSpectrum& s, KDatabase& db){
     fprintf(f,"   <result rank=\"%d\" ",j+1);
     psm = s.getScoreCard(j);
     pep = db.getPeptide(psm.pep1);
-    db.getPeptideSeq(pep.map->at(0).index, pep.map->at(0).start, pep.map->at(0).stop, strs);
+    db.getPeptideSeq(pep.map[0].index, pep.map[0].start, pep.map[0].stop, strs);
     pep1.clear();
     if (pep.nTerm && aa.getFixedModMass('$') != 0) {
       sprintf(st, "[%.2lf]", aa.getFixedModMass('$'));
@@ -648,7 +743,7 @@ void KData::outputDiagnostics(FILE* f, KSpectrum& s, KDatabase& db){
     pep2.clear();
     if (psm.pep2>-1){
       pep = db.getPeptide(psm.pep2);
-      db.getPeptideSeq(pep.map->at(0).index, pep.map->at(0).start, pep.map->at(0).stop, strs);
+      db.getPeptideSeq(pep.map[0].index, pep.map[0].start, pep.map[0].stop, strs);
       if (pep.nTerm && aa.getFixedModMass('$') != 0) {
         sprintf(st, "[%.2lf]", aa.getFixedModMass('$'));
         pep2+=st;
@@ -717,6 +812,7 @@ bool KData::outputIntermediate(KDatabase& db){
 
   kPeptide pep;
   kSingletScoreCard* sc;
+  kPepMod* mods;
   char strs[256];
   char strTmp[32];
   string pepSeq;
@@ -735,16 +831,17 @@ bool KData::outputIntermediate(KDatabase& db){
       fprintf(fOut, "  <precursor mono_mass=\"%.8lf\" charge=\"%d\" corr=\"%.4lf\">\n", spec[i].getPrecursor(j).monoMass, spec[i].getPrecursor(j).charge, spec[i].getPrecursor(j).corr);
       fprintf(fOut, "   <peptideList>\n");
       tp=spec[i].getTopPeps(j);
-      sc=tp->singletFirst;
       for (z = 0; z<params->intermediate; z++){
-        if (sc==NULL) break;
-        db.getPeptideSeq(db.getPeptideList()->at(sc->pep1).map->at(0).index, db.getPeptideList()->at(sc->pep1).map->at(0).start, db.getPeptideList()->at(sc->pep1).map->at(0).stop, strs);
+        if (z>=tp->singletCount) break;
+        sc=&tp->getSingletScoreCard(z);
+        mods=tp->getSingletMods(*sc);
+        db.getPeptideSeq(db.getPeptide(sc->pep1).map[0].index, db.getPeptide(sc->pep1).map[0].start, db.getPeptide(sc->pep1).map[0].stop, strs);
         pepSeq.clear();
         for (k = 0; k<strlen(strs); k++){
           pepSeq += strs[k];
           for (x = 0; x<sc->modLen; x++){
-            if (sc->mods[x].pos == k) {
-              sprintf(strTmp, "[%.2lf]", sc->mods[x].mass);
+            if (mods[x].pos == k) {
+              sprintf(strTmp, "[%.2lf]", mods[x].mass);
               pepSeq+=strTmp;
             }
           }
@@ -753,20 +850,19 @@ bool KData::outputIntermediate(KDatabase& db){
 
         pep = db.getPeptide(sc->pep1);
         protSeq.clear();
-        for (n = 0; n<pep.map->size(); n++){
-          protSeq += db[pep.map->at(n).index].name;
-          if (n<pep.map->size()-1) protSeq+='-';
+        for (n = 0; n<pep.mapSize; n++){
+          protSeq += db[pep.map[n].index].name;
+          if (n<pep.mapSize-1) protSeq+='-';
         }
-        fprintf(fOut, "    <peptide sequence=\"%s\" mass=\"%.8lf\" protein=\"%s\" num_tot_proteins=\"%d\" link_site=\"%d\" score=\"%.4lf\" complement_mass=\"%.8lf\">\n", &pepSeq[0], sc->mass, &protSeq[0], (int)pep.map->size(), sc->k1 + 1, sc->simpleScore,spec[i].getPrecursor((int)sc->pre).monoMass-sc->mass);
+        fprintf(fOut, "    <peptide sequence=\"%s\" mass=\"%.8lf\" protein=\"%s\" num_tot_proteins=\"%d\" link_site=\"%d\" score=\"%.4lf\" complement_mass=\"%.8lf\">\n", &pepSeq[0], sc->mass, &protSeq[0], (int)pep.mapSize, sc->k1 + 1, sc->simpleScore,spec[i].getPrecursor((int)sc->pre).monoMass-sc->mass);
         if (sc->modLen>0){
           fprintf(fOut, "     <modificationList>\n");
           for (k = 0; k<sc->modLen; k++){
-            fprintf(fOut, "      <modification position=\"%d\" mass=\"%.8lf\"/>\n",sc->mods[k].pos+1,sc->mods[k].mass);
+            fprintf(fOut, "      <modification position=\"%d\" mass=\"%.8lf\"/>\n",mods[k].pos+1,mods[k].mass);
           }
           fprintf(fOut, "     </modificationList>\n");
         }
         fprintf(fOut, "    </peptide>\n");
-        sc=sc->next;
       }
       fprintf(fOut, "  </peptideList>\n");
       fprintf(fOut,"  </precursor>\n");
@@ -1108,24 +1204,24 @@ bool KData::outputMzID(CMzIdentML& m, KDatabase& db, KParams& par, kResults& r){
   ////Add all proteins mapped by this peptide
   //pepRef.clear();
   //pep = db.getPeptide(r.pep1);
-  //for (i = 0; i<pep.map->size(); i++){
-  //  if (pep.n15 && db[pep.map->at(i).index].name.find(params->n15Label) == string::npos) {
+  //for (i = 0; i<pep.mapSize; i++){
+  //  if (pep.n15 && db[pep.map[i].index].name.find(params->n15Label) == string::npos) {
   //    continue;
   //  }
-  //  if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map->at(i).index].name.find(params->n15Label) != string::npos) {
+  //  if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map[i].index].name.find(params->n15Label) != string::npos) {
   //    continue;
   //  }
-  //  protein = db[pep.map->at(i).index].name;
+  //  protein = db[pep.map[i].index].name;
   //  proteinDesc = "";
   //  dbSequence_ref = m.addDBSequence(protein, searchDatabase_ref, proteinDesc);
 
-  //  if (pep.map->at(i).start<1) pre = '-';
-  //  else pre = db[pep.map->at(i).index].sequence[pep.map->at(i).start - 1];
-  //  if ((size_t)pep.map->at(i).stop + 1 == db[pep.map->at(i).index].sequence.size()) post = '-';
-  //  else post = db[pep.map->at(i).index].sequence[(size_t)pep.map->at(i).stop + 1];
-  //  isDecoy = db[pep.map->at(i).index].decoy;
+  //  if (pep.map[i].start<1) pre = '-';
+  //  else pre = db[pep.map[i].index].sequence[pep.map[i].start - 1];
+  //  if ((size_t)pep.map[i].stop + 1 == db[pep.map[i].index].sequence.size()) post = '-';
+  //  else post = db[pep.map[i].index].sequence[(size_t)pep.map[i].stop + 1];
+  //  isDecoy = db[pep.map[i].index].decoy;
 
-  //  pepRef.push_back(m.addPeptideEvidence(dbSequence_ref, peptide_ref,(int)pep.map->at(i).start+1,(int)pep.map->at(i).stop+1,pre,post,isDecoy));
+  //  pepRef.push_back(m.addPeptideEvidence(dbSequence_ref, peptide_ref,(int)pep.map[i].start+1,(int)pep.map[i].stop+1,pre,post,isDecoy));
   //}
 
   ////Add PSM
@@ -1139,20 +1235,20 @@ bool KData::outputMzID(CMzIdentML& m, KDatabase& db, KParams& par, kResults& r){
   //  //Add all proteins mapped by this peptide
   //  pepRef.clear();
   //  pep = db.getPeptide(r.pep2);
-  //  for (i = 0; i<pep.map->size(); i++){
-  //    if (pep.n15 && db[pep.map->at(i).index].name.find(params->n15Label) == string::npos) continue;
-  //    if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map->at(i).index].name.find(params->n15Label) != string::npos) continue;
-  //    protein = db[pep.map->at(i).index].name;
+  //  for (i = 0; i<pep.mapSize; i++){
+  //    if (pep.n15 && db[pep.map[i].index].name.find(params->n15Label) == string::npos) continue;
+  //    if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map[i].index].name.find(params->n15Label) != string::npos) continue;
+  //    protein = db[pep.map[i].index].name;
   //    proteinDesc = "";
   //    dbSequence_ref = m.addDBSequence(protein, searchDatabase_ref, proteinDesc);
 
-  //    if (pep.map->at(i).start<1) pre = '-';
-  //    else pre = db[pep.map->at(i).index].sequence[pep.map->at(i).start - 1];
-  //    if ((size_t)pep.map->at(i).stop + 1 == db[pep.map->at(i).index].sequence.size()) post = '-';
-  //    else post = db[pep.map->at(i).index].sequence[(size_t)pep.map->at(i).stop + 1];
-  //    isDecoy = db[pep.map->at(i).index].decoy;
+  //    if (pep.map[i].start<1) pre = '-';
+  //    else pre = db[pep.map[i].index].sequence[pep.map[i].start - 1];
+  //    if ((size_t)pep.map[i].stop + 1 == db[pep.map[i].index].sequence.size()) post = '-';
+  //    else post = db[pep.map[i].index].sequence[(size_t)pep.map[i].stop + 1];
+  //    isDecoy = db[pep.map[i].index].decoy;
 
-  //    pepRef.push_back(m.addPeptideEvidence(dbSequence_ref, peptide_ref2, pep.map->at(i).start + 1, pep.map->at(i).stop + 1, pre, post, isDecoy));
+  //    pepRef.push_back(m.addPeptideEvidence(dbSequence_ref, peptide_ref2, pep.map[i].start + 1, pep.map[i].stop + 1, pre, post, isDecoy));
   //  }
 
   //  //Add PSM
@@ -1315,57 +1411,57 @@ bool KData::outputPepXML(PXWSpectrumQuery& sq, KDatabase& db, kResults& r){
 
   //Get proteins
   pep = db.getPeptide(r.pep1);
-  sh.num_tot_proteins=(int)pep.map->size();
-  for(j=0;j<pep.map->size();j++){
-    if (pep.n15 && db[pep.map->at(j).index].name.find(params->n15Label)==string::npos) {
+  sh.num_tot_proteins=(int)pep.mapSize;
+  for(j=0;j<pep.mapSize;j++){
+    if (pep.n15 && db[pep.map[j].index].name.find(params->n15Label)==string::npos) {
       sh.num_tot_proteins--;
       continue;
     }
-    if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map->at(j).index].name.find(params->n15Label) != string::npos) {
+    if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map[j].index].name.find(params->n15Label) != string::npos) {
       sh.num_tot_proteins--;
       continue;
     }
     protein="";
-    for(i=0;i<db[pep.map->at(j).index].name.size();i++){
+    for(i=0;i<db[pep.map[j].index].name.size();i++){
       if(params->truncate>0 && i==params->truncate) break;
-      protein+=db[pep.map->at(j).index].name[i];
+      protein+=db[pep.map[j].index].name[i];
     }
-    if(pep.map->at(j).start<1) n='-';
-    else n=db[pep.map->at(j).index].sequence[pep.map->at(j).start-1];
-    if(pep.map->at(j).stop+1==db[pep.map->at(j).index].sequence.size()) c='-';
-    else c=db[pep.map->at(j).index].sequence[pep.map->at(j).stop+1];
-    siteA = pep.map->at(j).start+r.link1;
+    if(pep.map[j].start<1) n='-';
+    else n=db[pep.map[j].index].sequence[pep.map[j].start-1];
+    if(pep.map[j].stop+1==db[pep.map[j].index].sequence.size()) c='-';
+    else c=db[pep.map[j].index].sequence[pep.map[j].stop+1];
+    siteA = pep.map[j].start+r.link1;
     if(r.type==1){
-      siteB = pep.map->at(j).start+r.link2;
-      sh.addProtein(protein, c, n, (int)pep.map->at(j).start + 1,siteA, siteB);
+      siteB = pep.map[j].start+r.link2;
+      sh.addProtein(protein, c, n, (int)pep.map[j].start + 1,siteA, siteB);
     } else {
-      sh.addProtein(protein, c, n, (int)pep.map->at(j).start + 1, siteA);
+      sh.addProtein(protein, c, n, (int)pep.map[j].start + 1, siteA);
     }
   }
 
   if(r.type>1){
     pep = db.getPeptide(r.pep2);
-    shB.num_tot_proteins=(int)pep.map->size();
-    for(j=0;j<pep.map->size();j++){
-      if (pep.n15 && db[pep.map->at(j).index].name.find(params->n15Label) == string::npos) {
+    shB.num_tot_proteins=(int)pep.mapSize;
+    for(j=0;j<pep.mapSize;j++){
+      if (pep.n15 && db[pep.map[j].index].name.find(params->n15Label) == string::npos) {
         sh.num_tot_proteins--;
         continue;
       }
-      if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map->at(j).index].name.find(params->n15Label) != string::npos) {
+      if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map[j].index].name.find(params->n15Label) != string::npos) {
         sh.num_tot_proteins--;
         continue;
       }
       protein="";
-      for(i=0;i<db[pep.map->at(j).index].name.size();i++){
+      for(i=0;i<db[pep.map[j].index].name.size();i++){
         if(params->truncate>0 && i==params->truncate) break;
-        protein+=db[pep.map->at(j).index].name[i];
+        protein+=db[pep.map[j].index].name[i];
       }
-      if(pep.map->at(j).start<1) n='-';
-      else n=db[pep.map->at(j).index].sequence[pep.map->at(j).start-1];
-      if(pep.map->at(j).stop+1==db[pep.map->at(j).index].sequence.size()) c='-';
-      else c=db[pep.map->at(j).index].sequence[pep.map->at(j).stop+1];
-      siteA = pep.map->at(j).start + r.link2;
-      shB.addProtein(protein, c, n, (int)pep.map->at(j).start+1,siteA);
+      if(pep.map[j].start<1) n='-';
+      else n=db[pep.map[j].index].sequence[pep.map[j].start-1];
+      if(pep.map[j].stop+1==db[pep.map[j].index].sequence.size()) c='-';
+      else c=db[pep.map[j].index].sequence[pep.map[j].stop+1];
+      siteA = pep.map[j].start + r.link2;
+      shB.addProtein(protein, c, n, (int)pep.map[j].start+1,siteA);
     }
   }
 
@@ -1380,7 +1476,7 @@ bool KData::outputPepXML(PXWSpectrumQuery& sq, KDatabase& db, kResults& r){
   return true;
 }
 
-bool KData::outputPercolator(FILE* f, KDatabase& db, kResults& r, int count){
+bool KData::outputPercolator(string& s, KDatabase& db, kResults& r, int count){
 
   unsigned int i;
   unsigned int j;
@@ -1396,92 +1492,92 @@ bool KData::outputPercolator(FILE* f, KDatabase& db, kResults& r, int count){
   kScoreCard sc2;
 
   //Export Results:
-  if(r.decoy) fprintf(f,"D-");
-  else fprintf(f,"T-");
-  fprintf(f,"%s-%d-%.2f",r.baseName.c_str(),r.scanNumber,r.rTime);
-  if(count>1) fprintf(f,"-%d",count);
-  if(r.decoy) fprintf(f,"\t-1");
-  else fprintf(f,"\t1");
+  if(r.decoy) appendf(s,"D-");
+  else appendf(s,"T-");
+  appendf(s,"%s-%d-%.2f",r.baseName.c_str(),r.scanNumber,r.rTime);
+  if(count>1) appendf(s,"-%d",count);
+  if(r.decoy) appendf(s,"\t-1");
+  else appendf(s,"\t1");
 
   // Add label for each peptide:
   if(r.type==2 || r.type==3) {
     if (r.scoreA>r.scoreB) {
-      if (r.decoy1) fprintf(f, "\t-1");
-      else fprintf(f, "\t1");
-      if (r.decoy2) fprintf(f, "\t-1");
-      else fprintf(f, "\t1");
+      if (r.decoy1) appendf(s, "\t-1");
+      else appendf(s, "\t1");
+      if (r.decoy2) appendf(s, "\t-1");
+      else appendf(s, "\t1");
     } else {
-      if (r.decoy2) fprintf(f, "\t-1");
-      else fprintf(f, "\t1");
-      if (r.decoy1) fprintf(f, "\t-1");
-      else fprintf(f, "\t1");
+      if (r.decoy2) appendf(s, "\t-1");
+      else appendf(s, "\t1");
+      if (r.decoy1) appendf(s, "\t-1");
+      else appendf(s, "\t1");
     }
   }
 
-  if(params->percVersion>2.04) fprintf(f,"\t%d",r.scanNumber);
-  fprintf(f,"\t%.4lf",r.score);
-  fprintf(f,"\t%.4lf",r.scoreDelta);
-  fprintf(f,"\t%.6lf",-log10(r.eVal));
+  if(params->percVersion>2.04) appendf(s,"\t%d",r.scanNumber);
+  appendf(s,"\t%.4lf",r.score);
+  appendf(s,"\t%.4lf",r.scoreDelta);
+  appendf(s,"\t%.6lf",-log10(r.eVal));
   if(r.type==2 || r.type==3) {
-    if (r.scoreA>r.scoreB) fprintf(f,"\t%.6lf\t%.6lf\t%d\t%d\t%d\t%d\t%d\t%d",-log10(r.eVal1),-log10(r.eVal2),r.matches1+r.matches2,(r.conFrag1+r.conFrag2)/2,r.matches1,r.conFrag1,r.matches2,r.conFrag2);
-    else fprintf(f, "\t%.6lf\t%.6lf\t%d\t%d\t%d\t%d\t%d\t%d", -log10(r.eVal2), -log10(r.eVal1), r.matches1 + r.matches2, (r.conFrag1 + r.conFrag2) / 2, r.matches2, r.conFrag2, r.matches1, r.conFrag1);
-    fprintf(f,"\t%d\t%.4lf",r.rank,r.scorePepDif);
+    if (r.scoreA>r.scoreB) appendf(s,"\t%.6lf\t%.6lf\t%d\t%d\t%d\t%d\t%d\t%d",-log10(r.eVal1),-log10(r.eVal2),r.matches1+r.matches2,(r.conFrag1+r.conFrag2)/2,r.matches1,r.conFrag1,r.matches2,r.conFrag2);
+    else appendf(s, "\t%.6lf\t%.6lf\t%d\t%d\t%d\t%d\t%d\t%d", -log10(r.eVal2), -log10(r.eVal1), r.matches1 + r.matches2, (r.conFrag1 + r.conFrag2) / 2, r.matches2, r.conFrag2, r.matches1, r.conFrag1);
+    appendf(s,"\t%d\t%.4lf",r.rank,r.scorePepDif);
   } else {
-    fprintf(f,"\t%d\t%d",r.matches1,r.conFrag1);
+    appendf(s,"\t%d\t%d",r.matches1,r.conFrag1);
   }
-  //if(r.type==1) fprintf(f,"\t1\t0");
-  //else if(r.type==2) fprintf(f,"\t0\t1");
-  //else if(r.type==3) fprintf(f,"\t0\t0");
-  //else fprintf(f,"\t0\t0");
+  //if(r.type==1) appendf(s,"\t1\t0");
+  //else if(r.type==2) appendf(s,"\t0\t1");
+  //else if(r.type==3) appendf(s,"\t0\t0");
+  //else appendf(s,"\t0\t0");
   for(int z=1;z<8;z++){
-    if(r.charge==(int)z) fprintf(f,"\t1");
-    else fprintf(f,"\t0");
+    if(r.charge==(int)z) appendf(s,"\t1");
+    else appendf(s,"\t0");
   }
-  if(r.charge>7) fprintf(f,"\t1");
-  else fprintf(f,"\t0");
-  fprintf(f,"\t%.4lf",r.psmMass);
-  fprintf(f,"\t%.4lf",r.ppm);
+  if(r.charge>7) appendf(s,"\t1");
+  else appendf(s,"\t0");
+  appendf(s,"\t%.4lf",r.psmMass);
+  appendf(s,"\t%.4lf",r.ppm);
   p1=r.modPeptide1;
   p2=r.modPeptide2;
   if(r.n15Pep1)p1+="-15N";
   if(r.n15Pep2)p2+="-15N";
   if (r.type == 2 || r.type == 3) {
-    if (r.peptide1.size()>r.peptide2.size()) fprintf(f,"\t%d\t%d", (int)r.peptide2.size(), (int)r.peptide1.size());
-    else fprintf(f,"\t%d\t%d", (int)r.peptide1.size(), (int)r.peptide2.size());
-    if(r.type==3) fprintf(f,"\t%d\t-.%s+%s.-",(int)(r.peptide1.size()+r.peptide2.size()),&p1[0],&p2[0]);
-    else fprintf(f,"\t%d\t-.%s(%d)--%s(%d).-",(int)(r.peptide1.size()+r.peptide2.size()),&p1[0],r.link1,&p2[0],r.link2);
+    if (r.peptide1.size()>r.peptide2.size()) appendf(s,"\t%d\t%d", (int)r.peptide2.size(), (int)r.peptide1.size());
+    else appendf(s,"\t%d\t%d", (int)r.peptide1.size(), (int)r.peptide2.size());
+    if(r.type==3) appendf(s,"\t%d\t-.%s+%s.-",(int)(r.peptide1.size()+r.peptide2.size()),&p1[0],&p2[0]);
+    else appendf(s,"\t%d\t-.%s(%d)--%s(%d).-",(int)(r.peptide1.size()+r.peptide2.size()),&p1[0],r.link1,&p2[0],r.link2);
   } else {
-    fprintf(f,"\t%d\t-.%s",(int)r.peptide1.size(),&p1[0]);
-    if(r.type==1) fprintf(f,"(%d,%d)-LOOP",r.link1,r.link2);
-    fprintf(f,".-");
+    appendf(s,"\t%d\t-.%s",(int)r.peptide1.size(),&p1[0]);
+    if(r.type==1) appendf(s,"(%d,%d)-LOOP",r.link1,r.link2);
+    appendf(s,".-");
   }
   
 
   //export proteins
   pep = db.getPeptide(r.pep1);
-  for(j=0;j<pep.map->size();j++){
+  for(j=0;j<pep.mapSize;j++){
     protein="";
-    for(i=0;i<db[pep.map->at(j).index].name.size();i++){
+    for(i=0;i<db[pep.map[j].index].name.size();i++){
       if(params->truncate>0 && i==params->truncate) break;
-      if(db[pep.map->at(j).index].name[i]==' ') protein+='_';
-      else protein+=db[pep.map->at(j).index].name[i];
+      if(db[pep.map[j].index].name[i]==' ') protein+='_';
+      else protein+=db[pep.map[j].index].name[i];
     }
-    fprintf(f,"\t%s",&protein[0]);
+    appendf(s,"\t%s",&protein[0]);
   }
   if(r.pep2>=0){
     pep = db.getPeptide(r.pep2);
-    for(j=0;j<pep.map->size();j++){
+    for(j=0;j<pep.mapSize;j++){
       protein="";
-      for(i=0;i<db[pep.map->at(j).index].name.size();i++){
+      for(i=0;i<db[pep.map[j].index].name.size();i++){
         if(params->truncate>0 && i==params->truncate) break;
-        if(db[pep.map->at(j).index].name[i]==' ') protein+='_';
-        else protein+=db[pep.map->at(j).index].name[i];
+        if(db[pep.map[j].index].name[i]==' ') protein+='_';
+        else protein+=db[pep.map[j].index].name[i];
       }
-      fprintf(f,"\t%s",&protein[0]);
+      appendf(s,"\t%s",&protein[0]);
     }
   }
 
-  fprintf(f,"\n");
+  appendf(s,"\n");
 
   return true;
 }
@@ -1490,21 +1586,13 @@ bool KData::outputPercolator(FILE* f, KDatabase& db, kResults& r, int count){
 bool KData::outputResults(KDatabase& db, KParams& par){
 
   size_t i;
-  int j,k,n,d;
+  size_t sz;
+  int j,k;
   char fName[1056];
   char outPath[1056];
-  char peptide[256];
-  char tmp[16];
-  char specID[256];
-
-  kPeptide pep;
-  kPeptide pep2;
-  kPrecursor precursor;
-  kScoreCard tmpSC;
-  kScoreCard tmpSC2;
 
   kEnzymeRules enzyme;
-  kResults res;
+  kSpecExport* batch;
 
   PepXMLWriter p;
   pxwAminoAcidModification aam;
@@ -1512,28 +1600,17 @@ bool KData::outputResults(KDatabase& db, KParams& par){
   pxwMSMSRunSummary rs;
   pxwSampleEnzyme enz;
   PXWSearchSummary ss;
-  PXWSpectrumQuery sq;
 
   CMzIdentML mzID;
   string analysisSoftware_ref;
   string sip_ref;
 
   bool bBadFiles;
-  bool bInter;
-  bool bTarget1;
-  bool bDupe;
-  bool bDiag;
-
-  int scoreIndex;
-  int iDupe;
 
-  double topScore;
-
-  string tmpPep1;
-  string tmpPep2;
+  string baseName;
   string outFile;
-  string dStr;
 
+  FILE* fPerc[5];
   FILE* fOut    = NULL;
   FILE* fIntra  = NULL;
   FILE* fInter  = NULL;
@@ -1728,331 +1805,59 @@ bool KData::outputResults(KDatabase& db, KParams& par){
     fprintf(fDiag,"<kojak_analysis date=\"now\">\n");
   }
 
-  res.baseName=params->outFile;
-  if (res.baseName[0] == '/'){ //unix
-    res.baseName = res.baseName.substr(res.baseName.find_last_of("/") + 1, res.baseName.size());
+  baseName=params->outFile;
+  if (baseName[0] == '/'){ //unix
+    baseName = baseName.substr(baseName.find_last_of("/") + 1, baseName.size());
   } else { //assuming windows
-    res.baseName = res.baseName.substr(res.baseName.find_last_of("\\") + 1, res.baseName.size());
+    baseName = baseName.substr(baseName.find_last_of("\\") + 1, baseName.size());
   }
 
   //Output top score for each spectrum
-  //Must iterate through all possible precursors for that spectrum
-  dStr=params->decoy;
-  for(i=0;i<spec.size();i++) {
-
-    //update top hits so that a target result is always first among ties between targets and decoys
-    spec[i].refreshScore(db,dStr);
-
-    //Check if we need to output diagnostic information
-    bDiag=false;
-    if(params->diag->size()>0){
-      if(params->diag->at(0)==-1) {
-        bDiag=true;
-      } else {
-        for (d = 0; d<params->diag->size(); d++){
-          if (spec[i].getScanNumber() == params->diag->at(d)){
-            bDiag=true;
-            break;
-          }
+  //Spectra are formatted on all threads, a batch at a time, then written in scan order. The mzID
+  //and pepXML writers are not thread-safe, so only their input is prepared on the worker threads.
+  fPerc[0]=fIntra;
+  fPerc[1]=fInter;
+  fPerc[2]=fLoop;
+  fPerc[3]=fSingle;
+  fPerc[4]=fDimer;
+  batch = new kSpecExport[EXPORTBATCH];
+  ThreadPool<kSpecExport*>* threadPool = new ThreadPool<kSpecExport*>(exportProc,params->threads,params->threads,params->threads);
+  for(i=0;i<spec.size();i+=EXPORTBATCH) {
+    sz=spec.size()-i;
+    if(sz>EXPORTBATCH) sz=EXPORTBATCH;
+
+    for(j=0;j<(int)sz;j++){
+      threadPool->WaitForQueuedParams();
+      batch[j].data=this;
+      batch[j].db=&db;
+      batch[j].baseName=&baseName;
+      batch[j].pepXMLName=&outFile;
+      batch[j].index=(int)(i+j);
+      threadPool->Launch(&batch[j]);
+    }
+    threadPool->WaitForQueuedParams();
+    threadPool->WaitForThreads();
+
+    for(j=0;j<(int)sz;j++){
+      kSpecExport& e=batch[j];
+      if(e.diag) outputDiagnostics(fDiag,spec[e.index],db);
+      fwrite(e.out.c_str(),1,e.out.size(),fOut);
+      if(params->exportPercolator){
+        for(k=0;k<5;k++){
+          if(fPerc[k]!=NULL && e.perc[k].size()>0) fwrite(e.perc[k].c_str(),1,e.perc[k].size(),fPerc[k]);
         }
       }
-    }
-    if(bDiag) outputDiagnostics(fDiag,spec[i],db);
-
-    scoreIndex=0;
-    tmpSC=spec[i].getScoreCard(scoreIndex);
-    res.scanNumber=spec[i].getScanNumber();
-    res.scanID=spec[i].getNativeID();
-    res.rTime=spec[i].getRTime();
-
-    //if there are no matches to the spectrum, return null result and continue
-    if(tmpSC.simpleScore==0){
-      fprintf(fOut,"%d\t%.4f\t0\t0\t0\t0\t0\t0\t999\t0\t999\t-\t-\t-\t-\t0\t999\t-\t-\t-\t-\t0\n",res.scanNumber,res.rTime);
-      continue;
-    }
-
-    if(params->exportPepXML){
-      sq.clear();
-      sq.end_scan=res.scanNumber;
-      sq.retention_time_sec=res.rTime;
-      sq.start_scan=res.scanNumber;
-    }
-
-    //Export top scoring peptide, plus any ties that occur after it.
-    topScore=tmpSC.simpleScore;
-    int count=0;
-    while(tmpSC.simpleScore==topScore){
-
-      count++;
-
-      //Get precursor ion for the PSM
-      precursor=spec[i].getPrecursor((int)tmpSC.precursor);
-      res.obsMass = precursor.monoMass;
-      res.charge  = precursor.charge;
-      res.ppm = (tmpSC.mass - precursor.monoMass) / precursor.monoMass*1e6;
-      res.psmMass = tmpSC.mass;
-      res.hk = precursor.corr;
-
-      if(params->exportPepXML){
-        sq.assumed_charge=res.charge;
-        sq.precursor_neutral_mass=res.obsMass;
-        sprintf(specID,"%s.%d.%d.%d",outFile.c_str(),res.scanNumber,res.scanNumber,res.charge);
-        sq.spectrum=specID;
-      }
-
-      //grab the next highest score that matches to the same precursor ion for the delta score
-      //do not count ties - look for the first difference
-      //if no other match has the same precursor, just take the lowest score in the list
-      n=scoreIndex+1;
-      while(n<19){
-        tmpSC2=spec[i].getScoreCard(n++);
-        if(tmpSC2.simpleScore==0) break;
-        if(tmpSC2.simpleScore==topScore) continue;
-        if(tmpSC2.precursor!=tmpSC.precursor) continue;
-
-        //if peptides and link sites are the same, go to the next one
-        //this no longer applies to the top result. duplicates may occur among lower results
-        //if(tmpSC.link>-1 && tmpSC2.link>-1 && tmpSC2.pep1==tmpSC.pep1 && tmpSC2.pep2==tmpSC.pep2 && tmpSC2.k1==tmpSC.k1 && tmpSC2.k2==tmpSC.k2){
-        //  cout << "Oddity 1: " << spec[i].getScanNumber() << endl;
-        //  continue;
-        //}
-        break;
-      }
-      res.score       = tmpSC.simpleScore;
-      res.scoreDelta  = tmpSC.simpleScore-tmpSC2.simpleScore;
-      res.eVal        = tmpSC.eVal;
-      res.eVal1       = tmpSC.eVal1;
-      res.eVal2       = tmpSC.eVal2;
-      res.matches1    = tmpSC.matches1;
-      res.matches2    = tmpSC.matches2;
-      res.conFrag1    = tmpSC.conFrag1;
-      res.conFrag2    = tmpSC.conFrag2;
-      if(tmpSC.score1<tmpSC.score2) res.scorePepDif = tmpSC.score1;
-      else res.scorePepDif = tmpSC.score2;
-      
-      KTopPeps* tp = spec[i].getTopPeps((int)tmpSC.precursor);
-      kSingletScoreCard* grr;
-      grr = tp->singletFirst;
-      int rank=1;
-      res.rankA=0;
-      res.rankB=0;
-      while(grr!=NULL){
-        if(res.rankA==0 && tmpSC.pep1==grr->pep1 && tmpSC.score1==grr->simpleScore) res.rankA=rank;
-        if(res.rankB==0 && tmpSC.score2>grr->simpleScore) res.rankB=rank;
-        rank++;
-        grr = grr->next;
-      }
-      if(res.rankB==0) res.rankB=params->topCount;
-      res.rank        = res.rankA+res.rankB;
-      res.scoreA      = tmpSC.score1;
-      res.scoreB      = tmpSC.score2;
-      res.massA       = tmpSC.mass1;
-      res.massB       = tmpSC.mass2;
-
-      //Get the peptide sequence(s)
-      pep = db.getPeptide(tmpSC.pep1);
-      db.getPeptideSeq( pep.map->at(0).index,pep.map->at(0).start,pep.map->at(0).stop,peptide);
-      res.peptide1 = peptide;
-      res.mods1.clear();
-      res.cTerm1 = pep.cTerm;
-      res.nTerm1 = pep.nTerm;
-      res.linkSite1 = tmpSC.site1;
-      if(tmpSC.site2>-1) res.linkSite2=tmpSC.site2; //loop-link
-      res.n15Pep1 = pep.n15;
-      for(j=0;j<tmpSC.mods1->size();j++) res.mods1.push_back(tmpSC.mods1->at(j));
-      res.peptide2 = "";
-      if(tmpSC.pep2>=0){
-        pep2 = db.getPeptide(tmpSC.pep2);
-        db.getPeptideSeq( pep2.map->at(0).index,pep2.map->at(0).start,pep2.map->at(0).stop,peptide);
-        res.peptide2 = peptide;
-        res.mods2.clear();
-        res.cTerm2 = pep2.cTerm;
-        res.nTerm2 = pep2.nTerm;
-        res.linkSite2 = tmpSC.site2;
-        res.n15Pep2 = pep2.n15;
-        for(j=0;j<tmpSC.mods2->size();j++) res.mods2.push_back(tmpSC.mods2->at(j));
-      }
-
-      //Process the peptide
-      res.modPeptide1 = processPeptide(pep,tmpSC.mods1,db);      
-      res.modPeptide2 = "";
-      if(res.peptide2.size()>0){
-        res.modPeptide2=processPeptide(pep2,tmpSC.mods2,db);
-      }
-
-      //Get the link positions - relative to the peptide
-      res.link1 = tmpSC.k1;
-      res.link2 = tmpSC.k2;
-      if(res.link1>=0) res.link1++;
-      if(res.link2>=0) res.link2++;
-
-      //set link type
-      res.type=0;
-      if(tmpSC.k1>=0 && tmpSC.k2>=0) res.type=1;
-      if(tmpSC.pep1>=0 && tmpSC.pep2>=0) res.type=2;
-      if(res.type==2 && tmpSC.k1==-1 && tmpSC.k2==-1) res.type=3;
-
-      if(res.type>0 && res.type!=3) {
-        res.xlMass=link[tmpSC.link].mass;
-        res.xlLabel=link[tmpSC.link].label;
-      }
-
-      //Get the peptide indexes
-      res.pep1 = tmpSC.pep1;
-      res.pep2 = tmpSC.pep2;
-      res.linkable1 = tmpSC.linkable1;
-      res.linkable2 = tmpSC.linkable2;
-
-      //Edge case where single peptide is shared between linked and non-linked peptide lists
-      //This occurs when the peptide appears multiple times in a database: internally and on
-      //the c-terminus for amine reactive cross-linkers, for example.
-      bDupe=false;
-      if(res.type==0){
-        n=scoreIndex+1;
-        iDupe=1;
-        while(n<19){
-          iDupe++;
-          tmpSC2=spec[i].getScoreCard(n++);
-          if(tmpSC2.simpleScore==0) break;
-          if(tmpSC2.simpleScore!=topScore) break;
-
-          //if peptides are the same, but different lists (linked vs. non), use second peptide as location
-          if(tmpSC2.linkable1!=tmpSC.linkable1) {
-            pep = db.getPeptide(res.pep1);
-            db.getPeptideSeq(pep,tmpPep1);
-            pep2 = db.getPeptide(tmpSC2.pep1);
-            db.getPeptideSeq(pep2,tmpPep2);
-            if(tmpPep1.compare(tmpPep2)==0){
-              res.pep2=tmpSC2.pep1;
-              res.linkable2=tmpSC2.linkable1;
-              res.linkSite2=tmpSC2.site1;
-              bDupe=true;
-              break;
-            }
-          }
-        }
-      }
-
-      //Process the protein
-      processProtein(res.pep1, res.link1-1, res.linkSite1, res.protein1, res.protPos1, res.decoy1, db);
-      if (res.modPeptide2.size()>1) {
-        processProtein(res.pep2, res.link2-1, res.linkSite2, res.protein2, res.protPos2, res.decoy2, db);
-        if(res.decoy1 || res.decoy2) res.decoy=true;
-        else res.decoy=false;
-      } else if(res.linkSite2>-1){ //loop link special case.
-        processProtein(res.pep1, res.link2 - 1, res.linkSite2, res.protein2, res.protPos2, res.decoy2, db);
-        if(!res.decoy1 || !res.decoy2) res.decoy=false;
-        else res.decoy=true;
-      } else {
-        res.decoy=res.decoy1;
-      }
-
-      tmpPep1=res.peptide1;
-      sprintf(tmp,"(%d)",res.link1);
-      tmpPep1+=tmp;
-      tmpPep2 = res.peptide2;
-      sprintf(tmp, "(%d)", res.link2);
-      tmpPep2 += tmp;
-
-      //Export Results:
-      fprintf(fOut,"%d",res.scanNumber);
-      //fprintf(fOut, "\t%.4lf",res.hk); //this was for diagnostics of hardklor correlation results (or lack of)
-      fprintf(fOut,"\t%.4f",res.rTime);
-      fprintf(fOut,"\t%.4lf",res.obsMass);
-      fprintf(fOut,"\t%d",res.charge);
-      fprintf(fOut,"\t%.4lf",res.psmMass);
-      fprintf(fOut,"\t%.4lf",res.ppm);
-      fprintf(fOut,"\t%.4lf",res.score);
-      fprintf(fOut,"\t%.4lf",res.scoreDelta);
-      fprintf(fOut,"\t%.3e",res.eVal);
-      //fprintf(fOut,"\t%.4lf",res.scorePepDif);
-      if (res.scoreA == 0)fprintf(fOut, "\t%.4lf", res.score);
-      else fprintf(fOut,"\t%.4lf",res.scoreA);
-      fprintf(fOut,"\t%.3e",res.eVal1);
-      fprintf(fOut,"\t%s",&res.modPeptide1[0]);
-      if(res.n15Pep1) fprintf(fOut,"-15N");
-      fprintf(fOut,"\t%d",res.link1);
-
-      //export protein
-      fprintf(fOut, "\t%s", res.protein1.c_str());
-      /* not sure about this anymore - probably breaking something by removing it
-      if(bDupe){
-        pep = db.getPeptide(res.pep2);
-        for(j=0;j<pep.map->size();j++){
-          fprintf(fOut,"%s;",&db[pep.map->at(j).index].name[0]);
-          //if(res.link1>=0) fprintf(fOut,"(%d);",pep.map->at(j).start+res.link1); //only non-linked peptides
-        }
-      }
-      */
-      if(res.link1>-1) fprintf(fOut,"\t%s",res.protPos1.c_str());
-      else fprintf(fOut,"\t-");
-
-      if(res.modPeptide2.size()>1) {
-        fprintf(fOut, "\t%.4lf", res.scoreB);
-        fprintf(fOut, "\t%.3e", res.eVal2);
-        fprintf(fOut,"\t%s",&res.modPeptide2[0]);
-        if (res.n15Pep2) fprintf(fOut, "-15N");
-        fprintf(fOut,"\t%d",res.link2);
-        fprintf(fOut,"\t%s",res.protein2.c_str());
-        fprintf(fOut, "\t%s", res.protPos2.c_str());
-        if(tmpSC.link>-1)fprintf(fOut,"\t%.4lf",link[tmpSC.link].mass);
-        else fprintf(fOut,"\t0");
-      } else if(res.link2>-1){
-        fprintf(fOut,"\t0\t999\t-\t%d\t-\t%s",res.link2,res.protPos2.c_str());
-        fprintf(fOut,"\t%.4lf",link[tmpSC.link].mass);
-      } else {
-        fprintf(fOut,"\t0\t999\t-\t-1\t-\t-\t0");
-      }
-      
-      fprintf(fOut,"\n");
-
-      if(res.type==2){
-        bInter=true;
-        pep = db.getPeptide(res.pep1);
-        pep2 = db.getPeptide(res.pep2);
-        for(j=0;j<pep.map->size();j++){
-          for(k=0;k<pep2.map->size();k++){
-            if(pep.map->at(j).index==pep2.map->at(k).index){
-              bInter=false;
-              break;
-            }
-          }
-          if(!bInter) break;
-        }
-      }
-
       if(params->exportMzID){
-        outputMzID(mzID,db,par,res);
-      }
-      
-      if(params->exportPercolator) {
-        switch(res.type){
-          case 1:   outputPercolator(fLoop,db,res,count);   break;
-          case 2:
-            if(bInter)  outputPercolator(fInter,db,res,count);
-            else        outputPercolator(fIntra,db,res,count);
-            break;
-          case 3:   outputPercolator(fDimer, db, res, count);  break;
-          default:  outputPercolator(fSingle,db,res,count); break;
-        }
+        for(k=0;k<(int)e.res.size();k++) outputMzID(mzID,db,par,e.res[k]);
       }
-
-      if(params->exportPepXML){
-        outputPepXML(sq,db,res);
+      if(params->exportPepXML && e.query) {
+        p.writeSpectrumQuery(e.sq);
       }
-
-      //Get the next entry - it must also be exported if it has the same score
-      if(bDupe) scoreIndex+=iDupe;
-      else scoreIndex++;
-      if(scoreIndex>=20) break;
-      tmpSC=spec[i].getScoreCard(scoreIndex);
-    }
-
-    if(params->exportPepXML) {
-      p.writeSpectrumQuery(sq);
     }
 
   }
+  delete threadPool;
+  delete [] batch;
 
   fclose(fOut);
   if(params->exportPercolator) {
@@ -2097,39 +1902,38 @@ void KData::readLinkers(char* fn){
 }
 
 //Reads in raw/mzXML/mzML files. Other formats supported in MSToolkit as well.
+//Spectra are read on this thread and handed to a pool of worker threads for centroiding, isotope
+//collapse, and peak picking. Each spectrum keeps its position in the file, so the final order does
+//not depend on which worker finishes first. When searching in precursor mass shards, the peak lists
+//are dropped a batch at a time and readShard() reads them again for each shard.
 bool KData::readSpectra(){
 
   MSReader   msr;
   Spectrum   s;
-  Spectrum   c;
-  KSpectrum  pls(params->topCount,params->binSize,params->binOffset);
-  kSpecPoint sp;
-  float      max;
-  kPrecursor pre;
+  vector<KSpectrum*> vSpec;
 
   int totalScans=0;
-  int totalPeaks=0;
-  int collapsedPeaks=0;
   int iPercent=0;
   int iTmp;
 
-  int i;
-  int j;
-
-  char nStr[256];
-  string sStr;
-
-  bool doCentroid;
+  size_t i;
 
   spec.clear();
+  bShardPeaks=(params->precursorShards>1);
   msr.setFilter(MS2);
 
+  ThreadPool<kSpecReadStruct*>* threadPool = new ThreadPool<kSpecReadStruct*>(processSpectrumProc,params->threads,params->threads,params->threads);
+
   //Set progress meter
   printf("%2d%%", iPercent);
   fflush(stdout);
 
-  if(!msr.readFile(params->msFile,s)) return false;
+  if(!msr.readFile(params->msFile,s)) {
+    delete threadPool;
+    return false;
+  }
   while(s.getScanNumber()>0){
+    if(isCancelled()) break;
 
     totalScans++;
     if(s.size()<1) {
@@ -2137,108 +1941,22 @@ bool KData::readSpectra(){
       continue;
     }
 
-    pls.clear();
-    pls.setRTime(s.getRTime());
-    pls.setScanNumber(s.getScanNumber());
-    s.getNativeID(nStr,256);
-    sStr=nStr;
-    pls.setNativeID(sStr);
-    max=0;
-
-    doCentroid=false;
-    switch(s.getCentroidStatus()){
-    case 0:
-      if(params->ms2Centroid) {
-        char tmpStr[256];
-        sprintf(tmpStr,"Kojak parameter indicates MS/MS data are centroid, but spectrum %d labeled as profile.",s.getScanNumber());
-        klog->addError(string(tmpStr));
-      } else doCentroid=true;
-      break;
-    case 1:
-      if (!params->ms2Centroid) {
-        klog->addWarning(0, "Spectrum is labeled as centroid, but Kojak parameter indicates data are profile. Ignoring Kojak parameter.");
-      }
-      break;
-    default:
-      if(!params->ms2Centroid) doCentroid=true;
-      break;
-    }
-
-    //If not centroided, do so now.
-    if(doCentroid){
-      centroid(s, c, params->ms2Resolution, params->instrument);
-      totalPeaks += c.size();
-    } else c=s;
-
-    //remove precursor if requested
-    if(params->removePrecursor>0){
-      double pMin=s.getMZ()-params->removePrecursor;
-      double pMax=s.getMZ()+params->removePrecursor;
-      for(i=0;i<c.size();i++){
-        if(c[i].mz>pMin && c[i].mz<pMax) c[i].intensity=0;
-      }
-    }
-
-    //Collapse the isotope peaks
-    if (params->specProcess == 1 && c.size()>1) {
-      collapseSpectrum(c);
-      collapsedPeaks += c.size();
-    }
+    threadPool->WaitForQueuedParams();
 
-    //If user limits number of peaks to analyze, sort by intensity and take top N
-    if (params->maxPeaks>0){
-      if (c.size()>1) c.sortIntensityRev();
-      if (c.size()<params->maxPeaks) j = c.size();
-      else j = params->maxPeaks;
-    } else {
-      j = c.size();
-    }
-    for (i = 0; i<j; i++){
-      sp.mass = c[i].mz;
-      sp.intensity = c[i].intensity;
-      pls.addPoint(sp);
-      if (sp.intensity>max) max = sp.intensity;
-    }
-    pls.setMaxIntensity(max);
-
-    //Sort again by MZ, if needed
-    if (pls.size()>1 && params->maxPeaks>0) pls.sortMZ();
-
-    //Get any additional information user requested
-    pls.setCharge(s.getCharge());
-    pls.setMZ(s.getMZ());
-    if(params->preferPrecursor>0){
-      if(s.getMonoMZ()>0 && s.getCharge()>0){
-        pre.monoMass=s.getMonoMZ()*s.getCharge()-s.getCharge()*1.007276466;
-        pre.charge=s.getCharge();
-        pre.corr=0;
-        pls.addPrecursor(pre,params->topCount);
-        for(int px=1;px<=params->isotopeError;px++){
-          if(px==4) break;
-          pre.monoMass -= 1.00335483;
-          pre.corr -= 0.1;
-          pls.addPrecursor(pre, params->topCount);
-         }
-        pls.setInstrumentPrecursor(true);
-      }
-    }
+    kSpecReadStruct* a = new kSpecReadStruct();
+    a->data=this;
+    a->centroid=needCentroid(s,true);
+    a->s=s;
+    a->pls=new KSpectrum(params->topCount,params->binSize,params->binOffset);
+    vSpec.push_back(a->pls);
+    threadPool->Launch(a);
 
-    //Add spectrum (if it has enough data points) to data object and read next file
-    if(pls.size()>params->minPeaks) spec.push_back(pls);
-
-    /*
-    for(unsigned int d=0;d<params->diag->size();d++){
-      if(pls.getScanNumber()==params->diag->at(d)){
-        char diagStr[256];
-        sprintf(diagStr,"diagnostic_spectrum_%d.txt",params->diag->at(d));
-        FILE* f=fopen(diagStr,"wt");
-        fprintf(f,"Scan: %d\t%d\n",pls.getScanNumber(),pls.size());
-        for(int k=0;k<pls.size();k++) fprintf(f,"%.6lf\t%.0f\n",pls[k].mass,pls[k].intensity);
-        fclose(f);
-        break;
-      }
+    //peak lists are only held for a batch of spectra when they will be read again for each shard
+    if(bShardPeaks && vSpec.size()>=READBATCH){
+      threadPool->WaitForQueuedParams();
+      threadPool->WaitForThreads();
+      addSpectra(vSpec);
     }
-    */
 
     //Update progress meter
     iTmp = msr.getPercent();
@@ -2251,18 +1969,95 @@ bool KData::readSpectra(){
     msr.readFile(NULL,s);
   }
 
+  threadPool->WaitForQueuedParams();
+  threadPool->WaitForThreads();
+  delete threadPool;
+
+  if(isCancelled()){
+    for(i=0;i<vSpec.size();i++) delete vSpec[i];
+    cout << endl;
+    return false;
+  }
+
+  addSpectra(vSpec);
+
   //Finalize progress meter
   if(iPercent<100) printf("\b\b\b100%%");
   cout << endl;
 
   cout << "  " << spec.size() << " total spectra have enough data points (" << params->minPeaks << " peaks) for searching." << endl;
   //cout << totalScans << " total scans were loaded." <<  endl;
-  //cout << totalPeaks << " total peaks in original data." << endl;
-  //cout << collapsedPeaks << " peaks after collapsing." << endl;
-  //cout << finalPeaks << " peaks after top N." << endl;
 	return true;
 }
 
+//Reads the peak lists of the spectra in the active shard (or of all spectra, if no shard is set)
+//back from file, if readSpectra() dropped them. The file is read once per shard, so that peaks are
+//only held for the shard being searched. Spectra stay in file order, so each MS2 scan read is
+//either the next spectrum in the list or one that was skipped for too few peaks.
+bool KData::readShard(){
+
+  MSReader   msr;
+  Spectrum   s;
+  vector<KSpectrum*> vSpec;
+  vector<int> vIndex;
+
+  size_t i;
+  size_t j;
+
+  if(!bShardPeaks) return true;
+
+  msr.setFilter(MS2);
+
+  ThreadPool<kSpecReadStruct*>* threadPool = new ThreadPool<kSpecReadStruct*>(processSpectrumProc,params->threads,params->threads,params->threads);
+
+  if(!msr.readFile(params->msFile,s)) {
+    delete threadPool;
+    return false;
+  }
+  j=0;
+  while(s.getScanNumber()>0 && j<spec.size()){
+    if(isCancelled()) break;
+
+    if(s.getScanNumber()!=spec[j].getScanNumber()){
+      msr.readFile(NULL,s);
+      continue;
+    }
+
+    if(inShard((int)j)){
+      threadPool->WaitForQueuedParams();
+
+      kSpecReadStruct* a = new kSpecReadStruct();
+      a->data=this;
+      a->centroid=needCentroid(s,false);
+      a->s=s;
+      a->pls=new KSpectrum(params->topCount,params->binSize,params->binOffset);
+      vSpec.push_back(a->pls);
+      vIndex.push_back((int)j);
+      threadPool->Launch(a);
+    }
+
+    j++;
+    msr.readFile(NULL,s);
+  }
+
+  threadPool->WaitForQueuedParams();
+  threadPool->WaitForThreads();
+  delete threadPool;
+
+  //Only the peaks are taken; the precursors were already mapped
+  for(i=0;i<vSpec.size();i++){
+    spec[vIndex[i]].swapPeaks(*vSpec[i]);
+    delete vSpec[i];
+  }
+
+  return !isCancelled();
+}
+
+//Reading, precursor mapping, and transforming stop early once c is raised, and return false.
+void KData::setCancel(ThreadCancel* c){
+  cancel=c;
+}
+
 void KData::setLinker(kLinker x){
   if(x.mono==0) link.push_back(x);
 }
@@ -2271,6 +2066,13 @@ void KData::setLog(KLog* c){
   klog=c;
 }
 
+//Restricts the precursor mass list, and therefore the search, to a single shard. Use -1 for all spectra.
+bool KData::setShard(int s){
+  activeShard=s;
+  buildMassList();
+  return massList.size()>0;
+}
+
 void KData::setVersion(const char* v){
   strcpy(version,v);
 }
@@ -2283,7 +2085,7 @@ int KData::sizeLink(){
   return (int)link.size();
 }
 
-void KData::xCorr(bool b){
+bool KData::xCorr(bool b){
   if(b) {
     klog->addMessage("Using XCorr scores.",true);
     cout << "  Using XCorr scores." << endl;
@@ -2298,8 +2100,17 @@ void KData::xCorr(bool b){
   int iPercent = 0;
   printf("%2d%%", iPercent);
   fflush(stdout);
+  ThreadPool<kXCorrStruct*>* threadPool = new ThreadPool<kXCorrStruct*>(xCorrProc,params->threads,params->threads,params->threads);
   for(size_t i=0;i<spec.size();i++) {
-    spec[i].xCorrScore(b);
+    if(!inShard((int)i)) continue;
+    if(isCancelled()) break;
+
+    threadPool->WaitForQueuedParams();
+
+    kXCorrStruct* a = new kXCorrStruct();
+    a->spec=&spec[i];
+    a->xcorr=b;
+    threadPool->Launch(a);
 
     //Update progress meter
     iTmp = (int)((double)i / spec.size() * 100);
@@ -2310,10 +2121,19 @@ void KData::xCorr(bool b){
     }
 
   }
+  threadPool->WaitForQueuedParams();
+  threadPool->WaitForThreads();
+  delete threadPool;
+
+  if(isCancelled()){
+    cout << endl;
+    return false;
+  }
 
   //Finalize progress meter
   if(iPercent<100) printf("\b\b\b100%%");
   cout << endl;
+  return true;
 }
 
 /*============================
@@ -2602,6 +2422,74 @@ void KData::collapseSpectrum(Spectrum& s){
   
 }
 
+//Moves spectra (if they have enough data points) to the data object in file order, and deletes
+//them from v. Peak lists are dropped if they will be read again for each shard.
+void KData::addSpectra(vector<KSpectrum*>& v){
+  size_t i;
+  size_t n;
+
+  n=0;
+  for(i=0;i<v.size();i++){
+    if(v[i]->size()>params->minPeaks) n++;
+  }
+  if(spec.size()==0) spec.reserve(n);
+  for(i=0;i<v.size();i++){
+    if(v[i]->size()>params->minPeaks) {
+      if(bShardPeaks) v[i]->freePeaks();
+      spec.push_back(*v[i]);
+    }
+    delete v[i];
+  }
+  v.clear();
+}
+
+//Appends printf-style formatted text to s.
+void KData::appendf(string& s, const char* fmt, ...){
+  char str[256];
+  int n;
+  size_t sz;
+  va_list args;
+
+  va_start(args,fmt);
+  n=vsnprintf(str,256,fmt,args);
+  va_end(args);
+  if(n<0) return;
+  if(n<256){
+    s.append(str,n);
+    return;
+  }
+
+  //too long for the buffer; format again directly into s
+  sz=s.size();
+  s.resize(sz+n+1);
+  va_start(args,fmt);
+  vsnprintf(&s[sz],n+1,fmt,args);
+  va_end(args);
+  s.resize(sz+n);
+}
+
+//Build mass list - this orders all precursor masses, with an index pointing to the actual
+//array position for the spectrum. This is because all spectra will have more than 1
+//precursor mass. Only spectra in the active shard are listed.
+void KData::buildMassList(){
+  size_t i;
+  int j;
+  kMass m;
+
+  massList.clear();
+  for(i=0;i<spec.size();i++){
+    if(!inShard((int)i)) continue;
+    m.index=(int)i;
+    for(j=0;j<spec[i].sizePrecursor();j++){
+      m.mass=spec[i].getPrecursor(j).monoMass;
+      massList.push_back(m);
+    }
+  }
+
+  //sort mass list from low to high
+  if(massList.size()>1) qsort(&massList[0],massList.size(),sizeof(kMass),compareMassList);
+}
+
 int KData::compareInt(const void *p1, const void *p2){
   int d1 = *(int *)p1;
   int d2 = *(int *)p2;
@@ -2626,6 +2514,366 @@ int KData::compareMassList(const void *p1, const void *p2){
   }
 }
 
+//Sorts the spectrum indexes gathered by getBoundaries/getBoundaries2 and resets only the buffer
+//entries that were flagged. The buffer must be all false on entry (set once in KAnalysis), so the
+//cost of each lookup scales with the number of precursors in the mass window, not the number of spectra.
+void KData::finalizeBoundaries(vector<int>& index, bool* buffer){
+  size_t i;
+  for(i=0;i<index.size();i++) buffer[index[i]]=false;
+  if(index.size()>1) qsort(&index[0],index.size(),sizeof(int),compareInt);
+}
+
+//Formats the top hits of one spectrum for every requested output. Runs on a worker thread, so
+//nothing is written to file here; see outputResults().
+void KData::formatResults(kSpecExport& e){
+
+  size_t d;
+  int i,j,k,n;
+  int count;
+  int iDupe;
+  int scoreIndex;
+  char peptide[256];
+  char tmp[16];
+  char specID[256];
+
+  kPeptide pep;
+  kPeptide pep2;
+  kPrecursor precursor;
+  kScoreCard tmpSC;
+  kScoreCard tmpSC2;
+  kResults res;
+
+  KDatabase& db=*e.db;
+  PXWSpectrumQuery& sq=e.sq;
+
+  bool bInter;
+  bool bDupe;
+
+  double topScore;
+
+  string tmpPep1;
+  string tmpPep2;
+  string dStr;
+
+  i=e.index;
+  e.diag=false;
+  e.query=false;
+  e.out.clear();
+  for(j=0;j<5;j++) e.perc[j].clear();
+  e.res.clear();
+  sq.clear();
+
+  res.baseName=*e.baseName;
+  dStr=params->decoy;
+
+  //update top hits so that a target result is always first among ties between targets and decoys
+  spec[i].refreshScore(db,dStr);
+
+  //Check if we need to output diagnostic information
+  if(params->diag->size()>0){
+    if(params->diag->at(0)==-1) {
+      e.diag=true;
+    } else {
+      for (d = 0; d<params->diag->size(); d++){
+        if (spec[i].getScanNumber() == params->diag->at(d)){
+          e.diag=true;
+          break;
+        }
+      }
+    }
+  }
+
+  scoreIndex=0;
+  tmpSC=spec[i].getScoreCard(scoreIndex);
+  res.scanNumber=spec[i].getScanNumber();
+  res.scanID=spec[i].getNativeID();
+  res.rTime=spec[i].getRTime();
+
+  //if there are no matches to the spectrum, return null result
+  if(tmpSC.simpleScore==0){
+    appendf(e.out,"%d\t%.4f\t0\t0\t0\t0\t0\t0\t999\t0\t999\t-\t-\t-\t-\t0\t999\t-\t-\t-\t-\t0\n",res.scanNumber,res.rTime);
+    return;
+  }
+
+  if(params->exportPepXML){
+    e.query=true;
+    sq.end_scan=res.scanNumber;
+    sq.retention_time_sec=res.rTime;
+    sq.start_scan=res.scanNumber;
+  }
+
+  //Export top scoring peptide, plus any ties that occur after it.
+  topScore=tmpSC.simpleScore;
+  count=0;
+  while(tmpSC.simpleScore==topScore){
+
+    count++;
+
+    //clear anything a previous hit could leave behind
+    res.linkSite2=-1;
+    res.n15Pep2=false;
+    res.mods2.clear();
+    res.xlMass=0;
+    res.xlLabel.clear();
+
+    //Get precursor ion for the PSM
+    precursor=spec[i].getPrecursor((int)tmpSC.precursor);
+    res.obsMass = precursor.monoMass;
+    res.charge  = precursor.charge;
+    res.ppm = (tmpSC.mass - precursor.monoMass) / precursor.monoMass*1e6;
+    res.psmMass = tmpSC.mass;
+    res.hk = precursor.corr;
+
+    if(params->exportPepXML){
+      sq.assumed_charge=res.charge;
+      sq.precursor_neutral_mass=res.obsMass;
+      sprintf(specID,"%s.%d.%d.%d",e.pepXMLName->c_str(),res.scanNumber,res.scanNumber,res.charge);
+      sq.spectrum=specID;
+    }
+
+    //grab the next highest score that matches to the same precursor ion for the delta score
+    //do not count ties - look for the first difference
+    //if no other match has the same precursor, just take the lowest score in the list
+    n=scoreIndex+1;
+    while(n<19){
+      tmpSC2=spec[i].getScoreCard(n++);
+      if(tmpSC2.simpleScore==0) break;
+      if(tmpSC2.simpleScore==topScore) continue;
+      if(tmpSC2.precursor!=tmpSC.precursor) continue;
+
+      //if peptides and link sites are the same, go to the next one
+      //this no longer applies to the top result. duplicates may occur among lower results
+      //if(tmpSC.link>-1 && tmpSC2.link>-1 && tmpSC2.pep1==tmpSC.pep1 && tmpSC2.pep2==tmpSC.pep2 && tmpSC2.k1==tmpSC.k1 && tmpSC2.k2==tmpSC.k2){
+      //  cout << "Oddity 1: " << spec[i].getScanNumber() << endl;
+      //  continue;
+      //}
+      break;
+    }
+    res.score       = tmpSC.simpleScore;
+    res.scoreDelta  = tmpSC.simpleScore-tmpSC2.simpleScore;
+    res.eVal        = tmpSC.eVal;
+    res.eVal1       = tmpSC.eVal1;
+    res.eVal2       = tmpSC.eVal2;
+    res.matches1    = tmpSC.matches1;
+    res.matches2    = tmpSC.matches2;
+    res.conFrag1    = tmpSC.conFrag1;
+    res.conFrag2    = tmpSC.conFrag2;
+    if(tmpSC.score1<tmpSC.score2) res.scorePepDif = tmpSC.score1;
+    else res.scorePepDif = tmpSC.score2;
+    
+    KTopPeps* tp = spec[i].getTopPeps((int)tmpSC.precursor);
+    res.rankA=0;
+    res.rankB=0;
+    for(int rank=1;rank<=tp->singletCount;rank++){
+      kSingletScoreCard& grr = tp->getSingletScoreCard(rank-1);
+      if(res.rankA==0 && tmpSC.pep1==grr.pep1 && tmpSC.score1==grr.simpleScore) res.rankA=rank;
+      if(res.rankB==0 && tmpSC.score2>grr.simpleScore) res.rankB=rank;
+    }
+    if(res.rankB==0) res.rankB=params->topCount;
+    res.rank        = res.rankA+res.rankB;
+    res.scoreA      = tmpSC.score1;
+    res.scoreB      = tmpSC.score2;
+    res.massA       = tmpSC.mass1;
+    res.massB       = tmpSC.mass2;
+
+    //Get the peptide sequence(s)
+    pep = db.getPeptide(tmpSC.pep1);
+    db.getPeptideSeq( pep.map[0].index,pep.map[0].start,pep.map[0].stop,peptide);
+    res.peptide1 = peptide;
+    res.mods1.clear();
+    res.cTerm1 = pep.cTerm;
+    res.nTerm1 = pep.nTerm;
+    res.linkSite1 = tmpSC.site1;
+    if(tmpSC.site2>-1) res.linkSite2=tmpSC.site2; //loop-link
+    res.n15Pep1 = pep.n15;
+    for(j=0;j<tmpSC.mods1->size();j++) res.mods1.push_back(tmpSC.mods1->at(j));
+    res.peptide2 = "";
+    if(tmpSC.pep2>=0){
+      pep2 = db.getPeptide(tmpSC.pep2);
+      db.getPeptideSeq( pep2.map[0].index,pep2.map[0].start,pep2.map[0].stop,peptide);
+      res.peptide2 = peptide;
+      res.cTerm2 = pep2.cTerm;
+      res.nTerm2 = pep2.nTerm;
+      res.linkSite2 = tmpSC.site2;
+      res.n15Pep2 = pep2.n15;
+      for(j=0;j<tmpSC.mods2->size();j++) res.mods2.push_back(tmpSC.mods2->at(j));
+    }
+
+    //Process the peptide
+    res.modPeptide1 = processPeptide(pep,tmpSC.mods1,db);      
+    res.modPeptide2 = "";
+    if(res.peptide2.size()>0){
+      res.modPeptide2=processPeptide(pep2,tmpSC.mods2,db);
+    }
+
+    //Get the link positions - relative to the peptide
+    res.link1 = tmpSC.k1;
+    res.link2 = tmpSC.k2;
+    if(res.link1>=0) res.link1++;
+    if(res.link2>=0) res.link2++;
+
+    //set link type
+    res.type=0;
+    if(tmpSC.k1>=0 && tmpSC.k2>=0) res.type=1;
+    if(tmpSC.pep1>=0 && tmpSC.pep2>=0) res.type=2;
+    if(res.type==2 && tmpSC.k1==-1 && tmpSC.k2==-1) res.type=3;
+
+    if(res.type>0 && res.type!=3) {
+      res.xlMass=link[tmpSC.link].mass;
+      res.xlLabel=link[tmpSC.link].label;
+    }
+
+    //Get the peptide indexes
+    res.pep1 = tmpSC.pep1;
+    res.pep2 = tmpSC.pep2;
+    res.linkable1 = tmpSC.linkable1;
+    res.linkable2 = tmpSC.linkable2;
+
+    //Edge case where single peptide is shared between linked and non-linked peptide lists
+    //This occurs when the peptide appears multiple times in a database: internally and on
+    //the c-terminus for amine reactive cross-linkers, for example.
+    bDupe=false;
+    if(res.type==0){
+      n=scoreIndex+1;
+      iDupe=1;
+      while(n<19){
+        iDupe++;
+        tmpSC2=spec[i].getScoreCard(n++);
+        if(tmpSC2.simpleScore==0) break;
+        if(tmpSC2.simpleScore!=topScore) break;
+
+        //if peptides are the same, but different lists (linked vs. non), use second peptide as location
+        if(tmpSC2.linkable1!=tmpSC.linkable1) {
+          pep = db.getPeptide(res.pep1);
+          db.getPeptideSeq(pep,tmpPep1);
+          pep2 = db.getPeptide(tmpSC2.pep1);
+          db.getPeptideSeq(pep2,tmpPep2);
+          if(tmpPep1.compare(tmpPep2)==0){
+            res.pep2=tmpSC2.pep1;
+            res.linkable2=tmpSC2.linkable1;
+            res.linkSite2=tmpSC2.site1;
+            bDupe=true;
+            break;
+          }
+        }
+      }
+    }
+
+    //Process the protein
+    processProtein(res.pep1, res.link1-1, res.linkSite1, res.protein1, res.protPos1, res.decoy1, db);
+    if (res.modPeptide2.size()>1) {
+      processProtein(res.pep2, res.link2-1, res.linkSite2, res.protein2, res.protPos2, res.decoy2, db);
+      if(res.decoy1 || res.decoy2) res.decoy=true;
+      else res.decoy=false;
+    } else if(res.linkSite2>-1){ //loop link special case.
+      processProtein(res.pep1, res.link2 - 1, res.linkSite2, res.protein2, res.protPos2, res.decoy2, db);
+      if(!res.decoy1 || !res.decoy2) res.decoy=false;
+      else res.decoy=true;
+    } else {
+      res.decoy=res.decoy1;
+    }
+
+    tmpPep1=res.peptide1;
+    sprintf(tmp,"(%d)",res.link1);
+    tmpPep1+=tmp;
+    tmpPep2 = res.peptide2;
+    sprintf(tmp, "(%d)", res.link2);
+    tmpPep2 += tmp;
+
+    //Export Results:
+    appendf(e.out,"%d",res.scanNumber);
+    //appendf(e.out, "\t%.4lf",res.hk); //this was for diagnostics of hardklor correlation results (or lack of)
+    appendf(e.out,"\t%.4f",res.rTime);
+    appendf(e.out,"\t%.4lf",res.obsMass);
+    appendf(e.out,"\t%d",res.charge);
+    appendf(e.out,"\t%.4lf",res.psmMass);
+    appendf(e.out,"\t%.4lf",res.ppm);
+    appendf(e.out,"\t%.4lf",res.score);
+    appendf(e.out,"\t%.4lf",res.scoreDelta);
+    appendf(e.out,"\t%.3e",res.eVal);
+    //appendf(e.out,"\t%.4lf",res.scorePepDif);
+    if (res.scoreA == 0)appendf(e.out, "\t%.4lf", res.score);
+    else appendf(e.out,"\t%.4lf",res.scoreA);
+    appendf(e.out,"\t%.3e",res.eVal1);
+    appendf(e.out,"\t%s",&res.modPeptide1[0]);
+    if(res.n15Pep1) appendf(e.out,"-15N");
+    appendf(e.out,"\t%d",res.link1);
+
+    //export protein
+    appendf(e.out, "\t%s", res.protein1.c_str());
+    /* not sure about this anymore - probably breaking something by removing it
+    if(bDupe){
+      pep = db.getPeptide(res.pep2);
+      for(j=0;j<pep.mapSize;j++){
+        appendf(e.out,"%s;",&db[pep.map[j].index].name[0]);
+        //if(res.link1>=0) appendf(e.out,"(%d);",pep.map[j].start+res.link1); //only non-linked peptides
+      }
+    }
+    */
+    if(res.link1>-1) appendf(e.out,"\t%s",res.protPos1.c_str());
+    else appendf(e.out,"\t-");
+
+    if(res.modPeptide2.size()>1) {
+      appendf(e.out, "\t%.4lf", res.scoreB);
+      appendf(e.out, "\t%.3e", res.eVal2);
+      appendf(e.out,"\t%s",&res.modPeptide2[0]);
+      if (res.n15Pep2) appendf(e.out, "-15N");
+      appendf(e.out,"\t%d",res.link2);
+      appendf(e.out,"\t%s",res.protein2.c_str());
+      appendf(e.out, "\t%s", res.protPos2.c_str());
+      if(tmpSC.link>-1)appendf(e.out,"\t%.4lf",link[tmpSC.link].mass);
+      else appendf(e.out,"\t0");
+    } else if(res.link2>-1){
+      appendf(e.out,"\t0\t999\t-\t%d\t-\t%s",res.link2,res.protPos2.c_str());
+      appendf(e.out,"\t%.4lf",link[tmpSC.link].mass);
+    } else {
+      appendf(e.out,"\t0\t999\t-\t-1\t-\t-\t0");
+    }
+    
+    appendf(e.out,"\n");
+
+    if(res.type==2){
+      bInter=true;
+      pep = db.getPeptide(res.pep1);
+      pep2 = db.getPeptide(res.pep2);
+      for(j=0;j<pep.mapSize;j++){
+        for(k=0;k<pep2.mapSize;k++){
+          if(pep.map[j].index==pep2.map[k].index){
+            bInter=false;
+            break;
+          }
+        }
+        if(!bInter) break;
+      }
+    }
+
+    if(params->exportMzID) e.res.push_back(res);
+    
+    if(params->exportPercolator) {
+      switch(res.type){
+        case 1:   outputPercolator(e.perc[2],db,res,count);   break;
+        case 2:
+          if(bInter)  outputPercolator(e.perc[1],db,res,count);
+          else        outputPercolator(e.perc[0],db,res,count);
+          break;
+        case 3:   outputPercolator(e.perc[4], db, res, count);  break;
+        default:  outputPercolator(e.perc[3],db,res,count); break;
+      }
+    }
+
+    if(params->exportPepXML){
+      outputPepXML(sq,db,res);
+    }
+
+    //Get the next entry - it must also be exported if it has the same score
+    if(bDupe) scoreIndex+=iDupe;
+    else scoreIndex++;
+    if(scoreIndex>=20) break;
+    tmpSC=spec[i].getScoreCard(scoreIndex);
+  }
+
+}
+
 int KData::getCharge(Spectrum& s, int index, int next){
   double mass;
 
@@ -2640,6 +2888,10 @@ int KData::getCharge(Spectrum& s, int index, int next){
 
 }
 
+bool KData::isCancelled(){
+  return cancel!=NULL && cancel->IsCancelled();
+}
+
 double KData::polynomialBestFit(vector<double>& x, vector<double>& y, vector<double>& coeff, int degree){
 	if(degree>3){
 		cout << "High order polynomials not supported with this function. Max=3" << endl;
@@ -2767,6 +3019,32 @@ double KData::polynomialBestFit(vector<double>& x, vector<double>& y, vector<dou
 
 }
 
+//Returns true if an MS2 spectrum must be centroided before processing. Conflicts between the data
+//and the parameters are logged if bLog is set.
+bool KData::needCentroid(Spectrum& s, bool bLog){
+  bool doCentroid=false;
+  switch(s.getCentroidStatus()){
+  case 0:
+    if(params->ms2Centroid) {
+      if(bLog){
+        char tmpStr[256];
+        sprintf(tmpStr,"Kojak parameter indicates MS/MS data are centroid, but spectrum %d labeled as profile.",s.getScanNumber());
+        klog->addError(string(tmpStr));
+      }
+    } else doCentroid=true;
+    break;
+  case 1:
+    if (bLog && !params->ms2Centroid) {
+      klog->addWarning(0, "Spectrum is labeled as centroid, but Kojak parameter indicates data are profile. Ignoring Kojak parameter.");
+    }
+    break;
+  default:
+    if(!params->ms2Centroid) doCentroid=true;
+    break;
+  }
+  return doCentroid;
+}
+
 //Takes relative path and finds absolute path
 bool KData::processPath(const char* in_path, char* out_path){
   char cwd[1024];
@@ -2835,7 +3113,7 @@ string KData::processPeptide(kPeptide& pep, vector<kPepMod>* mod, KDatabase& db)
   string seq = "";
   string peptide;
 
-  db.getPeptideSeq(pep.map->at(0).index, pep.map->at(0).start, pep.map->at(0).stop, peptide);
+  db.getPeptideSeq(pep.map[0].index, pep.map[0].start, pep.map[0].stop, peptide);
 
   if (pep.nTerm && aa.getFixedModMass('$') != 0) {
     sprintf(tmp, "n[%.2lf]", aa.getFixedModMass('$'));
@@ -2886,28 +3164,104 @@ void KData::processProtein(int pepIndex, int site, char linkSite, string& prot,
   db.getPeptideSeq(pepIndex,peps);
   prot.clear();
   sites.clear();
-  for (j = 0; j<pep.map->size(); j++){
+  for (j = 0; j<pep.mapSize; j++){
 
     //for linkage to n- or c- termini, skip protein if not those things
-    if(linkSite=='n' && pep.map->at(j).start>1) continue;
-    if (linkSite == 'c' && pep.map->at(j).stop < db[pep.map->at(j).index].sequence.size()-1) continue;
+    if(linkSite=='n' && pep.map[j].start>1) continue;
+    if (linkSite == 'c' && pep.map[j].stop < db[pep.map[j].index].sequence.size()-1) continue;
 
     if(prot.size()>0) prot+=";"; //add spacer if appending a prior protein
-    prot+=db[pep.map->at(j).index].name;
+    prot+=db[pep.map[j].index].name;
 
     if(site>-1){//add the protein site location
       if(sites.size()>0) sites+=";";
-      sprintf(tmp, "%d", pep.map->at(j).start + site+1); 
+      sprintf(tmp, "%d", pep.map[j].start + site+1); 
       sites+=tmp;
     }
 
     //determine if target (if it is currently still decoy)
     if(decoy){
-      if (db[pep.map->at(j).index].name.find(params->decoy) == string::npos) decoy=false;
+      if (db[pep.map[j].index].name.find(params->decoy) == string::npos) decoy=false;
+    }
+
+  }
+
+}
+
+//Converts a spectrum read from file into a KSpectrum: centroid, remove the precursor, collapse
+//isotope peaks, and keep the top N peaks, as requested in the parameters.
+void KData::processSpectrum(Spectrum& s, bool doCentroid, KSpectrum& pls){
+  Spectrum   c;
+  kSpecPoint sp;
+  float      max;
+  kPrecursor pre;
+  char       nStr[256];
+  int i,j;
+
+  pls.setRTime(s.getRTime());
+  pls.setScanNumber(s.getScanNumber());
+  s.getNativeID(nStr,256);
+  pls.setNativeID(string(nStr));
+  max=0;
+
+  //If not centroided, do so now.
+  if(doCentroid) centroid(s, c, params->ms2Resolution, params->instrument);
+  else c=s;
+
+  //remove precursor if requested
+  if(params->removePrecursor>0){
+    double pMin=s.getMZ()-params->removePrecursor;
+    double pMax=s.getMZ()+params->removePrecursor;
+    for(i=0;i<c.size();i++){
+      if(c[i].mz>pMin && c[i].mz<pMax) c[i].intensity=0;
     }
+  }
 
+  //Collapse the isotope peaks
+  if (params->specProcess == 1 && c.size()>1) collapseSpectrum(c);
+
+  //If user limits number of peaks to analyze, sort by intensity and take top N
+  if (params->maxPeaks>0){
+    if (c.size()>1) c.sortIntensityRev();
+    if (c.size()<params->maxPeaks) j = c.size();
+    else j = params->maxPeaks;
+  } else {
+    j = c.size();
+  }
+  for (i = 0; i<j; i++){
+    sp.mass = c[i].mz;
+    sp.intensity = c[i].intensity;
+    pls.addPoint(sp);
+    if (sp.intensity>max) max = sp.intensity;
+  }
+  pls.setMaxIntensity(max);
+
+  //Sort again by MZ, if needed
+  if (pls.size()>1 && params->maxPeaks>0) pls.sortMZ();
+
+  //Get any additional information user requested
+  pls.setCharge(s.getCharge());
+  pls.setMZ(s.getMZ());
+  if(params->preferPrecursor>0){
+    if(s.getMonoMZ()>0 && s.getCharge()>0){
+      pre.monoMass=s.getMonoMZ()*s.getCharge()-s.getCharge()*1.007276466;
+      pre.charge=s.getCharge();
+      pre.corr=0;
+      pls.addPrecursor(pre,params->topCount);
+      for(int px=1;px<=params->isotopeError;px++){
+        if(px==4) break;
+        pre.monoMass -= 1.00335483;
+        pre.corr -= 0.1;
+        pls.addPrecursor(pre, params->topCount);
+      }
+      pls.setInstrumentPrecursor(true);
+    }
   }
+}
 
+void KData::processSpectrumProc(kSpecReadStruct* s){
+  s->data->processSpectrum(s->s,s->centroid,*s->pls);
+  delete s;
 }
 
 void KData::writeMzIDDatabase(CMzIdentML& m, KDatabase& db){
@@ -2999,27 +3353,27 @@ bool KData::writeMzIDEnzyme(pxwBasicXMLTag t, CEnzymes& e){
 void KData::writeMzIDPE(CMzIdentML& m, CSpectrumIdentificationItem& m_sii, int pepID, KDatabase& db){
   //Add all proteins mapped by this peptide
   kPeptide pep = db.getPeptide(pepID);
-  for (size_t i = 0; i<pep.map->size(); i++){
-    if (pep.n15 && db[pep.map->at(i).index].name.find(params->n15Label) == string::npos) continue;
-    if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map->at(i).index].name.find(params->n15Label) != string::npos) continue;
+  for (size_t i = 0; i<pep.mapSize; i++){
+    if (pep.n15 && db[pep.map[i].index].name.find(params->n15Label) == string::npos) continue;
+    if (!pep.n15 && strlen(params->n15Label)>0 && db[pep.map[i].index].name.find(params->n15Label) != string::npos) continue;
 
     CDBSequence m_dbs;
-    if (db[pep.map->at(i).index].name.find(' ') == string::npos){
-      m_dbs = m.getDBSequenceByAcc(db[pep.map->at(i).index].name);
+    if (db[pep.map[i].index].name.find(' ') == string::npos){
+      m_dbs = m.getDBSequenceByAcc(db[pep.map[i].index].name);
     } else {
-      string pName = db[pep.map->at(i).index].name.substr(0, db[pep.map->at(i).index].name.find(' '));
+      string pName = db[pep.map[i].index].name.substr(0, db[pep.map[i].index].name.find(' '));
       m_dbs = m.getDBSequenceByAcc(pName);
     }
     char pre;
     char post;
     bool isDecoy;
-    if (pep.map->at(i).start<1) pre = '-';
-    else pre = db[pep.map->at(i).index].sequence[pep.map->at(i).start - 1];
-    if ((size_t)pep.map->at(i).stop + 1 == db[pep.map->at(i).index].sequence.size()) post = '-';
-    else post = db[pep.map->at(i).index].sequence[(size_t)pep.map->at(i).stop + 1];
-    isDecoy = db[pep.map->at(i).index].decoy;
+    if (pep.map[i].start<1) pre = '-';
+    else pre = db[pep.map[i].index].sequence[pep.map[i].start - 1];
+    if ((size_t)pep.map[i].stop + 1 == db[pep.map[i].index].sequence.size()) post = '-';
+    else post = db[pep.map[i].index].sequence[(size_t)pep.map[i].stop + 1];
+    isDecoy = db[pep.map[i].index].decoy;
 
-    m_sii.peptideEvidenceRef.push_back(m.addPeptideEvidence(m_dbs.id, m_sii.peptideRef, (int)pep.map->at(i).start + 1, (int)pep.map->at(i).stop + 1, pre, post, isDecoy));
+    m_sii.peptideEvidenceRef.push_back(m.addPeptideEvidence(m_dbs.id, m_sii.peptideRef, (int)pep.map[i].start + 1, (int)pep.map[i].stop + 1, pre, post, isDecoy));
   }
 }
 
@@ -3107,5 +3461,33 @@ std::string KData::writeMzIDSIP(CMzIdentML& m, string& sRef, KParams& par){
   return m_sip->id;
 }
 
+void KData::exportProc(kSpecExport* s){
+  s->data->formatResults(*s);
+}
 
+void KData::xCorrProc(kXCorrStruct* s){
+  s->spec->xCorrScore(s->xcorr);
+  delete s;
+}
 
+void KData::mapPrecursorsProc(kPrecursorWindow* s){
+  KData* d=s->data;
+  int i;
+  Threading::LockMutex(d->mutexPrecursor);
+  for(i=0;i<d->params->threads;i++){
+    if(!d->bPrecursorMem[i]){
+      d->bPrecursorMem[i]=true;
+      break;
+    }
+  }
+  Threading::UnlockMutex(d->mutexPrecursor);
+  if(i==d->params->threads){
+    cout << "Error in KData::mapPrecursorsProc" << endl;
+    exit(-1);
+  }
+  d->mapPrecursorWindow(s->start,s->stop,d->precursors[i]);
+  Threading::LockMutex(d->mutexPrecursor);
+  d->bPrecursorMem[i]=false;
+  Threading::UnlockMutex(d->mutexPrecursor);
+  delete s;
+}
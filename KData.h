@@ -26,8 +26,12 @@ limitations under the License.
 #include "MSReader.h"
 #include "mzIMLTools.h"
 #include "pepXMLWriter.h"
+#include "ThreadPool.h"
 #include <iostream>
 
+#define EXPORTBATCH 1024 //spectra formatted together before they are written to the result files
+#define READBATCH   1024 //spectra processed together before their peaks are dropped, when searching in shards
+
 /*
 #ifdef _MSC_VER
 #include <direct.h>
@@ -38,6 +42,43 @@ limitations under the License.
 #endif
 */
 
+class KData;
+
+//A spectrum read from file, waiting for a worker thread to process it into pls
+typedef struct kSpecReadStruct{
+  KData*              data;
+  bool                centroid;
+  MSToolkit::Spectrum s;
+  KSpectrum*          pls;
+} kSpecReadStruct;
+
+//A window of consecutive spectra for precursor mapping on one thread
+typedef struct kPrecursorWindow{
+  KData*  data;
+  int     start;
+  int     stop;
+} kPrecursorWindow;
+
+typedef struct kXCorrStruct{
+  KSpectrum*  spec;
+  bool        xcorr;
+} kXCorrStruct;
+
+//The exported results of one spectrum, formatted on a worker thread and written in scan order
+typedef struct kSpecExport{
+  KData*                data;
+  KDatabase*            db;
+  const std::string*    baseName;   //results file name, without its path
+  const std::string*    pepXMLName; //spectrum name prefix for pepXML
+  int                   index;      //spectrum
+  bool                  diag;       //write diagnostics for this spectrum
+  bool                  query;      //sq holds a spectrum query to write
+  std::string           out;        //lines for the .kojak.txt file
+  std::string           perc[5];    //Percolator rows: intra, inter, loop, single, dimer
+  std::vector<kResults> res;        //every exported hit, for mzID
+  PXWSpectrumQuery      sq;
+} kSpecExport;
+
 class KData {
 public:
 
@@ -49,11 +90,14 @@ public:
   KSpectrum& at(const int& i);
   KSpectrum* getSpectrum(const int& i);
 
+  int       buildShards       (int n);
   void      buildXLTable      ();
   bool      checkLink         (char p1Site, char p2Site, int linkIndex);
+  size_t    countPrecursors   (double mass1, double mass2);
   void      diagSinglet       ();
-  bool      getBoundaries     (double mass1, double mass2, std::vector<int>& index, bool* buffer);
-  bool      getBoundaries2    (double mass, double prec, std::vector<int>& index, bool* buffer);
+  void      freeShard         ();
+  bool      getBoundaries     (double mass1, double mass2, std::vector<int>& index, bool* buffer, std::vector<kMass>* ml=NULL);
+  bool      getBoundaries2    (double mass, double prec, std::vector<int>& index, bool* buffer, std::vector<kMass>* ml=NULL);
   int       getCounterMotif   (int motifIndex, int counterIndex);
   kLinker&  getLink           (int i);
   double    getMaxMass        ();
@@ -62,53 +106,82 @@ public:
   int       getMotifCount     ();
   int       getXLIndex        (int motifIndex, int xlIndex);
   char**    getXLTable        ();
+  bool      inShard           (int i);
   bool      mapPrecursors     ();
   void      outputDiagnostics (FILE* f, KSpectrum& s, KDatabase& db);
   bool      outputIntermediate(KDatabase& db);
   bool      outputMzID        (CMzIdentML& m, KDatabase& db, KParams& par, kResults& r);
   bool      outputPepXML      (PXWSpectrumQuery& p, KDatabase& db, kResults& r);
-  bool      outputPercolator  (FILE* f, KDatabase& db, kResults& r, int count);
+  bool      outputPercolator  (std::string& s, KDatabase& db, kResults& r, int count);
   bool      outputResults     (KDatabase& db, KParams& par);
   void      readLinkers       (char* fn);
+  bool      readShard         ();
   bool      readSpectra       ();
+  void      setCancel         (ThreadCancel* c);
   void      setLinker         (kLinker x);
   void      setLog            (KLog* c);
+  bool      setShard          (int s);
   void      setVersion        (const char* v);
   int       size              ();
   int       sizeLink          ();
-  void      xCorr             (bool b);
+  bool      xCorr             (bool b);
 
 private:
 
   //Data Members
   bool* bScans;
+  bool               bShardPeaks;  //peak lists are read one shard at a time; see readShard()
+  int                activeShard;  //-1 when all spectra are searched together
+  int                shardCount;
   char               version[32];
   char**             xlTable;
   std::vector<KSpectrum>  spec;
   std::vector<kLinker>    link;  //just cross-links, not mono-links
   std::vector<kMass>      massList;
+  std::vector<int>        specShard; //precursor mass shard of each spectrum
   kParams*           params;
   KIons              aa;
   kXLMotif           motifs[20]; //lets put a cap on this for now
   int                motifCount;
   kXLTarget          xlTargets[128][5]; //capping analysis at 5 crosslinkers for now
   KLog*              klog;
+  ThreadCancel*      cancel;  //raised to stop reading and transforming early; may be NULL
+
+  //Precursor mapping: one KPrecursor per thread, borrowed for a window at a time
+  KPrecursor**       precursors;
+  bool*              bPrecursorMem;
+  Mutex              mutexPrecursor;
 
   //Utilities
+  void        addSpectra        (std::vector<KSpectrum*>& v);
+  static void appendf           (std::string& s, const char* fmt, ...);
+  void        buildMassList     ();
   void        centroid(MSToolkit::Spectrum& s, MSToolkit::Spectrum& out, double resolution, int instrument = 0);
   void        collapseSpectrum(MSToolkit::Spectrum& s);
   static int  compareInt        (const void *p1, const void *p2);
   static int  compareMassList   (const void *p1, const void *p2);
+  void        finalizeBoundaries(std::vector<int>& index, bool* buffer);
+  void        formatResults     (kSpecExport& e);
   int         getCharge(MSToolkit::Spectrum& s, int index, int next);
+  bool        isCancelled       ();
+  void        mapPrecursorWindow(int start, int stop, KPrecursor* kp);
+  bool        needCentroid      (MSToolkit::Spectrum& s, bool bLog);
   double      polynomialBestFit (std::vector<double>& x, std::vector<double>& y, std::vector<double>& coeff, int degree=2);
   bool        processPath       (const char* in_path, char* out_path);
   std::string processPeptide    (kPeptide& pep, std::vector<kPepMod>* mod, KDatabase& db);
   void        processProtein    (int pepIndex, int site, char linkSite, std::string& prot, std::string& sites, bool& decoy, KDatabase& db);
+  void        processSpectrum   (MSToolkit::Spectrum& s, bool doCentroid, KSpectrum& pls);
   void        writeMzIDDatabase (CMzIdentML& m, KDatabase& db);
   bool        writeMzIDEnzyme   (pxwBasicXMLTag t, CEnzymes& e);
   void        writeMzIDPE       (CMzIdentML& m, CSpectrumIdentificationItem& m_sii, int pepID, KDatabase& db);
   std::string writeMzIDSIP      (CMzIdentML& m, std::string& sRef, KParams& par);
 
+  //Thread-start functions
+  static void exportProc          (kSpecExport* s);
+  static void mapPrecursorsProc   (kPrecursorWindow* s);
+  static void processSpectrumProc (kSpecReadStruct* s);
+  static void xCorrProc           (kXCorrStruct* s);
+
 };
 
 
@@ -0,0 +1,101 @@
+/*
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "KDecoyTable.h"
+
+using namespace std;
+
+KDecoyTable::KDecoyTable(){
+  decoySz=0;
+  seriesSz=0;
+}
+
+//The bins are computed exactly as KSpectrum did for each decoy, so the scores are unchanged.
+void KDecoyTable::build(kParams& p, KDecoys& d){
+  int i,j,n,z;
+  int key;
+  size_t a,b;
+  double m;
+  double mz;
+  double invBinSize=1.0/p.binSize;
+
+  //precompute which ion series to use
+  seriesSz=0;
+  for (i = 0; i<6; i++){
+    if (p.ionSeries[i]) {
+      if (i<3) {
+        series[seriesSz].b = true;
+        if (i == 0) series[seriesSz++].mass = -27.9949141;
+        else if (i == 1) series[seriesSz++].mass = 0;
+        else series[seriesSz++].mass = 17.026547;
+      } else {
+        series[seriesSz].b = false;
+        if (i == 3) series[seriesSz++].mass = 25.9792649;
+        else if (i == 4) series[seriesSz++].mass = 0;
+        else series[seriesSz++].mass = -16.0187224;
+      }
+    }
+  }
+
+  decoySz=d.decoySize;
+  masses.resize((size_t)decoySz*seriesSz*MAX_DECOY_PEP_LEN);
+  keys.resize(masses.size()*DECOYCHARGES);
+  pos.resize(keys.size());
+
+  for(i=0;i<decoySz;i++){
+    for(n=0;n<seriesSz;n++){
+      a=((size_t)i*seriesSz+n)*MAX_DECOY_PEP_LEN;
+      for(j=0;j<MAX_DECOY_PEP_LEN;j++){
+        if(series[n].b) m = d.decoyIons[i].pdIonsN[j] + series[n].mass;
+        else m = d.decoyIons[i].pdIonsC[j] + series[n].mass;
+        masses[a+j]=m;
+        for(z=1;z<=DECOYCHARGES;z++){
+          mz = (m + (z - 1)*1.007276466) / z;
+          mz = p.binSize * (int)(mz*invBinSize + p.binOffset);
+          key = (int)mz;
+          b=(a*DECOYCHARGES)+(z-1)*MAX_DECOY_PEP_LEN+j;
+          keys[b]=key;
+          pos[b]=(short)((mz - key)*invBinSize);
+        }
+      }
+    }
+  }
+}
+
+void KDecoyTable::clear(){
+  decoySz=0;
+  vector<double>().swap(masses);
+  vector<int>().swap(keys);
+  vector<short>().swap(pos);
+}
+
+const int* KDecoyTable::getKey(int decoy, int series, int z){
+  return &keys[(((size_t)decoy*seriesSz+series)*DECOYCHARGES+z-1)*MAX_DECOY_PEP_LEN];
+}
+
+const double* KDecoyTable::getMass(int decoy, int series){
+  return &masses[((size_t)decoy*seriesSz+series)*MAX_DECOY_PEP_LEN];
+}
+
+const short* KDecoyTable::getPos(int decoy, int series, int z){
+  return &pos[(((size_t)decoy*seriesSz+series)*DECOYCHARGES+z-1)*MAX_DECOY_PEP_LEN];
+}
+
+sDecoyIons& KDecoyTable::getSeries(int i){
+  return series[i];
+}
+
+int KDecoyTable::seriesCount(){
+  return seriesSz;
+}
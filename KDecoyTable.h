@@ -0,0 +1,59 @@
+/*
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _KDECOYTABLE_H
+#define _KDECOYTABLE_H
+
+#include "CometDecoys.h"
+#include "KStructs.h"
+#include <vector>
+
+#define DECOYCHARGES 3  //fragment charges scored for decoys; precursor charge is capped at 4
+
+//a small structure for defining which ions (a,b,c,x,y,z) to compute for decoys
+typedef struct sDecoyIons{
+  bool b;
+  double mass;
+} sDecoyIons;
+
+//Comet's decoy fragment ions for every ion series in use, each with the kojakArray key and
+//position it bins to at charges 1 to 3. The bins depend only on the parameters, so they are
+//computed once per run instead of for every spectrum. Fragments are stored by decoy, then series,
+//then charge, with MAX_DECOY_PEP_LEN entries in each.
+class KDecoyTable{
+public:
+
+  KDecoyTable();
+
+  void          build       (kParams& p, KDecoys& d);
+  void          clear       ();
+  const int*    getKey      (int decoy, int series, int z);
+  const double* getMass     (int decoy, int series);
+  const short*  getPos      (int decoy, int series, int z);
+  sDecoyIons&   getSeries   (int series);
+  int           seriesCount ();
+
+private:
+
+  int         decoySz;
+  int         seriesSz;
+  sDecoyIons  series[6];
+
+  std::vector<double> masses; //fragment neutral masses, ion series offset included
+  std::vector<int>    keys;
+  std::vector<short>  pos;
+
+};
+
+#endif
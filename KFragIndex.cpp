@@ -0,0 +1,172 @@
+/*
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "KFragIndex.h"
+
+using namespace std;
+
+KFragIndex::KFragIndex(){
+  binCount=0;
+  binWidth=1;
+  threadCount=0;
+  binStart=NULL;
+  postings=NULL;
+  counts=NULL;
+  touched=NULL;
+}
+
+KFragIndex::~KFragIndex(){
+  clear();
+}
+
+kFragCandidate& KFragIndex::operator[](const int& i){
+  return cand[i];
+}
+
+void KFragIndex::addCandidate(kFragCandidate& c){
+  cand.push_back(c);
+}
+
+//Adds a fragment bin to the most recently added candidate
+void KFragIndex::addFragment(int key, int pos){
+  kFragPosting p;
+  p.bin=key*binWidth+pos;
+  p.cand=(int)cand.size()-1;
+  tmpPostings.push_back(p);
+}
+
+//Call after finalize(), once the number of candidates is known
+void KFragIndex::allocate(int threads){
+  int i;
+  size_t j;
+  freeCounts();
+  threadCount=threads;
+  counts = new unsigned short*[threadCount];
+  touched = new vector<int>[threadCount];
+  for(i=0;i<threadCount;i++){
+    counts[i] = new unsigned short[cand.size()];
+    for(j=0;j<cand.size();j++) counts[i][j]=0;
+  }
+}
+
+void KFragIndex::clear(){
+  freeCounts();
+  if(binStart!=NULL) delete [] binStart;
+  if(postings!=NULL) delete [] postings;
+  binStart=NULL;
+  postings=NULL;
+  binCount=0;
+  vector<kFragCandidate>().swap(cand);
+  vector<kFragPosting>().swap(tmpPostings);
+}
+
+//Groups the postings by fragment bin. Postings were added in candidate order, so each bin's
+//candidates remain sorted.
+void KFragIndex::finalize(){
+  size_t i;
+  int j;
+
+  if(binStart!=NULL) delete [] binStart;
+  if(postings!=NULL) delete [] postings;
+
+  binCount=0;
+  for(i=0;i<tmpPostings.size();i++){
+    if(tmpPostings[i].bin>=binCount) binCount=tmpPostings[i].bin+1;
+  }
+
+  binStart = new size_t[binCount+1];
+  for(j=0;j<=binCount;j++) binStart[j]=0;
+  for(i=0;i<tmpPostings.size();i++) binStart[tmpPostings[i].bin+1]++;
+  for(j=0;j<binCount;j++) binStart[j+1]+=binStart[j];
+
+  postings = new int[tmpPostings.size()];
+  size_t* next = new size_t[binCount];
+  for(j=0;j<binCount;j++) next[j]=binStart[j];
+  for(i=0;i<tmpPostings.size();i++) postings[next[tmpPostings[i].bin]++]=tmpPostings[i].cand;
+  delete [] next;
+
+  vector<kFragPosting>().swap(tmpPostings);
+}
+
+//Counts, for every candidate, the unshifted fragments that land on a peak in the spectrum. Candidates
+//with at least minMatch fragments are returned in ascending order, which keeps each peptide's link
+//sites and ion sets together.
+void KFragIndex::getCandidates(KSpectrum* s, int thread, int minMatch, vector<int>& v){
+  int key,pos,bin;
+  int keyCount;
+  char* b;
+  size_t i;
+  unsigned short* c=counts[thread];
+  vector<int>& t=touched[thread];
+
+  v.clear();
+  t.clear();
+
+  keyCount=binCount/binWidth+1;
+  if(keyCount>s->kojakArray.bins) keyCount=s->kojakArray.bins;
+
+  for(key=0;key<keyCount;key++){
+    b=s->kojakArray.bucket(key);
+    if(b==NULL) continue;
+    for(pos=0;pos<binWidth;pos++){
+      if(b[pos]<=5) continue; //same peak threshold as a match in kojakScoring
+      bin=key*binWidth+pos;
+      if(bin>=binCount) break;
+      for(i=binStart[bin];i<binStart[bin+1];i++){
+        if(c[postings[i]]==0) t.push_back(postings[i]);
+        if(c[postings[i]]<65535) c[postings[i]]++;
+      }
+    }
+  }
+
+  for(i=0;i<t.size();i++){
+    if(c[t[i]]>=minMatch) v.push_back(t[i]);
+    c[t[i]]=0;
+  }
+  if(v.size()>1) qsort(&v[0],v.size(),sizeof(int),compareInt);
+}
+
+//Must match the key width of KSpectrum::kojakArray
+void KFragIndex::setBinWidth(double binSize){
+  binWidth=(int)(1.0/binSize)+1;
+}
+
+size_t KFragIndex::size(){
+  return cand.size();
+}
+
+size_t KFragIndex::sizePostings(){
+  if(binStart==NULL) return tmpPostings.size();
+  return binStart[binCount];
+}
+
+void KFragIndex::freeCounts(){
+  int i;
+  if(counts!=NULL){
+    for(i=0;i<threadCount;i++) delete [] counts[i];
+    delete [] counts;
+  }
+  if(touched!=NULL) delete [] touched;
+  counts=NULL;
+  touched=NULL;
+  threadCount=0;
+}
+
+int KFragIndex::compareInt(const void *p1, const void *p2){
+  const int d1 = *(int *)p1;
+  const int d2 = *(int *)p2;
+  if(d1<d2) return -1;
+  else if(d1>d2) return 1;
+  else return 0;
+}
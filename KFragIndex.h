@@ -0,0 +1,76 @@
+/*
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _KFRAGINDEX_H
+#define _KFRAGINDEX_H
+
+#include "KSpectrum.h"
+#include <vector>
+
+//A singlet candidate: one ion set of a peptide, linked at site k
+typedef struct kFragCandidate{
+  int     pep;      //index into the peptide list
+  int     set;      //ion set index after buildSingletIons(k) and modIonsRec2()
+  char    k;        //link position on the peptide
+  double  lowMass;  //precursor masses this candidate can explain, including ppm tolerance
+  double  highMass;
+} kFragCandidate;
+
+typedef struct kFragPosting{
+  int bin;
+  int cand;
+} kFragPosting;
+
+//Inverted index of the fragment ions that do not carry the linked partner. Postings are grouped by
+//fragment bin (key * binWidth + pos, the same addressing as KSpectrum::kojakArray) so that a
+//spectrum collects its candidates by walking its peaks instead of scoring every peptide in range.
+class KFragIndex{
+public:
+
+  KFragIndex();
+  ~KFragIndex();
+
+  kFragCandidate& operator[](const int& i);
+
+  void    addCandidate  (kFragCandidate& c);
+  void    addFragment   (int key, int pos);
+  void    allocate      (int threads);
+  void    clear         ();
+  void    finalize      ();
+  void    getCandidates (KSpectrum* s, int thread, int minMatch, std::vector<int>& v);
+  void    setBinWidth   (double binSize);
+  size_t  size          ();
+  size_t  sizePostings  ();
+
+private:
+
+  int     binCount;
+  int     binWidth;
+  int     threadCount;
+  size_t* binStart;     //binCount+1 offsets into postings
+  int*    postings;     //candidate indexes, grouped by bin
+
+  std::vector<kFragCandidate> cand;
+  std::vector<kFragPosting>   tmpPostings; //unsorted postings until finalize()
+
+  unsigned short**  counts;   //per-thread fragment match counts for every candidate
+  std::vector<int>* touched;  //per-thread list of candidates with nonzero counts
+
+  void freeCounts();
+
+  static int compareInt(const void *p1, const void *p2);
+
+};
+
+#endif
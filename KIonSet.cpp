@@ -34,6 +34,9 @@ KIonSet::KIonSet(){
   nTermMass=0;
   cTermMass=0;
   index=false;
+  soaMz=NULL;
+  soaKey=NULL;
+  soaPos=NULL;
 }
 
 KIonSet::KIonSet(const KIonSet& k){
@@ -68,6 +71,10 @@ KIonSet::KIonSet(const KIonSet& k){
   nTermMass=k.nTermMass;
   cTermMass=k.cTermMass;
   index=k.index;
+  soaMz=NULL;
+  soaKey=NULL;
+  soaPos=NULL;
+  copySoA(k);
 }
   
 KIonSet::~KIonSet(){
@@ -110,10 +117,25 @@ KIonSet& KIonSet::operator=(const KIonSet& k){
     nTermMass = k.nTermMass;
     cTermMass = k.cTermMass;
     index=k.index;
+    copySoA(k);
   }
   return *this;
 }
 
+void KIonSet::copySoA(const KIonSet& k){
+  int i;
+  freeSoA();
+  if(k.soaMz==NULL) return;
+  soaMz = new double[24*len];
+  soaKey = new int[24*len];
+  soaPos = new int[24*len];
+  for(i=0;i<24*len;i++){
+    soaMz[i]=k.soaMz[i];
+    soaKey[i]=k.soaKey[i];
+    soaPos[i]=k.soaPos[i];
+  }
+}
+
 void KIonSet::freeMem(){
   for (int j = 0; j<4; j++){
     delete[] aIons[j];
@@ -130,10 +152,20 @@ void KIonSet::freeMem(){
   delete[] yIons;
   delete[] zIons;
   delete[] mods;
+  freeSoA();
+}
+
+void KIonSet::freeSoA(){
+  if(soaMz!=NULL) delete[] soaMz;
+  if(soaKey!=NULL) delete[] soaKey;
+  if(soaPos!=NULL) delete[] soaPos;
+  soaMz=NULL;
+  soaKey=NULL;
+  soaPos=NULL;
 }
 
 void KIonSet::makeIndex(double binSize, double binOffset, bool a, bool b, bool c, bool x, bool y, bool z){
-  int i,j;
+  int i,j,s,off;
   double mz;
   double invBinSize = 1.0/binSize;
   for(i=0;i<len;i++){
@@ -171,11 +203,30 @@ void KIonSet::makeIndex(double binSize, double binOffset, bool a, bool b, bool c
       }
     }
   }
+
+  //refresh the kernel's copy of the ions
+  kISValue** series[6]={aIons,bIons,cIons,xIons,yIons,zIons};
+  if(soaMz==NULL){
+    soaMz = new double[24*len];
+    soaKey = new int[24*len];
+    soaPos = new int[24*len];
+  }
+  for(s=0;s<6;s++){
+    for(j=0;j<4;j++){
+      off=(s*4+j)*len;
+      for(i=0;i<len;i++){
+        soaMz[off+i]=series[s][j][i].mz;
+        soaKey[off+i]=series[s][j][i].key;
+        soaPos[off+i]=series[s][j][i].pos;
+      }
+    }
+  }
   index=true;
 }
 
 void KIonSet::setIons(int sz, double m){
   freeMem();
+  index=false;
 
   int i, j;
   len = sz;
@@ -37,8 +37,16 @@ public:
   int     len;
   bool    index;
 
+  //Structure-of-arrays copy of all ions for the scoring kernel, made by makeIndex. Series a,b,c,x,y,z
+  //are 0-5; the values for series s at charge z start at (s*4+z)*len.
+  double* soaMz;
+  int*    soaKey;
+  int*    soaPos;
+
 private:
+  void copySoA(const KIonSet& k);
   void freeMem();
+  void freeSoA();
 };
 
 #endif
\ No newline at end of file
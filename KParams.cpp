@@ -254,6 +254,11 @@ void KParams::parse(const char* cmd) {
     strcpy(params->dbFile,&values[0][0]);
     logParam("database",values[0]);
 
+  } else if(strcmp(param,"database_cache")==0){
+    if(atoi(&values[0][0])!=0) params->dbCache=true;
+    else params->dbCache=false;
+    logParam("database_cache",values[0]);
+
   } else if(strcmp(param,"diagnostic")==0){  //a value of -1 means diagnose all spectra, overriding any existing or following spectrum specifications
     if (atoi(&values[0][0])==-1) params->diag->clear();
     params->diag->push_back(atoi(&values[0][0]));
@@ -586,6 +591,13 @@ void KParams::parse(const char* cmd) {
     xml.value = values[0];
     logParam(xml);
 
+  } else if(strcmp(param,"precursor_shards")==0) {
+    params->precursorShards=atoi(&values[0][0]);
+    if(params->precursorShards<1) params->precursorShards=1;
+    xml.name = "precursor_shards";
+    xml.value = values[0];
+    logParam(xml);
+
   } else if(strcmp(param,"prefer_precursor_pred")==0){
     params->preferPrecursor=atoi(&values[0][0]);
     xml.name = "prefer_precursor_pred";
@@ -619,6 +631,27 @@ void KParams::parse(const char* cmd) {
     xml.value = values[0];
     logParam(xml);
 
+  } else if(strcmp(param,"single_pass")==0) {
+    if(atoi(&values[0][0])==0) params->singlePass=false;
+    else params->singlePass=true;
+    xml.name = "single_pass";
+    xml.value = values[0];
+    logParam(xml);
+
+  } else if(strcmp(param,"singlet_index")==0) {
+    params->singletIndex=atoi(&values[0][0]);
+    if(params->singletIndex<0) params->singletIndex=0;
+    xml.name = "singlet_index";
+    xml.value = values[0];
+    logParam(xml);
+
+  } else if(strcmp(param,"spectrum_centric")==0) {
+    if(atoi(&values[0][0])==0) params->specCentric=false;
+    else params->specCentric=true;
+    xml.name = "spectrum_centric";
+    xml.value = values[0];
+    logParam(xml);
+
   } else if(strcmp(param,"spectrum_processing")==0) {
     params->specProcess=atoi(&values[0][0]);
     xml.name = "spectrum_processing";
@@ -0,0 +1,223 @@
+/*
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "KScheduler.h"
+
+using namespace std;
+
+KScheduler::KScheduler(int threads){
+  int i;
+  if(threads<1) threads=1;
+  threadCount=threads;
+  bQuit=false;
+  cancel=NULL;
+  proc=NULL;
+  progress=NULL;
+  data=NULL;
+  total=0;
+  complete=0;
+  Threading::CreateMutex(&mutexComplete);
+  workers = new kWorker[threadCount];
+  for(i=0;i<threadCount;i++){
+    workers[i].sched=this;
+    workers[i].thread=i;
+    workers[i].head=0;
+    workers[i].tail=0;
+    Threading::CreateMutex(&workers[i].mutex);
+    Threading::CreateSemaphore(&workers[i].wake);
+    Threading::CreateSemaphore(&workers[i].done);
+  }
+  for(i=1;i<threadCount;i++) Threading::BeginThread(workerProc,&workers[i],&workers[i].id);
+}
+
+KScheduler::~KScheduler(){
+  int i;
+  bQuit=true;
+  for(i=1;i<threadCount;i++) Threading::SignalSemaphore(workers[i].wake);
+  for(i=1;i<threadCount;i++) Threading::WaitSemaphore(workers[i].done);
+  for(i=0;i<threadCount;i++){
+    Threading::DestroyMutex(workers[i].mutex);
+    Threading::DestroySemaphore(workers[i].wake);
+    Threading::DestroySemaphore(workers[i].done);
+  }
+  Threading::DestroyMutex(mutexComplete);
+  delete [] workers;
+}
+
+//Runs proc on every item and returns when all are done. If cost is given (one value per item), the
+//costliest items are started first. Returns false if the run was cancelled before every item ran.
+bool KScheduler::run(kWorkProc p, void* d, vector<size_t>& items, vector<double>* cost, kProgressProc prog){
+  size_t i;
+  int t;
+  vector<kWorkItem> v;
+  kWorkItem w;
+
+  proc=p;
+  data=d;
+  progress=prog;
+  total=items.size();
+  complete=0;
+
+  for(t=0;t<threadCount;t++){
+    workers[t].items.clear();
+    workers[t].items.reserve(total/threadCount+1);
+  }
+  if(cost!=NULL){
+    v.reserve(total);
+    for(i=0;i<total;i++){
+      w.cost=cost->at(i);
+      w.item=items[i];
+      v.push_back(w);
+    }
+    if(v.size()>1) qsort(&v[0],v.size(),sizeof(kWorkItem),compareCost);
+    for(i=0;i<total;i++) workers[i%threadCount].items.push_back(v[i].item);
+  } else {
+    for(i=0;i<total;i++) workers[i%threadCount].items.push_back(items[i]);
+  }
+  for(t=0;t<threadCount;t++){
+    workers[t].head=0;
+    workers[t].tail=workers[t].items.size();
+  }
+
+  for(t=1;t<threadCount;t++) Threading::SignalSemaphore(workers[t].wake);
+  work(0);
+  for(t=1;t<threadCount;t++) Threading::WaitSemaphore(workers[t].done);
+
+  proc=NULL;
+  data=NULL;
+  progress=NULL;
+  return complete==total;
+}
+
+void KScheduler::setCancel(ThreadCancel* c){
+  cancel=c;
+}
+
+int KScheduler::size(){
+  return threadCount;
+}
+
+//Takes the next chunk of the worker's own list. Chunks start at an eighth of the list and shrink
+//as it empties, so the items left to steal at the end are small.
+bool KScheduler::nextChunk(int thread, size_t& start, size_t& stop){
+  kWorker& w=workers[thread];
+  bool bOK=false;
+  Threading::LockMutex(w.mutex);
+  if(w.head<w.tail){
+    start=w.head;
+    stop=start+(w.tail-w.head)/8+1;
+    w.head=stop;
+    bOK=true;
+  }
+  Threading::UnlockMutex(w.mutex);
+  return bOK;
+}
+
+//Moves the back half of the longest remaining list to this worker. Returns false when every
+//list is empty.
+bool KScheduler::steal(int thread){
+  int i;
+  int victim;
+  size_t n;
+  size_t most;
+  vector<size_t> v;
+
+  while(true){
+    victim=-1;
+    most=0;
+    for(i=0;i<threadCount;i++){
+      if(i==thread) continue;
+      Threading::LockMutex(workers[i].mutex);
+      n=workers[i].tail-workers[i].head;
+      Threading::UnlockMutex(workers[i].mutex);
+      if(n>most){
+        most=n;
+        victim=i;
+      }
+    }
+    if(victim<0) return false;
+
+    kWorker& w=workers[victim];
+    Threading::LockMutex(w.mutex);
+    if(w.head<w.tail){
+      n=(w.tail-w.head+1)/2;
+      v.assign(w.items.begin()+(w.tail-n),w.items.begin()+w.tail);
+      w.tail-=n;
+    }
+    Threading::UnlockMutex(w.mutex);
+    if(v.size()>0) break; //otherwise the victim finished first; look again
+  }
+
+  kWorker& w=workers[thread];
+  Threading::LockMutex(w.mutex);
+  w.items.swap(v);
+  w.head=0;
+  w.tail=w.items.size();
+  Threading::UnlockMutex(w.mutex);
+  return true;
+}
+
+void KScheduler::work(int thread){
+  size_t i;
+  size_t start;
+  size_t stop;
+  size_t done;
+  kWorker& w=workers[thread];
+
+  while(true){
+    if(cancel!=NULL && cancel->IsCancelled()) break;
+    if(!nextChunk(thread,start,stop)){
+      if(!steal(thread)) break;
+      continue;
+    }
+    for(i=start;i<stop;i++){
+      if(cancel!=NULL && cancel->IsCancelled()) break;
+      proc(data,w.items[i],thread);
+    }
+
+    Threading::LockMutex(mutexComplete);
+    complete+=i-start;
+    done=complete;
+    Threading::UnlockMutex(mutexComplete);
+    if(thread==0 && progress!=NULL) progress(data,done,total);
+  }
+}
+
+//==============================
+//  Thread-start functions
+//==============================
+void* KScheduler::workerProc(void* w){
+  kWorker* k=(kWorker*)w;
+  while(true){
+    Threading::WaitSemaphore(k->wake);
+    if(k->sched->bQuit) break;
+    k->sched->work(k->thread);
+    Threading::SignalSemaphore(k->done);
+  }
+  Threading::SignalSemaphore(k->done);
+  return NULL;
+}
+
+//==============================
+//  Utility Functions
+//==============================
+int KScheduler::compareCost(const void *p1, const void *p2){ //sort high to low, then by item
+  const kWorkItem* d1 = (kWorkItem *)p1;
+  const kWorkItem* d2 = (kWorkItem *)p2;
+  if(d1->cost<d2->cost) return 1;
+  else if(d1->cost>d2->cost) return -1;
+  else if(d1->item<d2->item) return -1;
+  else if(d1->item>d2->item) return 1;
+  return 0;
+}
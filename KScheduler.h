@@ -0,0 +1,87 @@
+/*
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _KSCHEDULER_H
+#define _KSCHEDULER_H
+
+#include "Threading.h"
+#include <cstdlib>
+#include <vector>
+
+//proc is called once for every work item. thread (0 to threads-1) identifies the worker, so
+//per-thread buffers can be used without claiming them first. progress is only called on the
+//calling thread.
+typedef void (*kWorkProc)    (void* data, size_t item, int thread);
+typedef void (*kProgressProc)(void* data, size_t done, size_t total);
+
+class KScheduler;
+
+typedef struct kWorkItem{
+  double  cost;
+  size_t  item;
+} kWorkItem;
+
+typedef struct kWorker{
+  KScheduler*         sched;
+  int                 thread;
+  size_t              head;   //next item to run
+  size_t              tail;   //one past the last item; thieves take from here
+  std::vector<size_t> items;
+  Mutex               mutex;  //protects head, tail, and items
+  Semaphore           wake;
+  Semaphore           done;
+  ThreadId            id;
+} kWorker;
+
+//Persistent worker threads that share out a list of work items. Items are dealt to the workers
+//from most to least costly. Each worker takes shrinking chunks from the front of its own list, and
+//a worker that runs out steals half of what remains at the back of the longest list. The calling
+//thread is worker 0, so a scheduler for n threads starts n-1 threads of its own. If a cancel flag
+//is set, workers stop between items once it is raised and run() returns false.
+class KScheduler{
+public:
+
+  KScheduler(int threads);
+  ~KScheduler();
+
+  bool run       (kWorkProc p, void* d, std::vector<size_t>& items, std::vector<double>* cost=NULL, kProgressProc prog=NULL);
+  void setCancel (ThreadCancel* c);
+  int  size      ();
+
+private:
+
+  int           threadCount;
+  bool          bQuit;
+  kWorker*      workers;
+  ThreadCancel* cancel;
+
+  kWorkProc     proc;
+  kProgressProc progress;
+  void*         data;
+  size_t        total;
+  size_t        complete;
+  Mutex         mutexComplete;
+
+  bool nextChunk (int thread, size_t& start, size_t& stop);
+  bool steal     (int thread);
+  void work      (int thread);
+
+  //Thread-start functions
+  static void* workerProc (void* w);
+
+  static int compareCost (const void *p1, const void *p2);
+
+};
+
+#endif
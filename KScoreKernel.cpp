@@ -0,0 +1,244 @@
+/*
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "KScoreKernel.h"
+#include <cstddef>
+
+//Vector kernels are built with per-function target attributes, so the rest of the program does not
+//need any special compiler flags. Other compilers and platforms use the scalar kernel. Contraction
+//into fused multiply-adds is disabled because it changes the rounding of the bin calculation.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KSCOREKERNEL_X86
+#define KSCOREKERNEL_TARGET(x) __attribute__((target(x),optimize("fp-contract=off")))
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define KSCOREKERNEL_SCALAR __attribute__((optimize("fp-contract=off")))
+#else
+#define KSCOREKERNEL_SCALAR
+#endif
+
+KScoreKernel::binFunc KScoreKernel::binIons=KScoreKernel::binIonsScalar;
+const char*           KScoreKernel::name="scalar";
+
+//Selects the widest kernel supported by the CPU (and operating system)
+void KScoreKernel::init(){
+#ifdef KSCOREKERNEL_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")){
+    binIons=binIonsAVX512;
+    name="AVX-512";
+    return;
+  }
+  if(__builtin_cpu_supports("avx2")){
+    binIons=binIonsAVX2;
+    name="AVX2";
+    return;
+  }
+  if(__builtin_cpu_supports("sse4.2")){
+    binIons=binIonsSSE42;
+    name="SSE4.2";
+    return;
+  }
+#endif
+  binIons=binIonsScalar;
+  name="scalar";
+}
+
+const char* KScoreKernel::getName(){
+  return name;
+}
+
+//Matches the original kojakScoring loop: a bin beyond the spectrum ends the series, empty bins
+//break a run of consecutive fragments, and a run still open at the end of the series is not counted.
+void KScoreKernel::score(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, const kKojakArray& spec, int& sum, int& match, int& conFrag, int con){
+  int outKey[KERNELCHUNK];
+  int outPos[KERNELCHUNK];
+  int c,i,sz;
+  char v;
+
+  for(c=0;c<n;c+=KERNELCHUNK){
+    sz=n-c;
+    if(sz>KERNELCHUNK) sz=KERNELCHUNK;
+    binIons(&mz[c],&key[c],&pos[c],sz,dif,binSize,invBinSize,binOffset,outKey,outPos);
+
+    for(i=0;i<sz;i++){
+      if(outKey[i]>=spec.bins){
+        if(con>conFrag) conFrag=con;
+        return;
+      }
+      v=spec.value(outKey[i],outPos[i]); //empty keys read 0, which ends a run like any non-match
+      sum+=v;
+      if(v>5){
+        match++;
+        con++;
+      } else {
+        if(con>conFrag) conFrag=con;
+        con=0;
+      }
+    }
+  }
+}
+
+//Scores the ions before the first shifted one with the same rules as score(). Continuing with
+//score() on the rest of the series, passing p.con, gives the same result as scoring it whole.
+void KScoreKernel::scorePrefix(const double* mz, const int* key, const int* pos, int n, const kKojakArray& spec, kScorePrefix& p){
+  int i;
+  char v;
+
+  p.done=true;
+  p.valid=true;
+  p.ended=false;
+  p.sum=0;
+  p.match=0;
+  p.conFrag=0;
+  p.con=0;
+
+  for(i=0;i<n;i++){
+    if(mz[i]<0) break;
+  }
+  p.start=i;
+  for(;i<n;i++){
+    if(mz[i]>=0){
+      p.valid=false;
+      return;
+    }
+  }
+
+  for(i=0;i<p.start;i++){
+    if(key[i]>=spec.bins){
+      if(p.con>p.conFrag) p.conFrag=p.con;
+      p.ended=true;
+      return;
+    }
+    v=spec.value(key[i],pos[i]);
+    p.sum+=v;
+    if(v>5){
+      p.match++;
+      p.con++;
+    } else {
+      if(p.con>p.conFrag) p.conFrag=p.con;
+      p.con=0;
+    }
+  }
+}
+
+KSCOREKERNEL_SCALAR
+void KScoreKernel::binIonsScalar(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos){
+  int i;
+  double m;
+  for(i=0;i<n;i++){
+    if(mz[i]<0){
+      m = binSize * (int)((dif-mz[i])*invBinSize+binOffset);
+      outKey[i] = (int)m;
+      outPos[i] = (int)((m-outKey[i])*invBinSize);
+    } else {
+      outKey[i] = key[i];
+      outPos[i] = pos[i];
+    }
+  }
+}
+
+#ifdef KSCOREKERNEL_X86
+
+KSCOREKERNEL_TARGET("sse4.2")
+void KScoreKernel::binIonsSSE42(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos){
+  int i=0;
+  __m128d vDif=_mm_set1_pd(dif);
+  __m128d vBin=_mm_set1_pd(binSize);
+  __m128d vInv=_mm_set1_pd(invBinSize);
+  __m128d vOff=_mm_set1_pd(binOffset);
+  __m128d vZero=_mm_setzero_pd();
+  __m128d vMz,vM;
+  __m128i vKey,vPos,vMask;
+
+  for(;i+2<=n;i+=2){
+    vMz=_mm_loadu_pd(&mz[i]);
+    vMask=_mm_shuffle_epi32(_mm_castpd_si128(_mm_cmplt_pd(vMz,vZero)),_MM_SHUFFLE(3,3,2,0));
+    vM=_mm_mul_pd(vBin,_mm_cvtepi32_pd(_mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(_mm_sub_pd(vDif,vMz),vInv),vOff))));
+    vKey=_mm_cvttpd_epi32(vM);
+    vPos=_mm_cvttpd_epi32(_mm_mul_pd(_mm_sub_pd(vM,_mm_cvtepi32_pd(vKey)),vInv));
+    vKey=_mm_blendv_epi8(_mm_loadl_epi64((const __m128i*)&key[i]),vKey,vMask);
+    vPos=_mm_blendv_epi8(_mm_loadl_epi64((const __m128i*)&pos[i]),vPos,vMask);
+    _mm_storel_epi64((__m128i*)&outKey[i],vKey);
+    _mm_storel_epi64((__m128i*)&outPos[i],vPos);
+  }
+  if(i<n) binIonsScalar(&mz[i],&key[i],&pos[i],n-i,dif,binSize,invBinSize,binOffset,&outKey[i],&outPos[i]);
+}
+
+KSCOREKERNEL_TARGET("avx2")
+void KScoreKernel::binIonsAVX2(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos){
+  int i=0;
+  __m256d vDif=_mm256_set1_pd(dif);
+  __m256d vBin=_mm256_set1_pd(binSize);
+  __m256d vInv=_mm256_set1_pd(invBinSize);
+  __m256d vOff=_mm256_set1_pd(binOffset);
+  __m256d vZero=_mm256_setzero_pd();
+  __m256i vPack=_mm256_setr_epi32(0,2,4,6,0,2,4,6); //low half of each 64-bit mask lane
+  __m256d vMz,vM;
+  __m128i vKey,vPos,vMask;
+
+  for(;i+4<=n;i+=4){
+    vMz=_mm256_loadu_pd(&mz[i]);
+    vMask=_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_castpd_si256(_mm256_cmp_pd(vMz,vZero,_CMP_LT_OQ)),vPack));
+    vM=_mm256_mul_pd(vBin,_mm256_cvtepi32_pd(_mm256_cvttpd_epi32(_mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(vDif,vMz),vInv),vOff))));
+    vKey=_mm256_cvttpd_epi32(vM);
+    vPos=_mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_sub_pd(vM,_mm256_cvtepi32_pd(vKey)),vInv));
+    vKey=_mm_blendv_epi8(_mm_loadu_si128((const __m128i*)&key[i]),vKey,vMask);
+    vPos=_mm_blendv_epi8(_mm_loadu_si128((const __m128i*)&pos[i]),vPos,vMask);
+    _mm_storeu_si128((__m128i*)&outKey[i],vKey);
+    _mm_storeu_si128((__m128i*)&outPos[i],vPos);
+  }
+  if(i<n) binIonsScalar(&mz[i],&key[i],&pos[i],n-i,dif,binSize,invBinSize,binOffset,&outKey[i],&outPos[i]);
+}
+
+KSCOREKERNEL_TARGET("avx512f")
+void KScoreKernel::binIonsAVX512(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos){
+  int i=0;
+  __m512d vDif=_mm512_set1_pd(dif);
+  __m512d vBin=_mm512_set1_pd(binSize);
+  __m512d vInv=_mm512_set1_pd(invBinSize);
+  __m512d vOff=_mm512_set1_pd(binOffset);
+  __m512d vZero=_mm512_setzero_pd();
+  __m512d vMz,vM;
+  __m256i vKey;
+  __mmask8 mask;
+
+  for(;i+8<=n;i+=8){
+    vMz=_mm512_loadu_pd(&mz[i]);
+    mask=_mm512_cmp_pd_mask(vMz,vZero,_CMP_LT_OQ);
+    vM=_mm512_mul_pd(vBin,_mm512_cvtepi32_pd(_mm512_cvttpd_epi32(_mm512_add_pd(_mm512_mul_pd(_mm512_sub_pd(vDif,vMz),vInv),vOff))));
+    vKey=_mm512_cvttpd_epi32(vM);
+    _mm256_storeu_si256((__m256i*)&outPos[i],_mm512_mask_cvttpd_epi32(_mm256_loadu_si256((const __m256i*)&pos[i]),mask,_mm512_mul_pd(_mm512_sub_pd(vM,_mm512_cvtepi32_pd(vKey)),vInv)));
+    _mm256_storeu_si256((__m256i*)&outKey[i],_mm512_mask_cvttpd_epi32(_mm256_loadu_si256((const __m256i*)&key[i]),mask,vM));
+  }
+  if(i<n) binIonsScalar(&mz[i],&key[i],&pos[i],n-i,dif,binSize,invBinSize,binOffset,&outKey[i],&outPos[i]);
+}
+
+#else
+
+void KScoreKernel::binIonsSSE42(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos){
+  binIonsScalar(mz,key,pos,n,dif,binSize,invBinSize,binOffset,outKey,outPos);
+}
+
+void KScoreKernel::binIonsAVX2(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos){
+  binIonsScalar(mz,key,pos,n,dif,binSize,invBinSize,binOffset,outKey,outPos);
+}
+
+void KScoreKernel::binIonsAVX512(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos){
+  binIonsScalar(mz,key,pos,n,dif,binSize,invBinSize,binOffset,outKey,outPos);
+}
+
+#endif
@@ -0,0 +1,66 @@
+/*
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _KSCOREKERNEL_H
+#define _KSCOREKERNEL_H
+
+#include "KStructs.h"
+
+#define KERNELCHUNK 64  //ions binned per kernel call
+
+//The unshifted ions at the front of one series and charge. They score the same whatever the
+//partner's mass, so scorePrefix() scores them once and score() continues from them with only the
+//shifted ions.
+typedef struct kScorePrefix{
+  bool  done;     //filled for the current spectrum and ion set
+  bool  valid;    //false if the shifted ions are not all at the end; score the whole series instead
+  bool  ended;    //a bin beyond the spectrum ended the series within the prefix
+  int   start;    //first shifted ion
+  int   sum;
+  int   match;
+  int   conFrag;  //longest run that closed within the prefix
+  int   con;      //run still open where the shifted ions begin
+} kScorePrefix;
+
+//Inner loop of KAnalysis::kojakScoring for one ion series at one charge state. Ion bins are
+//computed with the widest vector instructions the CPU supports (chosen once by init()), then
+//looked up in the spectrum. Every kernel performs the same floating point operations in the same
+//order as the scalar path, so scores are bit-identical regardless of which kernel runs.
+class KScoreKernel{
+public:
+
+  static void         init    ();
+  static const char*  getName ();
+
+  //mz, key, and pos are one series and charge of a KIonSet in structure-of-arrays form. Negative
+  //mz values are shifted by dif before binning; the others use their precomputed key and pos.
+  //sum, match, and conFrag accumulate across calls. con is a run carried in from a prefix.
+  static void score(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, const kKojakArray& spec, int& sum, int& match, int& conFrag, int con=0);
+  static void scorePrefix(const double* mz, const int* key, const int* pos, int n, const kKojakArray& spec, kScorePrefix& p);
+
+private:
+
+  typedef void (*binFunc)(const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos);
+
+  static binFunc      binIons;
+  static const char*  name;
+
+  static void binIonsScalar (const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos);
+  static void binIonsSSE42  (const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos);
+  static void binIonsAVX2   (const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos);
+  static void binIonsAVX512 (const double* mz, const int* key, const int* pos, int n, double dif, double binSize, double invBinSize, double binOffset, int* outKey, int* outPos);
+
+};
+
+#endif
@@ -31,6 +31,7 @@ KSpectrum::KSpectrum(const int& i, const double& bs, const double& os){
   maxIntensity=0;
   mz = 0;
   precursor = new vector<kPrecursor>;
+  lightSinglets = new vector<KTopPeps>;
   singlets = new vector<KTopPeps>;
   spec = new vector<kSpecPoint>;
   scanNumber = 0;
@@ -39,17 +40,10 @@ KSpectrum::KSpectrum(const int& i, const double& bs, const double& os){
   xCorrSparseArraySize=0;
   xCorrSparseArray=NULL;
   
-  singletCount=0;
-  singletFirst=NULL;
-  singletLast=NULL;
   singletMax=i;
 
-  kojakSparseArray=NULL;
   kojakBins=0;
 
-  singletList=NULL;
-  singletBins=0;
-
   lowScore=0;
 
   nativeID.clear();
@@ -58,6 +52,7 @@ KSpectrum::KSpectrum(const int& i, const double& bs, const double& os){
   for (j = 0; j<HISTOSZ; j++) histogram[j] = 0;
   histogramCount = 0;
   histoMaxIndex = 0;
+  histoFit.valid = false;
 
   for (j = 0; j<HISTOSZ; j++) histogramSinglet[j] = 0;
   histogramSingletCount = 0;
@@ -92,6 +87,7 @@ KSpectrum::KSpectrum(const KSpectrum& p){
   for(i=0;i<p.precursor->size();i++) precursor->push_back(p.precursor->at(i));
   singlets = new vector<KTopPeps>;
   for (i = 0; i<p.singlets->size(); i++) singlets->push_back(p.singlets->at(i));
+  lightSinglets = new vector<KTopPeps>(*p.lightSinglets);
 
   binOffset = p.binOffset;
   binSize = p.binSize;
@@ -104,12 +100,13 @@ KSpectrum::KSpectrum(const KSpectrum& p){
   rTime = p.rTime;
   xCorrArraySize = p.xCorrArraySize;
   xCorrSparseArraySize = p.xCorrSparseArraySize;
-  lowScore=p.lowScore;
+  lowScore=p.lowScore.load();
   nativeID=p.nativeID;
 
   for (i = 0; i<HISTOSZ; i++) histogram[i] = p.histogram[i];
   histogramCount = p.histogramCount;
   histoMaxIndex = p.histoMaxIndex;
+  histoFit = p.histoFit;
 
   for (i = 0; i<HISTOSZ; i++) histogramSinglet[i] = p.histogramSinglet[i];
   histogramSingletCount = p.histogramSingletCount;
@@ -133,24 +130,7 @@ KSpectrum::KSpectrum(const KSpectrum& p){
   cc=p.cc;
   sc=p.sc;
 
-  singletCount=p.singletCount;
   singletMax=p.singletMax;
-  singletFirst=NULL;
-  singletLast=NULL;
-  kSingletScoreCard* sc=NULL;
-  kSingletScoreCard* tmp=p.singletFirst;
-  if(tmp!=NULL) {
-    singletFirst=new kSingletScoreCard(*tmp);
-    sc=singletFirst;
-    tmp=tmp->next;
-    while(tmp!=NULL){
-      sc->next=new kSingletScoreCard(*tmp);
-      sc->next->prev=sc;
-      sc=sc->next;
-      tmp=tmp->next;
-    }
-    singletLast=sc;
-  }
 
   if(p.xCorrSparseArray==NULL){
     xCorrSparseArray=NULL;
@@ -160,66 +140,15 @@ KSpectrum::KSpectrum(const KSpectrum& p){
   }
 
   kojakBins=p.kojakBins;
-  if(p.kojakSparseArray==NULL){
-    kojakSparseArray=NULL;
-  } else {
-    for(j=0;j<kojakBins;j++){
-      if(p.kojakSparseArray[j]==NULL){
-        kojakSparseArray[j]=NULL;
-      } else {
-        kojakSparseArray[j] = new char[(int)invBinSize+1];
-        for(i=0;i<(unsigned int)invBinSize+1;i++) kojakSparseArray[j][i]=p.kojakSparseArray[j][i];
-      }
-    }
-  }
-
-  singletBins=p.singletBins;
-  if(singletBins==0) singletList=NULL;
-  else {
-    singletList = new list<kSingletScoreCard*>*[singletBins];
-    for(j=0;j<singletBins;j++){
-      if(p.singletList[j]==NULL) singletList[j]=NULL;
-      else {
-        singletList[j] = new list<kSingletScoreCard*>;
-        list<kSingletScoreCard*>::iterator it = p.singletList[j]->begin();
-        while(it!=p.singletList[j]->end()){
-          singletList[j]->emplace_back(*it);
-          it++;
-        }
-      }
-    }
-  }
-
-
+  kojakArray=p.kojakArray;
 }
   
 KSpectrum::~KSpectrum(){
   delete spec;
   delete precursor;
   delete singlets;
+  delete lightSinglets;
   if(xCorrSparseArray!=NULL) free(xCorrSparseArray);
-
-  while(singletFirst!=NULL){
-    kSingletScoreCard* tmp=singletFirst;
-    singletFirst=singletFirst->next;
-    delete tmp;
-  }
-  singletLast=NULL;
-
-  int j;
-  if(kojakSparseArray!=NULL){
-    for(j=0;j<kojakBins;j++){
-      if(kojakSparseArray[j]!=NULL) delete [] kojakSparseArray[j];
-    }
-    delete [] kojakSparseArray;
-  }
-
-  if (singletList != NULL){
-    for (j = 0; j<singletBins; j++){
-      if (singletList[j] != NULL) delete singletList[j];
-    }
-    delete[] singletList;
-  }
 }
 
 
@@ -240,6 +169,7 @@ KSpectrum& KSpectrum::operator=(const KSpectrum& p){
     delete singlets;
     singlets = new vector<KTopPeps>;
     for (i = 0; i<p.singlets->size(); i++) singlets->push_back(p.singlets->at(i));
+    *lightSinglets = *p.lightSinglets;
 
     binOffset = p.binOffset;
     binSize = p.binSize;
@@ -252,12 +182,13 @@ KSpectrum& KSpectrum::operator=(const KSpectrum& p){
     rTime = p.rTime;
     xCorrArraySize = p.xCorrArraySize;
     xCorrSparseArraySize = p.xCorrSparseArraySize;
-    lowScore = p.lowScore;
+    lowScore = p.lowScore.load();
     nativeID = p.nativeID;
 
     for (i = 0; i<HISTOSZ; i++) histogram[i] = p.histogram[i];
     histogramCount = p.histogramCount;
     histoMaxIndex = p.histoMaxIndex;
+    histoFit = p.histoFit;
 
     for (i = 0; i<HISTOSZ; i++) histogramSinglet[i] = p.histogramSinglet[i];
     histogramSingletCount = p.histogramSingletCount;
@@ -281,24 +212,7 @@ KSpectrum& KSpectrum::operator=(const KSpectrum& p){
     cc = p.cc;
     sc = p.sc;
 
-    singletCount=p.singletCount;
     singletMax=p.singletMax;
-    singletFirst=NULL;
-    singletLast=NULL;
-    kSingletScoreCard* sc=NULL;
-    kSingletScoreCard* tmp=p.singletFirst;
-    if(tmp!=NULL) {
-      singletFirst=new kSingletScoreCard(*tmp);
-      sc=singletFirst;
-      tmp=tmp->next;
-      while(tmp!=NULL){
-        sc->next=new kSingletScoreCard(*tmp);
-        sc->next->prev=sc;
-        sc=sc->next;
-        tmp=tmp->next;
-      }
-      singletLast=sc;
-    }
 
     if(xCorrSparseArray!=NULL) free(xCorrSparseArray);
     if(p.xCorrSparseArray==NULL){
@@ -308,48 +222,8 @@ KSpectrum& KSpectrum::operator=(const KSpectrum& p){
       for(j=0;j<xCorrSparseArraySize;j++) xCorrSparseArray[j]=p.xCorrSparseArray[j];
     }
     
-    if(kojakSparseArray!=NULL){
-      for(j=0;j<kojakBins;j++){
-        if(kojakSparseArray[j]!=NULL) delete [] kojakSparseArray[j];
-      }
-      delete [] kojakSparseArray;
-    }
     kojakBins=p.kojakBins;
-    if(p.kojakSparseArray==NULL){
-      kojakSparseArray=NULL;
-    } else {
-      for(j=0;j<kojakBins;j++){
-        if(p.kojakSparseArray[j]==NULL){
-          kojakSparseArray[j]=NULL;
-        } else {
-          kojakSparseArray[j] = new char[(int)invBinSize+1];
-          for(i=0;i<(unsigned int)invBinSize+1;i++) kojakSparseArray[j][i]=p.kojakSparseArray[j][i];
-        }
-      }
-    }
-
-    if (singletList != NULL){
-      for (j = 0; j<singletBins; j++){
-        if (singletList[j] != NULL) delete singletList[j];
-      }
-      delete[] singletList;
-    }
-    singletBins = p.singletBins;
-    if (singletBins == 0) singletList = NULL;
-    else {
-      singletList = new list<kSingletScoreCard*>*[singletBins];
-      for (j = 0; j<singletBins; j++){
-        if (p.singletList[j] == NULL) singletList[j] = NULL;
-        else {
-          singletList[j] = new list<kSingletScoreCard*>;
-          list<kSingletScoreCard*>::iterator it = p.singletList[j]->begin();
-          while (it != p.singletList[j]->end()){
-            singletList[j]->emplace_back(*it);
-            it++;
-          }
-        }
-      }
-    }
+    kojakArray=p.kojakArray;
   }
   return *this;
 }
@@ -406,24 +280,12 @@ int KSpectrum::getScanNumber(){
   return scanNumber;
 }
 
-kScoreCard& KSpectrum::getScoreCard(int i){
-  return topHit[i];
-}
-
-int KSpectrum::getSingletCount(){
-  return singletCount;
+KTopPeps* KSpectrum::getLightPeps(int i){
+  return &lightSinglets->at(i);
 }
 
-kSingletScoreCard& KSpectrum::getSingletScoreCard(int i){
-  if(i>=singletCount) return *singletLast;
-  kSingletScoreCard* sc=singletFirst;
-  int j=0;
-  while(j<i){
-    if(sc->next==NULL) break;
-    sc=sc->next;
-    j++;
-  }
-  return *sc;
+kScoreCard& KSpectrum::getScoreCard(int i){
+  return topHit[i];
 }
 
 KTopPeps* KSpectrum::getTopPeps(int i){
@@ -450,7 +312,6 @@ void KSpectrum::addPrecursor(kPrecursor& p, int sz){
   precursor->push_back(p);
   KTopPeps tp;
   tp.singletMax=sz;
-  tp.resetSingletList(p.monoMass);
   singlets->push_back(tp);
 }
 
@@ -458,11 +319,13 @@ void KSpectrum::clear(){
   spec->clear();
   precursor->clear();
   singlets->clear();
+  lightSinglets->clear();
 }
 
 void KSpectrum::clearPrecursors(){
   precursor->clear();
   singlets->clear();
+  lightSinglets->clear();
 }
 
 void KSpectrum::erasePrecursor(int i){
@@ -501,60 +364,46 @@ void KSpectrum::setScanNumber(int i){
 /*============================
   Functions
 ============================*/
-bool KSpectrum::calcEValue(kParams* params, KDecoys& decoys) {
+bool KSpectrum::calcEValue(kParams* params, KDecoys& decoys, KDecoyTable& table) {
   int i;
   int iLoopCount;
-  int iMaxCorr;
-  int iStartCorr;
-  int iNextCorr;
   double dSlope;
   double dIntercept;
-  double dRSquare;
   bool bSkipXL=false;
   bool bSingletFail=false;
 
+  //Singlet decoys are sampled from a stream of this spectrum's own, so e-values do not depend on
+  //which thread computes them or in what order.
+  kRandom rng((unsigned long long)scanNumber);
+
   tmpSingCount = histogramSingletCount;
   tmpHistCount = histogramCount;
   if (topHit[0].simpleScore == 0) return true; //no need to do any of this if there are no PSMs...
 
-  if (histogramCount < decoys.decoySize) {
-
-    //precompute which ion series to use
-    decoyIonSz=0;
-    for (i = 0; i<6; i++){
-      if (params->ionSeries[i]) {
-        if (i<3) {
-          decoyIons[decoyIonSz].b = true;
-          if (i == 0) decoyIons[decoyIonSz++].mass = -27.9949141;
-          else if (i == 1) decoyIons[decoyIonSz++].mass = 0;
-          else decoyIons[decoyIonSz++].mass = 17.026547;
-        } else {
-          decoyIons[decoyIonSz].b = false;
-          if (i == 3) decoyIons[decoyIonSz++].mass = 25.9792649;
-          else if (i == 4) decoyIons[decoyIonSz++].mass = 0;
-          else decoyIons[decoyIonSz++].mass = -16.0187224;
-        }
-      }
+  //The histogram is fit once and the fit kept; fitting also replaces the histogram with its
+  //cumulative counts, so it could not be fit again anyway.
+  if (!histoFit.valid) {
+    if (histogramCount < decoys.decoySize) {
+      if (!generateXcorrDecoys(params, decoys, table)) return false;
     }
-
-    if (!generateXcorrDecoys(params, decoys)) return false;
+    for (i = 0; i<HISTOSZ; i++) histogramO[i] = histogram[i]; //for diagnostics
+    fitHistogram(histogram, histogramCount, histoFit);
   }
-
-  linearRegression2(dSlope, dIntercept, iMaxCorr, iStartCorr, iNextCorr,dRSquare);
-  histoMaxIndex = iMaxCorr;
+  dSlope = histoFit.slope;
+  dIntercept = histoFit.intercept;
+  histoMaxIndex = histoFit.maxCorr;
 
   //diagnostics - probably temporary
   tmpIntercept = (float)dIntercept;  // b
   tmpSlope = (float)dSlope;  // m
-  tmpIStartCorr = (float)iStartCorr;
-  tmpINextCorr = (float)iNextCorr;
-  tmpIMaxCorr = (short)iMaxCorr;
-  tmpRSquare = dRSquare;
+  tmpIStartCorr = (float)histoFit.startCorr;
+  tmpINextCorr = (float)histoFit.nextCorr;
+  tmpIMaxCorr = (short)histoFit.maxCorr;
+  tmpRSquare = histoFit.rSquared;
 
   dSlope *= 10.0;
 
   iLoopCount = 20; //score all e-values among top hits?
-  double topScore=topHit[0].simpleScore;
   for (i = 0; i<iLoopCount; i++) {
     if (topHit[i].simpleScore == 0) break; //score all e-values among top hits?
     if (dSlope >= 0.0) {
@@ -563,21 +412,8 @@ bool KSpectrum::calcEValue(kParams* params, KDecoys& decoys) {
       topHit[i].eVal = pow(10.0, dSlope * topHit[i].simpleScore + dIntercept);
       if (topHit[i].eVal>1e12) topHit[i].eVal = 1e12;
     }
-    //score individual peptides
-    if(topHit[i].score2>0){
-      if(topHit[i].simpleScore==topScore){ //only do this for top hits right now: it is slow...
-        if(i>0){
-          //check if we've computed these already - happens with one of the peptides in ties.
-          if(topHit[i].score1==topHit[i-1].score1) topHit[i].eVal1=topHit[i-1].eVal1;
-          else topHit[i].eVal1 = generateSingletDecoys2(params, decoys, topHit[i].score1, topHit[i].mass1, (int)topHit[i].precursor, topHit[i].score2);
-          if(topHit[i].score2==topHit[i-1].score2) topHit[i].eVal2=topHit[i-1].eVal2;
-          else topHit[i].eVal2 = generateSingletDecoys2(params, decoys, topHit[i].score2, topHit[i].mass2, (int)topHit[i].precursor, topHit[i].score1);
-        } else {
-          topHit[i].eVal1 = generateSingletDecoys2(params,decoys,topHit[i].score1,topHit[i].mass1,(int)topHit[i].precursor,topHit[i].score2);
-          topHit[i].eVal2 = generateSingletDecoys2(params, decoys, topHit[i].score2, topHit[i].mass2, (int)topHit[i].precursor,topHit[i].score1);
-        }
-      }
-    } else {
+    //score individual peptides; cross-links are done together below
+    if(topHit[i].score2<=0){
       if (dSlope >= 0.0) {
         topHit[i].eVal1 = 1e12;
       } else {
@@ -587,9 +423,47 @@ bool KSpectrum::calcEValue(kParams* params, KDecoys& decoys) {
       topHit[i].eVal2 = 1e12;
     }
   }
+  calcSingletEValues(params, decoys, table, rng, i);
   return true;
 }
 
+//Peptide e-values for both peptides of every cross-linked hit among the first sz top hits. Each
+//distinct peptide mass and precursor scores one set of decoys, which is shared by every peptide
+//that matches it; only the partner's score shift differs between them.
+void KSpectrum::calcSingletEValues(kParams* params, KDecoys& decoys, KDecoyTable& table, kRandom& rng, int sz){
+  int i,j;
+  int pre;
+  bool bDecoys;
+  bool bDone[40];
+  double mass;
+  vector<int> decoyScores;
+  vector<kSingletEValue> fits; //e-values already fit from this set of decoys
+
+  //peptide j is topHit[j/2], first or second by j%2
+  for(i=0;i<sz*2;i++) bDone[i] = (topHit[i/2].score2<=0);
+
+  for(i=0;i<sz*2;i++){
+    if(bDone[i]) continue;
+    pre = (int)topHit[i/2].precursor;
+    if(i%2==0) mass = topHit[i/2].mass1;
+    else mass = topHit[i/2].mass2;
+    bDecoys = generateSingletDecoys2(params, decoys, table, rng, mass, pre, decoyScores);
+    fits.clear();
+
+    for(j=i;j<sz*2;j++){
+      if(bDone[j] || (int)topHit[j/2].precursor!=pre) continue;
+      if(j%2==0){
+        if(topHit[j/2].mass1!=mass) continue;
+        topHit[j/2].eVal1 = bDecoys ? singletEValue(decoys, decoyScores, fits, topHit[j/2].score1, topHit[j/2].score2) : 1e12;
+      } else {
+        if(topHit[j/2].mass2!=mass) continue;
+        topHit[j/2].eVal2 = bDecoys ? singletEValue(decoys, decoyScores, fits, topHit[j/2].score2, topHit[j/2].score1) : 1e12;
+      }
+      bDone[j]=true;
+    }
+  }
+}
+
 void KSpectrum::checkScore(kScoreCard& s){
   unsigned int i;
   unsigned int j;
@@ -624,161 +498,24 @@ void KSpectrum::checkScore(kScoreCard& s){
   }
 }
 
-//This function is now deprecated...
-void KSpectrum::checkSingletScore(kSingletScoreCard& s){
-
-  cout << "CHECK SS" << endl;
-  printf("CheckSS\n");
-
-  kSingletScoreCard* sc;
-  kSingletScoreCard* cur;
-  size_t ind;
-  
-  //If list is empty, add the score card
-  if(singletCount==0){
-    singletFirst=new kSingletScoreCard(s);
-    singletLast=singletFirst;
-    singletCount++;
-
-    //add to singlet list
-    ind = (int)(s.mass/10);
-    if(singletList[ind]==NULL) singletList[ind] = new list<kSingletScoreCard*>;
-    singletList[ind]->emplace_back(singletFirst);
-
-    return;
-  }  
-
-  //check if we can just add to the end
-  if(s.simpleScore<=singletLast->simpleScore){
-    //check if we need to store the singlet
-    //if(singletCount>=singletMax) return;
-
-    singletLast->next=new kSingletScoreCard(s);
-    singletLast->next->prev=singletLast;
-    singletLast=singletLast->next;
-    singletCount++;
-
-    if(singletCount>singletMax) cout << "Appended max" << endl;
-
-    //add to singlet list
-    ind = (int)(s.mass / 10);
-    if (singletList[ind] == NULL) singletList[ind] = new list<kSingletScoreCard*>;
-    singletList[ind]->emplace_back(singletLast);
-
-    return;
-  }
-  
-  //check if it goes in the front
-  if(s.simpleScore>=singletFirst->simpleScore){
-    singletFirst->prev=new kSingletScoreCard(s);
-    singletFirst->prev->next=singletFirst;
-    singletFirst=singletFirst->prev;
-
-    //add to singlet list
-    ind = (int)(s.mass / 10);
-    if (singletList[ind] == NULL) singletList[ind] = new list<kSingletScoreCard*>;
-    singletList[ind]->emplace_back(singletFirst);
-    singletCount++;
-
-    if (singletCount>singletMax) {
-      cout << "Maxxed out: " << singletCount << "\t" << singletLast->simpleScore << "\t" << singletLast->prev->simpleScore << endl;
-    }
-
-    if(singletCount>singletMax){
-      int i = singletCount;
-      cur = singletLast;
-      while (i>singletMax){ //step to singletMax position
-        cur = cur->prev;
-        i--;
-      }
-      while (cur->next!=NULL && cur->next->simpleScore==cur->simpleScore){ //step to first instance of score lower than singletMax
-        cur=cur->next;
-      }
-
-      //delete everything hereafter
-      while(cur->next!=NULL){ 
-        sc=cur->next;
-        cur->next=sc->next;
-        //if(sc->next!=NULL) sc->next->prev=cur; //is this necessary if they're all going to go?
-
-        ind = (int)(sc->mass / 10);
-        if (singletList[ind]->size() == 1) {
-          delete singletList[ind];
-          singletList[ind] = NULL;
-        } else {
-          list<kSingletScoreCard*>::iterator it = singletList[ind]->begin();
-          while (*it != sc) it++;
-          singletList[ind]->erase(it);
-        }
-        delete sc;
-        singletCount--;
-      }
-
-      singletLast = cur;
-      return;
-    }
-  }
-
-
-  //scan to find insertion point
-  cout << "WTF" << endl;
-  cur = singletFirst->next;
-  int i=1;
-  while(s.simpleScore < cur->simpleScore){
-    i++;
-    cur=cur->next;
-  }
-
-  sc=new kSingletScoreCard(s);
-  sc->prev=cur->prev;
-  sc->next=cur;
-  cur->prev->next=sc;
-  cur->prev=sc;
-  if(sc->prev==NULL) singletFirst=sc;
-
-  //add to singlet list
-  ind = (int)(s.mass / 10);
-  if (singletList[ind] == NULL) singletList[ind] = new list<kSingletScoreCard*>;
-  singletList[ind]->emplace_back(sc);
-  singletCount++;
-
-  if (singletCount>singletMax) {
-    cout << "Middle Maxxed out: " << singletCount << "\t" << singletLast->simpleScore << "\t" << singletLast->prev->simpleScore << endl;
-  }
-
-  if (singletCount>singletMax){
-    int i = singletCount;
-    cur = singletLast;
-    while (i>singletMax){ //step to singletMax position
-      cur = cur->prev;
-      i--;
-    }
-    while (cur->next != NULL && cur->next->simpleScore == cur->simpleScore){ //step to first instance of score lower than singletMax
-      cur = cur->next;
-    }
-
-    //delete everything hereafter
-    while (cur->next != NULL){
-      sc = cur->next;
-      cur->next = sc->next;
-      //if(sc->next!=NULL) sc->next->prev=cur; //is this necessary if they're all going to go?
+//Releases the peak list. The scan information and precursors are kept.
+void KSpectrum::freePeaks(){
+  vector<kSpecPoint>().swap(*spec);
+}
 
-      ind = (int)(sc->mass / 10);
-      if (singletList[ind]->size() == 1) {
-        delete singletList[ind];
-        singletList[ind] = NULL;
-      } else {
-        list<kSingletScoreCard*>::iterator it = singletList[ind]->begin();
-        while (*it != sc) it++;
-        singletList[ind]->erase(it);
-      }
-      delete sc;
-      singletCount--;
-    }
+//Releases the peak list, transformed spectrum, and singlet mass lookups after the spectrum has been
+//searched and its e-values calculated. The top hits and ranked singlets are kept for exporting.
+void KSpectrum::freeSearchData(){
+  size_t j;
 
-    singletLast = cur;
-  }
+  freePeaks();
+  kojakArray.clear();
+  if(xCorrSparseArray!=NULL) free(xCorrSparseArray);
+  xCorrSparseArray=NULL;
+  xCorrSparseArraySize=0;
 
+  for(j=0;j<singlets->size();j++) singlets->at(j).freeSingletList();
+  vector<KTopPeps>().swap(*lightSinglets);
 }
 
 //from Comet
@@ -863,9 +600,8 @@ bool KSpectrum::generateSingletDecoys(kParams* params, KDecoys& decoys) {
           mz = params->binSize * (int)(mz*invBinSize + params->binOffset);
           key = (int)mz;
           if (key >= kojakBins) break;
-          if (kojakSparseArray[key] == NULL) continue;
           pos = (int)((mz - key)*invBinSize);
-          dXcorr += kojakSparseArray[key][pos];
+          dXcorr += kojakArray.value(key,pos);
         }
       }
     }
@@ -886,27 +622,30 @@ bool KSpectrum::generateSingletDecoys(kParams* params, KDecoys& decoys) {
 // Make synthetic decoy spectra to fill out correlation histogram by going
 // through each candidate peptide and rotating spectra in m/z space.
 
-//Rethink the need to have score2 as a parameter...
-double KSpectrum::generateSingletDecoys2(kParams* params, KDecoys& decoys, double xcorr, double mass, int preIndex,double score2) {
+//Scores decoy_size-1 decoys for a peptide of the given mass on precursor preIndex, with the rest of
+//the precursor mass placed on a random link site. The scores do not depend on the peptide's own
+//score, so every peptide of this mass and precursor can share them. Returns false if the decoys
+//cannot hold the peptide's mass.
+bool KSpectrum::generateSingletDecoys2(kParams* params, KDecoys& decoys, KDecoyTable& table, kRandom& rng, double mass, int preIndex, vector<int>& decoyScores) {
   int i;
   int n;
   int j;
-  int k;
   int maxZ;
   int z;
   int key;
   int pos;
+  int sum;
   int xlSite;
   int xlLen;
-  double dXcorr;
+  int xlIon;
   double dFragmentIonMass = 0.0;
   double diffMass;
   double preMass;
+  const double* ionMass;
+  const int* ionKey[DECOYCHARGES+1];
+  const short* ionPos[DECOYCHARGES+1];
 
-  int tempHistogram[HISTOSZ];
-  for(i=0;i<HISTOSZ;i++) tempHistogram[i]=0;
-
-  int seed = rand() % decoys.decoySize;
+  int seed = rng.next(decoys.decoySize);
   int decoyIndex;
 
   //compute modification mass
@@ -914,31 +653,43 @@ double KSpectrum::generateSingletDecoys2(kParams* params, KDecoys& decoys, doubl
   if (maxZ>4) maxZ = 4;
   preMass = precursor->at(preIndex).monoMass;
   diffMass=preMass-mass;
+  decoyScores.clear();
 
   //Does this function need as many DECOY_SIZE as the other? Can this be shortened?
   for (i = 0; i<decoys.decoySize - 1; i++) { // iterate through required # decoys
-    dXcorr = 0.0;
+    sum = 0;
     decoyIndex = (seed + i) % decoys.decoySize;
  
     //find link site - somewhat wasted cycles
     for (j = 0; j<MAX_DECOY_PEP_LEN; j++) {
       if (decoys.decoyIons[decoyIndex].pdIonsN[j]>mass) break;
     }
-    if(j<1) return 1e12;
+    if(j<1) return false;
     else if(j==1) xlSite=0;
-    else xlSite = rand() % (j - 1);
+    else xlSite = rng.next(j - 1);
     xlLen = j - 1;
 
-    for (n = 0; n<decoyIonSz; n++) { //iterate over each ion series
-      for (j = 0; j<MAX_DECOY_PEP_LEN; j++) {  // iterate through decoy fragment ions
-      
-        if (decoyIons[n].b) {
-          dFragmentIonMass = decoys.decoyIons[decoyIndex].pdIonsN[j] + decoyIons[n].mass;
-          if (j >= xlSite) dFragmentIonMass+=diffMass;
-        } else {
-          dFragmentIonMass = decoys.decoyIons[decoyIndex].pdIonsC[j] + decoyIons[n].mass;
-          if (j >= xlLen - xlSite) dFragmentIonMass += diffMass;
+    for (n = 0; n<table.seriesCount(); n++) { //iterate over each ion series
+      ionMass = table.getMass(decoyIndex, n);
+      for (z = 1; z<maxZ; z++) {
+        ionKey[z] = table.getKey(decoyIndex, n, z);
+        ionPos[z] = table.getPos(decoyIndex, n, z);
+      }
+      if (table.getSeries(n).b) xlIon = xlSite;
+      else xlIon = xlLen - xlSite;
+
+      //fragments before the link site are unmodified, so their bins come from the table
+      for (j = 0; j<xlIon && j<MAX_DECOY_PEP_LEN; j++) {
+        if (ionMass[j]>preMass) break;
+        for (z = 1; z<maxZ; z++) {
+          if (ionKey[z][j] >= kojakBins) break;
+          sum += kojakArray.value(ionKey[z][j],ionPos[z][j]);
         }
+      }
+      if (j<xlIon) continue;
+
+      for (; j<MAX_DECOY_PEP_LEN; j++) {  // iterate through decoy fragment ions carrying the modification
+        dFragmentIonMass = ionMass[j] + diffMass;
         if (dFragmentIonMass>preMass) break;
 
         for (z = 1; z<maxZ; z++) {
@@ -946,14 +697,36 @@ double KSpectrum::generateSingletDecoys2(kParams* params, KDecoys& decoys, doubl
           mz = params->binSize * (int)(mz*invBinSize + params->binOffset);
           key = (int)mz;
           if (key >= kojakBins) break;
-          if (kojakSparseArray[key] == NULL) continue;
           pos = (int)((mz - key)*invBinSize);
-          dXcorr += kojakSparseArray[key][pos];
+          sum += kojakArray.value(key,pos);
         }
       }
     }
 
-    if (dXcorr <= 0.0) dXcorr = 0.0;
+    if (sum < 0) sum = 0;
+    decoyScores.push_back(sum);
+  }
+  return true;
+}
+
+//Peptide e-value from the decoy scores of generateSingletDecoys2. score2, the partner peptide's
+//score, shifts every decoy so the histogram is of whole cross-link scores. Peptides with the same
+//scores against the same decoys have the same e-value, so fits holds those already computed.
+double KSpectrum::singletEValue(KDecoys& decoys, vector<int>& decoyScores, vector<kSingletEValue>& fits, double xcorr, double score2){
+  size_t i;
+  int k;
+  double dXcorr;
+  kSingletEValue e;
+
+  for(i=0;i<fits.size();i++){
+    if(fits[i].xcorr==xcorr && fits[i].score2==score2) return fits[i].eVal;
+  }
+
+  int tempHistogram[HISTOSZ];
+  for(k=0;k<HISTOSZ;k++) tempHistogram[k]=0;
+
+  for (i = 0; i<decoyScores.size(); i++) {
+    dXcorr = decoyScores[i];
     k = (int)(dXcorr*0.05+score2*10 + 0.5);  // 0.05=0.005*10; see KAnalysis::kojakScoring
     if (k < 0) k = 0;
     else if (k >= HISTOSZ) k = HISTOSZ - 1;
@@ -967,12 +740,15 @@ double KSpectrum::generateSingletDecoys2(kParams* params, KDecoys& decoys, doubl
   tempHistogram[k]++;
 
   //Do linear regression and compute e-value
-  double dSlope,dIntercept,dRSquare;
-  int iMaxCorr,iStartCorr,iNextCorr;
-  linearRegression4(tempHistogram, decoys.decoySize, dSlope, dIntercept, iMaxCorr, iStartCorr, iNextCorr, dRSquare);
-  double eVal = pow(10.0, dSlope * 10 * (xcorr+score2) + dIntercept);
+  kHistoFit fit;
+  fitHistogram(tempHistogram, decoys.decoySize, fit);
+  double eVal = pow(10.0, fit.slope * 10 * (xcorr+score2) + fit.intercept);
   if(eVal>1e12) eVal=1e12;
 
+  e.xcorr=xcorr;
+  e.score2=score2;
+  e.eVal=eVal;
+  fits.push_back(e);
   return eVal;
 }
 /*
@@ -1056,9 +832,8 @@ bool KSpectrum::generateXLDecoys(kParams* params, KDecoys& decoys) {
           mz = params->binSize * (int)(mz*invBinSize + params->binOffset);
           key = (int)mz;
           if (key >= kojakBins) break;
-          if (kojakSparseArray[key] == NULL) continue;
           pos = (int)((mz - key)*invBinSize);
-          dXcorr += kojakSparseArray[key][pos];
+          dXcorr += kojakArray.value(key,pos);
         }
       }
     }
@@ -1090,7 +865,7 @@ bool KSpectrum::generateXLDecoys(kParams* params, KDecoys& decoys) {
 //from Comet
 // Make synthetic decoy spectra to fill out correlation histogram by going
 // through each candidate peptide and rotating spectra in m/z space.
-bool KSpectrum::generateXcorrDecoys(kParams* params, KDecoys& decoys) {
+bool KSpectrum::generateXcorrDecoys(kParams* params, KDecoys& decoys, KDecoyTable& table) {
   int i;
   int n;
   int j;
@@ -1098,11 +873,13 @@ bool KSpectrum::generateXcorrDecoys(kParams* params, KDecoys& decoys) {
   int maxZ;
   int z;
   int r;
-  int key;
-  int pos;
+  int sum;
   double dXcorr;
-  double dFragmentIonMass = 0.0;
+  double preMass;
   int myCount=0;
+  const double* ionMass;
+  const int* ionKey[DECOYCHARGES+1];
+  const short* ionPos[DECOYCHARGES+1];
 
   tmpSingCount = histogramSingletCount;
   tmpHistCount = histogramCount;
@@ -1119,7 +896,7 @@ bool KSpectrum::generateXcorrDecoys(kParams* params, KDecoys& decoys) {
   r=0;
 
   for (i = 0; i<iLoopMax; i++) { // iterate through required # decoys
-    dXcorr = 0.0;
+    sum = 0;
     decoyIndex = (seed + i) % decoys.decoySize;
 
     //iterate over precursors
@@ -1127,26 +904,25 @@ bool KSpectrum::generateXcorrDecoys(kParams* params, KDecoys& decoys) {
     if(r>=(int)precursor->size()) r=0;
     maxZ = precursor->at(r).charge;
     if (maxZ>4) maxZ = 4;
-
-    for (n = 0; n<decoyIonSz; n++) { //iterate over each ion series
+    preMass = precursor->at(r).monoMass;
+
+    //decoy fragments are unmodified, so every bin comes from the table
+    for (n = 0; n<table.seriesCount(); n++) { //iterate over each ion series
+      ionMass = table.getMass(decoyIndex, n);
+      for (z = 1; z<maxZ; z++) {
+        ionKey[z] = table.getKey(decoyIndex, n, z);
+        ionPos[z] = table.getPos(decoyIndex, n, z);
+      }
       for (j = 0; j<MAX_DECOY_PEP_LEN; j++) {  // iterate through decoy fragment ions
-      
-        if (decoyIons[n].b) dFragmentIonMass = decoys.decoyIons[decoyIndex].pdIonsN[j] + decoyIons[n].mass;
-        else dFragmentIonMass = decoys.decoyIons[decoyIndex].pdIonsC[j] + decoyIons[n].mass;
-        if (dFragmentIonMass>precursor->at(r).monoMass) break;
-
+        if (ionMass[j]>preMass) break;
         for (z = 1; z<maxZ; z++) {
-          mz = (dFragmentIonMass + (z - 1)*1.007276466) / z;
-          mz = params->binSize * (int)(mz*invBinSize + params->binOffset);
-          key = (int)mz;
-          if (key >= kojakBins) break;
-          if (kojakSparseArray[key] == NULL) continue;
-          pos = (int)((mz - key)*invBinSize);
-          dXcorr += kojakSparseArray[key][pos];
+          if (ionKey[z][j] >= kojakBins) break;
+          sum += kojakArray.value(ionKey[z][j],ionPos[z][j]);
         }
       }
     }
     
+    dXcorr = sum;
     if (dXcorr <= 0.0) dXcorr = 0.0;
     k = (int)(dXcorr*0.05 + 0.5);  // 0.05=0.005*10; see KAnalysis::kojakScoring
     if (k < 0) k = 0;
@@ -1252,9 +1028,8 @@ bool KSpectrum::generateXcorrDecoysXL(kParams* params, KDecoys& decoys) {
           mz = params->binSize * (int)(mz*invBinSize + params->binOffset);
           key = (int)mz;
           if (key >= kojakBins) break;
-          if (kojakSparseArray[key] == NULL) continue;
           pos = (int)((mz - key)*invBinSize);
-          dXcorr += kojakSparseArray[key][pos];
+          dXcorr += kojakArray.value(key,pos);
         }
       }
     }
@@ -1295,9 +1070,8 @@ bool KSpectrum::generateXcorrDecoysXL(kParams* params, KDecoys& decoys) {
           mz = params->binSize * (int)(mz*invBinSize + params->binOffset);
           key = (int)mz;
           if (key >= kojakBins) break;
-          if (kojakSparseArray[key] == NULL) continue;
           pos = (int)((mz - key)*invBinSize);
-          dXcorr += kojakSparseArray[key][pos];
+          dXcorr += kojakArray.value(key,pos);
         }
       }
     }
@@ -1316,216 +1090,10 @@ bool KSpectrum::generateXcorrDecoysXL(kParams* params, KDecoys& decoys) {
 }
 */
 
-//from Comet
-void KSpectrum::linearRegression(double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr, double& rSquared) {
-  double Sx, Sxy;      // Sum of square distances.
-  double Mx, My;       // means
-  double dx, dy;
-  double b, a;
-  double SumX, SumY;   // Sum of X and Y values to calculate mean.
-  double SST,SSR;
-  double rsq;
-  double bestRSQ;
-  double bestSlope;
-  double bestInt;
-
-  double dCummulative[HISTOSZ];  // Cummulative frequency at each xcorr value.
-
-  int i;
-  int bestNC;
-  int bestStart;
-  int iNextCorr;    // 2nd best xcorr index
-  int iMaxCorr = 0;   // max xcorr index
-  int iStartCorr;
-  int iNumPoints;
-
-  // Find maximum correlation score index.
-  for (i = HISTOSZ - 2; i >= 0; i--) {
-    if (histogram[i] > 0)  break;
-  }
-  iMaxCorr = i;
-  if(iMaxCorr<2) {
-    slope=0;
-    intercept=0;
-    iMaxXcorr=0;
-    iStartXcorr=0;
-    iNextXcorr=0;
-    rSquared=0;
-    return;
-  }
-
-  //get last datapoint before first zero value; I think this is best indicator of boundaries
-  iNextCorr = 0;
-  for (i = 0; i<iMaxCorr; i++){
-    if (histogram[i]==0) break;
-    iNextCorr = i;
-  }
-
-  //get the next non-zero value below iMaxCorr
-  /* MH: version 2,replaced original.
-  iNextCorr=0;
-  for(i=iMaxCorr-1;i>=0;i--){
-    if(histogram[i]>0){
-      iNextCorr=i;
-      break;
-    }
-  }
-  */
-  /* original from comet
-  //MH: this also causes problems if there are early gaps in the scores.
-  iNextCorr = 0;
-  for (i = 0; i<iMaxCorr; i++)  {
-    if (histogram[i] == 0)  {
-      // register iNextCorr if there's a histo value of 0 consecutively
-      if (histogram[i + 1] == 0 || i + 1 == iMaxCorr) {
-        if (i>0) iNextCorr = i - 1;
-        break;
-      }
-    }
-  }
-  */
-
-  /* MH: This does nothing!
-  if (i == iMaxCorr) {
-    cout << scanNumber << "\tNOT POSSIBLE: " << i << "\t" << iMaxCorr;
-    iNextCorr = iMaxCorr;
-    if (iMaxCorr>12) iNextCorr = iMaxCorr - 2;
-  }
-  */
-
-  // Create cummulative distribution function from iNextCorr down, skipping the outliers.
-  //MH: its the skipping the outliers that is causing problems, I think...
-  /*
-  dCummulative[iNextCorr] = histogram[iNextCorr];
-  for (i = iNextCorr - 1; i >= 0; i--) {
-    dCummulative[i] = dCummulative[i + 1] + histogram[i];
-    //if (histogram[i + 1] == 0) dCummulative[i + 1] = 0.0;
-  }
-  */
-  //More aggressive version summing everything below the max
-  dCummulative[iMaxCorr-1] = histogram[iMaxCorr-1];
-  for (i = iMaxCorr - 2; i >= 0; i--) {
-    dCummulative[i] = dCummulative[i + 1] + histogram[i];
-    //if (histogram[i + 1] == 0) dCummulative[i + 1] = 0.0;
-  }
-
-  // log10
-  for (i = iMaxCorr-1; i >= 0; i--)  {
-    histogram[i] = (int)dCummulative[i];  // First store cummulative in histogram. MH:...and stomp all over the original...hard to troubleshoot later
-    dCummulative[i] = log10(dCummulative[i]);
-  }
-
-  // log10
-  /*MH old version
-  for (i = iNextCorr; i >= 0; i--)  {
-    histogram[i] = (int)dCummulative[i];  // First store cummulative in histogram. MH:...and stomp all over the original...hard to troubleshoot later
-    dCummulative[i] = log10(dCummulative[i]);
-  }
-  */
-
-  iStartCorr = 0;
-  //MH: futzing around here
-  //if (iNextCorr >= 30) iStartCorr = (int)(iNextCorr - iNextCorr*0.25);
-  //else if (iNextCorr >= 15) iStartCorr = (int)(iNextCorr - iNextCorr*0.5);
-
-  bool bRight=false;
-  //if((histogram[iStartCorr]-histogram[iStartCorr+1]) < (histogram[iNextCorr-1]-histogram[iNextCorr])) bRight=false; //get rid of outlier with least slope?
-  //else bRight=true;
-  bestRSQ=0;
-  bestNC=0;
-  bestSlope=0;
-  bestInt=0;
-  rsq = Mx = My = a = b = 0.0;
-  while (iStartCorr < iNextCorr-1) {
-    Sx = Sxy = SumX = SumY = 0.0;
-    iNumPoints = 0;
-
-    // Calculate means.
-    for (i = iStartCorr; i <= iNextCorr; i++) {
-      if (histogram[i] > 0) {
-        SumY += dCummulative[i];
-        SumX += i;
-        iNumPoints++;
-      }
-    }
-    if (iNumPoints > 0) {
-      Mx = SumX / iNumPoints;
-      My = SumY / iNumPoints;
-    } else {
-      Mx = My = 0.0;
-    }
-
-    // Calculate sum of squares.
-    SST=0;
-    for (i = iStartCorr; i <= iNextCorr; i++) {
-      //if (dCummulative[i] > 0) {  //MH: this will allow skipping of data points!!!
-        dx = i - Mx;
-        dy = dCummulative[i] - My;
-        Sx += dx*dx;
-        Sxy += dx*dy;
-        SST += dy*dy;
-      //}
-    }
-    b = Sxy / Sx;
-    //if (Sx > 0) b = Sxy / Sx;   // slope //MH: don't see how Sx could be zero or less given the rules above...
-    //else b = 0;
-    a = My - b*Mx;  // y-intercept
-
-    //MH: compute R2
-    SSR=0;
-    for (i = iStartCorr; i <= iNextCorr; i++) {
-      //if (dCummulative[i] > 0) {
-        dy=dCummulative[i]-(b*i+a);
-        SSR+=(dy*dy);
-      //}
-    }
-    rsq = 1-SSR/SST;
-
-    if(rsq>bestRSQ){
-      bestRSQ=rsq;
-      bestNC=iNextCorr;
-      bestSlope=b;
-      bestInt=a;
-      bestStart=iStartCorr;
-      if(rsq>0.95) break; //stop when fit is good enough? Don't trim too many outliers?
-      if(dCummulative[iStartCorr]-dCummulative[iStartCorr+1] > dCummulative[iNextCorr-1]-dCummulative[iNextCorr]){
-      //if(bRight){
-        iNextCorr--;
-        continue;
-      } else {
-        //iNextCorr=bestNC;
-        iStartCorr++;
-        continue;
-      }
-    } else {
-      break;
-
-      if(bRight) {
-        if(iNextCorr>10 && dCummulative[iNextCorr]<10){
-          iNextCorr--;
-          continue;
-        }
-        bRight=false;
-        iNextCorr=bestNC;
-        iStartCorr++;
-        continue;
-      } else {
-        iStartCorr--;
-        break;
-      }
-    }
-  }
-
-  slope = bestSlope;
-  intercept = bestInt;
-  iMaxXcorr = iMaxCorr;
-  iStartXcorr = bestStart;
-  iNextXcorr = bestNC;
-  rSquared = bestRSQ;
-}
-
-//from Comet
-void KSpectrum::linearRegression2(double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr, double& rSquared) {
+//from Comet. Fits a line to the log10 survival counts (every count at or above a score bin) of
+//histo, starting near the bin where a tenth of count remain and widening while the fit holds.
+//histo is replaced by its cumulative counts.
+void KSpectrum::fitHistogram(int* histo, int count, kHistoFit& fit) {
   double Sx, Sxy;      // Sum of square distances.
   double Mx, My;       // means
   double dx, dy;
@@ -1533,299 +1101,22 @@ void KSpectrum::linearRegression2(double& slope, double& intercept, int&  iMaxXc
   double SumX, SumY;   // Sum of X and Y values to calculate mean.
   double SST, SSR;
   double rsq;
-  double bestRSQ;
-  double bestSlope;
-  double bestInt;
 
   double dCummulative[HISTOSZ];  // Cummulative frequency at each xcorr value.
 
   int i;
-  int bestNC;
-  int bestStart;
   int iNextCorr;    // 2nd best xcorr index
   int iMaxCorr = 0;   // max xcorr index
   int iStartCorr;
   int iNumPoints;
 
-  //for diagnostics
-  for(i=0;i<HISTOSZ;i++) histogramO[i]=histogram[i];
-
-  // Find maximum correlation score index.
-  for (i = HISTOSZ - 2; i >= 0; i--) {
-    if (histogram[i] > 0)  break;
-  }
-  iMaxCorr = i;
-
-  //bail now if there is no width to the distribution
-  if (iMaxCorr<3) {
-    slope = 0;
-    intercept = 0;
-    iMaxXcorr = 0;
-    iStartXcorr = 0;
-    iNextXcorr = 0;
-    rSquared = 0;
-    return;
-  }
-
-  //More aggressive version summing everything below the max
-  dCummulative[iMaxCorr - 1] = histogram[iMaxCorr - 1];
-  for (i = iMaxCorr - 2; i >= 0; i--) {
-    dCummulative[i] = dCummulative[i + 1] + histogram[i];
-  }
-
-  //get middle-ish datapoint as seed. Using count/10.
-  for (i = 0; i<iMaxCorr; i++){
-    if (dCummulative[i] < histogramCount/10) break;  
-  }
-  if(i>=(iMaxCorr-1)) iNextCorr=iMaxCorr-2;
-  else iNextCorr = i;
-
-  // log10...and stomp all over the original...hard to troubleshoot later
-  for (i = iMaxCorr - 1; i >= 0; i--)  {
-    histogram[i] = (int)dCummulative[i];
-    dCummulative[i] = log10(dCummulative[i]);
-  }
-
-  iStartCorr = iNextCorr-1;
-  iNextCorr++;
-
-  bool bRight = false; // which direction to add datapoint from
-  bestRSQ = 0;
-  bestNC = 0;
-  bestSlope = 0;
-  bestInt = 0;
-  rsq = Mx = My = a = b = 0.0;
-  while (true) {
-    Sx = Sxy = SumX = SumY = 0.0;
-    iNumPoints = 0;
-
-    // Calculate means.
-    for (i = iStartCorr; i <= iNextCorr; i++) {
-      if (histogram[i] > 0) {
-        SumY += dCummulative[i];
-        SumX += i;
-        iNumPoints++;
-      }
-    }
-    if (iNumPoints > 0) {
-      Mx = SumX / iNumPoints;
-      My = SumY / iNumPoints;
-    } else {
-      Mx = My = 0.0;
-    }
-
-    // Calculate sum of squares.
-    SST = 0;
-    for (i = iStartCorr; i <= iNextCorr; i++) {
-      dx = i - Mx;
-      dy = dCummulative[i] - My;
-      Sx += dx*dx;
-      Sxy += dx*dy;
-      SST += dy*dy;
-    }
-    b = Sxy / Sx;
-    a = My - b*Mx;  // y-intercept
-
-    //MH: compute R2
-    SSR = 0;
-    for (i = iStartCorr; i <= iNextCorr; i++) {
-      dy = dCummulative[i] - (b*i + a);
-      SSR += (dy*dy);
-    }
-    rsq = 1 - SSR / SST;
-
-    if (rsq>0.95 || rsq>bestRSQ){
-      if(rsq>bestRSQ || iNextCorr-iStartCorr+1<8){ //keep better RSQ only if more than 8 datapoints, otherwise keep every RSQ below 8 datapoints
-        bestRSQ = rsq;
-        bestNC = iNextCorr;
-        bestSlope = b;
-        bestInt = a;
-        bestStart = iStartCorr;
-      }
-      if(bRight){
-        if (iNextCorr<(iMaxCorr - 1)) iNextCorr++;
-        else if (iStartCorr>0) iStartCorr--;
-        else break;
-      } else {
-        if(iStartCorr>0) iStartCorr--;
-        else if(iNextCorr<(iMaxCorr-1)) iNextCorr++;
-        else break;
-      }
-      bRight=!bRight;
-    } else {
-      break;
-    }
-  }
-
-  slope = bestSlope;
-  intercept = bestInt;
-  iMaxXcorr = iMaxCorr;
-  iStartXcorr = bestStart;
-  iNextXcorr = bestNC;
-  rSquared = bestRSQ;
-
-}
-
-//from Comet. THIS IS TEMPORARY! for testing singlets only...
-void KSpectrum::linearRegression3(double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr, double& rSquared) {
-  double Sx, Sxy;      // Sum of square distances.
-  double Mx, My;       // means
-  double dx, dy;
-  double b, a;
-  double SumX, SumY;   // Sum of X and Y values to calculate mean.
-  double SST, SSR;
-  double rsq;
-  double bestRSQ;
-  double bestSlope;
-  double bestInt;
-
-  double dCummulative[HISTOSZ];  // Cummulative frequency at each xcorr value.
-
-  int i;
-  int bestNC;
-  int bestStart;
-  int iNextCorr;    // 2nd best xcorr index
-  int iMaxCorr = 0;   // max xcorr index
-  int iStartCorr;
-  int iNumPoints;
-
-  // Find maximum correlation score index.
-  for (i = HISTOSZ - 2; i >= 0; i--) {
-    if (histogramSinglet[i] > 0)  break;
-  }
-  iMaxCorr = i;
-
-  //bail now if there is no width to the distribution
-  if (iMaxCorr<3) {
-    slope = 0;
-    intercept = 0;
-    iMaxXcorr = 0;
-    iStartXcorr = 0;
-    iNextXcorr = 0;
-    rSquared = 0;
-    return;
-  }
-
-  //More aggressive version summing everything below the max
-  dCummulative[iMaxCorr - 1] = histogramSinglet[iMaxCorr - 1];
-  for (i = iMaxCorr - 2; i >= 0; i--) {
-    dCummulative[i] = dCummulative[i + 1] + histogramSinglet[i];
-  }
-
-  //get middle-ish datapoint as seed. Using count/10.
-  for (i = 0; i<iMaxCorr; i++){
-    if (dCummulative[i] < histogramSingletCount / 10) break;
-  }
-  if (i >= (iMaxCorr - 1)) iNextCorr = iMaxCorr - 2;
-  else iNextCorr = i;
-
-  // log10...and stomp all over the original...hard to troubleshoot later
-  for (i = iMaxCorr - 1; i >= 0; i--)  {
-    histogramSinglet[i] = (int)dCummulative[i];
-    dCummulative[i] = log10(dCummulative[i]);
-  }
-
-  iStartCorr = iNextCorr - 1;
-  iNextCorr++;
-
-  bool bRight = false; // which direction to add datapoint from
-  bestRSQ = 0;
-  bestNC = 0;
-  bestSlope = 0;
-  bestInt = 0;
-  rsq = Mx = My = a = b = 0.0;
-  while (true) {
-    Sx = Sxy = SumX = SumY = 0.0;
-    iNumPoints = 0;
-
-    // Calculate means.
-    for (i = iStartCorr; i <= iNextCorr; i++) {
-      if (histogramSinglet[i] > 0) {
-        SumY += dCummulative[i];
-        SumX += i;
-        iNumPoints++;
-      }
-    }
-    if (iNumPoints > 0) {
-      Mx = SumX / iNumPoints;
-      My = SumY / iNumPoints;
-    } else {
-      Mx = My = 0.0;
-    }
-
-    // Calculate sum of squares.
-    SST = 0;
-    for (i = iStartCorr; i <= iNextCorr; i++) {
-      dx = i - Mx;
-      dy = dCummulative[i] - My;
-      Sx += dx*dx;
-      Sxy += dx*dy;
-      SST += dy*dy;
-    }
-    b = Sxy / Sx;
-    a = My - b*Mx;  // y-intercept
-
-    //MH: compute R2
-    SSR = 0;
-    for (i = iStartCorr; i <= iNextCorr; i++) {
-      dy = dCummulative[i] - (b*i + a);
-      SSR += (dy*dy);
-    }
-    rsq = 1 - SSR / SST;
-
-    if (rsq>0.95 || rsq>bestRSQ){
-      if (rsq>bestRSQ || iNextCorr - iStartCorr + 1<8){ //keep better RSQ only if more than 8 datapoints, otherwise keep every RSQ below 8 datapoints
-        bestRSQ = rsq;
-        bestNC = iNextCorr;
-        bestSlope = b;
-        bestInt = a;
-        bestStart = iStartCorr;
-      }
-      if (bRight){
-        if (iNextCorr<(iMaxCorr - 1)) iNextCorr++;
-        else if (iStartCorr>0) iStartCorr--;
-        else break;
-      } else {
-        if (iStartCorr>0) iStartCorr--;
-        else if (iNextCorr<(iMaxCorr - 1)) iNextCorr++;
-        else break;
-      }
-      bRight = !bRight;
-    } else {
-      break;
-    }
-  }
-
-  slope = bestSlope;
-  intercept = bestInt;
-  iMaxXcorr = iMaxCorr;
-  iStartXcorr = bestStart;
-  iNextXcorr = bestNC;
-  rSquared = bestRSQ;
-}
-
-//from Comet. THIS IS TEMPORARY! for testing singlets only...
-void KSpectrum::linearRegression4(int* histo, int decoySz, double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr, double& rSquared) {
-  double Sx, Sxy;      // Sum of square distances.
-  double Mx, My;       // means
-  double dx, dy;
-  double b, a;
-  double SumX, SumY;   // Sum of X and Y values to calculate mean.
-  double SST, SSR;
-  double rsq;
-  double bestRSQ;
-  double bestSlope;
-  double bestInt;
-
-  double dCummulative[HISTOSZ];  // Cummulative frequency at each xcorr value.
-
-  int i;
-  int bestNC;
-  int bestStart;
-  int iNextCorr;    // 2nd best xcorr index
-  int iMaxCorr = 0;   // max xcorr index
-  int iStartCorr;
-  int iNumPoints;
+  fit.valid = true;
+  fit.slope = 0;
+  fit.intercept = 0;
+  fit.rSquared = 0;
+  fit.maxCorr = 0;
+  fit.startCorr = 0;
+  fit.nextCorr = 0;
 
   // Find maximum correlation score index.
   for (i = HISTOSZ - 2; i >= 0; i--) {
@@ -1834,15 +1125,7 @@ void KSpectrum::linearRegression4(int* histo, int decoySz, double& slope, double
   iMaxCorr = i;
 
   //bail now if there is no width to the distribution
-  if (iMaxCorr<3) {
-    slope = 0;
-    intercept = 0;
-    iMaxXcorr = 0;
-    iStartXcorr = 0;
-    iNextXcorr = 0;
-    rSquared = 0;
-    return;
-  }
+  if (iMaxCorr<3) return;
 
   //More aggressive version summing everything below the max
   dCummulative[iMaxCorr - 1] = histo[iMaxCorr - 1];
@@ -1852,7 +1135,7 @@ void KSpectrum::linearRegression4(int* histo, int decoySz, double& slope, double
 
   //get middle-ish datapoint as seed. Using count/10.
   for (i = 0; i<iMaxCorr; i++){
-    if (dCummulative[i] < decoySz / 10) break;
+    if (dCummulative[i] < count / 10) break;
   }
   if (i >= (iMaxCorr - 1)) iNextCorr = iMaxCorr - 2;
   else iNextCorr = i;
@@ -1864,13 +1147,11 @@ void KSpectrum::linearRegression4(int* histo, int decoySz, double& slope, double
   }
 
   iStartCorr = iNextCorr - 1;
+  if (iStartCorr<0) iStartCorr = 0; //the seed can be the first bin; don't read before it
   iNextCorr++;
+  fit.maxCorr = iMaxCorr;
 
   bool bRight = false; // which direction to add datapoint from
-  bestRSQ = 0;
-  bestNC = 0;
-  bestSlope = 0;
-  bestInt = 0;
   rsq = Mx = My = a = b = 0.0;
   while (true) {
     Sx = Sxy = SumX = SumY = 0.0;
@@ -1911,13 +1192,13 @@ void KSpectrum::linearRegression4(int* histo, int decoySz, double& slope, double
     }
     rsq = 1 - SSR / SST;
 
-    if (rsq>0.95 || rsq>bestRSQ){
-      if (rsq>bestRSQ || iNextCorr - iStartCorr + 1<8){ //keep better RSQ only if more than 8 datapoints, otherwise keep every RSQ below 8 datapoints
-        bestRSQ = rsq;
-        bestNC = iNextCorr;
-        bestSlope = b;
-        bestInt = a;
-        bestStart = iStartCorr;
+    if (rsq>0.95 || rsq>fit.rSquared){
+      if (rsq>fit.rSquared || iNextCorr - iStartCorr + 1<8){ //keep better RSQ only if more than 8 datapoints, otherwise keep every RSQ below 8 datapoints
+        fit.rSquared = rsq;
+        fit.nextCorr = iNextCorr;
+        fit.slope = b;
+        fit.intercept = a;
+        fit.startCorr = iStartCorr;
       }
       if (bRight){
         if (iNextCorr<(iMaxCorr - 1)) iNextCorr++;
@@ -1933,13 +1214,6 @@ void KSpectrum::linearRegression4(int* histo, int decoySz, double& slope, double
       break;
     }
   }
-
-  slope = bestSlope;
-  intercept = bestInt;
-  iMaxXcorr = iMaxCorr;
-  iStartXcorr = bestStart;
-  iNextXcorr = bestNC;
-  rSquared = bestRSQ;
 }
 
 void KSpectrum::refreshScore(KDatabase& db, string dStr){
@@ -1955,13 +1229,13 @@ void KSpectrum::refreshScore(KDatabase& db, string dStr){
   size_t i;
   kPeptide pep;
   pep=db.getPeptide(topHit[0].pep1);
-  for(i=0;i<pep.map->size();i++){
-    if (db[pep.map->at(i).index].name.find(dStr) != string::npos) bDecoy = true;
+  for(i=0;i<pep.mapSize;i++){
+    if (db[pep.map[i].index].name.find(dStr) != string::npos) bDecoy = true;
   }
   if (!bDecoy && topHit[0].pep2>-1){ //only check second peptide if necessary
     pep=db.getPeptide(topHit[0].pep2);
-    for (i = 0; i<pep.map->size(); i++){
-      if (db[pep.map->at(i).index].name.find(dStr) != string::npos) bDecoy = true;
+    for (i = 0; i<pep.mapSize; i++){
+      if (db[pep.map[i].index].name.find(dStr) != string::npos) bDecoy = true;
     }
   }
   if(!bDecoy) return;
@@ -1972,13 +1246,13 @@ void KSpectrum::refreshScore(KDatabase& db, string dStr){
     if(topHit[j].simpleScore<topHit[0].simpleScore) return; //stop when we are past ties
     bDecoy=false;
     pep = db.getPeptide(topHit[j].pep1);
-    for (i = 0; i<pep.map->size(); i++){
-      if (db[pep.map->at(i).index].name.find(dStr) != string::npos) bDecoy = true;
+    for (i = 0; i<pep.mapSize; i++){
+      if (db[pep.map[i].index].name.find(dStr) != string::npos) bDecoy = true;
     }
     if (!bDecoy && topHit[0].pep2>-1){ //only check second peptide if necessary
       pep = db.getPeptide(topHit[j].pep2);
-      for (i = 0; i<pep.map->size(); i++){
-        if (db[pep.map->at(i).index].name.find(dStr) != string::npos) bDecoy = true;
+      for (i = 0; i<pep.mapSize; i++){
+        if (db[pep.map[i].index].name.find(dStr) != string::npos) bDecoy = true;
       }
     }
     if(bDecoy) continue; //if a decoy, onward to next peptide
@@ -1991,28 +1265,28 @@ void KSpectrum::refreshScore(KDatabase& db, string dStr){
   }
 }
 
-void KSpectrum::resetSingletList(){
-  size_t j;
-  double max;
-  if (singletList != NULL){
-    for (j = 0; j<singletBins; j++){
-      if (singletList[j] != NULL) delete singletList[j];
-    }
-    delete[] singletList;
-  }
-  max=precursor->at(0).monoMass;
-  for(j=1;j<precursor->size();j++){
-    if (precursor->at(j).monoMass>max) max = precursor->at(j).monoMass;
-  }
-  singletBins=(int)(max/10+1);
-  singletList = new list<kSingletScoreCard*>*[singletBins];
-  for (j = 0; j<singletBins; j++) singletList[j] = NULL;
+//Gives every precursor an empty list for the lighter halves of cross-links. Only single pass
+//searches use them, so they are not made with the precursors.
+void KSpectrum::resetLightPeps(int sz){
+  KTopPeps tp;
+  tp.singletMax=sz;
+  lightSinglets->assign(precursor->size(),tp);
 }
 
 void KSpectrum::sortMZ(){
   qsort(&spec->at(0),spec->size(),sizeof(kSpecPoint),compareMZ);
 }
 
+//Exchanges peak lists, and their maximum intensity, with s.
+void KSpectrum::swapPeaks(KSpectrum& s){
+  vector<kSpecPoint>* v=spec;
+  float f=maxIntensity;
+  spec=s.spec;
+  maxIntensity=s.maxIntensity;
+  s.spec=v;
+  s.maxIntensity=f;
+}
+
 void KSpectrum::xCorrScore(bool b){
   if(b) CometXCorr();
   else  kojakXCorr();
@@ -2122,6 +1396,9 @@ void KSpectrum::kojakXCorr(){
   int i;
   int j;
   int iTmp;
+  vector<int> vKey;
+  vector<int> vPos;
+  vector<char> vVal;
   double dTmp;
   double dSum;
   double *pdTempRawData;
@@ -2134,8 +1411,6 @@ void KSpectrum::kojakXCorr(){
 
   BinIons(&pPre);
   //cout << scanNumber << ": " << kojakBins << "\t" << xCorrArraySize << "\t" << invBinSize << "\t" << (int)invBinSize+1 << endl;
-  kojakSparseArray=new char*[kojakBins];
-  for(i=0;i<kojakBins;i++) kojakSparseArray[i]=NULL;
 
   pdTempRawData = (double *)calloc((size_t)xCorrArraySize, (size_t)sizeof(double));
   if (pdTempRawData == NULL) {
@@ -2211,10 +1486,6 @@ void KSpectrum::kojakXCorr(){
       dTmp=binSize*i;
       iTmp=(int)dTmp;
       //cout << i << "\t" << pfFastXcorrData[i] << "\t" << dTmp << "\t" << iTmp << endl;
-      if(kojakSparseArray[iTmp]==NULL) {
-        kojakSparseArray[iTmp]=new char[(int)invBinSize+1];
-        for(j=0;j<(int)invBinSize+1;j++) kojakSparseArray[iTmp][j]=0;
-      }
       j=(int)((dTmp-iTmp)*invBinSize/*+0.5*/);
       //cout << (dTmp-iTmp) << "\t" << (dTmp-iTmp)*invBinSize/*+0.5*/ << endl;
       //cout << j << endl;
@@ -2222,23 +1493,25 @@ void KSpectrum::kojakXCorr(){
       //  cout << "ERROR!" << endl;
       //  exit(0);
       //}
-      if(pfFastXcorrData[i]>127) kojakSparseArray[iTmp][j]=127;
-      else if(pfFastXcorrData[i]<-128) kojakSparseArray[iTmp][j]=-128;
-      else if(pfFastXcorrData[i]>0) kojakSparseArray[iTmp][j]=(char)(pfFastXcorrData[i]+0.5);
-      else kojakSparseArray[iTmp][j]=(char)(pfFastXcorrData[i]-0.5);
-      //cout << i << "\t" << iTmp << "\t" << j << "\t" << (int)kojakSparseArray[iTmp][j] << endl;
+      vKey.push_back(iTmp);
+      vPos.push_back(j);
+      if(pfFastXcorrData[i]>127) vVal.push_back(127);
+      else if(pfFastXcorrData[i]<-128) vVal.push_back(-128);
+      else if(pfFastXcorrData[i]>0) vVal.push_back((char)(pfFastXcorrData[i]+0.5));
+      else vVal.push_back((char)(pfFastXcorrData[i]-0.5));
     }
   }
+  kojakArray.build(kojakBins,(int)invBinSize+1,vKey,vPos,vVal);
 
   /*
   if(scanNumber==11368){
     for(i=0;i<kojakBins;i++){
-      if(kojakSparseArray[i]==NULL) {
+      if(kojakArray.bucket(i)==NULL) {
         cout << i << "\tNULL" << endl;
         continue;
       }
       for(j=0;j<(int)invBinSize+1;j++){
-        cout << i << "\t" << j << "\t" << (int)kojakSparseArray[i][j] << endl;
+        cout << i << "\t" << j << "\t" << (int)kojakArray.value(i,j) << endl;
       }
     }
   }
@@ -17,21 +17,34 @@ limitations under the License.
 #ifndef _KSPECTRUM_H
 #define _KSPECTRUM_H
 
+#include <atomic>
 #include <cmath>
-#include <list>
 #include <vector>
 #include "KDB.h"
+#include "KDecoyTable.h"
 #include "KStructs.h"
 #include "KTopPeps.h"
 #include "CometDecoys.h"
 
 #define HISTOSZ 152
 
-//a small structure for defining which ions (a,b,c,x,y,z) to compute for decoys
-typedef struct sDecoyIons{
-  bool b;
-  double mass;
-} sDecoyIons;
+//A line fit to the log10 survival counts of a score histogram, from which e-values are computed.
+//The bins and r-squared describe the fit for diagnostics.
+typedef struct kHistoFit{
+  bool    valid;
+  double  slope;
+  double  intercept;
+  double  rSquared;
+  int     maxCorr;    //highest bin with a score, excluding the last
+  int     startCorr;  //bins used in the fit
+  int     nextCorr;
+} kHistoFit;
+
+typedef struct kSingletEValue{
+  double  xcorr;
+  double  score2;
+  double  eVal;
+} kSingletEValue;
 
 class KSpectrum {
 
@@ -49,12 +62,10 @@ public:
   //Data Members
   kSparseMatrix*  xCorrSparseArray;
   int             xCorrSparseArraySize;
-  char**          kojakSparseArray;
+  kKojakArray     kojakArray;
   int             kojakBins;
   
-  int singletBins;
-  std::list<kSingletScoreCard*>**  singletList;
-  float lowScore;
+  std::atomic<float> lowScore; //score of the last top hit; read without locking to reject candidates early
 
   int cc;
   int sc;
@@ -88,15 +99,12 @@ public:
   kPrecursor*         getPrecursor2         (int i);
   float               getRTime              ();
   int                 getScanNumber         ();
+  KTopPeps*           getLightPeps          (int index);
   kScoreCard&         getScoreCard          (int i);
-  int                 getSingletCount       ();
-  kSingletScoreCard&  getSingletScoreCard   (int i);
   KTopPeps*           getTopPeps            (int index);
   int                 size                  ();
   int                 sizePrecursor         ();
   
-  kSingletScoreCard*    singletFirst;   //pointer to start of linked list
-  kSingletScoreCard*    singletLast;    //pointer to end of linked list
   int                   singletMax;
 
   int histogram[HISTOSZ];
@@ -123,22 +131,22 @@ public:
   void setScanNumber          (int i);
 
   //Functions
-  bool  calcEValue          (kParams* params, KDecoys& decoys);
+  bool  calcEValue          (kParams* params, KDecoys& decoys, KDecoyTable& table);
+  void  calcSingletEValues  (kParams* params, KDecoys& decoys, KDecoyTable& table, kRandom& rng, int sz);
   void  clearPrecursors     ();
   void  checkScore          (kScoreCard& s);
-  void  checkSingletScore   (kSingletScoreCard& s);
+  void  freePeaks           ();
+  void  freeSearchData      ();
   //bool  generateSingletDecoys(kParams* params, KDecoys& decoys);
-  double  generateSingletDecoys2(kParams* params, KDecoys& decoys, double xcorr, double mass, int preIndex,double score2);
+  bool  generateSingletDecoys2(kParams* params, KDecoys& decoys, KDecoyTable& table, kRandom& rng, double mass, int preIndex, std::vector<int>& decoyScores);
   //bool generateXLDecoys      (kParams* params, KDecoys& decoys);
-  bool  generateXcorrDecoys (kParams* params, KDecoys& decoys);
+  bool  generateXcorrDecoys (kParams* params, KDecoys& decoys, KDecoyTable& table);
   //bool  generateXcorrDecoysXL(kParams* params, KDecoys& decoys);
-  void  linearRegression    (double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr, double& rSquared);
-  void  linearRegression2   (double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr, double& rSquared);
-  void  linearRegression3   (double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr, double& rSquared);
-  void  linearRegression4   (int* histo, int decoySz, double& slope, double& intercept, int&  iMaxXcorr, int& iStartXcorr, int& iNextXcorr, double& rSquared);
+  double singletEValue      (KDecoys& decoys, std::vector<int>& decoyScores, std::vector<kSingletEValue>& fits, double xcorr, double score2);
   void  refreshScore        (KDatabase& db, std::string dStr);  //To be run AFTER analysis completes. Looks at top scores, if a tie, make sure decoys are listed second (to help TPP analysis)
-  void  resetSingletList    ();
+  void  resetLightPeps      (int sz);
   void  sortMZ              ();
+  void  swapPeaks           (KSpectrum& s);
   void  xCorrScore          (bool b);
 
 private:
@@ -155,11 +163,10 @@ private:
   std::vector<kPrecursor>*   precursor;
   float                 rTime;
   int                   scanNumber;
-  int                   singletCount;
 
-  int decoyIonSz;
-  sDecoyIons decoyIons[6];
+  kHistoFit             histoFit;   //fit of histogram, kept once computed
   
+  std::vector<KTopPeps>*     lightSinglets; //lighter halves of cross-links awaiting pairing (single pass searches)
   std::vector<KTopPeps>*     singlets;
   std::vector<kSpecPoint>*   spec;
   kScoreCard            topHit[20];
@@ -172,6 +179,8 @@ private:
 
   void kojakXCorr   ();
 
+  static void fitHistogram(int* histo, int count, kHistoFit& fit);
+
   //Utilities
   static int compareIntensity (const void *p1,const void *p2);
   static int compareMZ        (const void *p1,const void *p2);
@@ -46,44 +46,24 @@ typedef struct kPepMap{
   unsigned short stop;   //last aa
 } kPepMap;
 
-//Peptide reference to an entry in pldbDB
+//Peptide reference to an entry in pldbDB. This is a view of one row of the peptide table in
+//KDatabase; map points into the table and stays valid for the life of the database.
 typedef struct kPeptide{
   bool cTerm;
   bool nTerm;
   bool n15;
   char xlSites;
   double mass;            //monoisotopic, zero mass
-  std::vector<kPepMap>* map;   //array of mappings where peptides appear in more than one place
+  kPepMap* map;           //array of mappings where peptides appear in more than one place
+  size_t mapSize;
   kPeptide(){
     cTerm=false;
     nTerm=false;
     n15=false;
     xlSites=0;
     mass=0;
-    map = new std::vector<kPepMap>;
-  }
-  kPeptide(const kPeptide& m){
-    cTerm=m.cTerm;
-    nTerm=m.nTerm;
-    n15=m.n15;
-    xlSites=m.xlSites;
-    mass=m.mass;
-    map = new std::vector<kPepMap>(*m.map);
-  }
-  ~kPeptide(){
-    delete map;
-  }
-  kPeptide& operator=(const kPeptide& m){
-    if(this!=&m){
-      cTerm = m.cTerm;
-      nTerm = m.nTerm;
-      n15=m.n15;
-      xlSites = m.xlSites;
-      mass=m.mass;
-      delete map;
-      map = new std::vector<kPepMap>(*m.map);
-    }
-    return (*this);
+    map=NULL;
+    mapSize=0;
   }
 } kPeptide;
 
@@ -121,6 +101,128 @@ typedef struct kSparseMatrix{
   float fIntensity;
 } kSparseMatrix;
 
+inline int kPopCount(unsigned long long x){
+#ifdef __GNUC__
+  return __builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+//Counter-based random numbers. Each draw is a hash (splitmix64) of the seed and a draw count, so
+//a stream gives the same sequence on any thread and shares no state with other streams.
+typedef struct kRandom{
+  unsigned long long seed;
+  unsigned long long count;
+  kRandom(unsigned long long s=0){
+    seed=s;
+    count=0;
+  }
+  unsigned int next(){
+    unsigned long long z=seed+(++count)*0x9E3779B97F4A7C15ULL;
+    z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+    z=(z^(z>>27))*0x94D049BB133111EBULL;
+    return (unsigned int)((z^(z>>31))>>32);
+  }
+  int next(int n){ //0 to n-1
+    return (int)(next()%(unsigned int)n);
+  }
+} kRandom;
+
+//Binned spectrum for Kojak fragment scoring, addressed by 1 Da key and position within the key.
+//Only keys that contain data are stored, packed back to back in a single allocation. An occupancy
+//bitmap, with a running count of occupied keys for every 64 keys, locates each one. Empty keys
+//read as 0, which scores the same as skipping them.
+typedef struct kKojakArray{
+  int                 bins;     //number of 1 Da keys
+  int                 width;    //positions per key
+  int                 buckets;  //number of occupied keys
+  unsigned long long* map;      //occupancy bitmap; also the start of the allocation
+  int*                rank;     //occupied keys before each bitmap word
+  char*               data;     //occupied keys, width positions each
+  kKojakArray(){
+    bins=0;
+    width=0;
+    buckets=0;
+    map=NULL;
+    rank=NULL;
+    data=NULL;
+  }
+  kKojakArray(const kKojakArray& k){
+    map=NULL;
+    copy(k);
+  }
+  ~kKojakArray(){
+    clear();
+  }
+  kKojakArray& operator=(const kKojakArray& k){
+    if(this!=&k) copy(k);
+    return *this;
+  }
+  void allocate(int b, int w, int n){
+    clear();
+    int words=(b+63)/64;
+    bins=b;
+    width=w;
+    buckets=n;
+    map = new unsigned long long[words + (words*sizeof(int)+(size_t)n*w+7)/8];
+    rank = (int*)(map+words);
+    data = (char*)(rank+words);
+  }
+  //Builds the array from parallel lists of keys, positions, and values. Later entries overwrite
+  //earlier ones at the same key and position.
+  void build(int b, int w, std::vector<int>& keys, std::vector<int>& pos, std::vector<char>& vals){
+    size_t i;
+    int j,n;
+    int words=(b+63)/64;
+    std::vector<unsigned long long> m(words,0);
+    for(i=0;i<keys.size();i++) m[keys[i]>>6] |= (1ULL<<(keys[i]&63));
+    n=0;
+    for(j=0;j<words;j++) n+=kPopCount(m[j]);
+    allocate(b,w,n);
+    n=0;
+    for(j=0;j<words;j++){
+      map[j]=m[j];
+      rank[j]=n;
+      n+=kPopCount(m[j]);
+    }
+    memset(data,0,(size_t)buckets*width);
+    for(i=0;i<keys.size();i++) bucket(keys[i])[pos[i]]=vals[i];
+  }
+  //Returns the key's positions, or NULL if the key is empty
+  char* bucket(int key) const {
+    unsigned long long w=map[key>>6];
+    unsigned long long bit=1ULL<<(key&63);
+    if((w&bit)==0) return NULL;
+    return &data[(size_t)(rank[key>>6]+kPopCount(w&(bit-1)))*width];
+  }
+  char value(int key, int pos) const {
+    unsigned long long w=map[key>>6];
+    unsigned long long bit=1ULL<<(key&63);
+    if((w&bit)==0) return 0;
+    return data[(size_t)(rank[key>>6]+kPopCount(w&(bit-1)))*width+pos];
+  }
+  void clear(){
+    if(map!=NULL) delete [] map;
+    map=NULL;
+    rank=NULL;
+    data=NULL;
+    bins=0;
+    buckets=0;
+  }
+  void copy(const kKojakArray& k){
+    clear();
+    width=k.width;
+    if(k.map==NULL) return;
+    int words=(k.bins+63)/64;
+    allocate(k.bins,k.width,k.buckets);
+    memcpy(map,k.map,(words + (words*sizeof(int)+(size_t)buckets*width+7)/8)*sizeof(unsigned long long));
+  }
+} kKojakArray;
+
 typedef struct kEnzymeRules{
   bool cutC[128];
   bool cutN[128];
@@ -142,13 +244,16 @@ typedef struct kParams {
   int     ms1Resolution;
   int     ms2Resolution;
   int     preferPrecursor;
+  int     precursorShards; //precursor mass shards searched one after another to bound memory; 1 = off
   int     setA;
   int     setB;
+  int     singletIndex;   //minimum fragment matches for fragment index singlet search; 0 = off
   int     specProcess;
   int     threads;
   int     topCount;
   int     truncate;
   bool    buildDecoy;
+  bool    dbCache;        //save and reuse the digested peptide database
   bool    diffModsOnXL;
   bool    dimers;
   bool    dimersXL;
@@ -158,6 +263,8 @@ typedef struct kParams {
   bool    ionSeries[6];
   bool    monoLinksOnXL;
   bool    precursorRefinement;
+  bool    singlePass;     //one peptide sweep collects both halves of cross-links; pairing is done per spectrum
+  bool    specCentric;    //partition spectra across threads instead of peptides
   bool    turbo;
   bool    xcorr;
   double  binOffset;
@@ -200,13 +307,16 @@ typedef struct kParams {
     ms1Resolution=60000;
     ms2Resolution=15000;
     preferPrecursor=1;
+    precursorShards=1;
     setA=0;
     setB=0;
+    singletIndex=0;
     specProcess=0;
     threads=1;
     topCount=250;
     truncate=0;
     buildDecoy = false;
+    dbCache = false;
     diffModsOnXL=false;
     dimers=false;
     dimersXL=true;
@@ -221,6 +331,8 @@ typedef struct kParams {
     ionSeries[5]=false; //z-ions
     monoLinksOnXL=false;
     precursorRefinement=true;
+    singlePass=false;
+    specCentric=false;
     turbo=true;
     xcorr=false;
     binSize=0.03;
@@ -264,14 +376,17 @@ typedef struct kParams {
     ms1Resolution=p.ms1Resolution;
     ms2Resolution=p.ms2Resolution;
     preferPrecursor=p.preferPrecursor;
+    precursorShards=p.precursorShards;
     removePrecursor=p.removePrecursor;
     setA=p.setA;
     setB=p.setB;
+    singletIndex=p.singletIndex;
     specProcess=p.specProcess;
     threads=p.threads;
     topCount=p.topCount;
     truncate=p.truncate;
     buildDecoy = p.buildDecoy;
+    dbCache = p.dbCache;
     diffModsOnXL=p.diffModsOnXL;
     dimers=p.dimers;
     dimersXL=p.dimersXL;
@@ -280,6 +395,8 @@ typedef struct kParams {
     exportPercolator=p.exportPercolator;
     monoLinksOnXL=p.monoLinksOnXL;
     precursorRefinement=p.precursorRefinement;
+    singlePass=p.singlePass;
+    specCentric=p.specCentric;
     turbo=p.turbo;
     xcorr=p.xcorr;
     binOffset=p.binOffset;
@@ -332,14 +449,17 @@ typedef struct kParams {
       ms1Resolution=p.ms1Resolution;
       ms2Resolution=p.ms2Resolution;
       preferPrecursor=p.preferPrecursor;
+      precursorShards=p.precursorShards;
       removePrecursor=p.removePrecursor;
       setA=p.setA;
       setB=p.setB;
+      singletIndex=p.singletIndex;
       specProcess=p.specProcess;
       threads=p.threads;
       topCount=p.topCount;
       truncate=p.truncate;
       buildDecoy = p.buildDecoy;
+      dbCache = p.dbCache;
       diffModsOnXL=p.diffModsOnXL;
       dimers=p.dimers;
       dimersXL=p.dimersXL;
@@ -348,6 +468,8 @@ typedef struct kParams {
       exportPercolator=p.exportPercolator;
       monoLinksOnXL=p.monoLinksOnXL;
       precursorRefinement = p.precursorRefinement;
+      singlePass = p.singlePass;
+      specCentric = p.specCentric;
       turbo = p.turbo;
       xcorr=p.xcorr;
       binOffset=p.binOffset;
@@ -533,9 +655,8 @@ typedef struct kSingletScoreCard{
   double              mass;
   char                modLen;
   char                site;
-  kPepMod*            mods;
-  kSingletScoreCard*  next;
-  kSingletScoreCard*  prev;
+  int                 link;     //cross-linker index; only kept for lighter singlets in single pass searches
+  int                 modIndex; //first of modLen mods in the owning KTopPeps mod pool
   kSingletScoreCard(){
     len=0;
     linkable=false;
@@ -548,60 +669,8 @@ typedef struct kSingletScoreCard{
     site=0;
     matches=0;
     conFrag=0;
-    mods=NULL;
-    next=NULL;
-    prev=NULL;
-  }
-  kSingletScoreCard(const kSingletScoreCard& k){
-    len=k.len;
-    linkable=k.linkable;
-    k1=k.k1;
-    pep1=k.pep1;
-    pre=k.pre;
-    simpleScore=k.simpleScore;
-    mass=k.mass;
-    modLen=k.modLen;
-    site=k.site;
-    matches=k.matches;
-    conFrag=k.conFrag;
-    mods=NULL;
-    if(modLen>0){
-      mods=new kPepMod[modLen];
-      for(char i=0;i<modLen;i++) mods[i]=k.mods[i];
-    }
-    next=NULL;
-    prev=NULL;
-  }
-  ~kSingletScoreCard(){
-    if(mods!=NULL) delete [] mods;
-    next=NULL;
-    prev=NULL;
-  }
-  kSingletScoreCard& operator=(const kSingletScoreCard& k){
-    if(this!=&k){
-      len=k.len;
-      linkable=k.linkable;
-      k1=k.k1;
-      pep1=k.pep1;
-      pre=k.pre;
-      simpleScore=k.simpleScore;
-      mass=k.mass;
-      modLen=k.modLen;
-      site=k.site;
-      matches = k.matches;
-      conFrag = k.conFrag;
-      if(mods!=NULL) {
-        delete [] mods;
-        mods=NULL;
-      }
-      if(modLen>0){
-        mods=new kPepMod[modLen];
-        for(char i=0;i<modLen;i++) mods[i]=k.mods[i];
-      }
-      next=NULL;
-      prev=NULL;
-    }
-    return *this;
+    link=0;
+    modIndex=0;
   }
 } kSingletScoreCard;
 
@@ -20,274 +20,206 @@ using namespace std;
 
 KTopPeps::KTopPeps(){
   singletCount = 0;
-  singletFirst = NULL;
-  singletLast = NULL;
   singletMax = 0;
-
-  singletList = NULL;
-  singletBins = 0;
+  singletFloor = 0;
+  modGarbage = 0;
 }
 
 KTopPeps::KTopPeps(const KTopPeps& c){
   singletCount = c.singletCount;
   singletMax = c.singletMax;
-  singletFirst = NULL;
-  singletLast = NULL;
-  kSingletScoreCard* sc = NULL;
-  kSingletScoreCard* tmp = c.singletFirst;
-  if (tmp != NULL) {
-    singletFirst = new kSingletScoreCard(*tmp);
-    sc = singletFirst;
-    tmp = tmp->next;
-    while (tmp != NULL){
-      sc->next = new kSingletScoreCard(*tmp);
-      sc->next->prev = sc;
-      sc = sc->next;
-      tmp = tmp->next;
-    }
-    singletLast = sc;
-  }
-
-  singletBins = c.singletBins;
-  if (singletBins == 0) singletList = NULL;
-  else {
-    singletList = new list<kSingletScoreCard*>*[singletBins];
-    for (size_t j = 0; j<singletBins; j++){
-      if (c.singletList[j] == NULL) singletList[j] = NULL;
-      else {
-        singletList[j] = new list<kSingletScoreCard*>;
-        list<kSingletScoreCard*>::iterator it = c.singletList[j]->begin();
-        while (it != c.singletList[j]->end()){
-          singletList[j]->emplace_back(*it);
-          it++;
-        }
-      }
-    }
-  }
+  singletFloor = c.singletFloor.load();
+  pool = c.pool;
+  freeSlots = c.freeSlots;
+  ranked = c.ranked;
+  byMass = c.byMass;
+  modPool = c.modPool;
+  modGarbage = c.modGarbage;
 }
 
 KTopPeps::~KTopPeps(){
-  while (singletFirst != NULL){
-    kSingletScoreCard* tmp = singletFirst;
-    singletFirst = singletFirst->next;
-    delete tmp;
-  }
-  singletLast = NULL;
-
-  if (singletList != NULL){
-    for (size_t j = 0; j<singletBins; j++){
-      if (singletList[j] != NULL) delete singletList[j];
-    }
-    delete[] singletList;
-  }
 }
 
 KTopPeps& KTopPeps::operator=(const KTopPeps& c){
   if(this!=&c){
-    size_t j;
-
     singletCount = c.singletCount;
     singletMax = c.singletMax;
-    
-    while (singletFirst != NULL){
-      kSingletScoreCard* tmp = singletFirst;
-      singletFirst = singletFirst->next;
-      delete tmp;
-    }
-    singletLast = NULL;
-
-    kSingletScoreCard* sc = NULL;
-    kSingletScoreCard* tmp = c.singletFirst;
-    if (tmp != NULL) {
-      singletFirst = new kSingletScoreCard(*tmp);
-      sc = singletFirst;
-      tmp = tmp->next;
-      while (tmp != NULL){
-        sc->next = new kSingletScoreCard(*tmp);
-        sc->next->prev = sc;
-        sc = sc->next;
-        tmp = tmp->next;
-      }
-      singletLast = sc;
-    }
-
-    if (singletList != NULL){
-      for (j = 0; j<singletBins; j++){
-        if (singletList[j] != NULL) delete singletList[j];
-      }
-      delete[] singletList;
-    }
-    singletBins = c.singletBins;
-    if (singletBins == 0) singletList = NULL;
-    else {
-      singletList = new list<kSingletScoreCard*>*[singletBins];
-      for (size_t j = 0; j<singletBins; j++){
-        if (c.singletList[j] == NULL) singletList[j] = NULL;
-        else {
-          singletList[j] = new list<kSingletScoreCard*>;
-          list<kSingletScoreCard*>::iterator it = c.singletList[j]->begin();
-          while (it != c.singletList[j]->end()){
-            singletList[j]->emplace_back(*it);
-            it++;
-          }
-        }
-      }
-    }
+    singletFloor = c.singletFloor.load();
+    pool = c.pool;
+    freeSlots = c.freeSlots;
+    ranked = c.ranked;
+    byMass = c.byMass;
+    modPool = c.modPool;
+    modGarbage = c.modGarbage;
   }
   return *this;
 }
 
-void KTopPeps::checkSingletScore(kSingletScoreCard& s){
+//i is a position in mass order, valid until the list changes
+kSingletScoreCard& KTopPeps::getSingletByMass(int i){
+  return pool[byMass[i]];
+}
 
-  kSingletScoreCard* sc;
-  kSingletScoreCard* cur;
-  size_t ind;
+//The mods of a card from this list, or NULL if it has none
+kPepMod* KTopPeps::getSingletMods(kSingletScoreCard& s){
+  if (s.modLen == 0) return NULL;
+  return &modPool[s.modIndex];
+}
 
-  //If list is empty, add the score card
-  if (singletCount == 0){
-    singletFirst = new kSingletScoreCard(s);
-    singletLast = singletFirst;
-    singletCount++;
+//rank 0 is the best scoring singlet
+kSingletScoreCard& KTopPeps::getSingletScoreCard(int rank){
+  return pool[ranked[rank]];
+}
 
-    //add to singlet list
-    ind = (int)(s.mass / 10);
-    if (singletList[ind] == NULL) singletList[ind] = new list<kSingletScoreCard*>;
-    singletList[ind]->emplace_back(singletFirst);
+//Call while holding the list's lock. mods are copied into the list's mod pool; s.modLen and
+//s.modIndex are set from them.
+void KTopPeps::checkSingletScore(kSingletScoreCard& s, vector<kPepMod>& mods){
+  addSingletScore(s, mods);
+  if (singletCount >= singletMax && singletCount>0) singletFloor.store(pool[ranked.back()].simpleScore, memory_order_relaxed);
+  else singletFloor.store(0, memory_order_relaxed);
+}
 
-    return;
+//Returns the singlets with lowMass<=mass<=highMass as positions [first,last) in mass order
+void KTopPeps::findSingletMass(double lowMass, double highMass, int& first, int& last){
+  int lo, hi, mid;
+
+  first = findMass(lowMass);
+  lo = first;
+  hi = (int)byMass.size();
+  while (lo<hi){
+    mid = (lo + hi) / 2;
+    if (pool[byMass[mid]].mass <= highMass) lo = mid + 1;
+    else hi = mid;
   }
+  last = lo;
+}
 
-  //check if we can just add to the end
-  if (s.simpleScore <= singletLast->simpleScore){
-    //check if we need to store the singlet
-    //if(singletCount>=singletMax) return;
-
-    singletLast->next = new kSingletScoreCard(s);
-    singletLast->next->prev = singletLast;
-    singletLast = singletLast->next;
-    singletCount++;
-
-    //add to singlet list
-    ind = (int)(s.mass / 10);
-    if (singletList[ind] == NULL) singletList[ind] = new list<kSingletScoreCard*>;
-    singletList[ind]->emplace_back(singletLast);
-
-    return;
+//The mass lookup is only needed while scoring. The ranked cards are kept, repacked in rank order
+//with their mods, and the spare pool capacity is released.
+void KTopPeps::freeSingletList(){
+  size_t i;
+  char j;
+  vector<kSingletScoreCard> cards;
+  vector<kPepMod> m;
+
+  cards.reserve(ranked.size());
+  m.reserve(modPool.size() - modGarbage);
+  for (i = 0; i<ranked.size(); i++){
+    cards.push_back(pool[ranked[i]]);
+    cards.back().modIndex = (int)m.size();
+    for (j = 0; j<cards.back().modLen; j++) m.push_back(modPool[pool[ranked[i]].modIndex + j]);
+    ranked[i] = (int)i;
   }
+  pool.swap(cards);
+  modPool.swap(m);
+  modGarbage = 0;
+  ranked.shrink_to_fit();
+  vector<int>().swap(freeSlots);
+  vector<int>().swap(byMass);
+}
 
-  //check if it goes in the front
-  if (s.simpleScore >= singletFirst->simpleScore){
-    singletFirst->prev = new kSingletScoreCard(s);
-    singletFirst->prev->next = singletFirst;
-    singletFirst = singletFirst->prev;
-
-    //add to singlet list
-    ind = (int)(s.mass / 10);
-    if (singletList[ind] == NULL) singletList[ind] = new list<kSingletScoreCard*>;
-    singletList[ind]->emplace_back(singletFirst);
-    singletCount++;
-
-    if (singletCount>singletMax){
-      int i = singletCount;
-      cur = singletLast;
-      while (i>singletMax){ //step to singletMax position
-        cur = cur->prev;
-        i--;
-      }
-      while (cur->next != NULL && cur->next->simpleScore == cur->simpleScore){ //step to first instance of score lower than singletMax
-        cur = cur->next;
-      }
-
-      //delete everything hereafter
-      while (cur->next != NULL){
-        sc = cur->next;
-        cur->next = sc->next;
-        //if(sc->next!=NULL) sc->next->prev=cur; //is this necessary if they're all going to go?
-
-        ind = (int)(sc->mass / 10);
-        if (singletList[ind]->size() == 1) {
-          delete singletList[ind];
-          singletList[ind] = NULL;
-        } else {
-          list<kSingletScoreCard*>::iterator it = singletList[ind]->begin();
-          while (*it != sc) it++;
-          singletList[ind]->erase(it);
-        }
-        delete sc;
-        singletCount--;
-      }
+//Empties the list and releases its storage
+void KTopPeps::resetSingletList(){
+  singletCount = 0;
+  singletFloor = 0;
+  vector<kSingletScoreCard>().swap(pool);
+  vector<int>().swap(freeSlots);
+  vector<int>().swap(ranked);
+  vector<int>().swap(byMass);
+  vector<kPepMod>().swap(modPool);
+  modGarbage = 0;
+}
 
-      singletLast = cur;
+void KTopPeps::addSingletScore(kSingletScoreCard& s, vector<kPepMod>& mods){
+  int slot;
+  int pos;
+  int lo, hi, mid;
+  size_t i;
+
+  //A full list only takes scores that tie or beat its last entry. Ties at the cutoff are kept.
+  if (singletCount >= singletMax && singletCount>0 && s.simpleScore<pool[ranked.back()].simpleScore) return;
+
+  //Find the rank: after equal scores if it ties the last entry, otherwise ahead of them
+  if (singletCount == 0 || s.simpleScore <= pool[ranked.back()].simpleScore) {
+    pos = singletCount;
+  } else {
+    lo = 0;
+    hi = singletCount;
+    while (lo<hi){
+      mid = (lo + hi) / 2;
+      if (pool[ranked[mid]].simpleScore>s.simpleScore) lo = mid + 1;
+      else hi = mid;
     }
-    return;
+    pos = lo;
   }
 
-
-  //scan to find insertion point
-  cur = singletFirst->next;
-  int i = 1;
-  while (s.simpleScore < cur->simpleScore){
-    i++;
-    cur = cur->next;
+  //Store the card in a free slot and its mods at the end of the mod pool
+  if (freeSlots.size()>0){
+    slot = freeSlots.back();
+    freeSlots.pop_back();
+    pool[slot] = s;
+  } else {
+    slot = (int)pool.size();
+    pool.push_back(s);
   }
-
-  sc = new kSingletScoreCard(s);
-  sc->prev = cur->prev;
-  sc->next = cur;
-  cur->prev->next = sc;
-  cur->prev = sc;
-  if (sc->prev == NULL) singletFirst = sc;
-
-  //add to singlet list
-  ind = (int)(s.mass / 10);
-  if (singletList[ind] == NULL) singletList[ind] = new list<kSingletScoreCard*>;
-  singletList[ind]->emplace_back(sc);
+  pool[slot].modLen = (char)mods.size();
+  pool[slot].modIndex = (int)modPool.size();
+  for (i = 0; i<mods.size(); i++) modPool.push_back(mods[i]);
+
+  ranked.insert(ranked.begin() + pos, slot);
+  lo = findMass(s.mass);
+  while (lo<(int)byMass.size() && pool[byMass[lo]].mass == s.mass) lo++;
+  byMass.insert(byMass.begin() + lo, slot);
   singletCount++;
 
-  if (singletCount>singletMax){
-    int i = singletCount;
-    cur = singletLast;
-    while (i>singletMax){ //step to singletMax position
-      cur = cur->prev;
-      i--;
+  //Trim the list back to singletMax, keeping any that tie the score at that rank
+  if (singletCount>singletMax && singletMax>0){
+    pos = singletMax;
+    while (pos<singletCount && pool[ranked[pos]].simpleScore == pool[ranked[singletMax - 1]].simpleScore) pos++;
+    for (i = pos; i<ranked.size(); i++){
+      eraseMass(ranked[i]);
+      modGarbage += pool[ranked[i]].modLen;
+      freeSlots.push_back(ranked[i]);
     }
-    while (cur->next != NULL && cur->next->simpleScore == cur->simpleScore){ //step to first instance of score lower than singletMax
-      cur = cur->next;
-    }
-
-    //delete everything hereafter
-    while (cur->next != NULL){
-      sc = cur->next;
-      cur->next = sc->next;
-      //if(sc->next!=NULL) sc->next->prev=cur; //is this necessary if they're all going to go?
+    ranked.resize(pos);
+    singletCount = pos;
+    if (modGarbage>64 && modGarbage>modPool.size() / 2) compactMods();
+  }
 
-      ind = (int)(sc->mass / 10);
-      if (singletList[ind]->size() == 1) {
-        delete singletList[ind];
-        singletList[ind] = NULL;
-      } else {
-        list<kSingletScoreCard*>::iterator it = singletList[ind]->begin();
-        while (*it != sc) it++;
-        singletList[ind]->erase(it);
-      }
-      delete sc;
-      singletCount--;
-    }
+}
 
-    singletLast = cur;
+//Drops the mods of evicted cards from the mod pool
+void KTopPeps::compactMods(){
+  size_t i;
+  char j;
+  int slot;
+  vector<kPepMod> m;
+
+  m.reserve(modPool.size() - modGarbage);
+  for (i = 0; i<ranked.size(); i++){
+    slot = ranked[i];
+    for (j = 0; j<pool[slot].modLen; j++) m.push_back(modPool[pool[slot].modIndex + j]);
+    pool[slot].modIndex = (int)(m.size() - pool[slot].modLen);
   }
+  modPool.swap(m);
+  modGarbage = 0;
+}
 
+void KTopPeps::eraseMass(int slot){
+  int i = findMass(pool[slot].mass);
+  while (byMass[i] != slot) i++;
+  byMass.erase(byMass.begin() + i);
 }
 
-void KTopPeps::resetSingletList(double mass){
-  size_t j;
-  if (singletList != NULL){
-    for (j = 0; j<singletBins; j++){
-      if (singletList[j] != NULL) delete singletList[j];
-    }
-    delete[] singletList;
+//Returns the first position in mass order with a mass of at least mass
+int KTopPeps::findMass(double mass){
+  int lo, hi, mid;
+  lo = 0;
+  hi = (int)byMass.size();
+  while (lo<hi){
+    mid = (lo + hi) / 2;
+    if (pool[byMass[mid]].mass<mass) lo = mid + 1;
+    else hi = mid;
   }
-  singletBins = (int)(mass / 10 + 1);
-  singletList = new list<kSingletScoreCard*>*[singletBins];
-  for (j = 0; j<singletBins; j++) singletList[j] = NULL;
+  return lo;
 }
@@ -18,8 +18,13 @@ limitations under the License.
 #define _KTOPPEPS_H
 
 #include "KStructs.h"
-#include <list>
+#include <atomic>
+#include <vector>
 
+//The best singlets for one precursor. Cards live in a slot pool that grows as they are added, up to
+//singletMax; evicted slots are reused, and their mods are packed into a shared pool. Resetting the
+//list releases both pools. Slots are indexed twice: by rank (score descending) for admission and
+//eviction, and by mass for partner lookups during the cross-link pass.
 class KTopPeps{
 public:
 
@@ -29,16 +34,37 @@ public:
 
   KTopPeps& operator=(const KTopPeps& c);
 
-  int singletBins;
   int singletCount;
   int singletMax;
-  
-  kSingletScoreCard*    singletFirst;   //pointer to start of linked list
-  kSingletScoreCard*    singletLast;    //pointer to end of linked list
-  std::list<kSingletScoreCard*>**  singletList;
 
-  void  checkSingletScore(kSingletScoreCard& s);
-  void  resetSingletList(double mass);
+  //Scores below this cannot enter a full list. Published after every change so scoring threads
+  //can reject candidates without taking the list's lock; 0 while the list has room.
+  std::atomic<float> singletFloor;
+
+  //Accessors
+  kSingletScoreCard&  getSingletByMass    (int i);
+  kPepMod*            getSingletMods      (kSingletScoreCard& s);
+  kSingletScoreCard&  getSingletScoreCard (int rank);
+
+  //Functions
+  void  checkSingletScore (kSingletScoreCard& s, std::vector<kPepMod>& mods);
+  void  findSingletMass   (double lowMass, double highMass, int& first, int& last);
+  void  freeSingletList   ();
+  void  resetSingletList  ();
+
+private:
+
+  std::vector<kSingletScoreCard>  pool;       //card slots; evicted slots are reused
+  std::vector<int>                freeSlots;
+  std::vector<int>                ranked;     //slots by score, highest first
+  std::vector<int>                byMass;     //slots by mass, lowest first; equal masses in arrival order
+  std::vector<kPepMod>            modPool;    //mods of every card, addressed by modIndex
+  size_t                          modGarbage; //entries in modPool left behind by evicted cards
+
+  void  addSingletScore (kSingletScoreCard& s, std::vector<kPepMod>& mods);
+  void  compactMods     ();
+  void  eraseMass       (int slot);
+  int   findMass        (double mass);
 
 };
 
@@ -11,6 +11,12 @@ KojakManager::KojakManager(){
   param_obj.setLog(&log);
 }
 
+//Asks a run in progress to stop. The current stage finishes the work already in flight, then
+//run() returns -11 without exporting results.
+void KojakManager::cancel(){
+  cancelFlag.Cancel();
+}
+
 void KojakManager::clearFiles(){
   files.clear();
 }
@@ -61,9 +67,14 @@ bool KojakManager::setParams(string& s){
 int KojakManager::run(){
   time_t timeNow;
   size_t i;
+  int s;
+  int shards;
+  char ts[16];
 
   //Step 1: Prepare from settings
+  cancelFlag.Reset();
   KData spec(&params);
+  spec.setCancel(&cancelFlag);
   spec.setLog(&log);
   spec.setVersion(VERSION);
   for (i = 0; i<params.xLink->size(); i++) spec.setLinker(params.xLink->at(i));
@@ -72,6 +83,7 @@ int KojakManager::run(){
   //Step #2: Read in database and generate peptide lists
   KDatabase db;
   db.setLog(&log);
+  db.setThreads(params.threads);
   for (i = 0; i<params.fMods->size(); i++) db.addFixedMod(params.fMods->at(i).index, params.fMods->at(i).mass);
   for (i = 0; i<params.aaMass->size(); i++) db.setAAMass((char)params.aaMass->at(i).index, params.aaMass->at(i).mass, params.aaMass->at(i).xl);
   if (strlen(params.n15Label)>0) db.setN15Label(params.n15Label);
@@ -79,12 +91,23 @@ int KojakManager::run(){
   db.setXLTable(spec.getXLTable(), 128, 20);
   cout << "\n Reading FASTA database: " << params.dbFile << endl;
   string str = params.decoy;
-  if (!db.buildDB(params.dbFile,str)){
-    cout << "  Error opening database file: " << params.dbFile << endl;
-    return -1;
+  string cacheFile = string(params.dbFile) + ".kdb";
+  uint64_t cacheKey = 0;
+  if (params.dbCache) cacheKey = db.getCacheKey(params.dbFile, str, params.buildDecoy, params.minPepMass, params.maxPepMass, params.miscleave);
+  if (cacheKey>0 && db.loadCache(cacheFile, cacheKey)){
+    cout << "  Peptide database loaded from cache: " << cacheFile << endl;
+  } else {
+    if (!db.buildDB(params.dbFile,str)){
+      cout << "  Error opening database file: " << params.dbFile << endl;
+      return -1;
+    }
+    if (params.buildDecoy) db.buildDecoy(str);
+    db.buildPeptides(params.minPepMass, params.maxPepMass, params.miscleave);
+    if (cacheKey>0){
+      if (db.saveCache(cacheFile, cacheKey)) cout << "  Peptide database cache saved: " << cacheFile << endl;
+      else cout << "  WARNING: Unable to save peptide database cache: " << cacheFile << endl;
+    }
   }
-  if (params.buildDecoy) db.buildDecoy(str);
-  db.buildPeptides(params.minPepMass, params.maxPepMass, params.miscleave);
   log.setDBinfo(string(params.dbFile),db.getProteinDBSize(),db.getPeptideListSize(),db.linkablePepCount);
 
   //Step #3: Read in spectra and map precursors
@@ -105,30 +128,52 @@ int KojakManager::run(){
     log.addMessage("Reading spectra data file: " + files[i].input,true);
     cout << "\n Reading spectra data file: " << files[i].input.c_str() << " ... ";
     if (!spec.readSpectra()){
+      if (cancelFlag.IsCancelled()) return cancelled();
       log.addError("Error reading MS_data_file: " + files[i].input);
       return -2;
     }
-    spec.mapPrecursors();
-    spec.xCorr(params.xcorr);
-
-    //Step #4: Analyze single peptides, monolinks, and crosslinks
-    KAnalysis anal(params, &db, &spec);
-    anal.setLog(&log);
-
-    log.addMessage("Start spectral search.",true);
-    time(&timeNow);
-    cout << "\n Start spectral search: " << ctime(&timeNow);
-    log.addMessage("Scoring peptides (first pass).",true);
-    cout << "  Scoring peptides ... ";
-    anal.doPeptideAnalysis();
-
-    //if(params.intermediate>0) spec.outputIntermediate(db);
-
-    char ts[16];
-    sprintf(ts,"%d",params.decoySize);
-    log.addMessage("Calculating e-values (" + string(ts) + ")",true);
-    cout << "  Calculating e-values (" << params.decoySize << ")... ";
-    anal.doEValueAnalysis();
+    if (!spec.mapPrecursors()) return cancelled();
+
+    //Large runs may be searched in precursor mass shards. Each shard's peaks are read from file, then
+    //transformed, searched, and given e-values, then its search data are freed. Results are exported
+    //together in scan order.
+    shards=spec.buildShards(params.precursorShards);
+    for(s=0;s<shards;s++){
+
+      if(shards>1){
+        if(!spec.setShard(s)) continue;
+        sprintf(ts,"%d of %d",s+1,shards);
+        log.addMessage("Searching precursor mass shard " + string(ts),true);
+        cout << "\n Precursor mass shard " << ts << endl;
+      }
+      if (!spec.readShard()){
+        if (cancelFlag.IsCancelled()) return cancelled();
+        log.addError("Error reading MS_data_file: " + files[i].input);
+        return -2;
+      }
+      if (!spec.xCorr(params.xcorr)) return cancelled();
+
+      //Step #4: Analyze single peptides, monolinks, and crosslinks
+      KAnalysis anal(params, &db, &spec);
+      anal.setCancel(&cancelFlag);
+      anal.setLog(&log);
+
+      log.addMessage("Start spectral search.",true);
+      time(&timeNow);
+      cout << "\n Start spectral search: " << ctime(&timeNow);
+      log.addMessage("Scoring peptides (first pass).",true);
+      cout << "  Scoring peptides ... ";
+      if (!anal.doPeptideAnalysis()) return cancelled();
+
+      //if(params.intermediate>0) spec.outputIntermediate(db);
+
+      sprintf(ts,"%d",params.decoySize);
+      log.addMessage("Calculating e-values (" + string(ts) + ")",true);
+      cout << "  Calculating e-values (" << params.decoySize << ")... ";
+      if (!anal.doEValueAnalysis()) return cancelled();
+
+      if(shards>1) spec.freeShard();
+    }
 
     log.addMessage("Finish spectral search.",true);
     time(&timeNow);
@@ -150,6 +195,13 @@ int KojakManager::run(){
   return 0;
 }
 
+int KojakManager::cancelled(){
+  log.addMessage("Search cancelled.",true);
+  log.exportLog();
+  cout << " Search cancelled." << endl;
+  return -11;
+}
+
 bool KojakManager::getBaseFileName(string& base, const char* fName, string& extP) {
   char file[256];
   char ext[256];
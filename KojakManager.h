@@ -3,6 +3,7 @@
 
 #include "KLog.h"
 #include "KParams.h"
+#include "Threading.h"
 
 #define VERSION "2.0.0 alpha 6"
 #define BDATE "September 15 2020"
@@ -11,6 +12,7 @@ class KojakManager {
 public:
   KojakManager();
 
+  void cancel();
   void clearFiles();
 
   int setFile(const char* fn);
@@ -30,6 +32,9 @@ private:
   std::string paramFile;
   KParams param_obj;
   kParams params;
+  ThreadCancel cancelFlag; //raised by cancel() from another thread
+
+  int cancelled();
 
 };
 
@@ -33,6 +33,7 @@
 
 typedef CRITICAL_SECTION Mutex;
 typedef HANDLE Semaphore;
+typedef CONDITION_VARIABLE Condition;
 typedef unsigned int ThreadId;
 typedef void* (__cdecl *ThreadProc)(void*);
 
@@ -45,6 +46,7 @@ typedef void* (__cdecl *ThreadProc)(void*);
 
 typedef pthread_mutex_t Mutex;
 typedef pthread_t ThreadId;
+typedef pthread_cond_t Condition;
 typedef void* (*ThreadProc)(void*);
 typedef struct PosixSemaphore {
    pthread_mutex_t mutex;
@@ -26,6 +26,10 @@
 //     * Minimum number of threads to keep around in the pool
 //     * The maximum number of threads to allow in the pool
 //
+// Jobs may be launched with a ThreadJob handle to wait on just those jobs.
+// WaitForThreads() blocks on a condition until the queue is empty and every
+// thread is back in the pool.
+//
 ///////////////////////////////////////////////////////////////////////////////
 
 #ifndef _THREADPOOL_H
@@ -38,6 +42,69 @@
 //#include "CometStatus.h"
 
 template<class T> class ThreadManager;
+template<class T> class ThreadPool;
+
+// Completion handle for one or more jobs. Each job launched with the handle
+// is counted, and Wait() returns once all of them have finished.
+class ThreadJob
+{
+public:
+   ThreadJob()
+   {
+      _numPending = 0;
+      Threading::CreateMutex(&_jobMutex);
+      Threading::CreateCondition(&_doneCondition);
+   }
+
+   ~ThreadJob()
+   {
+      Threading::DestroyMutex(_jobMutex);
+      Threading::DestroyCondition(_doneCondition);
+   }
+
+   bool IsDone()
+   {
+      Threading::LockMutex(_jobMutex);
+      bool bDone = (_numPending == 0);
+      Threading::UnlockMutex(_jobMutex);
+      return bDone;
+   }
+
+   void Wait()
+   {
+      Threading::LockMutex(_jobMutex);
+      while (_numPending > 0)
+      {
+         Threading::WaitCondition(_doneCondition, _jobMutex);
+      }
+      Threading::UnlockMutex(_jobMutex);
+   }
+
+private:
+   template<class T> friend class ThreadPool;
+   template<class T> friend class ThreadManager;
+
+   void Begin()
+   {
+      Threading::LockMutex(_jobMutex);
+      _numPending++;
+      Threading::UnlockMutex(_jobMutex);
+   }
+
+   void Finish()
+   {
+      Threading::LockMutex(_jobMutex);
+      if (--_numPending == 0)
+      {
+         Threading::BroadcastCondition(_doneCondition);
+      }
+      Threading::UnlockMutex(_jobMutex);
+   }
+
+   int       _numPending;
+   Mutex     _jobMutex;
+   Condition _doneCondition;
+};
 
 // This is the pool where the threads reside. New threads are created as
 // needed, but without exceeding the max number specified by the user.
@@ -64,10 +131,16 @@ public:
 
       Threading::CreateSemaphore(&_queueParamsSemaphore);
 
+      Threading::CreateCondition(&_idleCondition);
+
+      // New threads rejoin the pool right away; hold them off until the
+      // count is complete.
+      Threading::LockMutex(_poolAccessMutex);
       for (_numCurrThreads=0; _numCurrThreads < _minThreads; _numCurrThreads++)
       {
          new ThreadManager<T>(this);
       }
+      Threading::UnlockMutex(_poolAccessMutex);
    }
 
    ~ThreadPool()
@@ -80,19 +153,27 @@ public:
      Threading::DestroyMutex(_poolAccessMutex);
 
      Threading::DestroySemaphore(_queueParamsSemaphore);
+
+     Threading::DestroyCondition(_idleCondition);
    }
 
    ThreadProc GetThreadProc() { return _threadProc; }
 
-   void Launch(T param)
+   // If job is given, it is counted until the thread proc returns.
+   void Launch(T param, ThreadJob* job = NULL)
    {
+      if (job != NULL)
+      {
+         job->Begin();
+      }
+
       Threading::LockMutex(_poolAccessMutex);
       if (!_threads.empty())
       {
          ThreadManager<T> *pThreadMgr = _threads.back();
          _threads.pop_back();
          Threading::UnlockMutex(_poolAccessMutex);
-         pThreadMgr->Wake(param);
+         pThreadMgr->Wake(param, job);
          return;
       }
 
@@ -102,7 +183,10 @@ public:
          _numCurrThreads++;
       }
 
-      _params.push_back(param);
+      QueuedParam queued;
+      queued.param = param;
+      queued.job = job;
+      _params.push_back(queued);
       Threading::UnlockMutex(_poolAccessMutex);
    }
 
@@ -113,10 +197,10 @@ public:
       // Any parameters queued?  If yes, give it to the thread to process.
       if (!_params.empty())
       {
-         T param = _params.front();
+         QueuedParam queued = _params.front();
          _params.pop_front();
          Threading::UnlockMutex(_poolAccessMutex);
-         pThreadMgr->SetParam(param);
+         pThreadMgr->SetParam(queued.param, queued.job);
          return ThreadPool<T>::Run;
       }
 
@@ -125,50 +209,35 @@ public:
       if (_numCurrThreads > _minThreads)
       {
          _numCurrThreads--;
-         Threading::UnlockMutex(_poolAccessMutex);
-         return ThreadPool<T>::Die;
-      }
-
-      // Has there been an error, or has search been cancelled?
-      bool bError = false;
-      // If so, we need to kill the thread.
-      if (bError)
-      {
-         _numCurrThreads--;
+         if (IsIdle())
+         {
+            Threading::BroadcastCondition(_idleCondition);
+         }
          Threading::UnlockMutex(_poolAccessMutex);
          return ThreadPool<T>::Die;
       }
 
       // No params queued; ask thread to go to sleep & wait mode.
       _threads.push_back(pThreadMgr);
+      if (IsIdle())
+      {
+         Threading::BroadcastCondition(_idleCondition);
+      }
       Threading::UnlockMutex(_poolAccessMutex);
       return ThreadPool<T>::Sleep;
    }
 
+   // Blocks until nothing is queued and every thread has rejoined the pool.
+   // Threads started by the constructor count as busy until they first
+   // rejoin, so this is safe to call before they have run.
    void WaitForThreads()
    {
-      // This is not the best solution. Try to think of a better way to
-      // handle this - maybe using a semaphore?
-
-      // Give the threads a chance to start doing work - 1 second at the most!
-      const unsigned long ulMaxTotalWaitMilliseconds = 1000;
-      const unsigned long ulWaitMilliseconds = 10;
-      unsigned long ulElapsedTimeMilliseconds = 0;
-      while (NumActiveThreads() == 0)
-      {
-         if (ulElapsedTimeMilliseconds >= ulMaxTotalWaitMilliseconds)
-         {
-            break;
-         }
-         Threading::ThreadSleep(ulWaitMilliseconds);
-         ulElapsedTimeMilliseconds += ulWaitMilliseconds;
-      }
-
-      // Now wait for all of them to go to sleep
-      while (NumActiveThreads() != 0)
+      Threading::LockMutex(_poolAccessMutex);
+      while (!IsIdle())
       {
-         Threading::ThreadSleep(100);
+         Threading::WaitCondition(_idleCondition, _poolAccessMutex);
       }
+      Threading::UnlockMutex(_poolAccessMutex);
    }
 
    void WaitForQueuedParams()
@@ -207,6 +276,18 @@ public:
    }
 
 protected:
+   struct QueuedParam
+   {
+      T          param;
+      ThreadJob* job;
+   };
+
+   // _poolAccessMutex must be held
+   bool IsIdle()
+   {
+      return _params.empty() && _numCurrThreads == (int)_threads.size();
+   }
+
    bool ShouldCheckQueuedParams()
    {
        // Only check for queued params if we have a valid number for _maxQueuedParams
@@ -220,13 +301,14 @@ protected:
 
    ThreadProc                     _threadProc;
    std::vector<ThreadManager<T>*> _threads;
-   std::deque<T>                  _params;
+   std::deque<QueuedParam>        _params;
    Mutex                          _poolAccessMutex;
    int                            _maxThreads;
    int                            _minThreads;
    int                            _numCurrThreads;
    int                            _maxQueuedParams;
    Semaphore                      _queueParamsSemaphore;
+   Condition                      _idleCondition;
 };
 
 
@@ -247,6 +329,7 @@ public:
    ThreadManager(ThreadPool<T> *pPool)
    {
       _endThread = false;
+      _job = NULL;
 
       ThreadManager<T>::_pPool = pPool;
 
@@ -266,7 +349,11 @@ public:
       Threading::DestroySemaphore(_sleepSemaphore);
    }
 
-   void SetParam(T param) { ThreadManager::_param = param; }
+   void SetParam(T param, ThreadJob* job = NULL)
+   {
+      ThreadManager::_param = param;
+      ThreadManager::_job = job;
+   }
 
    T GetParam() { return _param; }
 
@@ -276,10 +363,10 @@ public:
       Threading::WaitSemaphore(_wakeSemaphore);
    }
 
-   void Wake(T param)
+   void Wake(T param, ThreadJob* job)
    {
       Threading::WaitSemaphore(_sleepSemaphore);
-      SetParam(param);
+      SetParam(param, job);
       Threading::SignalSemaphore(_wakeSemaphore);
    }
 
@@ -310,6 +397,11 @@ public:
 
          (*_pPool->GetThreadProc()) (GetParam());
 
+         if (_job != NULL)
+         {
+            _job->Finish();
+         }
+
          // So we don't loop endlessly with the same parameter
          SetParam(NULL);
 
@@ -328,6 +420,7 @@ protected:
    Semaphore     _sleepSemaphore;
    Semaphore     _wakeSemaphore;
    ThreadId      _threadIdentifier;
+   ThreadJob     *_job;
    bool          _endThread;
 };
 
@@ -103,6 +103,26 @@ void Threading::DestroySemaphore(Semaphore& sem)
    pthread_mutex_destroy(&sem.mutex);
 }
 
+void Threading::CreateCondition(Condition* pCond)
+{
+   pthread_cond_init(pCond, NULL);
+}
+
+void Threading::WaitCondition(Condition& cond, Mutex& mutex)
+{
+   pthread_cond_wait(&cond, &mutex);
+}
+
+void Threading::BroadcastCondition(Condition& cond)
+{
+   pthread_cond_broadcast(&cond);
+}
+
+void Threading::DestroyCondition(Condition& cond)
+{
+   pthread_cond_destroy(&cond);
+}
+
 #else  // _WIN32
 #include <process.h>
 
@@ -180,4 +200,24 @@ void Threading::DestroySemaphore(Semaphore& sem)
    CloseHandle(sem);
 }
 
+void Threading::CreateCondition(Condition* pCond)
+{
+   InitializeConditionVariable(pCond);
+}
+
+void Threading::WaitCondition(Condition& cond, Mutex& mutex)
+{
+   SleepConditionVariableCS(&cond, &mutex, INFINITE);
+}
+
+void Threading::BroadcastCondition(Condition& cond)
+{
+   WakeAllConditionVariable(&cond);
+}
+
+void Threading::DestroyCondition(Condition& cond)
+{
+   // Windows condition variables hold no resources
+}
+
 #endif // ifdef _WIN32
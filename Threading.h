@@ -26,6 +26,7 @@
 #define _THREADING_H
 
 #include "OSSpecificThreading.h"
+#include <atomic>
 
 class Threading
 {
@@ -51,8 +52,43 @@ public:
    static void SignalSemaphore(Semaphore& sem);
    static void DestroySemaphore(Semaphore& sem);
 
+   // Condition methods; the mutex must be locked when waiting
+   static void CreateCondition(Condition* pCond);
+   static void WaitCondition(Condition& cond, Mutex& mutex);
+   static void BroadcastCondition(Condition& cond);
+   static void DestroyCondition(Condition& cond);
+
+   // Relaxed atomic increment, for counters shared by threads that are only
+   // read after those threads have finished
+   static inline void AtomicIncrement(int& value)
+   {
+#ifdef _WIN32
+      _InterlockedIncrement(reinterpret_cast<volatile long*>(&value));
+#else
+      __atomic_fetch_add(&value, 1, __ATOMIC_RELAXED);
+#endif
+   }
+
 private:
     static ThreadId _threadId;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// Cooperative cancellation flag shared by a run and its worker threads. Work
+// already in progress is not interrupted; loops and jobs check IsCancelled()
+// and return early once it is set. Safe to set from any thread.
+///////////////////////////////////////////////////////////////////////////////
+class ThreadCancel
+{
+public:
+   ThreadCancel() : _cancelled(false) {}
+
+   void Cancel() { _cancelled.store(true); }
+   void Reset() { _cancelled.store(false); }
+   bool IsCancelled() const { return _cancelled.load(std::memory_order_relaxed); }
+
+private:
+   std::atomic<bool> _cancelled;
+};
+
 #endif // ifndef _THREADING_H